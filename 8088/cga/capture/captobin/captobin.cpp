@@ -7,97 +7,144 @@
 #include "alfe/evaluate.h"
 #include "alfe/bitmap.h"
 #include "alfe/ntsc_decode.h"
+#include "alfe/thread.h"
+#include "alfe/zdr.h"
 
-#ifdef WIN32
-#define ZLIB_WINAPI
-#endif
-#include "zlib.h"
+static const bool doDecode = false;
+static const int samples = zdrSamplesPerFrame;
+static const int sampleSpaceBefore = 256;
+static const int sampleSpaceAfter = 256;
+static const int rawBytes = 1824*253;
 
-class Program : public ProgramBase
+// Decodes a run of consecutive frames into its own output buffer.
+class DecodeTask : public Task
 {
 public:
-    void run()
+    DecodeTask()
+      : _buffer(sampleSpaceBefore +
+            max(samples + sampleSpaceAfter, rawBytes)),
+        _count(0), _failed(false)
     {
-        bool doDecode = false;
-
-        static const int samples = 450*1024;
-        static const int inputBufferSize = samples;
-        static const int sampleSpaceBefore = 256;
-        static const int sampleSpaceAfter = 256;
-
-        FileStream in = File("captured.zdr", true).openRead();
-        UInt64 inputFileSizeRemaining = in.size();
-        Array<Byte> inputBuffer(inputBufferSize);
-        int inputBufferRemaining = 0;
-        Byte* inputPointer = 0;
-        z_stream zs;
-        memset(&zs, 0, sizeof(z_stream));
-        if (inflateInit(&zs) != Z_OK)
-            throw Exception("inflateInit failed");
-
-        Array<Byte> buffer(sampleSpaceBefore + samples + sampleSpaceAfter);
-        Byte* b = &buffer[0] + sampleSpaceBefore;
-        for (int i = 0; i < sampleSpaceBefore; ++i)
-            b[i - sampleSpaceBefore] = 0;
-        for (int i = 0; i < sampleSpaceAfter; ++i)
-            b[i + samples] = 0;
-        int outputBytesRemaining = samples;
-
-        Vector outputSize;
-        NTSCCaptureDecoder<UInt32> decoder;
-
+        memset(&_buffer[0], 0, _buffer.count());
+        Byte* b = &_buffer[0] + sampleSpaceBefore;
         if (doDecode)
-            outputSize = Vector(960, 240);
+            _outputSize = Vector(960, 240);
         else
-            outputSize = Vector(1824, 253);
-        Bitmap<UInt32> decoded(outputSize);
-        decoder.setOutputBuffer(decoded);
-        decoded.fill(0);
-        decoder.setInputBuffer(b);
-        decoder.setOutputPixelsPerLine(1140);
-        decoder.setYScale(1);
-        decoder.setDoDecode(doDecode);
-
-        FileStream outputStream = File("u:\\captured.bin", true).openWrite();
-
-        do {
-            if (inputBufferRemaining == 0) {
-                int bytesToRead = inputBufferSize;
-                if (bytesToRead > inputFileSizeRemaining)
-                    bytesToRead = inputFileSizeRemaining;
-                inputPointer = &inputBuffer[0];
-                in.read(inputPointer, bytesToRead);
-                inputBufferRemaining = bytesToRead;
-                inputFileSizeRemaining -= bytesToRead;
-            }
-            zs.avail_in = inputBufferRemaining;
-            zs.next_in = inputPointer;
-            zs.avail_out = outputBytesRemaining;
-            zs.next_out = b + samples - outputBytesRemaining;
-            int r = inflate(&zs, Z_SYNC_FLUSH);
-            if (r != Z_STREAM_END && r != Z_OK)
-                throw Exception("inflate failed");
-            outputBytesRemaining = zs.avail_out;
-            inputPointer = zs.next_in;
-            inputBufferRemaining = zs.avail_in;
-
-            if (outputBytesRemaining == 0) {
-                if (inflateReset(&zs) != Z_OK)
-                    throw Exception("inflateReset failed");
-                outputBytesRemaining = samples;
-                console.write(".");
-
+            _outputSize = Vector(1824, 253);
+        _decoded = Bitmap<UInt32>(_outputSize);
+        _decoder.setOutputBuffer(_decoded);
+        _decoded.fill(0);
+        _decoder.setInputBuffer(b);
+        _decoder.setOutputPixelsPerLine(1140);
+        _decoder.setYScale(1);
+        _decoder.setDoDecode(doDecode);
+    }
+    void setFrames(ZDRReader* reader, int first, int count)
+    {
+        _reader = reader;
+        _first = first;
+        _count = count;
+        _output.ensure(count*frameBytes());
+        if (count > 0)
+            restart();
+    }
+    int count() const { return _count; }
+    void write(Stream* stream)
+    {
+        join();
+        if (_failed)
+            throw _exception;
+        stream->write(&_output[0], _count*frameBytes());
+        for (int i = 0; i < _count; ++i)
+            console.write(".");
+    }
+private:
+    int frameBytes()
+    {
+        return doDecode ? _decoded.stride()*_outputSize.y : rawBytes;
+    }
+    void run()
+    {
+        try {
+            Byte* b = &_buffer[0] + sampleSpaceBefore;
+            for (int i = 0; i < _count; ++i) {
+                _reader->readFrame(_first + i, &_inflater, b);
+                Byte* output = &_output[0] + i*frameBytes();
                 if (doDecode) {
-                    decoder.decode();
-                    outputStream.write(decoded.data(), decoded.stride()*outputSize.y);
+                    _decoder.decode();
+                    memcpy(output, _decoded.data(), frameBytes());
                 }
                 else
-                    outputStream.write(b, 1824*253);
+                    memcpy(output, b, rawBytes);
             }
+        }
+        catch (const Exception& e) {
+            _exception = e;
+            _failed = true;
+        }
+    }
+
+    ZDRReader* _reader;
+    ZDRInflater _inflater;
+    Array<Byte> _buffer;
+    Array<Byte> _output;
+    Vector _outputSize;
+    Bitmap<UInt32> _decoded;
+    NTSCCaptureDecoder<UInt32> _decoder;
+    int _first;
+    int _count;
+    bool _failed;
+    Exception _exception;
+};
+
+class Program : public ProgramBase
+{
+public:
+    void run()
+    {
+        String inputName = "captured.zdr";
+        String outputName = "u:\\captured.bin";
+        if (_arguments.count() >= 2)
+            inputName = _arguments[1];
+        if (_arguments.count() >= 3)
+            outputName = _arguments[2];
+        ZDRReader reader(File(inputName, true));
+        int first = 0;
+        int end = reader.frames();
+        if (_arguments.count() >= 4) {
+            first = evaluate<int>(_arguments[3]);
+            if (first < 0)
+                throw Exception("The first frame can't be negative.");
+            first = min(first, end);
+        }
+        if (_arguments.count() >= 5) {
+            int frames = evaluate<int>(_arguments[4]);
+            if (frames <= 0)
+                throw Exception("The number of frames must be positive.");
+            end = first + min(frames, end - first);
+        }
 
-        } while (inputFileSizeRemaining != 0);
+        FileStream outputStream = File(outputName, true).openWrite();
 
-        if (inflateEnd(&zs) != Z_OK)
-            throw Exception("inflateEnd failed");
+        // Each task works on a run of frames at a time. The runs are handed
+        // out in turn, and the results are collected in the same order so
+        // that they can be written as soon as they are ready, at which point
+        // that task gets the next run.
+        static const int framesPerRun = 4;
+        ThreadPool pool;
+        Array<DecodeTask> tasks(pool.threads());
+        int next = first;
+        for (auto& t : tasks) {
+            t.setPool(&pool);
+            int count = min(framesPerRun, end - next);
+            t.setFrames(&reader, next, count);
+            next += count;
+        }
+        for (int i = 0; tasks[i].count() != 0; i = (i + 1) % tasks.count()) {
+            tasks[i].write(&outputStream);
+            int count = min(framesPerRun, end - next);
+            tasks[i].setFrames(&reader, next, count);
+            next += count;
+        }
     }
 };
@@ -65,6 +65,7 @@ public:
         _decoder.setInputBuffer(_b);
         _decoder.setOutputPixelsPerLine(1140);
         _decoder.setYScale(3);
+        _decoder.setThreadPool(&_decoderPool);
 
         BitmapWindow::create();
         _thread.setWindow(this);
@@ -111,6 +112,7 @@ private:
 
     CaptureWindow* _captureWindow;
 
+    ThreadPool _decoderPool;
     NTSCCaptureDecoder<DWORD> _decoder;
 
     AutoStream _vbiCapPipe;
@@ -1,111 +1,222 @@
 #include "alfe/main.h"
 #include "alfe/thread.h"
-#ifdef WIN32
-#define ZLIB_WINAPI
-#endif
-#include "zlib.h"
+#include "alfe/zdr.h"
+#include <atomic>
+#ifdef _WIN32
 #include <conio.h>
+#else
+// The non-Windows code here is groundwork only: alfe/main.h is still
+// Win32-only, so this program can't yet be built anywhere else.
+#include <sys/mman.h>
+#endif
 
-static const int samplesPerFrame = 450*1024;
-
-class Program;
+static const int samplesPerFrame = zdrSamplesPerFrame;
 
-class Frame : public Handle::Body
+// A block of memory allocated directly from the OS, so that it's page
+// aligned and (unlike the heap) never fragmented or moved.
+class PageAlignedMemory : Uncopyable
 {
 public:
-    Frame(int index, int bytes) : _data(bytes), _index(index) { }
-    Byte* data() { return &_data[0]; }
-    int bytes() { return _data.count(); }
-    int index() { return _index; }
+    static const int pageSize = 4096;
+
+    PageAlignedMemory(size_t bytes) : _bytes(roundUp(bytes))
+    {
+#ifdef _WIN32
+        _data = static_cast<Byte*>(VirtualAlloc(NULL, _bytes,
+            MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+        IF_NULL_THROW(_data);
+#else
+        void* data = mmap(NULL, _bytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED)
+            throw Exception::systemError("Allocating frame buffers");
+        _data = static_cast<Byte*>(data);
+#endif
+    }
+    ~PageAlignedMemory()
+    {
+#ifdef _WIN32
+        VirtualFree(_data, 0, MEM_RELEASE);
+#else
+        munmap(_data, _bytes);
+#endif
+    }
+    Byte* data() { return _data; }
+    static size_t roundUp(size_t bytes)
+    {
+        return (bytes + pageSize - 1) & ~static_cast<size_t>(pageSize - 1);
+    }
 private:
-    Array<Byte> _data;
-    int _index;
+    Byte* _data;
+    size_t _bytes;
 };
 
-class Queue
+// A fixed number of slots, each holding a captured frame and its compressed
+// form. Frame i uses slot i % slotCount, so the capture thread can't reuse a
+// slot until the writer has written the frame that was in it. That bounds
+// the memory used when the disk falls behind: the capture thread waits
+// instead.
+//
+// The compress tasks finish in any order. Each publishes its result by
+// storing the frame's index (plus 1) in the slot's _completed, and the writer
+// takes the frames in order, so the slots double as the reorder buffer
+// without any locking.
+class FrameRing : Uncopyable
 {
 public:
-    Queue()
-      : _data(1), _addIndex(0), _addOffset(0), _removeOffset(0), _count(0) { }
-    void add(Handle frame)
-    {
-        Lock l(&_mutex);
-        int index = frame->index() - _addIndex;
-        int items = (_addOffset + _data.count() - _removeOffset) & mask();
-        while (_data.count() <= items + index + 1) {
-            Array<Handle> data(_data.count() * 2);
-            for (int i = 0; i < _data.count(); ++i)
-                data[i] = _data[(i + _removeOffset) & mask()];
-            _data.swap(data);
-            _addOffset = items;
-            _removeOffset = 0;
+    static const int slotCount = 64;
+
+    FrameRing()
+      : _rawBytes(PageAlignedMemory::roundUp(samplesPerFrame)),
+        _compressedBytes(PageAlignedMemory::roundUp(max(
+            static_cast<int>(compressBound(samplesPerFrame)),
+            CompositeCodec::maximumCompressedBytes(samplesPerFrame)))),
+        _memory(slotCount*(_rawBytes + _compressedBytes)),
+        _written(0),
+        _end(0x7fffffff),
+        _aborted(false)
+    {
+        for (int i = 0; i < slotCount; ++i) {
+            _completed[i] = 0;
+            _bytes[i] = 0;
         }
-        _data[(_addOffset + index) & mask()] = frame;
-        while (_data[_addOffset].valid()) {
-            _addOffset = (_addOffset + 1) & mask();
-            ++_addIndex;
+    }
+    Byte* raw(int index) { return _memory.data() + slot(index)*_rawBytes; }
+    Byte* compressed(int index)
+    {
+        return _memory.data() + slotCount*_rawBytes +
+            slot(index)*_compressedBytes;
+    }
+    int compressedCapacity() const
+    {
+        return static_cast<int>(_compressedBytes);
+    }
+    int compressedBytes(int index) const { return _bytes[slot(index)]; }
+
+    // Capture thread: returns true if frame index can be captured without
+    // waiting for the writer.
+    bool slotFree(int index) const
+    {
+        return index - _written.load(std::memory_order_acquire) < slotCount;
+    }
+    // Capture thread: waits until frame index can be captured. Returns false
+    // if the writer has given up.
+    bool waitForSlot(int index)
+    {
+        while (!slotFree(index)) {
+            if (_aborted.load())
+                return false;
+            _slotFreed.wait();
         }
-        ++_count;
-    }
-    Handle remove()
-    {
-        Lock l(&_mutex);
-        if (_removeOffset == _addOffset)
-            return Handle();
-        if (!_data[_removeOffset].valid())
-            return Handle();
-        Handle frame = _data[_removeOffset];
-        _data[_removeOffset] = Handle();
-        _removeOffset = (_removeOffset + 1) & mask();
-        --_count;
-        return frame;
-    }
-    //void doDump()
-    //{
-    //    for (int i = 0; i < _data.count(); ++i)
-    //        if (_data[i].valid())
-    //            console.write(String(decimal(_data[i]->index())) + " ");
-    //        else
-    //            console.write(String("- "));
-    //    console.write(String(" = ") + decimal(_addIndex) + ", " + decimal(_addOffset) + ", " + decimal(_removeOffset) + "\n");
-    //}
-    int count() { Lock l(&_mutex); return _count; }
+        return !_aborted.load();
+    }
+    // Capture thread: no more frames after count.
+    void end(int count)
+    {
+        _end.store(count);
+        _frameCompleted.signal();
+    }
+
+    // Compress task: the compressed data for frame index is ready.
+    void completed(int index, int bytes)
+    {
+        int s = slot(index);
+        _bytes[s] = bytes;
+        _completed[s].store(index + 1, std::memory_order_release);
+        _frameCompleted.signal();
+    }
+    // Compress task: frame index couldn't be compressed.
+    void failed(int index, const Exception& e)
+    {
+        _exceptions[slot(index)] = e;
+        completed(index, -1);
+    }
+
+    // Writer: waits until frame index has been compressed. Returns false if
+    // the capture ended before index.
+    bool waitForFrame(int index)
+    {
+        int s = slot(index);
+        do {
+            if (_completed[s].load(std::memory_order_acquire) == index + 1) {
+                if (_bytes[s] < 0)
+                    throw _exceptions[s];
+                return true;
+            }
+            if (index >= _end.load())
+                return false;
+            _frameCompleted.wait();
+        } while (true);
+    }
+    // Writer: frame index has been written, so its slot can be reused.
+    void written(int index)
+    {
+        _written.store(index + 1, std::memory_order_release);
+        _slotFreed.signal();
+    }
+    // Writer: wakes the capture thread if it's waiting for a slot that will
+    // never be freed.
+    void abort()
+    {
+        _aborted.store(true);
+        _slotFreed.signal();
+    }
+    bool aborted() const { return _aborted.load(); }
 private:
-    int mask() { return _data.count() - 1; }
-
-    Array<Handle> _data;
-    int _addIndex;     // Index of frame at _addOffset
-    int _addOffset;    // Offset into _data
-    int _removeOffset; // Offset into _data
-    Mutex _mutex;
-    int _count;
+    static int slot(int index) { return index % slotCount; }
+
+    size_t _rawBytes;
+    size_t _compressedBytes;
+    PageAlignedMemory _memory;
+    std::atomic<int> _completed[slotCount];
+    int _bytes[slotCount];
+    Exception _exceptions[slotCount];
+    std::atomic<int> _written;
+    std::atomic<int> _end;
+    std::atomic<bool> _aborted;
+    Event _frameCompleted;
+    Event _slotFreed;
 };
 
 template<class T> class CompressTaskT : public Task
 {
 public:
-    CompressTaskT(Program* program) : _program(program)
+    CompressTaskT(FrameRing* ring, bool composite)
+      : _ring(ring), _composite(composite)
     {
         memset(&_zs, 0, sizeof(z_stream));
         int r = deflateInit(&_zs, 4);  // or Z_DEFAULT_COMPRESSION?
         if (r != Z_OK)
             throw Exception("deflateInit failed");
-        int bufferSize = deflateBound(&_zs, samplesPerFrame);
-        buffer.allocate(bufferSize);
     }
-    ~CompressThreadT() { deflateEnd(&_zs); }
-    void setProgram(Program* program) { _program = program; }
-    void setFrame(Handle frame) { _frame = frame; restart(); }
+    ~CompressTaskT() { deflateEnd(&_zs); }
+    void setFrame(int index) { _index = index; restart(); }
 private:
     void run()
     {
-        int bufferSize = _buffer.size();
+        // Exceptions can't propagate out of a pool thread, so hand them to
+        // the writer to rethrow.
+        try {
+            _ring->completed(_index, compress());
+        }
+        catch (const Exception& e) {
+            _ring->failed(_index, e);
+        }
+    }
+    int compress()
+    {
+        Byte* raw = _ring->raw(_index);
+        Byte* compressed = _ring->compressed(_index);
+        if (_composite)
+            return _codec.encode(raw, samplesPerFrame, compressed);
+
+        int bufferSize = _ring->compressedCapacity();
         _zs.avail_in = samplesPerFrame;
-        _zs.next_in = _frame->data();
+        _zs.next_in = raw;
         _zs.avail_out = bufferSize;
-        _zs.next_out = &_buffer[0];
+        _zs.next_out = compressed;
 
-        r = deflate(&_zs, Z_FINISH);
+        int r = deflate(&_zs, Z_FINISH);
         if (r != Z_STREAM_END)
             throw Exception("deflate failed");
 
@@ -113,39 +224,57 @@ private:
         if (r != Z_OK)
             throw Exception("deflateReset failed");
 
-        int compressedSize = bufferSize - _zs.avail_out;
-        Handle compressed = new Frame(_frame->index(), compressedSize);
-        memcpy(compressed->data(), &_buffer[0], compressedSize);
-        _program->putCompressedFrame(compressed);
+        return bufferSize - _zs.avail_out;
     }
 
-    Handle _frame;
+    FrameRing* _ring;
+    bool _composite;
+    int _index;
     z_stream _zs;
-    Array<Byte> _buffer;
-    Program* _program;
+    CompositeCodec _codec;
 };
 
 typedef CompressTaskT<void> CompressTask;
 
+// Writes the compressed frames in order as they become available. Started
+// once, and runs until the capture ends or a write fails.
 template<class T> class WriteThreadT : public ThreadTask
 {
 public:
-    WriteThreadT() : _program(0) { }
-    void setProgram(Program* program) { _program = program; restart(); }
+    WriteThreadT() : _ring(0), _writer(0), _failed(false) { }
+    void start(FrameRing* ring, ZDRWriter* writer)
+    {
+        _ring = ring;
+        _writer = writer;
+        restart();
+    }
+    void finish()
+    {
+        join();
+        if (_failed)
+            throw _exception;
+    }
 private:
     void run()
     {
-        do {
-            Handle frame = _program->getCompressedFrame();
-            if (!frame.valid())
-                return;
-            _program->write(frame);
-        } while (!cancelling());
+        try {
+            for (int index = 0; _ring->waitForFrame(index); ++index) {
+                _writer->write(_ring->compressed(index),
+                    _ring->compressedBytes(index));
+                _ring->written(index);
+            }
+        }
+        catch (const Exception& e) {
+            _exception = e;
+            _failed = true;
+            _ring->abort();
+        }
     }
 
-    Program* _program;
-    Event _go;
-    bool _ending;
+    FrameRing* _ring;
+    ZDRWriter* _writer;
+    bool _failed;
+    Exception _exception;
 };
 
 typedef WriteThreadT<void> WriteThread;
@@ -155,77 +284,122 @@ class Program : public ProgramBase
 public:
     void run()
     {
-        _writeThread.setProgram(this);
-
         String name = "captured.zdr";
         if (_arguments.count() >= 2)
             name = _arguments[1];
-        Stream h = File("\\\\.\\pipe\\vbicap", true).openPipe();
-        h.write<int>(1);
-
-        _outputStream = File(name, true).openWrite();
+        // Frames are compressed with zlib unless "composite" is given, in
+        // which case CompositeCodec is used. Readers handle either.
+        bool composite = false;
+        if (_arguments.count() >= 3) {
+            if (_arguments[2] == "composite")
+                composite = true;
+            else {
+                if (_arguments[2] != "zlib")
+                    throw Exception("Unknown codec " + _arguments[2]);
+            }
+        }
+        // Frames are read from the given file or FIFO until it ends, or
+        // otherwise from the VBICap driver's pipe until Escape is pressed.
+        AutoStream input;
+        if (_arguments.count() >= 4)
+            input = File(_arguments[3], true).openRead();
+        else {
+#ifdef _WIN32
+            input = File("\\\\.\\pipe\\vbicap", true).openPipe();
+            input.write<int>(1);
+#else
+            throw Exception("No input file given");
+#endif
+        }
 
-        int k = 0;
-        int index = 0;
+        ZDRWriter writer(File(name, true));
+        FrameRing ring;
+        WriteThread writeThread;
+        writeThread.start(&ring, &writer);
 
+        _frames = 0;
+        _stalledFrames = 0;
+        try {
+            capture(&ring, &input, composite);
+        }
+        catch (...) {
+            // The writer has to stop before the ring goes away.
+            endCapture(&ring);
+            throw;
+        }
+        endCapture(&ring);
+        writeThread.finish();
+        writer.close();
+        console.write("\n" + decimal(writer.frames()) + " frames written.\n");
+        if (_stalledFrames != 0) {
+            console.write(decimal(_stalledFrames) + " frames were delayed "
+                "waiting for the disk.\n");
+        }
+    }
+    ~Program()
+    {
+        for (auto t : _tasks)
+            delete t;
+    }
+private:
+    void capture(FrameRing* ring, Stream* input, bool composite)
+    {
+        bool stalled = false;
         do {
-            Handle uncompressed = new Frame(index, samplesPerFrame);
-            Byte* data = uncompressed->data();
-            int remaining = samplesPerFrame;
+            if (!ring->slotFree(_frames)) {
+                if (!stalled) {
+                    console.write("\nDisk is falling behind: capture paused "
+                        "at frame " + decimal(_frames) + "\n");
+                }
+                stalled = true;
+                ++_stalledFrames;
+                if (!ring->waitForSlot(_frames))
+                    break;
+            }
+            else
+                stalled = false;
+
+            // A partial frame at the end of the input is discarded.
+            Byte* data = ring->raw(_frames);
+            int bytesRead = 0;
             do {
-                DWORD bytesRead;
-                BOOL r = ReadFile(h, data + samplesPerFrame - remaining,
-                    remaining, &bytesRead, NULL);
+                int r = input->tryRead(data + bytesRead,
+                    samplesPerFrame - bytesRead);
                 if (r == 0)
-                    throw Exception::systemError("Reading VBICap pipe");
-                remaining -= bytesRead;
-            } while (remaining > 0);
+                    break;
+                bytesRead += r;
+            } while (bytesRead < samplesPerFrame);
+            if (bytesRead < samplesPerFrame)
+                break;
 
             CompressTask* task = _compressPool.getCompletedTask();
             if (task == 0) {
-                task = new CompressTask(this);
+                task = new CompressTask(ring, composite);
                 task->setPool(&_compressPool);
                 _tasks.add(task);
             }
-            task->setFrame(uncompressed);
+            task->setFrame(_frames);
 
-            ++index;
-            if (index % 60 == 0)
+            ++_frames;
+            if (_frames % 60 == 0)
                 printf(".");
-            if (_kbhit())
-                k = _getch();
-        } while (k != 27);
-    }
-    void write(Handle frame)
-    {
-        _outputStream.write(frame->data(), frame->bytes());
-    }
-    Handle getCompressedFrame()
-    {
-        return _compressedFrames.remove();
-        //if (frame.valid())
-        //    console.write(String("Writing frame ") + decimal(frame->index()) + "\n");
-        //else
-        //    console.write(String("No frame\n"));
-        //_compressedFrames.dump();
-        //return frame;
-    }
-    void putCompressedFrame(Handle frame)
-    {
-        //console.write(String("Completed frame ") + decimal(frame->index()) + "\n");
-        _compressedFrames.add(frame);
-        //_compressedFrames.dump();
-        _writeThread.restart();
+#ifdef _WIN32
+            if (_kbhit() && _getch() == 27)
+                break;
+#endif
+        } while (!ring->aborted());
     }
-    ~Program()
+    // Finishes compressing the captured frames and lets the writer know how
+    // many there are, so that it can finish and the index can be added.
+    void endCapture(FrameRing* ring)
     {
         for (auto t : _tasks)
-            delete t;
+            t->join();
+        ring->end(_frames);
     }
-private:
-    Queue _compressedFrames;
-    WriteThread _writeThread;
+
     ThreadPool _compressPool;
-    AutoStream _outputStream;
     List<CompressTask*> _tasks;
+    int _frames;
+    int _stalledFrames;
 };
@@ -1,1608 +1,8 @@
 #include "alfe/main.h"
-#include "alfe/complex.h"
-#include "alfe/space.h"
-#include "alfe/set.h"
-#include "alfe/config_file.h"
-#include "alfe/cga.h"
+#include "cgaart.h"
 #include "alfe/knob.h"
-#include "alfe/image_filter.h"
 #include <commdlg.h>
 
-class MatcherTable
-{
-public:
-    MatcherTable() : _next(0x10000), _patterns(0x10000) { }
-    void setSize(int entries)
-    {
-        _table.ensure(entries);
-        _entries = entries;
-        for (int i = 0; i < _entries; ++i) {
-            _table[i]._count = 0;
-            _table[i]._pattern = 1;
-        }
-    }
-
-    void add(Word pattern, int position)
-    {
-        Entry* e = &_table[position];
-        _next[pattern] = e->_pattern;
-        e->_pattern = pattern;
-        ++e->_count;
-    }
-    void finalize()
-    {
-        int p = 0;
-        for (int i = 0; i < _entries; ++i) {
-            int c = _table[i]._count;
-            if (c == 0 && _table[i]._pattern != 1)
-                c = 0x10000;
-            if (c == 0)
-                continue;
-            int pattern = _table[i]._pattern;
-            _table[i]._pattern = p;
-            for (int j = 0; j < c; ++j) {
-                _patterns[p] = pattern;
-                pattern = _next[pattern];
-                ++p;
-            }
-        }
-    }
-    int get(int position, Word** p)
-    {
-        Entry* e = &_table[position];
-        *p = &_patterns[e->_pattern];
-        if (e->_count == 0 && e->_pattern != 1)
-            return 0x10000;
-        return e->_count;
-    }
-private:
-    struct Entry
-    {
-        Word _pattern;
-        Word _count;
-    };
-    Array<Entry> _table;
-    Array<Word> _next;
-    Array<Word> _patterns;
-    int _entries;
-};
-
-template<class T> class CGAMatcherT : public ThreadTask
-{
-    struct Box
-    {
-        MatcherTable _table;
-        MatchingNTSCDecoder _baseDecoder;
-        MatchingNTSCDecoder _deltaDecoder;
-        int _bitOffset;
-        int _lChangeToRChange;
-        int _lCompareToRCompare;
-        int _lBlockToLChange;
-        int _lBaseToLCompare;
-        int _lBlockToLDelta;
-        int _lBlockToLCompare;
-        int _lBlockToLInput;
-        float _blockArea;
-        SInt8 _positionForPixel[35];
-        int position(int pixel)  // Relative to lChange
-        {
-            pixel += _lBlockToLChange;
-            if (pixel < 0 || pixel >= 35)
-                return -1;
-            return _positionForPixel[pixel];
-        }
-    };
-public:
-    CGAMatcherT()
-      : _active(false), _skip(0x100), _prescalerProfile(0),
-        _lTargetToLBlock(0), _lBlockToRTarget(0), _needRescale(true)
-    {
-        _scaler.setWidth(1);
-        _scaler.setBleeding(2);
-        _scaler.setOffset(Vector2<float>(0, 0));
-    }
-    void setInput(Bitmap<SRGB> input, Vector activeSize)
-    {
-        _activeSize = activeSize;
-        _input = input;
-        _active = true;
-        initData();
-    }
-    void setSize(Vector size)
-    {
-        _activeSize = size;
-        initData();
-    }
-    void setProgram(Program* program) { _program = program; }
-    void setSequencer(CGASequencer* sequencer) { _sequencer = sequencer; }
-    void setData(CGAData* data) { _data = data; }
-    void run()
-    {
-        int scanlinesPerRow;
-        int phase;
-        int interlace;
-        bool interlaceSync;
-        bool interlacePhase;
-        bool flicker;
-        double quality;
-        bool needRescale;
-        double gamma;
-        int characterSet;
-        double hue;
-        double saturation;
-        double contrast;
-        double brightness;
-        int connector;
-        double chromaBandwidth;
-        double lumaBandwidth;
-        double rollOff;
-        double lobes;
-        int prescalerProfile;
-        int lookAhead;
-        bool combineScanlines;
-        int advance;
-        {
-            Lock lock(&_mutex);
-            _diffusionHorizontal2 = _diffusionHorizontal;
-            _diffusionVertical2 = _diffusionVertical;
-            _diffusionTemporal2 = _diffusionTemporal;
-            _modeThread = _mode;
-            _palette2 = _palette;
-            scanlinesPerRow = _scanlinesPerRow;
-            _scanlinesRepeat2 = _scanlinesRepeat;
-            phase = _phase;
-            interlace = _interlace;
-            interlaceSync = _interlaceSync;
-            interlacePhase = _interlacePhase;
-            flicker = _flicker;
-            quality = _quality;
-            needRescale = _needRescale;
-            _needRescale = false;
-            gamma = _gamma;
-            _clipping2 = _clipping;
-            _metric2 = _metric;
-            characterSet = _characterSet;
-            hue = _hue;
-            saturation = _saturation;
-            contrast = _contrast;
-            brightness = _brightness;
-            connector = _connector;
-            chromaBandwidth = _chromaBandwidth;
-            lumaBandwidth = _lumaBandwidth;
-            rollOff = _rollOff;
-            lobes = _lobes;
-            prescalerProfile = _prescalerProfile;
-            lookAhead = _lookAhead;
-            combineScanlines = _combineScanlines;
-            advance = _advance;
-			_diffuseInternally2 = _diffuseInternally;
-        }
-
-        bool hres = (_mode & 1) != 0;
-        _isComposite = connector != 0;
-        _graphics = (_mode & 2) != 0;
-        bool oneBpp = (_mode & 0x10) != 0;
-		if (!hres || (!_graphics && !oneBpp))
-			phase = 0;
-        _combineVertical = false;
-        int boxCount;
-        int boxIncrement = hres == _graphics ? 16 : 8;
-        if (_graphics && !hres && advance == 4)
-            boxIncrement = 16;
-        if (advance == 0 && _graphics && !oneBpp)
-            advance = 1;
-        int bitCount = 16;
-        int incrementBytes = 2;
-        if (_graphics) {
-            if (scanlinesPerRow > 2 && combineScanlines)
-                _combineVertical = true;
-            _pixelMask = oneBpp ? 1 : 3;
-            if (_combineVertical) {
-                lookAhead = max(lookAhead, 7);
-                if (advance == 4)
-                    advance = 3;
-            }
-            if (hres) {
-                incrementBytes = 4;
-                if (!oneBpp) {
-                    if (_combineVertical) {
-                        lookAhead = max(lookAhead, 3);
-                        if (advance == 3)
-                            advance = 2;
-                    }
-                    lookAhead = max(lookAhead, _combineVertical ? 7 : 3);
-                }
-                int bpp = oneBpp ? 1 : 2;
-                bitCount = bpp << advance;
-                int positions = (lookAhead & -(1 << advance)) + (1 << advance);
-                _combineShift = positions*bpp;
-                int firstPixel = 0;
-                boxCount = 0;
-                do {
-                    Box* box = &_boxes[boxCount];
-                    for (int pixel = 0; pixel < 35; ++pixel)
-                        box->_positionForPixel[pixel] = -1;
-                    int pixel = firstPixel;
-                    int minPixel = 35;
-                    for (int position = 0; position < positions; ++position) {
-                        while (box->_positionForPixel[pixel] != -1)
-                            ++pixel;
-                        int bitPosition = position*bpp;
-                        box->_positionForPixel[pixel] = bitPosition;
-                        minPixel = min(minPixel, pixel);
-                        if ((pixel & 4) != 0) {
-                            box->_positionForPixel[pixel ^ 8] = bitPosition;
-                            minPixel = min(minPixel, pixel ^ 8);
-                        }
-                    }
-                    box->_bitOffset = minPixel << 1;
-                    bool newBox = false;
-                    if (boxCount != 0) {
-                        for (int pixel = 0; pixel < 35; ++pixel) {
-                            if ((box->_positionForPixel[pixel] == -1) !=
-                                (_boxes[boxCount-1]._positionForPixel[pixel] ==
-                                -1)) {
-                                newBox = true;
-                                break;
-                            }
-                        }
-                    }
-                    else
-                        newBox = true;
-                    if (newBox)
-                        ++boxCount;
-                    firstPixel += 1 << advance;
-                } while (firstPixel < 16);
-            }
-            else {
-                bitCount = 1 << advance;
-                incrementBytes = advance == 4 ? 2 : 1;
-                _combineShift = (lookAhead & -(1 << advance)) + (1 << advance);
-                boxCount = advance == 4 ? 1 : 8 >> advance;
-                for (int i = 0; i < boxCount; ++i) {
-                    Box* box = &_boxes[i];
-                    box->_bitOffset = (i << advance) & 7;
-                    for (int x = 0; x < 35; ++x) {
-                        int v = (x & -1 << (oneBpp ? 0 : 1)) - (i << advance);
-                        box->_positionForPixel[x] = v >= 0 && v < _combineShift
-                            ? v : -1;
-                    }
-                }
-            }
-            if (_combineVertical)
-                _patternCount = 1 << (_combineShift << 1);
-            else
-                _patternCount = 1 << _combineShift;
-            for (int boxIndex = 0; boxIndex < boxCount; ++boxIndex) {
-                Box* box = &_boxes[boxIndex];
-                int i;
-                for (i = 0; i < 35; ++i)
-                    if (box->_positionForPixel[i] != -1)
-                        break;
-                box->_lBlockToLChange = i;
-                for (i = 30; i >= 0; --i)
-                    if (box->_positionForPixel[i] != -1)
-                        break;
-                box->_lChangeToRChange = i + 1 - box->_lBlockToLChange;
-            }
-        }
-        else {
-            lookAhead = 0;
-            boxCount = 1;
-            Box* box = &_boxes[0];
-            box->_bitOffset = 0;
-            box->_lBlockToLChange = 0;
-            box->_lChangeToRChange = boxIncrement;
-            _patternCount = 0x10000;
-            _combineShift = 0;
-        }
-
-        for (int i = 0; i < 4; ++i) {
-            UInt64 rgbi = _sequencer->process(i*0x55555555, _modeThread,
-                _palette2, 0, false, 0);
-            _rgbiFromBits[i] = (rgbi >> 12) & 0xf;
-        }
-
-        _program->setProgress(0);
-
-        int lErrorToLBlock = 0;
-        int lBlockToRError = 0;
-        int gamutLeftPadding = 0;
-        int gamutWidth = 0;
-        int gamutOutputWidth = _graphics ? 4 : hres ? 8 : 16;
-        bool newCGA = connector == 2;
-        int lNtscToLBlock = 0;
-        int lBlockToRNtsc = 0;
-        int lBlockToRChange = 0;
-        for (int boxIndex = 0; boxIndex < boxCount; ++boxIndex) {
-            Box* box = &_boxes[boxIndex];
-            box->_lCompareToRCompare = box->_lChangeToRChange;
-            box->_lBlockToLCompare = box->_lBlockToLChange;
-            lBlockToRChange = max(lBlockToRChange,
-                box->_lBlockToLChange + box->_lChangeToRChange);
-        }
-        if (_isComposite) {
-            _composite.setBW(false);
-            _composite.setNewCGA(newCGA);
-            _composite.initChroma();
-            Byte burst[4];
-            for (int i = 0; i < 4; ++i)
-                burst[i] = _composite.simulateCGA(6, 6, i);
-            _composite.setBW((_mode & 4) != 0);
-            _composite.initChroma();
-            double black = _composite.black();
-            double white = _composite.white();
-            int rChangeToRBase = static_cast<int>(4*lobes);
-            for (int boxIndex = 0; boxIndex < boxCount; ++boxIndex) {
-                Box* box = &_boxes[boxIndex];
-                int lBaseToLChange = ((rChangeToRBase + 4) & ~3) +
-                    (box->_lBlockToLChange & 3);
-                int lBaseToRChange = lBaseToLChange + box->_lChangeToRChange;
-                MatchingNTSCDecoder* base = &box->_baseDecoder;
-                base->setLength(lBaseToRChange + rChangeToRBase);
-                base->setLumaBandwidth(lumaBandwidth);
-                base->setChromaBandwidth(chromaBandwidth);
-                base->setRollOff(rollOff);
-                base->setLobes(lobes);
-                base->setHue(hue + (hres ? 14 : 4) - 90);
-                base->setSaturation(
-                    saturation*1.45*(newCGA ? 1.5 : 1.0)/100);
-                double c = contrast*256*(newCGA ? 1.2 : 1)/(white - black)/100;
-                base->setContrast(c);
-                base->setBrightness(
-                    (-black*c + brightness*5 + (newCGA ? -50 : 0))/256.0);
-                base->setInputScaling(1);
-                base->calculateBurst(burst);
-                int lInputToLBase = -base->inputLeft();
-                int lBaseToRInput = base->inputRight();
-                int lInputToLChange = lInputToLBase + lBaseToLChange;
-                lNtscToLBlock = max(lNtscToLBlock,
-                    lInputToLChange - box->_lBlockToLChange);
-                lBlockToRNtsc = max(lBlockToRNtsc,
-                    lBaseToRInput + box->_lBlockToLChange - lBaseToLChange);
-                _bias = base->bias();
-                _shift = base->shift();
-                MatchingNTSCDecoder* delta = &box->_deltaDecoder;
-                *delta = *base;
-                int lInputToRInput = lInputToLBase + lBaseToRInput;
-                _activeInputs.ensure(lInputToRInput);
-                for (int x = 0; x < lInputToRInput; ++x) {
-                    int r = x - lInputToLChange;
-                    _activeInputs[x] =
-                        box->position(r + 1) != -1 || box->position(r) != -1 ?
-                        1 : 0;
-                }
-                delta->calculateBurst(burst, &_activeInputs[lInputToLBase]);
-                box->_lBaseToLCompare = delta->outputLeft();
-                int lBaseToRCompare = delta->outputRight();
-                box->_lCompareToRCompare =
-                    lBaseToRCompare - box->_lBaseToLCompare;
-                int lBaseToLDelta = delta->inputLeft();
-                int lInputToLCompare = lInputToLBase + box->_lBaseToLCompare;
-                int lCompareToLChange = lInputToLChange - lInputToLCompare;
-                int lCompareToLBlock =
-                    lCompareToLChange - box->_lBlockToLChange;
-                int lBlockToLBase = box->_lBlockToLChange - lBaseToLChange;
-                box->_lBlockToLDelta = lBlockToLBase + lBaseToLDelta;
-                box->_lBlockToLCompare = lBlockToLBase + box->_lBaseToLCompare;
-                box->_lBlockToLInput = lBlockToLBase - lInputToLBase;
-                lErrorToLBlock = max(lErrorToLBlock, lCompareToLBlock);
-                lBlockToRError = max(lBlockToRError,
-                    box->_lCompareToRCompare - lCompareToLBlock);
-            }
-            _gamutDecoder = _boxes[0]._baseDecoder;
-            _gamutDecoder.setLength(gamutOutputWidth);
-            _gamutDecoder.calculateBurst(burst);
-            gamutLeftPadding = _gamutDecoder.inputLeft();
-            gamutWidth = _gamutDecoder.inputRight() - gamutLeftPadding;
-            _ntscPattern.ensure(gamutWidth);
-        }
-
-        // Resample input image to desired size
-        Vector size(_hdotsPerChar*_horizontalDisplayed,
-            scanlinesPerRow*_scanlinesRepeat2*_verticalDisplayed);
-        _linearizer.setGamma(static_cast<float>(gamma));
-        if (size != _size || lNtscToLBlock > _lTargetToLBlock ||
-            lBlockToRNtsc > _lBlockToRTarget || needRescale) {
-            _lTargetToLBlock = lNtscToLBlock;
-            _lBlockToRTarget = lBlockToRNtsc;
-            auto zoom = Vector2Cast<float>(_activeSize*
-                Vector(1, interlaceSync ? 2 : 1))/
-                Vector2Cast<float>(_input.size());
-            _scaler.setZoom(zoom);
-            Vector offset(static_cast<int>(_lTargetToLBlock / zoom.x), 0);
-            _scaler.setProfile(prescalerProfile);
-            _scaler.setOutputSize(size
-                + Vector(_lTargetToLBlock + _lBlockToRTarget, 0));
-            _scaler.setHorizontalLobes(3);
-            _scaler.setVerticalLobes(3);
-            _scaler.init();
-            _size = size;
-            AlignedBuffer input = _scaler.input();
-            Vector tl = _scaler.inputTL() - offset;
-            Vector br = _scaler.inputBR() - offset;
-            Byte* unscaledRow = input.data() - tl.y*input.stride();
-            Byte* inputRow = _input.data();
-            int height = _input.size().y;
-            if (tl.y > 0) {
-                inputRow += _input.stride()*tl.y;
-                height -= tl.y;
-            }
-            int below = br.y - _input.size().y;
-            if (below < 0)
-                height += below;
-            int width = _input.size().x;
-            if (tl.x > 0) {
-                inputRow += sizeof(SRGB)*tl.x;
-                width -= tl.x;
-            }
-            int right = br.x - _input.size().x;
-            if (right < 0)
-                width += right;
-            for (int y = 0; y < height; ++y) {
-                Colour* unscaled = reinterpret_cast<Colour*>(unscaledRow);
-                SRGB* p = reinterpret_cast<SRGB*>(inputRow);
-                for (int x = 0; x < -tl.x; ++x) {
-                    *unscaled = _linearizer.linear(*p);
-                    ++unscaled;
-                }
-                for (int x = 0; x < width; ++x) {
-                    *unscaled = _linearizer.linear(*p);
-                    ++unscaled;
-                    ++p;
-                }
-                --p;
-                for (int x = 0; x < right; ++x) {
-                    *unscaled = _linearizer.linear(*p);
-                    ++unscaled;
-                }
-                unscaledRow += input.stride();
-                inputRow += _input.stride();
-            }
-            unscaledRow = input.data();
-            Byte* pp = input.data() - tl.y*input.stride();
-            for (int y = 0; y < -tl.y; ++y) {
-                memcpy(unscaledRow, pp, (br.x - tl.x)*sizeof(Colour));
-                unscaledRow += input.stride();
-            }
-            unscaledRow =
-                input.data() + (_input.size().y - tl.y)*input.stride();
-            pp = unscaledRow - input.stride();
-            for (int y = 0; y < below; ++y) {
-                memcpy(unscaledRow, pp, (br.x - tl.x)*sizeof(Colour));
-                unscaledRow += input.stride();
-            }
-            _scaler.render();
-            _scaled = _scaler.output();
-        }
-
-        // Set up gamut table
-        float gDivisions = static_cast<float>(64.0/pow(2, quality*6));
-        Vector3<float> srgbScale;
-        srgbScale.y = gDivisions/256;
-        srgbScale.x = srgbScale.y*0.84f;
-        srgbScale.z = srgbScale.y*0.55f;
-        Vector3<int> srgbDiv = Vector3Cast<int>(255.0f*srgbScale) + 1;
-        int entries = srgbDiv.x*srgbDiv.y*srgbDiv.z;
-        _blockHeight = scanlinesPerRow*_scanlinesRepeat2;
-        if (_graphics) {
-            _blockHeight = (scanlinesPerRow <= 2 ? 1 : scanlinesPerRow)*
-                _scanlinesRepeat2;
-            for (int i = 0; i < 0x100; ++i)
-                _skip[i] = false;
-        }
-        else {
-            bool blink = ((_modeThread & 0x20) != 0);
-            auto cgaROM = _sequencer->romData();
-            int lines = scanlinesPerRow*_scanlinesRepeat2;
-            for (int i = 0; i < 0x100; ++i) {
-                _skip[i] = false;
-                if (characterSet == 0) {
-                    _skip[i] = (i != 0xdd);
-                    continue;
-                }
-                if (characterSet == 1) {
-                    _skip[i] = (i != 0x13 && i != 0x55);
-                    continue;
-                }
-                if (characterSet == 2) {
-                    _skip[i] =
-                        (i != 0x13 && i != 0x55 && i != 0xb0 && i != 0xb1);
-                    continue;
-                }
-                if (characterSet == 4) {
-                    _skip[i] = (i != 0xb1);
-                    continue;
-                }
-                if (characterSet == 5) {
-                    _skip[i] = (i != 0xb0 && i != 0xb1);
-                    continue;
-                }
-                if (characterSet == 7) {
-                    _skip[i] = (i != 0x0c && i != 0x0d && i != 0x21 &&
-                        i != 0x35 && i != 0x55 && i != 0x6a && i != 0xdd);
-                    continue;
-                }
-                if (characterSet == 6) {
-                    _skip[i] = (i != 0x06 && i != 0x13 && i != 0x19 &&
-                        i != 0x22 && i != 0x27 && i != 0x55 && i != 0x57 &&
-                        i != 0x60 && i != 0xb6 && i != 0xdd);
-                }
-                if ((_modeThread & 0x10) != 0)
-                    continue;
-                bool isBackground = true;
-                bool isForeground = true;
-                for (int y = 0; y < lines; ++y) {
-                    Byte b = cgaROM[i*8 + y];
-                    if (b != 0x00)
-                        isBackground = false;
-                    if (b != 0xff)
-                        isForeground = false;
-                }
-                if (isBackground || (isForeground && blink)) {
-                    _skip[i] = true;
-                    continue;
-                }
-                int j;
-                for (j = 0; j < i; ++j) {
-                    int y;
-                    for (y = 0; y < lines; ++y)
-                        if (cgaROM[i*8 + y] != cgaROM[j*8 + y])
-                            break;
-                    if (y == lines)
-                        break;
-                }
-                if (j != i)
-                    _skip[i] = true;
-                if (blink)
-                    continue;
-                for (j = 0; j < i; ++j) {
-                    int y;
-                    for (y = 0; y < lines; ++y)
-                        if (cgaROM[i*8 + y] != (cgaROM[j*8 + y]^0xff))
-                            break;
-                    if (y == lines)
-                        break;
-                }
-                if (j != i)
-                    _skip[i] = true;
-            }
-        }
-        int banks = (_graphics && scanlinesPerRow > 1) ? 2 : 1;
-        int bytesPerRow = 2*_horizontalDisplayed;
-        if (!_isComposite) {
-            Byte levels[4];
-            for (int i = 0; i < 4; ++i)
-                levels[i] = byteClamp(2.55*brightness + 0.85*i*contrast + 0.5);
-            int palette[3*0x11] = {
-                0, 0, 0,  0, 0, 2,  0, 2, 0,  0, 2, 2,
-                2, 0, 0,  2, 0, 2,  2, 1, 0,  2, 2, 2,
-                1, 1, 1,  1, 1, 3,  1, 3, 1,  1, 3, 3,
-                3, 1, 1,  3, 1, 3,  3, 3, 1,  3, 3, 3,
-                0, 0, 0};
-            for (int i = 0; i < 3*0x11; ++i)
-                _rgbiPalette[i] = levels[palette[i]];
-        }
-
-        // Populate gamut tables
-        for (int boxIndex = 0; boxIndex < boxCount; ++boxIndex) {
-            Box* box = &_boxes[boxIndex];
-            int lChangeToRChange = box->_lChangeToRChange;
-            _srgb.ensure(lChangeToRChange);
-            _srgb.ensure(box->_lCompareToRCompare);
-            box->_table.setSize(entries);
-            if (_isComposite)
-                _base.ensure(box->_lCompareToRCompare*_blockHeight);
-            box->_blockArea = static_cast<float>(lChangeToRChange);
-            if (_combineVertical)
-                box->_blockArea *= _blockHeight;
-            int skipSolidColour = 0xf00;
-            for (int pattern = 0; pattern < _patternCount; ++pattern) {
-                if (!_graphics && !oneBpp) {
-                    if (_skip[pattern & 0xff])
-                        continue;
-                    int foreground = pattern & 0xf00;
-                    if (foreground == ((pattern >> 4) & 0x0f00)) {
-                        if (foreground == skipSolidColour)
-                            continue;
-                        skipSolidColour = foreground;
-                    }
-                }
-                int blockLines = _blockHeight;
-                if (_graphics)
-                    blockLines = _combineVertical ? 2 : 1;
-                Colour rgb(0, 0, 0);
-                for (int y = 0; y < blockLines; ++y) {
-                    if (_graphics) {
-                        for (int x = 0; x < lChangeToRChange; ++x) {
-                            int p = pattern;
-                            if (_combineVertical && y != 0)
-                                p >>= _combineShift;
-                            p >>= box->_positionForPixel[x +
-                                box->_lBlockToLChange];
-                            _rgbiPattern[x] = _rgbiFromBits[p & _pixelMask];
-                        }
-                    }
-                    else {
-                        UInt64 rgbi = _sequencer->process(pattern * 0x00010001,
-                            _modeThread, _palette2, y, false, 0);
-                        for (int x = 0; x < lChangeToRChange; ++x)
-                            _rgbiPattern[x] = (rgbi >> (x << 2)) & 0xf;
-                    }
-
-                    if (!_isComposite) {
-                        SRGB* srgb = &_srgb[0];
-                        for (int x = 0; x < lChangeToRChange; ++x) {
-                            Byte* p = &_rgbiPalette[3*_rgbiPattern[x]];
-                            *srgb = SRGB(p[0], p[1], p[2]);
-                            ++srgb;
-                        }
-                    }
-                    else {
-                        Byte* ntsc = &_ntscPattern[0];
-                        int l = ((gamutLeftPadding - box->_lBlockToLChange)
-                            *(1 - lChangeToRChange)) % lChangeToRChange;
-                        int r = (l + 1)%lChangeToRChange;
-                        for (int x = 0; x < gamutWidth; ++x) {
-                            *ntsc = _composite.simulateCGA(_rgbiPattern[l],
-                                _rgbiPattern[r], (x + gamutLeftPadding) & 3);
-                            l = r;
-                            r = (r + 1)%lChangeToRChange;
-                            ++ntsc;
-                        }
-                        _gamutDecoder.decodeNTSC(&_ntscPattern[0]);
-                        _gamutDecoder.outputToSRGB(&_srgb[0]);
-                    }
-                    SRGB* srgb = &_srgb[0];
-                    float lineScale = 1;
-                    if (_combineVertical) {
-                        lineScale = static_cast<float>(
-                            (_blockHeight + (y == 0 ? 1 : 0)) >> 1);
-                    }
-                    for (int x = 0; x < gamutOutputWidth; ++x)
-                        rgb += lineScale*_linearizer.linear(srgb[x]);
-                }
-                SRGB srgb = _linearizer.srgb(rgb/box->_blockArea);
-                auto s = Vector3Cast<int>(Vector3Cast<float>(srgb)*srgbScale);
-                box->_table.add(pattern,
-                    s.x + srgbDiv.x*(s.y + srgbDiv.y*s.z));
-            }
-            box->_table.finalize();
-        }
-
-        // Set up data structures for matching
-        int rowDataStride = 2*_horizontalDisplayed + 1;
-        _rowData.ensure(rowDataStride*2);
-        _rowData[0] = 0;
-        _rowData[rowDataStride] = 0;
-        _errorStride = 1 + lErrorToLBlock + size.x + lBlockToRError;
-        int errorSize = _errorStride*(size.y + 1);
-        _error.ensure(errorSize);
-        srand(0);
-        for (int x = 0; x < errorSize; ++x)
-            _error[x] = Colour(0, 0, 0);
-        int size1 = size.x - boxIncrement;
-        _rgbiStride = 1 + size1 + lBlockToRChange;
-        _rgbi.ensure(_rgbiStride*_blockHeight + 1);
-        int row = 0;
-        int scanline = 0;
-        int scanlineIteration = 0;
-        int overscan = (_modeThread & 0x10) != 0 ? 0 : _palette2 & 0xf;
-
-        const Byte* inputStart = _scaled.data();
-        if (_isComposite) {
-            _ntscStride = lNtscToLBlock + size1 + lBlockToRNtsc;
-            _ntscInput.ensure(_ntscStride*_blockHeight);
-            _ntsc.ensure(size.y*_ntscStride);
-            const Byte* inputRow = inputStart;
-            Byte* outputRow = &_ntsc[0];
-            for (int y = 0; y < size.y; ++y) {
-                _boxes[0]._baseDecoder.encodeNTSC(
-                    reinterpret_cast<const Colour*>(inputRow),
-                    outputRow, _ntscStride, &_linearizer, -lNtscToLBlock);
-                inputRow += _scaled.stride();
-                outputRow += _ntscStride;
-            }
-        }
-
-        const Byte* inputRow = inputStart + sizeof(Colour)*(_lTargetToLBlock);
-        Colour* errorRow = &_error[_errorStride + 1] + lErrorToLBlock;
-        Byte* ntscRow = &_ntsc[0] + lNtscToLBlock;
-        int bankShift =
-            _data->getDataByte(CGAData::registerLogCharactersPerBank) + 1;
-        int bank = 0;
-        row = 0;
-        int phaseOffset = phase*2;
-
-        // Perform matching
-        while (!cancelling()) {
-            if (_combineVertical) {
-                Array<Byte> rowData = _data->getData(row*bytesPerRow,
-                    bytesPerRow);
-                memcpy(&_rowData[1], &rowData[0], bytesPerRow);
-                rowData = _data->getData(row*bytesPerRow + (1 << bankShift),
-                    bytesPerRow);
-                memcpy(&_rowData[1 + rowDataStride], &rowData[0], bytesPerRow);
-            }
-            else {
-                Array<Byte> rowData = _data->getData(
-                    row*bytesPerRow + (bank << bankShift), bytesPerRow);
-                memcpy(&_rowData[1], &rowData[0], bytesPerRow);
-            }
-            Byte* rgbi = &_rgbi[0];
-            for (int y = 0;; ++y) {
-                *rgbi = overscan;
-                if (y == _blockHeight)
-                    break;
-                for (int x = 1; x < _rgbiStride; ++x)
-                    rgbi[x] = -1;
-                rgbi += _rgbiStride;
-            }
-            Byte* rgbiRow = &_rgbi[1];
-            if (_isComposite) {
-                const Byte* inputLine =
-                    inputRow - sizeof(Colour)*(_lTargetToLBlock);
-                Byte* outputLine = &_ntscInput[0];
-                for (int y = 0; y < _blockHeight; ++y) {
-                    memcpy(outputLine, inputLine, _ntscStride);
-                    inputLine += _ntscStride;
-                    outputLine += _ntscStride;
-                }
-            }
-
-            _d0 = &_rowData[1 + phaseOffset];
-            Byte* d1 = &_rowData[1 + rowDataStride + phaseOffset];
-            _inputBlock = inputRow;
-            _errorBlock = errorRow;
-            _rgbiBlock = rgbiRow;
-            _ntscBlock = ntscRow;
-            _ntscInputBlock = &_ntscInput[lNtscToLBlock];
-            int column = 0;
-            int boxIndex = 0;
-            while (true) {
-                Box* box = &_boxes[boxIndex];
-                int bestPattern = 0;
-                float bestMetric = std::numeric_limits<float>::max();
-                Colour rgb(0, 0, 0);
-                const Byte* inputChangeLine = _inputBlock + sizeof(Colour)*
-                    box->_lBlockToLChange;
-                Colour* errorChangeLine = _errorBlock + box->_lBlockToLChange;
-                Byte* ntscInputLine = _ntscBlock + box->_lBlockToLInput;
-                Byte* ntscDeltaLine = _ntscBlock + box->_lBlockToLDelta;
-
-                Vector3<SInt16>* baseLine = &_base[0];
-                for (int scanline = 0; scanline < _blockHeight; ++scanline) {
-                    // Compute average target colour for block to look up in
-                    // table.
-                    auto input =
-                        reinterpret_cast<const Colour*>(inputChangeLine);
-                    Colour* error = errorChangeLine;
-                    for (int x = 0; x < box->_lChangeToRChange; ++x) {
-                        Colour target = *input;
-						if (!_diffuseInternally2 || x != 0)
-                            target -= _diffusionHorizontal2*error[-1];
-						if (!_diffuseInternally2 || scanline != 0)
-                            target -= _diffusionVertical2*error[-_errorStride];
-                        target.x = clamp(0.0f, target.x, 1.0f);
-                        target.y = clamp(0.0f, target.y, 1.0f);
-                        target.z = clamp(0.0f, target.z, 1.0f);
-                        rgb += target;
-                        *error = Colour(0, 0, 0);
-                        ++input;
-                        ++error;
-                    }
-                    inputChangeLine += _scaled.stride();
-                    errorChangeLine += _errorStride;
-
-                    if (_isComposite) {
-                        // Compute base for decoding.
-                        box->_baseDecoder.decodeNTSC(ntscInputLine);
-                        box->_deltaDecoder.decodeNTSC(ntscDeltaLine);
-                        SInt16* decoded = box->_baseDecoder.outputData() +
-                            box->_lBaseToLCompare*3;
-                        SInt16* deltaDecoded = box->_deltaDecoder.outputData()
-                            + box->_lBaseToLCompare*3;
-                        _deltaDecoded = deltaDecoded;
-                        for (int x = 0; x < box->_lCompareToRCompare; ++x) {
-                            baseLine[x] = Vector3<SInt16>(decoded[0],
-                                decoded[1], decoded[2])
-                                - Vector3<SInt16>(deltaDecoded[0],
-                                deltaDecoded[1], deltaDecoded[2]);
-                            decoded += 3;
-                            deltaDecoded += 3;
-                        }
-                        ntscInputLine += _ntscStride;
-                        ntscDeltaLine += _ntscStride;
-                        baseLine += box->_lCompareToRCompare;
-                    }
-                }
-                SRGB srgb = _linearizer.srgb(rgb/box->_blockArea);
-                auto s = Vector3Cast<int>(
-                    Vector3Cast<float>(srgb)*srgbScale - 0.5f);
-                // Iterate through closest patterns to find the best match.
-                int z;
-                for (z = 0;; ++z) {
-                    bool foundPatterns = false;
-                    // Always search at least a 2x2x2 region of the gamut in
-                    // case we're on the boundary between two entries on any
-                    // given access.
-                    int rMin = max(s.x - z, 0);
-                    int rMax = min(s.x + 1 + z, srgbDiv.x - 1);
-                    int gMin = max(s.y - z, 0);
-                    int gMax = min(s.y + 1 + z, srgbDiv.y - 1);
-                    int bMin = max(s.z - z, 0);
-                    int bMax = min(s.z + 1 + z, srgbDiv.z - 1);
-                    for (int r = rMin; r <= rMax; ++r) {
-                        for (int g = gMin; g <= gMax; ++g) {
-                            for (int b = bMin; b <= bMax; ++b) {
-                                Word* patterns;
-                                int n = box->_table.get(r +
-                                    srgbDiv.x*(g + srgbDiv.y*b), &patterns);
-                                for (int i = 0; i < n; ++i) {
-                                    int pattern = *patterns;
-                                    foundPatterns = true;
-                                    float metric = tryPattern(box, pattern);
-                                    if (metric < bestMetric) {
-                                        bestPattern = pattern;
-                                        bestMetric = metric;
-                                    }
-                                    ++patterns;
-                                }
-                                if (r > rMin && r < rMax && g > gMin &&
-                                    g < gMax && b == bMin)
-                                    b = bMax - 1;
-                            }
-                        }
-                    }
-                    if (foundPatterns)
-                        break;
-                }
-                tryPattern(box, bestPattern);
-                if (oneBpp && hres) {
-                    bestPattern = ((bestPattern & 1) << 1) +
-                        ((bestPattern & 2) << 2) +
-                        ((bestPattern & 4) << 3) +
-                        ((bestPattern & 8) << 4) +
-                        ((bestPattern & 0x10) << 5) +
-                        ((bestPattern & 0x20) << 6) +
-                        ((bestPattern & 0x40) << 7) +
-                        ((bestPattern & 0x80) << 8) +
-                        ((bestPattern & 0x100) << 9) +
-                        ((bestPattern & 0x200) << 10) +
-                        ((bestPattern & 0x400) << 11) +
-                        ((bestPattern & 0x800) << 12) +
-                        ((bestPattern & 0x1000) << 13) +
-                        ((bestPattern & 0x2000) << 14) +
-                        ((bestPattern & 0x4000) << 15) +
-                        ((bestPattern & 0x8000) << 16);
-                }
-                if (bitCount == 16) {
-                    if (!_graphics ||
-                        ((box->_bitOffset & 16) == 0 && (!oneBpp || !hres))) {
-                        *_d0 = bestPattern;
-                        _d0[1] = bestPattern >> 8;
-                    }
-                    else {
-                        if (oneBpp && hres) {
-                            *_d0 = bestPattern;
-                            _d0[1] = bestPattern >> 8;
-                            _d0[2] = bestPattern >> 16;
-                            _d0[3] = bestPattern >> 24;
-                        }
-                        else {
-                            _d0[2] = bestPattern;
-                            _d0[3] = bestPattern >> 8;
-                        }
-                    }
-                }
-                else {
-                    int byte = box->_bitOffset >> 3;
-                    int mask = (1 << bitCount) - 1;
-                    int shift = box->_bitOffset & 7;
-                    bestPattern >>= _combineShift - bitCount;
-                    if (oneBpp && hres) {
-                        mask = (1 << (bitCount << 1)) - 1;
-                        if (bitCount == 8) {
-                            _d0[byte] = bestPattern;
-                            _d0[byte + 1] = bestPattern >> 8;
-                            if (_combineVertical) {
-                                d1[byte] = bestPattern >> 16;
-                                d1[byte + 1] = bestPattern >> 24;
-                            }
-                        }
-                        else {
-                            if (bitCount == 4) {
-                                _d0[byte] = bestPattern;
-                                if (_combineVertical)
-                                    d1[byte] = bestPattern >> 8;
-                            }
-                            else {
-                                _d0[byte] = (_d0[byte] & ~(mask << shift)) +
-                                    ((bestPattern & mask) << shift);
-                                if (_combineVertical) {
-                                    bestPattern >>= _combineShift;
-                                    d1[byte] = (d1[byte] & ~(mask << shift)) +
-                                        ((bestPattern & mask) << shift);
-                                }
-                            }
-                        }
-                    }
-                    else {
-                        _d0[byte] = (_d0[byte] & ~(mask << shift)) +
-                            ((bestPattern & mask) << shift);
-                        if (_combineVertical) {
-                            bestPattern >>= _combineShift;
-                            d1[byte] = (d1[byte] & ~(mask << shift)) +
-                                ((bestPattern & mask) << shift);
-                        }
-                    }
-                }
-                ++boxIndex;
-                if (boxIndex == boxCount) {
-                    boxIndex = 0;
-                    _inputBlock += boxIncrement*3*sizeof(float);
-                    _errorBlock += boxIncrement;
-                    _rgbiBlock += boxIncrement;
-                    _ntscBlock += boxIncrement;
-                    _ntscInputBlock += boxIncrement;
-                    _d0 += incrementBytes;
-                    d1 += incrementBytes;
-                    column += incrementBytes;
-                    if ((incrementBytes & 2) != 0)
-                        phaseOffset ^= phase*2;
-                    if (column >= bytesPerRow)
-                        break;
-                }
-            }
-
-            if (_graphics) {
-                fixEndianness(&_rowData[1], bytesPerRow, oneBpp);
-                if (_combineVertical) {
-                    fixEndianness(&_rowData[1 + rowDataStride], bytesPerRow,
-                        oneBpp);
-                }
-            }
-            if (_combineVertical) {
-                _data->change(0, row*bytesPerRow, bytesPerRow, &_rowData[1]);
-                _data->change(0, row*bytesPerRow + (1 << bankShift),
-                    bytesPerRow, &_rowData[1 + rowDataStride]);
-                ++bank;
-            }
-            else {
-                _data->change(0, row*bytesPerRow + (bank << bankShift),
-                    bytesPerRow, &_rowData[1]);
-            }
-            _program->updateOutput();
-            ++bank;
-            inputRow += _blockHeight*_scaled.stride();
-            errorRow += _errorStride*_blockHeight;
-            rgbiRow += _rgbiStride*_blockHeight;
-            ntscRow += _ntscStride*_blockHeight;
-            if (bank == banks) {
-                bank = 0;
-                ++row;
-                if (row >= _verticalDisplayed)
-                    break;
-            }
-            _program->setProgress(static_cast<float>(row*banks + bank)/
-                (_verticalDisplayed*banks));
-        } // while (!cancelling())
-        _program->setProgress(-1);
-    }
-
-    void setDiffusionHorizontal(double diffusionHorizontal)
-    {
-        Lock lock(&_mutex);
-        _diffusionHorizontal = static_cast<float>(diffusionHorizontal);
-    }
-    double getDiffusionHorizontal() { return _diffusionHorizontal; }
-    void setDiffusionVertical(double diffusionVertical)
-    {
-        Lock lock(&_mutex);
-        _diffusionVertical = static_cast<float>(diffusionVertical);
-    }
-    double getDiffusionVertical() { return _diffusionVertical; }
-    void setDiffusionTemporal(double diffusionTemporal)
-    {
-        Lock lock(&_mutex);
-        _diffusionTemporal = static_cast<float>(diffusionTemporal);
-    }
-    double getDiffusionTemporal() { return _diffusionTemporal; }
-    void setMode(int mode)
-    {
-        Lock lock(&_mutex);
-        _mode = mode;
-        initData();
-    }
-    int getMode() { return _mode; }
-    void setPalette(int palette)
-    {
-        Lock lock(&_mutex);
-        _palette = palette;
-        initData();
-    }
-    int getPalette() { return _palette; }
-    void setScanlinesPerRow(int v)
-    {
-        Lock lock(&_mutex);
-        _scanlinesPerRow = v;
-        initData();
-    }
-    int getScanlinesPerRow() { return _scanlinesPerRow; }
-    void setScanlinesRepeat(int v)
-    {
-        Lock lock(&_mutex);
-        _scanlinesRepeat = v;
-        initData();
-    }
-    int getScanlinesRepeat() { return _scanlinesRepeat; }
-    void setPhase(int phase)
-    {
-        Lock lock(&_mutex);
-        _phase = phase;
-        initData();
-    }
-    int getPhase() { return _phase; }
-    void setInterlace(int interlace)
-    {
-        Lock lock(&_mutex);
-        _interlace = interlace;
-        initData();
-    }
-    int getInterlace() { return _interlace; }
-    void setInterlaceSync(bool interlaceSync)
-    {
-        Lock lock(&_mutex);
-        _interlaceSync = interlaceSync;
-        initData();
-    }
-    bool getInterlaceSync() { return _interlaceSync; }
-    void setInterlacePhase(bool interlacePhase)
-    {
-        Lock lock(&_mutex);
-        _interlacePhase = interlacePhase;
-        initData();
-    }
-    bool getInterlacePhase() { return _interlacePhase; }
-    void setFlicker(bool flicker)
-    {
-        Lock lock(&_mutex);
-        _flicker = flicker;
-        initData();
-    }
-    bool getFlicker() { return _flicker; }
-    void setQuality(double quality)
-    {
-        Lock lock(&_mutex);
-        _quality = quality;
-    }
-    double getQuality() { return _quality; }
-    void setGamma(double gamma)
-    {
-        Lock lock(&_mutex);
-        if (gamma != _gamma)
-            _needRescale = true;
-        _gamma = gamma;
-    }
-    double getGamma() { return _gamma; }
-    void setClipping(int clipping)
-    {
-        Lock lock(&_mutex);
-        _clipping = clipping;
-    }
-    int getClipping() { return _clipping; }
-    void setMetric(int metric)
-    {
-        Lock lock(&_mutex);
-        _metric = metric;
-    }
-    int getMetric() { return _metric; }
-    void setCharacterSet(int characterSet)
-    {
-        Lock lock(&_mutex);
-        _characterSet = characterSet;
-    }
-    int getCharacterSet() { return _characterSet; }
-    double getHue() { return _hue; }
-    void setHue(double hue)
-    {
-        Lock lock(&_mutex);
-        _hue = hue;
-    }
-    double getSaturation() { return _saturation; }
-    void setSaturation(double saturation)
-    {
-        Lock lock(&_mutex);
-        _saturation = saturation;
-    }
-    double getContrast() { return _contrast; }
-    void setContrast(double contrast)
-    {
-        Lock lock(&_mutex);
-        _contrast = contrast;
-    }
-    double getBrightness() { return _brightness; }
-    void setBrightness(double brightness)
-    {
-        Lock lock(&_mutex);
-        _brightness = brightness;
-    }
-    void setConnector(int connector)
-    {
-        Lock lock(&_mutex);
-        _connector = connector;
-    }
-    void setChromaBandwidth(double chromaBandwidth)
-    {
-        Lock lock(&_mutex);
-        _chromaBandwidth = chromaBandwidth;
-    }
-    double getChromaBandwidth() { return _chromaBandwidth; }
-    void setLumaBandwidth(double lumaBandwidth)
-    {
-        Lock lock(&_mutex);
-        _lumaBandwidth = lumaBandwidth;
-    }
-    double getLumaBandwidth() { return _lumaBandwidth; }
-    void setRollOff(double rollOff)
-    {
-        Lock lock(&_mutex);
-        _rollOff = rollOff;
-    }
-    double getRollOff() { return _rollOff; }
-    void setLobes(double lobes)
-    {
-        Lock lock(&_mutex);
-        _lobes = lobes;
-    }
-    double getLobes() { return _lobes; }
-    void setPrescalerProfile(int profile)
-    {
-        Lock lock(&_mutex);
-        if (profile != _prescalerProfile)
-            _needRescale = true;
-        _prescalerProfile = profile;
-    }
-    int getPrescalerProfile() { return _prescalerProfile; }
-    void setLookAhead(int lookAhead)
-    {
-        Lock lock(&_mutex);
-        _lookAhead = lookAhead;
-    }
-    int getLookAhead() { return _lookAhead; }
-    void setCombineScanlines(bool combineScanlines)
-    {
-        Lock lock(&_mutex);
-        _combineScanlines = combineScanlines;
-    }
-    bool getCombineScanlines() { return _combineScanlines; }
-    void setAdvance(int advance)
-    {
-        Lock lock(&_mutex);
-        _advance = advance;
-    }
-    int getAdvance() { return _advance; }
-	void setDiffuseInternally(bool diffuseInternally)
-	{
-		Lock lock(&_mutex);
-		_diffuseInternally = diffuseInternally;
-	}
-	bool getDiffuseInternally() { return _diffuseInternally; }
-    void initFromData()
-    {
-        _mode = _data->getDataByte(CGAData::registerMode);
-        _palette = _data->getDataByte(CGAData::registerPalette);
-        _scanlinesPerRow = 1 +
-            _data->getDataByte(CGAData::registerMaximumScanline);
-        _scanlinesRepeat =
-            _data->getDataByte(CGAData::registerScanlinesRepeat);
-    }
-private:
-    void fixEndianness(Byte* data, int bytes, bool oneBpp)
-    {
-        for (int i = 0; i < bytes; ++i) {
-            Byte b = *data;
-            if (!oneBpp) {
-                *data = ((b & 3) << 6) + ((b & 0x0c) << 2) +
-                    ((b & 0x30) >> 2) + ((b & 0xc0) >> 6);
-            }
-            else {
-                *data = ((b & 1) << 7) + ((b & 2) << 5) + ((b & 4) << 3) +
-                    ((b & 8) << 1) + ((b & 0x10) >> 1) + ((b & 0x20) >> 3) +
-                    ((b & 0x40) >> 5) + ((b & 0x80) >> 7);
-            }
-            ++data;
-        }
-    }
-
-    float tryPattern(Box* box, int pattern)
-    {
-        float metric = 0;
-        int lBlockToLChange = box->_lBlockToLChange;
-        const Byte* inputLine =
-            _inputBlock + sizeof(Colour)*box->_lBlockToLCompare;
-        Colour* errorLine = _errorBlock + box->_lBlockToLCompare;
-        Byte* rgbiLine = _rgbiBlock + lBlockToLChange;
-        Byte* ntscLine = _ntscBlock;
-        Byte* ntscInputLine = _ntscInputBlock + box->_lBlockToLChange;
-        Vector3<SInt16>* baseLine = &_base[0];
-        for (int scanline = 0; scanline < _blockHeight; ++scanline) {
-            int s = scanline / _scanlinesRepeat2;
-            SRGB* srgb = &_srgb[0];
-            auto input = reinterpret_cast<const Colour*>(inputLine);
-            auto error = errorLine;
-            if (_graphics) {
-                for (int x = 0; x < box->_lChangeToRChange; ++x) {
-                    int p = pattern;
-                    if (_combineVertical && (scanline & 1) != 0)
-                        p >>= _combineShift;
-                    int position = box->_positionForPixel[x + lBlockToLChange];
-                    if (position == -1)
-                        _rgbiPattern[x] = 16;
-                    else {
-                        _rgbiPattern[x] =
-                            _rgbiFromBits[(p >> position) & _pixelMask];
-                    }
-                }
-            }
-            else {
-                UInt64 rgbi = _sequencer->process(pattern + (_d0[-1] << 24),
-                    _modeThread, _palette2, s, false, 0);
-                for (int x = 0; x < box->_lChangeToRChange; ++x)
-                    _rgbiPattern[x] = (rgbi >> (x << 2)) & 0xf;
-            }
-            if (!_isComposite) {
-                for (int x = 0; x < box->_lChangeToRChange; ++x) {
-                    Byte* p = &_rgbiPalette[3*_rgbiPattern[x]];
-                    *srgb = SRGB(p[0], p[1], p[2]);
-                    ++srgb;
-                }
-            }
-            else {
-                Byte* rgbi = rgbiLine;
-                int x;
-                for (x = 0; x < box->_lChangeToRChange; ++x) {
-                    if (_rgbiPattern[x] != 16)
-                        rgbi[x] = _rgbiPattern[x];
-                }
-                Byte* ntsc = ntscLine + box->_lBlockToLChange;
-                for (x = -1; x < box->_lChangeToRChange; ++x) {
-                    int phase = (x + lBlockToLChange) & 3;
-                    if (rgbi[x] != 16) {
-                        if (rgbi[x + 1] != 16) {
-                            ntsc[x] = _composite.simulateCGA(rgbi[x],
-                                rgbi[x + 1], phase);
-                        }
-                        else {
-                            ntsc[x] = _composite.simulateHalfCGA(rgbi[x],
-                                ntscInputLine[x + 1], phase);
-                        }
-                    }
-                    else {
-                        if (rgbi[x + 1] != 16) {
-                            ntsc[x] = _composite.simulateRightHalfCGA(
-                                ntscInputLine[x], rgbi[x + 1], phase);
-                        }
-                        else
-                            ntsc[x] = ntscInputLine[x];
-                    }
-                }
-                box->_deltaDecoder.decodeNTSC(ntscLine + box->_lBlockToLDelta);
-                SInt16* decoded = _deltaDecoded;
-                for (int x = 0; x < box->_lCompareToRCompare; ++x) {
-                    Vector3<SInt16> b = baseLine[x];
-                    srgb[x] = SRGB(
-                        byteClamp((b.x + decoded[0] + _bias) >> _shift),
-                        byteClamp((b.y + decoded[1] + _bias) >> _shift),
-                        byteClamp((b.z + decoded[2] + _bias) >> _shift));
-                    decoded += 3;
-                }
-            }
-            srgb = &_srgb[0];
-            Byte* rgbi = rgbiLine;
-            for (int x = 0; x < box->_lCompareToRCompare; ++x) {
-                SRGB o = *srgb;
-                Colour output = _linearizer.linear(o);
-                Colour target = *input;
-				if (!_diffuseInternally2 || scanline != 0)
-                    target -= _diffusionVertical2*error[-_errorStride];
-                if (*rgbi != 16 && (!_diffuseInternally2 || x != 0))
-                    target -= _diffusionHorizontal2*error[-1];
-                switch (_clipping2) {
-                    case 1:
-                        target.x = clamp(0.0f, target.x, 1.0f);
-                        target.y = clamp(0.0f, target.y, 1.0f);
-                        target.z = clamp(0.0f, target.z, 1.0f);
-                        break;
-                    case 2:
-                        if (target.x < 0.0f) {
-                            float scale = 0.5f/(0.5f - target.x);
-                            target.x = 0.0f;
-                            target.y = 0.5f + (target.y - 0.5f)*scale;
-                            target.z = 0.5f + (target.z - 0.5f)*scale;
-                        }
-                        if (target.x > 1.0f) {
-                            float scale = 0.5f/(target.x - 0.5f);
-                            target.x = 1.0f;
-                            target.y = 0.5f + (target.y - 0.5f)*scale;
-                            target.z = 0.5f + (target.z - 0.5f)*scale;
-                        }
-                        if (target.y < 0.0f) {
-                            float scale = 0.5f/(0.5f - target.y);
-                            target.x = 0.5f + (target.x - 0.5f)*scale;
-                            target.y = 0.0f;
-                            target.z = 0.5f + (target.z - 0.5f)*scale;
-                        }
-                        if (target.y > 1.0f) {
-                            float scale = 0.5f/(target.y - 0.5f);
-                            target.x = 0.5f + (target.x - 0.5f)*scale;
-                            target.y = 1.0f;
-                            target.z = 0.5f + (target.z - 0.5f)*scale;
-                        }
-                        if (target.z < 0.0f) {
-                            float scale = 0.5f/(0.5f - target.z);
-                            target.x = 0.5f + (target.x - 0.5f)*scale;
-                            target.y = 0.5f + (target.y - 0.5f)*scale;
-                            target.z = 0.0f;
-                        }
-                        if (target.z > 1.0f) {
-                            float scale = 0.5f/(target.z - 0.5f);
-                            target.x = 0.5f + (target.x - 0.5f)*scale;
-                            target.y = 0.5f + (target.y - 0.5f)*scale;
-                            target.z = 1.0f;
-                        }
-                        break;
-                    case 3:
-                        target.x = clamp(-1.0f, target.x, 2.0f);
-                        target.y = clamp(-1.0f, target.y, 2.0f);
-                        target.z = clamp(-1.0f, target.z, 2.0f);
-                        break;
-                }
-
-                Colour e = output - target;
-                *error = e;
-
-                float contribution = 0;
-                switch (_metric2) {
-                    case 1:
-                        contribution = e.modulus2();
-                        break;
-                    case 0:
-                    case 2:
-                        {
-                            SRGB t = _linearizer.srgb(target);
-                            float dr = static_cast<float>(o.x - t.x);
-                            float dg = static_cast<float>(o.y - t.y);
-                            float db = static_cast<float>(o.z - t.z);
-                            if (_metric == 0)
-                                contribution = dr*dr + dg*dg + db*db;
-                            else {
-                                // Fast colour distance metric from
-                                // http://www.compuphase.com/cmetric.htm .
-                                float mr = (o.x + t.x)/512.0f;
-                                contribution = 4.0f*dg*dg + (2.0f + mr)*dr*dr +
-                                    (3.0f - mr)*db*db;
-                            }
-                        }
-                        break;
-                    case 3:
-                        contribution = deltaE2Luv(output, target);
-                        break;
-                    case 4:
-                        contribution = deltaE2CIE76(output, target);
-                        break;
-                    case 5:
-                        contribution = deltaE2CIE94(output, target);
-                        break;
-                    case 6:
-                        contribution = deltaE2CIEDE2000(output, target);
-                        break;
-                }
-                metric += contribution;
-
-                ++input;
-                ++error;
-                ++srgb;
-                ++rgbi;
-            }
-            inputLine += _scaled.stride();
-            errorLine += _errorStride;
-            ntscLine += _ntscStride;
-            ntscInputLine += _ntscStride;
-            rgbiLine += _rgbiStride;
-            baseLine += box->_lCompareToRCompare;
-        }
-        return metric;
-    }
-    void initData()
-    {
-        static const int regs = -CGAData::registerLogCharactersPerBank;
-        Byte cgaRegistersData[regs] = { 0 };
-        Byte* cgaRegisters = &cgaRegistersData[regs];
-        cgaRegisters[CGAData::registerScanlinesRepeat] = _scanlinesRepeat;
-        cgaRegisters[CGAData::registerMode] = _mode;
-        cgaRegisters[CGAData::registerPalette] = _palette;
-        cgaRegisters[CGAData::registerInterlaceMode] = 2;
-        cgaRegisters[CGAData::registerMaximumScanline] = _scanlinesPerRow - 1;
-        if (!_active) {
-            _data->change(0, CGAData::registerScanlinesRepeat, 1,
-                &cgaRegisters[CGAData::registerScanlinesRepeat]);
-            _data->change(0, CGAData::registerMode, 2,
-                &cgaRegisters[CGAData::registerMode]);
-            _data->change(0, CGAData::registerInterlaceMode, 2,
-                &cgaRegisters[CGAData::registerInterlaceMode]);
-            return;
-        }
-        _hdotsPerChar = (_mode & 1) != 0 ? 8 : 16;
-        _horizontalDisplayed =
-            (_activeSize.x + _hdotsPerChar - 1)/_hdotsPerChar;
-        int scanlinesPerRow = _scanlinesPerRow*_scanlinesRepeat;
-        _verticalDisplayed =
-            (_activeSize.y + scanlinesPerRow - 1)/scanlinesPerRow;
-        _logCharactersPerBank = 0;
-        while ((1 << _logCharactersPerBank) <
-            _horizontalDisplayed*_verticalDisplayed)
-            ++_logCharactersPerBank;
-        int horizontalTotal = _horizontalDisplayed + 272/_hdotsPerChar;
-        int horizontalSyncPosition = _horizontalDisplayed + 80/_hdotsPerChar;
-        int totalScanlines = _activeSize.y + 62;
-        int verticalTotal = totalScanlines/scanlinesPerRow;
-        int verticalTotalAdjust =
-            totalScanlines - verticalTotal*scanlinesPerRow;
-        if (verticalTotal > 128 &&
-            verticalTotal < (32 - verticalTotalAdjust)/scanlinesPerRow + 128) {
-            verticalTotalAdjust += (verticalTotal - 128)*scanlinesPerRow;
-            verticalTotal = 128;
-        }
-        int verticalSyncPosition = _verticalDisplayed + 24/scanlinesPerRow;
-        int hdotsPerScanline = horizontalTotal*_hdotsPerChar;
-        cgaRegisters[CGAData::registerLogCharactersPerBank] =
-            _logCharactersPerBank;
-        cgaRegisters[CGAData::registerHorizontalTotalHigh] =
-            (horizontalTotal - 1) >> 8;
-        cgaRegisters[CGAData::registerHorizontalDisplayedHigh] =
-            _horizontalDisplayed >> 8;
-        cgaRegisters[CGAData::registerHorizontalSyncPositionHigh] =
-            horizontalSyncPosition >> 8;
-        cgaRegisters[CGAData::registerVerticalTotalHigh] =
-            (verticalTotal - 1) >> 8;
-        cgaRegisters[CGAData::registerVerticalDisplayedHigh] =
-            _verticalDisplayed >> 8;
-        cgaRegisters[CGAData::registerVerticalSyncPositionHigh] =
-            verticalSyncPosition >> 8;
-        cgaRegisters[CGAData::registerHorizontalTotal] =
-            (horizontalTotal - 1) & 0xff;
-        cgaRegisters[CGAData::registerHorizontalDisplayed] =
-            _horizontalDisplayed & 0xff;
-        cgaRegisters[CGAData::registerHorizontalSyncPosition] =
-            horizontalSyncPosition & 0xff;
-        cgaRegisters[CGAData::registerHorizontalSyncWidth] = 10;
-        cgaRegisters[CGAData::registerVerticalTotal] =
-            (verticalTotal - 1) & 0xff;
-        cgaRegisters[CGAData::registerVerticalTotalAdjust] =
-            verticalTotalAdjust;
-        cgaRegisters[CGAData::registerVerticalDisplayed] =
-            _verticalDisplayed & 0xff;
-        cgaRegisters[CGAData::registerVerticalSyncPosition] =
-            verticalSyncPosition & 0xff;
-        cgaRegisters[CGAData::registerCursorStart] = 6;
-        cgaRegisters[CGAData::registerCursorEnd] = 7;
-        _data->change(0, -regs, regs, &cgaRegistersData[0]);
-        int last = _horizontalDisplayed*_verticalDisplayed*2 - 1;
-        if ((_mode & 2) != 0)
-            last += 2 << _logCharactersPerBank;
-        _data->change(0, last, 0);
-        _data->setTotals(hdotsPerScanline*totalScanlines, hdotsPerScanline - 2,
-            static_cast<int>((hdotsPerScanline - 2)*(totalScanlines + 0.5)));
-    }
-
-    Program* _program;
-    CGAData* _data;
-    CGASequencer* _sequencer;
-    CGAComposite _composite;
-    Linearizer _linearizer;
-
-    int _phase;
-    int _mode;
-    int _palette;
-    int _scanlinesPerRow;
-    int _scanlinesRepeat;
-    int _connector;
-    float _diffusionHorizontal;
-    float _diffusionVertical;
-    float _diffusionTemporal;
-    int _interlace;
-    bool _interlaceSync;
-    bool _interlacePhase;
-    bool _flicker;
-    double _quality;
-    double _gamma;
-    int _clipping;
-    int _metric;
-    int _characterSet;
-    double _hue;
-    double _saturation;
-    double _contrast;
-    double _brightness;
-    double _chromaBandwidth;
-    double _lumaBandwidth;
-    double _rollOff;
-    double _lobes;
-    int _prescalerProfile;
-    int _lookAhead;
-    bool _combineScanlines;
-    int _advance;
-	bool _diffuseInternally;
-	bool _diffuseInternally2;
-    bool _needRescale;
-
-    bool _active;
-    Vector _size;
-    int _lTargetToLBlock;
-    int _lBlockToRTarget;
-    Vector _activeSize;
-    ScanlineRenderer _scaler;
-    AlignedBuffer _scaled;
-    int _horizontalDisplayed;
-    int _verticalDisplayed;
-    int _hdotsPerChar;
-    int _logCharactersPerBank;
-
-    Byte _rgbiPalette[3*0x11];
-    Array<bool> _skip;
-
-    Byte _rgbiPattern[28];
-    Array<Byte> _ntscPattern;
-    Array<Byte> _rowData;
-    Array<Byte> _rgbi;
-    Array<Byte> _ntsc;
-    Array<Byte> _ntscInput;
-    Array<SRGB> _srgb;
-    Bitmap<SRGB> _input;
-    Array<Colour> _error;
-    Array<Byte> _activeInputs;
-    Array<Vector3<SInt16>> _base;
-    int _bias;
-    int _shift;
-
-    Byte* _d0;
-	int _phaseMode;
-    const Byte* _inputBlock;
-    Colour* _errorBlock;
-    Byte* _rgbiBlock;
-    Byte* _ntscBlock;
-    Byte* _ntscInputBlock;
-    int _blockHeight;
-    int _decoderLength;
-    int _errorStride;
-    int _ntscStride;
-    int _rgbiStride;
-    SInt16* _deltaDecoded;
-    bool _isComposite;
-    bool _graphics;
-    int _metric2;
-    int _clipping2;
-    int _scanlinesRepeat2;
-    int _palette2;
-    int _modeThread;
-    float _diffusionHorizontal2;
-    float _diffusionVertical2;
-    float _diffusionTemporal2;
-    bool _combineVertical;
-
-    Mutex _mutex;
-
-    Box _boxes[24];
-    Byte _rgbiFromBits[4];
-    int _pixelMask;
-    int _combineShift;
-    int _patternCount;
-
-    MatchingNTSCDecoder _gamutDecoder;
-};
-
-typedef CGAMatcherT<void> CGAMatcher;
-
 template<class T> class CGAArtWindowT;
 typedef CGAArtWindowT<void> CGAArtWindow;
 
@@ -2883,150 +1283,6 @@ private:
     friend class OutputWindow;
 };
 
-bool endsIn(String s, String suffix)
-{
-    int l = suffix.length();
-    int o = s.length() - l;
-    if (o < 0)
-        return false;
-    for (int i = 0; i < l; ++i)
-        if (tolower(s[i + o]) != tolower(suffix[i]))
-            return false;
-    return true;
-}
-
-class BitmapValue : public Structure
-{
-public:
-    void load(String filename)
-    {
-        _name = filename;
-        _file = File(filename, true);
-        // We parse the filename relative to the current directory here instead
-        // of relative to the config file path because the filename usually
-        // comes from the command line.
-        Vector size(0, 0);
-        _isPNG = endsIn(filename, ".png");
-        if (_isPNG) {
-            _bitmap = PNGFileFormat<SRGB>().load(_file);
-            size = _bitmap.size();
-        }
-        _size.set("x", size.x, Span());
-        _size.set("y", size.y, Span());
-    }
-    Bitmap<SRGB> bitmap() { return _bitmap; }
-    Value getValue(Identifier identifier) const
-    {
-        if (identifier == Identifier("size"))
-            return Value(VectorType(), &_size, Span());
-        return Structure::getValue(identifier);
-    }
-    String name() { return _name; }
-    bool operator==(const BitmapValue& other) const
-    {
-        return _name == other._name;
-    }
-    bool isPNG() { return _isPNG; }
-    File file() { return _file; }
-private:
-    bool _isPNG;
-    Structure _size;
-    String _name;
-    File _file;
-    Bitmap<SRGB> _bitmap;
-};
-
-class BitmapType : public StructuredType
-{
-public:
-    BitmapType(BitmapValue* bitmapValue)
-      : StructuredType(create<Body>(bitmapValue)) { }
-    static String name() { return "Bitmap"; }
-    class Body : public StructuredType::Body
-    {
-    public:
-        Body(BitmapValue* bitmapValue)
-          : StructuredType::Body("Bitmap", members()),
-            _bitmapValue(bitmapValue)
-        { }
-        List<StructuredType::Member> members()
-        {
-            List<StructuredType::Member> vectorMembers;
-            vectorMembers.add(StructuredType::member<Vector>("size"));
-            return vectorMembers;
-        }
-        bool canConvertFrom(const Type& from, String* reason) const
-        {
-            return from == StringType();
-        }
-        Value convert(const Value& value) const
-        {
-            _bitmapValue->load(value.value<String>());
-            return Value(type(), static_cast<Structure*>(_bitmapValue),
-                value.span());
-        }
-        Value defaultValue() const
-        {
-            return Value(type(), static_cast<Structure*>(_bitmapValue),
-                Span());
-        }
-    private:
-        BitmapValue* _bitmapValue;
-    };
-};
-
-class BitmapIsRGBIFunction : public Function
-{
-public:
-    BitmapIsRGBIFunction(BitmapType bitmapType)
-      : Function(create<Body>(bitmapType)) { }
-    class Body : public Function::Body
-    {
-    public:
-        Body(BitmapType bitmapType) : _bitmapType(bitmapType) { }
-        Value evaluate(List<Value> arguments, Span span) const
-        {
-            auto bitmap = static_cast<BitmapValue*>(
-                arguments.begin()->value<Structure*>())->bitmap();
-            Vector size = bitmap.size();
-
-            int maxDistance = 0;
-            const Byte* inputRow = bitmap.data();
-
-            for (int y = 0; y < size.y; ++y) {
-                const SRGB* inputPixel =
-                    reinterpret_cast<const SRGB*>(inputRow);
-                for (int x = 0; x < size.x; ++x) {
-                    SRGB s = *inputPixel;
-                    ++inputPixel;
-                    int bestDistance = 0x7fffffff;
-                    Byte bestRGBI = 0;
-                    for (int i = 0; i < 16; ++i) {
-                        int distance = (Vector3Cast<int>(rgbiPalette[i]) -
-                            Vector3Cast<int>(s)).modulus2();
-                        if (distance < bestDistance) {
-                            bestDistance = distance;
-                            if (distance < 42*42)
-                                break;
-                        }
-                    }
-                    maxDistance = max(bestDistance, maxDistance);
-                }
-                inputRow += bitmap.stride();
-            }
-
-            return Value(maxDistance < 15*15*3);
-        }
-        Identifier identifier() const { return "bitmapIsRGBI"; }
-        FunctionType type() const
-        {
-            return FunctionType(BooleanType(), _bitmapType);
-        }
-    private:
-        BitmapType _bitmapType;
-    };
-};
-
 class Program : public WindowProgram<CGAArtWindow>
 {
 public:
@@ -3036,63 +1292,7 @@ public:
 
         ConfigFile configFile;
         _config = &configFile;
-        configFile.addType(VectorType());
-        configFile.addOption("inputPicture", bitmapType);
-        configFile.addDefaultOption("mode", 0x1a);
-        configFile.addDefaultOption("palette", 0x0f);
-        configFile.addDefaultOption("interlaceMode", 0);
-        configFile.addDefaultOption("interlaceSync", false);
-        configFile.addDefaultOption("interlacePhase", false);
-        configFile.addDefaultOption("flicker", false);
-        configFile.addDefaultOption("scanlinesPerRow", 2);
-        configFile.addDefaultOption("scanlinesRepeat", 1);
-        configFile.addDefaultOption("contrast", 100.0);
-        configFile.addDefaultOption("brightness", 0.0);
-        configFile.addDefaultOption("saturation", 100.0);
-        configFile.addDefaultOption("hue", 0.0);
-        configFile.addDefaultOption("showClipping", false);
-        configFile.addDefaultOption("chromaBandwidth", 1.0);
-        configFile.addDefaultOption("lumaBandwidth", 1.0);
-        configFile.addDefaultOption("rollOff", 0.0);
-        configFile.addDefaultOption("lobes", 4.0);
-        configFile.addDefaultOption("horizontalDiffusion", 0.647565);
-        configFile.addDefaultOption("verticalDiffusion", 0.352435);
-        configFile.addDefaultOption("temporalDiffusion", 0.0);
-        configFile.addDefaultOption("quality", 0.5);
-        configFile.addDefaultOption("gamma", 0.0);
-        configFile.addDefaultOption("clipping", 1);
-        configFile.addDefaultOption("metric", 2);
-        configFile.addDefaultOption("connector", 1);
-        configFile.addDefaultOption("characterSet", 3);
-        configFile.addDefaultOption("cgaROM", String("5788005.u33"));
-        configFile.addDefaultOption("aspectRatio", 5.0/6.0);
-        configFile.addDefaultOption("scanlineWidth", 0.5);
-        configFile.addDefaultOption("scanlineProfile", 0);
-        configFile.addDefaultOption("horizontalProfile", 0);
-        configFile.addDefaultOption("prescalerProfile", 4);
-        configFile.addDefaultOption("lookAhead", 3);
-        configFile.addDefaultOption("advance", 2);
-		configFile.addDefaultOption("diffuseInternally", false);
-        configFile.addDefaultOption("combineScanlines", true);
-        configFile.addDefaultOption("scanlineBleeding", 2);
-        configFile.addDefaultOption("horizontalBleeding", 2);
-        configFile.addDefaultOption("zoom", 2.0);
-        configFile.addDefaultOption("horizontalRollOff", 0.0);
-        configFile.addDefaultOption("verticalRollOff", 0.0);
-        configFile.addDefaultOption("horizontalLobes", 4.0);
-        configFile.addDefaultOption("verticalLobes", 4.0);
-        configFile.addDefaultOption("subPixelSeparation", 1.0);
-        configFile.addDefaultOption("phosphor", 0);
-        configFile.addDefaultOption("mask", 0);
-        configFile.addDefaultOption("maskSize", 0.0);
-        configFile.addDefaultOption("overscan", 0.1);
-        configFile.addDefaultOption("phase", 1);
-        configFile.addDefaultOption("interactive", true);
-        configFile.addDefaultOption("combFilter", 0);
-        configFile.addDefaultOption("fftWisdom", String("wisdom"));
-        configFile.addDefaultOption("activeSize", Vector(640, 200));
-
-        configFile.addFunco(BitmapIsRGBIFunction(bitmapType));
+        addCGAArtOptions(&configFile, bitmapType);
 
         List<Value> arguments;
 
@@ -3291,86 +1491,10 @@ public:
     bool matchingPossible() { return _matchingPossible; }
     void loadConfig()
     {
-        _matcher->setDiffusionHorizontal(
-            _config->get<double>("horizontalDiffusion"));
-        _matcher->setDiffusionVertical(
-            _config->get<double>("verticalDiffusion"));
-        _matcher->setDiffusionTemporal(
-            _config->get<double>("temporalDiffusion"));
-        _matcher->setQuality(_config->get<double>("quality"));
-        _matcher->setLookAhead(_config->get<int>("lookAhead"));
-        _matcher->setAdvance(_config->get<int>("advance"));
-		_matcher->setDiffuseInternally(
-			_config->get<bool>("diffuseInternally"));
-        _matcher->setCombineScanlines(_config->get<bool>("combineScanlines"));
-        _matcher->setGamma(_config->get<double>("gamma"));
-        _matcher->setClipping(_config->get<int>("clipping"));
-        _matcher->setMetric(_config->get<int>("metric"));
-        _matcher->setInterlace(_config->get<int>("interlaceMode"));
-        _matcher->setInterlaceSync(_config->get<bool>("interlaceSync"));
-        _matcher->setInterlacePhase(_config->get<bool>("interlacePhase"));
-        _matcher->setFlicker(_config->get<bool>("flicker"));
-        bool phase = _config->get<int>("phase") == 0;
-        _matcher->setPhase(phase ? 0 : 1);
-        _output->setPhase(phase ? 0 : 1);
-        _matcher->setCharacterSet(_config->get<int>("characterSet"));
-        _matcher->setMode(_config->get<int>("mode"));
-        _matcher->setPalette(_config->get<int>("palette"));
-        _matcher->setScanlinesPerRow(_config->get<int>("scanlinesPerRow"));
-        _matcher->setScanlinesRepeat(_config->get<int>("scanlinesRepeat"));
+        applyCGAArtConfig(_config, _matcher, _output);
         _cgaROM = _config->get<String>("cgaROM");
         _sequencer.setROM(File(_cgaROM, _configFile.parent()));
-
-        double brightness = _config->get<double>("brightness");
-        _output->setBrightness(brightness);
-        _matcher->setBrightness(brightness);
-        double saturation = _config->get<double>("saturation");
-        _output->setSaturation(saturation);
-        _matcher->setSaturation(saturation);
-        double hue = _config->get<double>("hue");
-        _output->setHue(hue);
-        _matcher->setHue(hue);
-        double contrast = _config->get<double>("contrast");
-        _output->setContrast(contrast);
-        _matcher->setContrast(contrast);
-        _output->setShowClipping(_config->get<bool>("showClipping"));
-        double chromaBandwidth = _config->get<double>("chromaBandwidth");
-        _matcher->setChromaBandwidth(chromaBandwidth);
-        _output->setChromaBandwidth(chromaBandwidth);
-        double lumaBandwidth = _config->get<double>("lumaBandwidth");
-        _matcher->setLumaBandwidth(lumaBandwidth);
-        _output->setLumaBandwidth(lumaBandwidth);
-        double rollOff = _config->get<double>("rollOff");
-        _matcher->setRollOff(rollOff);
-        _output->setRollOff(rollOff);
-        double lobes = _config->get<double>("lobes");
-        _output->setLobes(lobes);
-        _matcher->setLobes(lobes);
-        int connector = _config->get<int>("connector");
-        _output->setConnector(connector);
-        _matcher->setConnector(connector);
-        _output->setScanlineWidth(_config->get<double>("scanlineWidth"));
-        _output->setScanlineProfile(_config->get<int>("scanlineProfile"));
-        _output->setHorizontalProfile(_config->get<int>("horizontalProfile"));
-        _matcher->setPrescalerProfile(_config->get<int>("prescalerProfile"));
-        _output->setZoom(_config->get<double>("zoom"));
-        _output->setScanlineBleeding(_config->get<int>("scanlineBleeding"));
-        _output->setHorizontalBleeding(
-            _config->get<int>("horizontalBleeding"));
-        _output->setHorizontalRollOff(
-            _config->get<double>("horizontalRollOff"));
-        _output->setVerticalRollOff(_config->get<double>("verticalRollOff"));
-        _output->setHorizontalLobes(_config->get<double>("horizontalLobes"));
-        _output->setVerticalLobes(_config->get<double>("verticalLobes"));
-        _output->setSubPixelSeparation(
-            _config->get<double>("subPixelSeparation"));
-        _output->setPhosphor(_config->get<int>("phosphor"));
-        _output->setMask(_config->get<int>("mask"));
-        _output->setMaskSize(_config->get<double>("maskSize"));
-        _output->setAspectRatio(_config->get<double>("aspectRatio"));
         _overscan = _config->get<double>("overscan");
-        _output->setOverscan(_overscan);
-        _output->setCombFilter(_config->get<int>("combFilter"));
         _activeSize = _config->get<Vector>("activeSize");
     }
 private:
@@ -0,0 +1,2276 @@
+#include "alfe/main.h"
+
+#ifndef INCLUDED_CGAART_H
+#define INCLUDED_CGAART_H
+
+#include "alfe/complex.h"
+#include "alfe/space.h"
+#include "alfe/set.h"
+#include "alfe/config_file.h"
+#include "alfe/cga.h"
+#include "alfe/image_filter.h"
+
+class MatcherTable
+{
+public:
+    MatcherTable() : _next(0x10000), _patterns(0x10000) { }
+    void setSize(int entries)
+    {
+        _table.ensure(entries);
+        _entries = entries;
+        for (int i = 0; i < _entries; ++i) {
+            _table[i]._count = 0;
+            _table[i]._pattern = 1;
+        }
+    }
+
+    void add(Word pattern, int position)
+    {
+        Entry* e = &_table[position];
+        _next[pattern] = e->_pattern;
+        e->_pattern = pattern;
+        ++e->_count;
+    }
+    void finalize()
+    {
+        int p = 0;
+        for (int i = 0; i < _entries; ++i) {
+            int c = _table[i]._count;
+            if (c == 0 && _table[i]._pattern != 1)
+                c = 0x10000;
+            if (c == 0)
+                continue;
+            int pattern = _table[i]._pattern;
+            _table[i]._pattern = p;
+            for (int j = 0; j < c; ++j) {
+                _patterns[p] = pattern;
+                pattern = _next[pattern];
+                ++p;
+            }
+        }
+    }
+    int get(int position, Word** p)
+    {
+        Entry* e = &_table[position];
+        *p = &_patterns[e->_pattern];
+        if (e->_count == 0 && e->_pattern != 1)
+            return 0x10000;
+        return e->_count;
+    }
+private:
+    struct Entry
+    {
+        Word _pattern;
+        Word _count;
+    };
+    Array<Entry> _table;
+    Array<Word> _next;
+    Array<Word> _patterns;
+    int _entries;
+};
+
+template<class T> class CGAMatcherT : public ThreadTask
+{
+    struct Box
+    {
+        MatcherTable _table;
+        MatchingNTSCDecoder _baseDecoder;
+        MatchingNTSCDecoder _deltaDecoder;
+        int _bitOffset;
+        int _lChangeToRChange;
+        int _lCompareToRCompare;
+        int _lBlockToLChange;
+        int _lBaseToLCompare;
+        int _lBlockToLDelta;
+        int _lBlockToLCompare;
+        int _lBlockToLInput;
+        float _blockArea;
+        // Average colour of each pattern, for ordering the search.
+        Array<SRGB> _patternSRGB;
+        SInt8 _positionForPixel[35];
+        int position(int pixel)  // Relative to lChange
+        {
+            pixel += _lBlockToLChange;
+            if (pixel < 0 || pixel >= 35)
+                return -1;
+            return _positionForPixel[pixel];
+        }
+    };
+
+    struct Candidate
+    {
+        bool operator<(const Candidate& other) const
+        {
+            if (_prescore != other._prescore)
+                return _prescore < other._prescore;
+            return _index < other._index;
+        }
+        int _prescore;  // Distance between average and target colours
+        int _index;     // Position in gamut table order, for breaking ties
+        int _pattern;
+    };
+
+    // Everything that is written to while matching a row of character blocks.
+    // Each worker thread has its own so that rows can be matched concurrently.
+    class RowMatcher : public Task
+    {
+    public:
+        CGAMatcherT* _matcher;
+        MatchingNTSCDecoder _baseDecoders[24];
+        MatchingNTSCDecoder _deltaDecoders[24];
+        Array<Byte> _rowData;
+        Array<Byte> _rgbi;
+        Array<Byte> _ntscInput;
+        Array<SRGB> _srgb;
+        Array<Vector3<SInt16>> _base;
+        Byte _rgbiPattern[28];
+        Byte* _d0;
+        const Byte* _inputBlock;
+        Colour* _errorBlock;
+        const Colour* _temporalBlock;
+        Byte* _rgbiBlock;
+        Byte* _ntscBlock;
+        Byte* _ntscInputBlock;
+        SInt16* _deltaDecoded;
+        Array<Candidate> _candidates;
+        int _previousPattern[24];
+        // The previous frame's pattern for the previous block in the row,
+        // which _framePatterns no longer has.
+        int _previousFramePattern[24];
+    private:
+        void run() { _matcher->matchRows(this); }
+    };
+public:
+    // threads is the number of row workers, 0 for one per available CPU.
+    CGAMatcherT(int threads = 0)
+      : _active(false), _skip(0x100), _prescalerProfile(0),
+        _lTargetToLBlock(0), _lBlockToRTarget(0), _needRescale(true),
+        _sequence(false), _sequenceStarted(false), _rowPool(threads)
+    {
+        _scaler.setWidth(1);
+        _scaler.setBleeding(2);
+        _scaler.setOffset(Vector2<float>(0, 0));
+        _rowMatchers.allocate(_rowPool.threads());
+        for (auto& m : _rowMatchers) {
+            m._matcher = this;
+            m.setPool(&_rowPool);
+        }
+    }
+    void setInput(Bitmap<SRGB> input, Vector activeSize)
+    {
+        _activeSize = activeSize;
+        _input = input;
+        _active = true;
+        _needRescale = true;
+        initData();
+    }
+    void setSize(Vector size)
+    {
+        _activeSize = size;
+        initData();
+    }
+    void setProgram(Program* program) { _program = program; }
+    void setSequencer(CGASequencer* sequencer) { _sequencer = sequencer; }
+    void setData(CGAData* data) { _data = data; }
+    void run()
+    {
+        int scanlinesPerRow;
+        int phase;
+        int interlace;
+        bool interlaceSync;
+        bool interlacePhase;
+        bool flicker;
+        double quality;
+        bool needRescale;
+        double gamma;
+        int characterSet;
+        double hue;
+        double saturation;
+        double contrast;
+        double brightness;
+        int connector;
+        double chromaBandwidth;
+        double lumaBandwidth;
+        double rollOff;
+        double lobes;
+        int prescalerProfile;
+        int lookAhead;
+        bool combineScanlines;
+        int advance;
+        {
+            Lock lock(&_mutex);
+            _diffusionHorizontal2 = _diffusionHorizontal;
+            _diffusionVertical2 = _diffusionVertical;
+            _diffusionTemporal2 = _diffusionTemporal;
+            _modeThread = _mode;
+            _palette2 = _palette;
+            scanlinesPerRow = _scanlinesPerRow;
+            _scanlinesRepeat2 = _scanlinesRepeat;
+            phase = _phase;
+            interlace = _interlace;
+            interlaceSync = _interlaceSync;
+            interlacePhase = _interlacePhase;
+            flicker = _flicker;
+            quality = _quality;
+            needRescale = _needRescale;
+            _needRescale = false;
+            gamma = _gamma;
+            _clipping2 = _clipping;
+            _metric2 = _metric;
+            characterSet = _characterSet;
+            hue = _hue;
+            saturation = _saturation;
+            contrast = _contrast;
+            brightness = _brightness;
+            connector = _connector;
+            chromaBandwidth = _chromaBandwidth;
+            lumaBandwidth = _lumaBandwidth;
+            rollOff = _rollOff;
+            lobes = _lobes;
+            prescalerProfile = _prescalerProfile;
+            lookAhead = _lookAhead;
+            combineScanlines = _combineScanlines;
+            advance = _advance;
+			_diffuseInternally2 = _diffuseInternally;
+        }
+
+        bool hres = (_mode & 1) != 0;
+        _isComposite = connector != 0;
+        _graphics = (_mode & 2) != 0;
+        bool oneBpp = (_mode & 0x10) != 0;
+		if (!hres || (!_graphics && !oneBpp))
+			phase = 0;
+        _combineVertical = false;
+        int boxCount;
+        int boxIncrement = hres == _graphics ? 16 : 8;
+        if (_graphics && !hres && advance == 4)
+            boxIncrement = 16;
+        if (advance == 0 && _graphics && !oneBpp)
+            advance = 1;
+        int bitCount = 16;
+        int incrementBytes = 2;
+        if (_graphics) {
+            if (scanlinesPerRow > 2 && combineScanlines)
+                _combineVertical = true;
+            _pixelMask = oneBpp ? 1 : 3;
+            if (_combineVertical) {
+                lookAhead = max(lookAhead, 7);
+                if (advance == 4)
+                    advance = 3;
+            }
+            if (hres) {
+                incrementBytes = 4;
+                if (!oneBpp) {
+                    if (_combineVertical) {
+                        lookAhead = max(lookAhead, 3);
+                        if (advance == 3)
+                            advance = 2;
+                    }
+                    lookAhead = max(lookAhead, _combineVertical ? 7 : 3);
+                }
+                int bpp = oneBpp ? 1 : 2;
+                bitCount = bpp << advance;
+                int positions = (lookAhead & -(1 << advance)) + (1 << advance);
+                _combineShift = positions*bpp;
+                int firstPixel = 0;
+                boxCount = 0;
+                do {
+                    Box* box = &_boxes[boxCount];
+                    for (int pixel = 0; pixel < 35; ++pixel)
+                        box->_positionForPixel[pixel] = -1;
+                    int pixel = firstPixel;
+                    int minPixel = 35;
+                    for (int position = 0; position < positions; ++position) {
+                        while (box->_positionForPixel[pixel] != -1)
+                            ++pixel;
+                        int bitPosition = position*bpp;
+                        box->_positionForPixel[pixel] = bitPosition;
+                        minPixel = min(minPixel, pixel);
+                        if ((pixel & 4) != 0) {
+                            box->_positionForPixel[pixel ^ 8] = bitPosition;
+                            minPixel = min(minPixel, pixel ^ 8);
+                        }
+                    }
+                    box->_bitOffset = minPixel << 1;
+                    bool newBox = false;
+                    if (boxCount != 0) {
+                        for (int pixel = 0; pixel < 35; ++pixel) {
+                            if ((box->_positionForPixel[pixel] == -1) !=
+                                (_boxes[boxCount-1]._positionForPixel[pixel] ==
+                                -1)) {
+                                newBox = true;
+                                break;
+                            }
+                        }
+                    }
+                    else
+                        newBox = true;
+                    if (newBox)
+                        ++boxCount;
+                    firstPixel += 1 << advance;
+                } while (firstPixel < 16);
+            }
+            else {
+                bitCount = 1 << advance;
+                incrementBytes = advance == 4 ? 2 : 1;
+                _combineShift = (lookAhead & -(1 << advance)) + (1 << advance);
+                boxCount = advance == 4 ? 1 : 8 >> advance;
+                for (int i = 0; i < boxCount; ++i) {
+                    Box* box = &_boxes[i];
+                    box->_bitOffset = (i << advance) & 7;
+                    for (int x = 0; x < 35; ++x) {
+                        int v = (x & -1 << (oneBpp ? 0 : 1)) - (i << advance);
+                        box->_positionForPixel[x] = v >= 0 && v < _combineShift
+                            ? v : -1;
+                    }
+                }
+            }
+            if (_combineVertical)
+                _patternCount = 1 << (_combineShift << 1);
+            else
+                _patternCount = 1 << _combineShift;
+            for (int boxIndex = 0; boxIndex < boxCount; ++boxIndex) {
+                Box* box = &_boxes[boxIndex];
+                int i;
+                for (i = 0; i < 35; ++i)
+                    if (box->_positionForPixel[i] != -1)
+                        break;
+                box->_lBlockToLChange = i;
+                for (i = 30; i >= 0; --i)
+                    if (box->_positionForPixel[i] != -1)
+                        break;
+                box->_lChangeToRChange = i + 1 - box->_lBlockToLChange;
+            }
+        }
+        else {
+            lookAhead = 0;
+            boxCount = 1;
+            Box* box = &_boxes[0];
+            box->_bitOffset = 0;
+            box->_lBlockToLChange = 0;
+            box->_lChangeToRChange = boxIncrement;
+            _patternCount = 0x10000;
+            _combineShift = 0;
+        }
+
+        for (int i = 0; i < 4; ++i) {
+            UInt64 rgbi = _sequencer->process(i*0x55555555, _modeThread,
+                _palette2, 0, false, 0);
+            _rgbiFromBits[i] = (rgbi >> 12) & 0xf;
+        }
+
+        _program->setProgress(0);
+
+        int lErrorToLBlock = 0;
+        int lBlockToRError = 0;
+        int gamutLeftPadding = 0;
+        int gamutWidth = 0;
+        int gamutOutputWidth = _graphics ? 4 : hres ? 8 : 16;
+        bool newCGA = connector == 2;
+        int lNtscToLBlock = 0;
+        int lBlockToRNtsc = 0;
+        int lBlockToRChange = 0;
+        for (int boxIndex = 0; boxIndex < boxCount; ++boxIndex) {
+            Box* box = &_boxes[boxIndex];
+            box->_lCompareToRCompare = box->_lChangeToRChange;
+            box->_lBlockToLCompare = box->_lBlockToLChange;
+            lBlockToRChange = max(lBlockToRChange,
+                box->_lBlockToLChange + box->_lChangeToRChange);
+        }
+        if (_isComposite) {
+            _composite.setBW(false);
+            _composite.setNewCGA(newCGA);
+            _composite.initChroma();
+            Byte burst[4];
+            for (int i = 0; i < 4; ++i)
+                burst[i] = _composite.simulateCGA(6, 6, i);
+            _composite.setBW((_mode & 4) != 0);
+            _composite.initChroma();
+            double black = _composite.black();
+            double white = _composite.white();
+            int rChangeToRBase = static_cast<int>(4*lobes);
+            for (int boxIndex = 0; boxIndex < boxCount; ++boxIndex) {
+                Box* box = &_boxes[boxIndex];
+                int lBaseToLChange = ((rChangeToRBase + 4) & ~3) +
+                    (box->_lBlockToLChange & 3);
+                int lBaseToRChange = lBaseToLChange + box->_lChangeToRChange;
+                MatchingNTSCDecoder* base = &box->_baseDecoder;
+                base->setLength(lBaseToRChange + rChangeToRBase);
+                base->setLumaBandwidth(lumaBandwidth);
+                base->setChromaBandwidth(chromaBandwidth);
+                base->setRollOff(rollOff);
+                base->setLobes(lobes);
+                base->setHue(hue + (hres ? 14 : 4) - 90);
+                base->setSaturation(
+                    saturation*1.45*(newCGA ? 1.5 : 1.0)/100);
+                double c = contrast*256*(newCGA ? 1.2 : 1)/(white - black)/100;
+                base->setContrast(c);
+                base->setBrightness(
+                    (-black*c + brightness*5 + (newCGA ? -50 : 0))/256.0);
+                base->setInputScaling(1);
+                base->calculateBurst(burst);
+                int lInputToLBase = -base->inputLeft();
+                int lBaseToRInput = base->inputRight();
+                int lInputToLChange = lInputToLBase + lBaseToLChange;
+                lNtscToLBlock = max(lNtscToLBlock,
+                    lInputToLChange - box->_lBlockToLChange);
+                lBlockToRNtsc = max(lBlockToRNtsc,
+                    lBaseToRInput + box->_lBlockToLChange - lBaseToLChange);
+                _bias = base->bias();
+                _shift = base->shift();
+                MatchingNTSCDecoder* delta = &box->_deltaDecoder;
+                *delta = *base;
+                int lInputToRInput = lInputToLBase + lBaseToRInput;
+                _activeInputs.ensure(lInputToRInput);
+                for (int x = 0; x < lInputToRInput; ++x) {
+                    int r = x - lInputToLChange;
+                    _activeInputs[x] =
+                        box->position(r + 1) != -1 || box->position(r) != -1 ?
+                        1 : 0;
+                }
+                delta->calculateBurst(burst, &_activeInputs[lInputToLBase]);
+                for (auto& m : _rowMatchers) {
+                    m._baseDecoders[boxIndex] = *base;
+                    m._baseDecoders[boxIndex].calculateBurst(burst);
+                    m._deltaDecoders[boxIndex] = *base;
+                    m._deltaDecoders[boxIndex].calculateBurst(burst,
+                        &_activeInputs[lInputToLBase]);
+                }
+                box->_lBaseToLCompare = delta->outputLeft();
+                int lBaseToRCompare = delta->outputRight();
+                box->_lCompareToRCompare =
+                    lBaseToRCompare - box->_lBaseToLCompare;
+                int lBaseToLDelta = delta->inputLeft();
+                int lInputToLCompare = lInputToLBase + box->_lBaseToLCompare;
+                int lCompareToLChange = lInputToLChange - lInputToLCompare;
+                int lCompareToLBlock =
+                    lCompareToLChange - box->_lBlockToLChange;
+                int lBlockToLBase = box->_lBlockToLChange - lBaseToLChange;
+                box->_lBlockToLDelta = lBlockToLBase + lBaseToLDelta;
+                box->_lBlockToLCompare = lBlockToLBase + box->_lBaseToLCompare;
+                box->_lBlockToLInput = lBlockToLBase - lInputToLBase;
+                lErrorToLBlock = max(lErrorToLBlock, lCompareToLBlock);
+                lBlockToRError = max(lBlockToRError,
+                    box->_lCompareToRCompare - lCompareToLBlock);
+            }
+            _gamutDecoder = _boxes[0]._baseDecoder;
+            _gamutDecoder.setLength(gamutOutputWidth);
+            _gamutDecoder.calculateBurst(burst);
+            gamutLeftPadding = _gamutDecoder.inputLeft();
+            gamutWidth = _gamutDecoder.inputRight() - gamutLeftPadding;
+            _ntscPattern.ensure(gamutWidth);
+        }
+
+        // Resample input image to desired size
+        Vector size(_hdotsPerChar*_horizontalDisplayed,
+            scanlinesPerRow*_scanlinesRepeat2*_verticalDisplayed);
+        _linearizer.setGamma(static_cast<float>(gamma));
+        _continueSequence = _sequence && _sequenceStarted && size == _size &&
+            lNtscToLBlock <= _lTargetToLBlock &&
+            lBlockToRNtsc <= _lBlockToRTarget;
+        if (size != _size || lNtscToLBlock > _lTargetToLBlock ||
+            lBlockToRNtsc > _lBlockToRTarget || needRescale) {
+            _lTargetToLBlock = lNtscToLBlock;
+            _lBlockToRTarget = lBlockToRNtsc;
+            auto zoom = Vector2Cast<float>(_activeSize*
+                Vector(1, interlaceSync ? 2 : 1))/
+                Vector2Cast<float>(_input.size());
+            _scaler.setZoom(zoom);
+            Vector offset(static_cast<int>(_lTargetToLBlock / zoom.x), 0);
+            _scaler.setProfile(prescalerProfile);
+            _scaler.setOutputSize(size
+                + Vector(_lTargetToLBlock + _lBlockToRTarget, 0));
+            _scaler.setHorizontalLobes(3);
+            _scaler.setVerticalLobes(3);
+            _scaler.init();
+            _size = size;
+            AlignedBuffer input = _scaler.input();
+            Vector tl = _scaler.inputTL() - offset;
+            Vector br = _scaler.inputBR() - offset;
+            Byte* unscaledRow = input.data() - tl.y*input.stride();
+            Byte* inputRow = _input.data();
+            int height = _input.size().y;
+            if (tl.y > 0) {
+                inputRow += _input.stride()*tl.y;
+                height -= tl.y;
+            }
+            int below = br.y - _input.size().y;
+            if (below < 0)
+                height += below;
+            int width = _input.size().x;
+            if (tl.x > 0) {
+                inputRow += sizeof(SRGB)*tl.x;
+                width -= tl.x;
+            }
+            int right = br.x - _input.size().x;
+            if (right < 0)
+                width += right;
+            for (int y = 0; y < height; ++y) {
+                Colour* unscaled = reinterpret_cast<Colour*>(unscaledRow);
+                SRGB* p = reinterpret_cast<SRGB*>(inputRow);
+                for (int x = 0; x < -tl.x; ++x) {
+                    *unscaled = _linearizer.linear(*p);
+                    ++unscaled;
+                }
+                for (int x = 0; x < width; ++x) {
+                    *unscaled = _linearizer.linear(*p);
+                    ++unscaled;
+                    ++p;
+                }
+                --p;
+                for (int x = 0; x < right; ++x) {
+                    *unscaled = _linearizer.linear(*p);
+                    ++unscaled;
+                }
+                unscaledRow += input.stride();
+                inputRow += _input.stride();
+            }
+            unscaledRow = input.data();
+            Byte* pp = input.data() - tl.y*input.stride();
+            for (int y = 0; y < -tl.y; ++y) {
+                memcpy(unscaledRow, pp, (br.x - tl.x)*sizeof(Colour));
+                unscaledRow += input.stride();
+            }
+            unscaledRow =
+                input.data() + (_input.size().y - tl.y)*input.stride();
+            pp = unscaledRow - input.stride();
+            for (int y = 0; y < below; ++y) {
+                memcpy(unscaledRow, pp, (br.x - tl.x)*sizeof(Colour));
+                unscaledRow += input.stride();
+            }
+            _scaler.render();
+            _scaled = _scaler.output();
+        }
+
+        // Set up gamut table
+        float gDivisions = static_cast<float>(64.0/pow(2, quality*6));
+        Vector3<float> srgbScale;
+        srgbScale.y = gDivisions/256;
+        srgbScale.x = srgbScale.y*0.84f;
+        srgbScale.z = srgbScale.y*0.55f;
+        Vector3<int> srgbDiv = Vector3Cast<int>(255.0f*srgbScale) + 1;
+        int entries = srgbDiv.x*srgbDiv.y*srgbDiv.z;
+        _blockHeight = scanlinesPerRow*_scanlinesRepeat2;
+        if (_graphics) {
+            _blockHeight = (scanlinesPerRow <= 2 ? 1 : scanlinesPerRow)*
+                _scanlinesRepeat2;
+            for (int i = 0; i < 0x100; ++i)
+                _skip[i] = false;
+        }
+        else {
+            bool blink = ((_modeThread & 0x20) != 0);
+            auto cgaROM = _sequencer->romData();
+            int lines = scanlinesPerRow*_scanlinesRepeat2;
+            for (int i = 0; i < 0x100; ++i) {
+                _skip[i] = false;
+                if (characterSet == 0) {
+                    _skip[i] = (i != 0xdd);
+                    continue;
+                }
+                if (characterSet == 1) {
+                    _skip[i] = (i != 0x13 && i != 0x55);
+                    continue;
+                }
+                if (characterSet == 2) {
+                    _skip[i] =
+                        (i != 0x13 && i != 0x55 && i != 0xb0 && i != 0xb1);
+                    continue;
+                }
+                if (characterSet == 4) {
+                    _skip[i] = (i != 0xb1);
+                    continue;
+                }
+                if (characterSet == 5) {
+                    _skip[i] = (i != 0xb0 && i != 0xb1);
+                    continue;
+                }
+                if (characterSet == 7) {
+                    _skip[i] = (i != 0x0c && i != 0x0d && i != 0x21 &&
+                        i != 0x35 && i != 0x55 && i != 0x6a && i != 0xdd);
+                    continue;
+                }
+                if (characterSet == 6) {
+                    _skip[i] = (i != 0x06 && i != 0x13 && i != 0x19 &&
+                        i != 0x22 && i != 0x27 && i != 0x55 && i != 0x57 &&
+                        i != 0x60 && i != 0xb6 && i != 0xdd);
+                }
+                if ((_modeThread & 0x10) != 0)
+                    continue;
+                bool isBackground = true;
+                bool isForeground = true;
+                for (int y = 0; y < lines; ++y) {
+                    Byte b = cgaROM[i*8 + y];
+                    if (b != 0x00)
+                        isBackground = false;
+                    if (b != 0xff)
+                        isForeground = false;
+                }
+                if (isBackground || (isForeground && blink)) {
+                    _skip[i] = true;
+                    continue;
+                }
+                int j;
+                for (j = 0; j < i; ++j) {
+                    int y;
+                    for (y = 0; y < lines; ++y)
+                        if (cgaROM[i*8 + y] != cgaROM[j*8 + y])
+                            break;
+                    if (y == lines)
+                        break;
+                }
+                if (j != i)
+                    _skip[i] = true;
+                if (blink)
+                    continue;
+                for (j = 0; j < i; ++j) {
+                    int y;
+                    for (y = 0; y < lines; ++y)
+                        if (cgaROM[i*8 + y] != (cgaROM[j*8 + y]^0xff))
+                            break;
+                    if (y == lines)
+                        break;
+                }
+                if (j != i)
+                    _skip[i] = true;
+            }
+        }
+        int banks = (_graphics && scanlinesPerRow > 1) ? 2 : 1;
+        int bytesPerRow = 2*_horizontalDisplayed;
+        if (!_isComposite) {
+            Byte levels[4];
+            for (int i = 0; i < 4; ++i)
+                levels[i] = byteClamp(2.55*brightness + 0.85*i*contrast + 0.5);
+            int palette[3*0x11] = {
+                0, 0, 0,  0, 0, 2,  0, 2, 0,  0, 2, 2,
+                2, 0, 0,  2, 0, 2,  2, 1, 0,  2, 2, 2,
+                1, 1, 1,  1, 1, 3,  1, 3, 1,  1, 3, 3,
+                3, 1, 1,  3, 1, 3,  3, 3, 1,  3, 3, 3,
+                0, 0, 0};
+            for (int i = 0; i < 3*0x11; ++i)
+                _rgbiPalette[i] = levels[palette[i]];
+        }
+
+        // Populate gamut tables. These only depend on the settings, so later
+        // frames of a sequence reuse them.
+        for (int boxIndex = 0; boxIndex < boxCount && !_continueSequence;
+            ++boxIndex) {
+            Box* box = &_boxes[boxIndex];
+            int lChangeToRChange = box->_lChangeToRChange;
+            _srgb.ensure(lChangeToRChange);
+            _srgb.ensure(box->_lCompareToRCompare);
+            box->_table.setSize(entries);
+            box->_patternSRGB.ensure(_patternCount);
+            for (auto& m : _rowMatchers) {
+                m._srgb.ensure(_srgb.count());
+                if (_isComposite)
+                    m._base.ensure(box->_lCompareToRCompare*_blockHeight);
+            }
+            box->_blockArea = static_cast<float>(lChangeToRChange);
+            if (_combineVertical)
+                box->_blockArea *= _blockHeight;
+            int skipSolidColour = 0xf00;
+            for (int pattern = 0; pattern < _patternCount; ++pattern) {
+                if (!_graphics && !oneBpp) {
+                    if (_skip[pattern & 0xff])
+                        continue;
+                    int foreground = pattern & 0xf00;
+                    if (foreground == ((pattern >> 4) & 0x0f00)) {
+                        if (foreground == skipSolidColour)
+                            continue;
+                        skipSolidColour = foreground;
+                    }
+                }
+                int blockLines = _blockHeight;
+                if (_graphics)
+                    blockLines = _combineVertical ? 2 : 1;
+                Colour rgb(0, 0, 0);
+                for (int y = 0; y < blockLines; ++y) {
+                    if (_graphics) {
+                        for (int x = 0; x < lChangeToRChange; ++x) {
+                            int p = pattern;
+                            if (_combineVertical && y != 0)
+                                p >>= _combineShift;
+                            p >>= box->_positionForPixel[x +
+                                box->_lBlockToLChange];
+                            _rgbiPattern[x] = _rgbiFromBits[p & _pixelMask];
+                        }
+                    }
+                    else {
+                        UInt64 rgbi = _sequencer->process(pattern * 0x00010001,
+                            _modeThread, _palette2, y, false, 0);
+                        for (int x = 0; x < lChangeToRChange; ++x)
+                            _rgbiPattern[x] = (rgbi >> (x << 2)) & 0xf;
+                    }
+
+                    if (!_isComposite) {
+                        SRGB* srgb = &_srgb[0];
+                        for (int x = 0; x < lChangeToRChange; ++x) {
+                            Byte* p = &_rgbiPalette[3*_rgbiPattern[x]];
+                            *srgb = SRGB(p[0], p[1], p[2]);
+                            ++srgb;
+                        }
+                    }
+                    else {
+                        Byte* ntsc = &_ntscPattern[0];
+                        int l = ((gamutLeftPadding - box->_lBlockToLChange)
+                            *(1 - lChangeToRChange)) % lChangeToRChange;
+                        int r = (l + 1)%lChangeToRChange;
+                        for (int x = 0; x < gamutWidth; ++x) {
+                            *ntsc = _composite.simulateCGA(_rgbiPattern[l],
+                                _rgbiPattern[r], (x + gamutLeftPadding) & 3);
+                            l = r;
+                            r = (r + 1)%lChangeToRChange;
+                            ++ntsc;
+                        }
+                        _gamutDecoder.decodeNTSC(&_ntscPattern[0]);
+                        _gamutDecoder.outputToSRGB(&_srgb[0]);
+                    }
+                    SRGB* srgb = &_srgb[0];
+                    float lineScale = 1;
+                    if (_combineVertical) {
+                        lineScale = static_cast<float>(
+                            (_blockHeight + (y == 0 ? 1 : 0)) >> 1);
+                    }
+                    for (int x = 0; x < gamutOutputWidth; ++x)
+                        rgb += lineScale*_linearizer.linear(srgb[x]);
+                }
+                SRGB srgb = _linearizer.srgb(rgb/box->_blockArea);
+                box->_patternSRGB[pattern] = srgb;
+                auto s = Vector3Cast<int>(Vector3Cast<float>(srgb)*srgbScale);
+                box->_table.add(pattern,
+                    s.x + srgbDiv.x*(s.y + srgbDiv.y*s.z));
+            }
+            box->_table.finalize();
+        }
+
+        // Set up data structures for matching
+        _rowDataStride = 2*_horizontalDisplayed + 1;
+        // Leave room for the rightmost block's errors so that they don't
+        // spill onto the next line (which may belong to another row that is
+        // being matched concurrently).
+        lBlockToRError = max(lBlockToRError, lBlockToRChange);
+        _errorStride = 1 + lErrorToLBlock + size.x + lBlockToRError;
+        int errorSize = _errorStride*(size.y + 1);
+        // The previous frame's errors diffuse temporally into this one.
+        if (_continueSequence) {
+            Array<Colour> error = _temporalError;
+            _temporalError = _error;
+            _error = error;
+        }
+        _error.ensure(errorSize);
+        _temporalError.ensure(errorSize);
+        srand(0);
+        for (int x = 0; x < errorSize; ++x) {
+            _error[x] = Colour(0, 0, 0);
+            if (!_continueSequence)
+                _temporalError[x] = Colour(0, 0, 0);
+        }
+        int size1 = size.x - boxIncrement;
+        _rgbiStride = 1 + size1 + lBlockToRChange;
+        _overscan = (_modeThread & 0x10) != 0 ? 0 : _palette2 & 0xf;
+
+        const Byte* inputStart = _scaled.data();
+        if (_isComposite) {
+            _ntscStride = lNtscToLBlock + size1 + lBlockToRNtsc;
+            _ntsc.ensure(size.y*_ntscStride);
+            const Byte* inputRow = inputStart;
+            Byte* outputRow = &_ntsc[0];
+            for (int y = 0; y < size.y; ++y) {
+                _boxes[0]._baseDecoder.encodeNTSC(
+                    reinterpret_cast<const Colour*>(inputRow),
+                    outputRow, _ntscStride, &_linearizer, -lNtscToLBlock);
+                inputRow += _scaled.stride();
+                outputRow += _ntscStride;
+            }
+        }
+        for (auto& m : _rowMatchers) {
+            m._rowData.ensure(_rowDataStride*2);
+            m._rowData[0] = 0;
+            m._rowData[_rowDataStride] = 0;
+            m._rgbi.ensure(_rgbiStride*_blockHeight + 1);
+            if (_isComposite)
+                m._ntscInput.ensure(_ntscStride*_blockHeight);
+            m._candidates.ensure(_patternCount);
+        }
+
+        _inputStart = inputStart + sizeof(Colour)*(_lTargetToLBlock);
+        _errorStart = &_error[_errorStride + 1] + lErrorToLBlock;
+        _temporalStart = &_temporalError[_errorStride + 1] + lErrorToLBlock;
+        _ntscStart = &_ntsc[0] + lNtscToLBlock;
+        _lNtscToLBlock = lNtscToLBlock;
+        _bankShift =
+            _data->getDataByte(CGAData::registerLogCharactersPerBank) + 1;
+        _bytesPerRow = bytesPerRow;
+        _boxCount = boxCount;
+        _boxIncrement = boxIncrement;
+        _incrementBytes = incrementBytes;
+        _bitCount = bitCount;
+        _oneBpp = oneBpp;
+        _hres = hres;
+        _phase2 = phase;
+        _srgbScale = srgbScale;
+        _srgbDiv = srgbDiv;
+        _searchFraction = quality;
+        _columns = (bytesPerRow + incrementBytes - 1)/incrementBytes;
+        _blockRowsPerRow = _combineVertical ? 1 : banks;
+        _blockRows = _verticalDisplayed*_blockRowsPerRow;
+        _framePatterns.ensure(_blockRows*_columns*boxCount);
+
+        // Each row of blocks only depends on the row above it through
+        // vertical error diffusion into its top scanline. Without that, all
+        // rows can be matched at once. With it, a block can be matched once
+        // the row above has finished every block whose error it will read,
+        // so rows proceed as a diagonal wavefront _rowLag blocks apart.
+        _rowsIndependent = _diffusionVertical2 == 0 || _diffuseInternally2;
+        _rowLag = 1 +
+            (lErrorToLBlock + lBlockToRError + boxIncrement - 1)/boxIncrement;
+        _nextBlockRow = 0;
+        _blockRowsDone = 0;
+        _columnsDone.ensure(_blockRows);
+        for (int i = 0; i < _blockRows; ++i)
+            _columnsDone[i] = 0;
+        _rowProgressed.ensure(_blockRows);
+
+        // Perform matching
+        for (auto& m : _rowMatchers)
+            m.restart();
+        for (auto& m : _rowMatchers)
+            m.join();
+        if (_sequence) {
+            int scaledBytes = _scaled.stride()*size.y;
+            _previousScaled.ensure(scaledBytes);
+            memcpy(&_previousScaled[0], _scaled.data(), scaledBytes);
+            _sequenceStarted = _blockRowsDone == _blockRows;
+        }
+        _program->setProgress(-1);
+    }
+
+    // In sequence mode, successive inputs are treated as frames of an
+    // animation. The patterns chosen for one frame seed the search in the
+    // next, blocks whose input changes by no more than threshold keep their
+    // patterns, and errors diffuse temporally. Settings other than the input
+    // must not change between frames.
+    void setSequence(bool sequence, double threshold)
+    {
+        Lock lock(&_mutex);
+        _sequence = sequence;
+        _sequenceThreshold = static_cast<float>(threshold);
+        _sequenceStarted = false;
+    }
+
+    void setDiffusionHorizontal(double diffusionHorizontal)
+    {
+        Lock lock(&_mutex);
+        _diffusionHorizontal = static_cast<float>(diffusionHorizontal);
+    }
+    double getDiffusionHorizontal() { return _diffusionHorizontal; }
+    void setDiffusionVertical(double diffusionVertical)
+    {
+        Lock lock(&_mutex);
+        _diffusionVertical = static_cast<float>(diffusionVertical);
+    }
+    double getDiffusionVertical() { return _diffusionVertical; }
+    void setDiffusionTemporal(double diffusionTemporal)
+    {
+        Lock lock(&_mutex);
+        _diffusionTemporal = static_cast<float>(diffusionTemporal);
+    }
+    double getDiffusionTemporal() { return _diffusionTemporal; }
+    void setMode(int mode)
+    {
+        Lock lock(&_mutex);
+        _mode = mode;
+        initData();
+    }
+    int getMode() { return _mode; }
+    void setPalette(int palette)
+    {
+        Lock lock(&_mutex);
+        _palette = palette;
+        initData();
+    }
+    int getPalette() { return _palette; }
+    void setScanlinesPerRow(int v)
+    {
+        Lock lock(&_mutex);
+        _scanlinesPerRow = v;
+        initData();
+    }
+    int getScanlinesPerRow() { return _scanlinesPerRow; }
+    void setScanlinesRepeat(int v)
+    {
+        Lock lock(&_mutex);
+        _scanlinesRepeat = v;
+        initData();
+    }
+    int getScanlinesRepeat() { return _scanlinesRepeat; }
+    void setPhase(int phase)
+    {
+        Lock lock(&_mutex);
+        _phase = phase;
+        initData();
+    }
+    int getPhase() { return _phase; }
+    void setInterlace(int interlace)
+    {
+        Lock lock(&_mutex);
+        _interlace = interlace;
+        initData();
+    }
+    int getInterlace() { return _interlace; }
+    void setInterlaceSync(bool interlaceSync)
+    {
+        Lock lock(&_mutex);
+        _interlaceSync = interlaceSync;
+        initData();
+    }
+    bool getInterlaceSync() { return _interlaceSync; }
+    void setInterlacePhase(bool interlacePhase)
+    {
+        Lock lock(&_mutex);
+        _interlacePhase = interlacePhase;
+        initData();
+    }
+    bool getInterlacePhase() { return _interlacePhase; }
+    void setFlicker(bool flicker)
+    {
+        Lock lock(&_mutex);
+        _flicker = flicker;
+        initData();
+    }
+    bool getFlicker() { return _flicker; }
+    void setQuality(double quality)
+    {
+        Lock lock(&_mutex);
+        _quality = quality;
+    }
+    double getQuality() { return _quality; }
+    void setGamma(double gamma)
+    {
+        Lock lock(&_mutex);
+        if (gamma != _gamma)
+            _needRescale = true;
+        _gamma = gamma;
+    }
+    double getGamma() { return _gamma; }
+    void setClipping(int clipping)
+    {
+        Lock lock(&_mutex);
+        _clipping = clipping;
+    }
+    int getClipping() { return _clipping; }
+    void setMetric(int metric)
+    {
+        Lock lock(&_mutex);
+        _metric = metric;
+    }
+    int getMetric() { return _metric; }
+    void setCharacterSet(int characterSet)
+    {
+        Lock lock(&_mutex);
+        _characterSet = characterSet;
+    }
+    int getCharacterSet() { return _characterSet; }
+    double getHue() { return _hue; }
+    void setHue(double hue)
+    {
+        Lock lock(&_mutex);
+        _hue = hue;
+    }
+    double getSaturation() { return _saturation; }
+    void setSaturation(double saturation)
+    {
+        Lock lock(&_mutex);
+        _saturation = saturation;
+    }
+    double getContrast() { return _contrast; }
+    void setContrast(double contrast)
+    {
+        Lock lock(&_mutex);
+        _contrast = contrast;
+    }
+    double getBrightness() { return _brightness; }
+    void setBrightness(double brightness)
+    {
+        Lock lock(&_mutex);
+        _brightness = brightness;
+    }
+    void setConnector(int connector)
+    {
+        Lock lock(&_mutex);
+        _connector = connector;
+    }
+    void setChromaBandwidth(double chromaBandwidth)
+    {
+        Lock lock(&_mutex);
+        _chromaBandwidth = chromaBandwidth;
+    }
+    double getChromaBandwidth() { return _chromaBandwidth; }
+    void setLumaBandwidth(double lumaBandwidth)
+    {
+        Lock lock(&_mutex);
+        _lumaBandwidth = lumaBandwidth;
+    }
+    double getLumaBandwidth() { return _lumaBandwidth; }
+    void setRollOff(double rollOff)
+    {
+        Lock lock(&_mutex);
+        _rollOff = rollOff;
+    }
+    double getRollOff() { return _rollOff; }
+    void setLobes(double lobes)
+    {
+        Lock lock(&_mutex);
+        _lobes = lobes;
+    }
+    double getLobes() { return _lobes; }
+    void setPrescalerProfile(int profile)
+    {
+        Lock lock(&_mutex);
+        if (profile != _prescalerProfile)
+            _needRescale = true;
+        _prescalerProfile = profile;
+    }
+    int getPrescalerProfile() { return _prescalerProfile; }
+    void setLookAhead(int lookAhead)
+    {
+        Lock lock(&_mutex);
+        _lookAhead = lookAhead;
+    }
+    int getLookAhead() { return _lookAhead; }
+    void setCombineScanlines(bool combineScanlines)
+    {
+        Lock lock(&_mutex);
+        _combineScanlines = combineScanlines;
+    }
+    bool getCombineScanlines() { return _combineScanlines; }
+    void setAdvance(int advance)
+    {
+        Lock lock(&_mutex);
+        _advance = advance;
+    }
+    int getAdvance() { return _advance; }
+	void setDiffuseInternally(bool diffuseInternally)
+	{
+		Lock lock(&_mutex);
+		_diffuseInternally = diffuseInternally;
+	}
+	bool getDiffuseInternally() { return _diffuseInternally; }
+    void initFromData()
+    {
+        _mode = _data->getDataByte(CGAData::registerMode);
+        _palette = _data->getDataByte(CGAData::registerPalette);
+        _scanlinesPerRow = 1 +
+            _data->getDataByte(CGAData::registerMaximumScanline);
+        _scanlinesRepeat =
+            _data->getDataByte(CGAData::registerScanlinesRepeat);
+    }
+private:
+    void fixEndianness(Byte* data, int bytes, bool oneBpp)
+    {
+        for (int i = 0; i < bytes; ++i) {
+            Byte b = *data;
+            if (!oneBpp) {
+                *data = ((b & 3) << 6) + ((b & 0x0c) << 2) +
+                    ((b & 0x30) >> 2) + ((b & 0xc0) >> 6);
+            }
+            else {
+                *data = ((b & 1) << 7) + ((b & 2) << 5) + ((b & 4) << 3) +
+                    ((b & 8) << 1) + ((b & 0x10) >> 1) + ((b & 0x20) >> 3) +
+                    ((b & 0x40) >> 5) + ((b & 0x80) >> 7);
+            }
+            ++data;
+        }
+    }
+
+    void matchRows(RowMatcher* m)
+    {
+        while (!cancelling()) {
+            int blockRow;
+            {
+                Lock lock(&_rowMutex);
+                blockRow = _nextBlockRow;
+                if (blockRow == _blockRows)
+                    return;
+                ++_nextBlockRow;
+            }
+            matchRow(m, blockRow);
+        }
+    }
+
+    // Waits until the row of blocks blockRow has had at least "columns"
+    // columns matched.
+    void waitForColumns(int blockRow, int columns)
+    {
+        do {
+            {
+                Lock lock(&_rowMutex);
+                if (_columnsDone[blockRow] >= columns)
+                    return;
+            }
+            _rowProgressed[blockRow].wait();
+        } while (true);
+    }
+
+    void columnsDone(int blockRow, int columns)
+    {
+        {
+            Lock lock(&_rowMutex);
+            _columnsDone[blockRow] = columns;
+        }
+        _rowProgressed[blockRow].signal();
+    }
+
+    void matchRow(RowMatcher* m, int blockRow)
+    {
+        int row = blockRow / _blockRowsPerRow;
+        int bank = blockRow % _blockRowsPerRow;
+        int bytesPerRow = _bytesPerRow;
+        bool oneBpp = _oneBpp;
+        bool hres = _hres;
+        int bitCount = _bitCount;
+        int rowDataStride = _rowDataStride;
+        int bankShift = _bankShift;
+        int phase = _phase2;
+        int phaseOffset = phase*2;
+        if ((_incrementBytes & 2) != 0 && ((blockRow*_columns) & 1) != 0)
+            phaseOffset ^= phase*2;
+        const Byte* inputRow =
+            _inputStart + blockRow*_blockHeight*_scaled.stride();
+        Colour* errorRow = _errorStart + blockRow*_blockHeight*_errorStride;
+        Byte* ntscRow = _ntscStart + blockRow*_blockHeight*_ntscStride;
+        bool waitForRowAbove = !_rowsIndependent && blockRow > 0;
+
+        if (_combineVertical) {
+            Array<Byte> rowData = _data->getData(row*bytesPerRow,
+                bytesPerRow);
+            memcpy(&m->_rowData[1], &rowData[0], bytesPerRow);
+            rowData = _data->getData(row*bytesPerRow + (1 << bankShift),
+                bytesPerRow);
+            memcpy(&m->_rowData[1 + rowDataStride], &rowData[0], bytesPerRow);
+        }
+        else {
+            Array<Byte> rowData = _data->getData(
+                row*bytesPerRow + (bank << bankShift), bytesPerRow);
+            memcpy(&m->_rowData[1], &rowData[0], bytesPerRow);
+        }
+        Byte* rgbi = &m->_rgbi[0];
+        for (int y = 0;; ++y) {
+            *rgbi = _overscan;
+            if (y == _blockHeight)
+                break;
+            for (int x = 1; x < _rgbiStride; ++x)
+                rgbi[x] = -1;
+            rgbi += _rgbiStride;
+        }
+        Byte* rgbiRow = &m->_rgbi[1];
+        if (_isComposite) {
+            const Byte* inputLine =
+                inputRow - sizeof(Colour)*(_lTargetToLBlock);
+            Byte* outputLine = &m->_ntscInput[0];
+            for (int y = 0; y < _blockHeight; ++y) {
+                memcpy(outputLine, inputLine, _ntscStride);
+                inputLine += _ntscStride;
+                outputLine += _ntscStride;
+            }
+        }
+
+        m->_d0 = &m->_rowData[1 + phaseOffset];
+        Byte* d1 = &m->_rowData[1 + rowDataStride + phaseOffset];
+        m->_inputBlock = inputRow;
+        m->_errorBlock = errorRow;
+        m->_temporalBlock = _temporalStart + (errorRow - _errorStart);
+        m->_rgbiBlock = rgbiRow;
+        m->_ntscBlock = ntscRow;
+        m->_ntscInputBlock = &m->_ntscInput[_lNtscToLBlock];
+        for (int i = 0; i < _boxCount; ++i) {
+            m->_previousPattern[i] = -1;
+            m->_previousFramePattern[i] = -1;
+        }
+        int column = 0;
+        int boxColumn = 0;
+        int boxIndex = 0;
+        while (true) {
+            if (boxIndex == 0 && waitForRowAbove) {
+                waitForColumns(blockRow - 1,
+                    min(boxColumn + _rowLag, _columns));
+            }
+            Box* box = &_boxes[boxIndex];
+            MatchingNTSCDecoder* baseDecoder = &m->_baseDecoders[boxIndex];
+            MatchingNTSCDecoder* deltaDecoder = &m->_deltaDecoders[boxIndex];
+            Colour rgb(0, 0, 0);
+            const Byte* inputChangeLine = m->_inputBlock + sizeof(Colour)*
+                box->_lBlockToLChange;
+            int* framePatterns = 0;
+            int framePattern = -1;
+            bool unchanged = false;
+            if (_continueSequence) {
+                framePatterns = &_framePatterns[
+                    (blockRow*_columns + boxColumn)*_boxCount + boxIndex];
+                framePattern = *framePatterns;
+                unchanged = inputUnchanged(box, inputChangeLine);
+            }
+            Colour* errorChangeLine = m->_errorBlock + box->_lBlockToLChange;
+            const Colour* temporalChangeLine =
+                m->_temporalBlock + box->_lBlockToLChange;
+            Byte* ntscInputLine = m->_ntscBlock + box->_lBlockToLInput;
+            Byte* ntscDeltaLine = m->_ntscBlock + box->_lBlockToLDelta;
+
+            Vector3<SInt16>* baseLine = &m->_base[0];
+            for (int scanline = 0; scanline < _blockHeight; ++scanline) {
+                // Compute average target colour for block to look up in
+                // table.
+                auto input =
+                    reinterpret_cast<const Colour*>(inputChangeLine);
+                Colour* error = errorChangeLine;
+                for (int x = 0; x < box->_lChangeToRChange; ++x) {
+                    Colour target = *input;
+                    if (!_diffuseInternally2 || x != 0)
+                        target -= _diffusionHorizontal2*error[-1];
+                    if (_diffusionVertical2 != 0 &&
+                        (!_diffuseInternally2 || scanline != 0))
+                        target -= _diffusionVertical2*error[-_errorStride];
+                    if (_diffusionTemporal2 != 0)
+                        target -= _diffusionTemporal2*temporalChangeLine[x];
+                    target.x = clamp(0.0f, target.x, 1.0f);
+                    target.y = clamp(0.0f, target.y, 1.0f);
+                    target.z = clamp(0.0f, target.z, 1.0f);
+                    rgb += target;
+                    *error = Colour(0, 0, 0);
+                    ++input;
+                    ++error;
+                }
+                inputChangeLine += _scaled.stride();
+                errorChangeLine += _errorStride;
+                temporalChangeLine += _errorStride;
+
+                if (_isComposite) {
+                    // Compute base for decoding.
+                    baseDecoder->decodeNTSC(ntscInputLine);
+                    deltaDecoder->decodeNTSC(ntscDeltaLine);
+                    SInt16* decoded = baseDecoder->outputData() +
+                        box->_lBaseToLCompare*3;
+                    SInt16* deltaDecoded = deltaDecoder->outputData() +
+                        box->_lBaseToLCompare*3;
+                    m->_deltaDecoded = deltaDecoded;
+                    for (int x = 0; x < box->_lCompareToRCompare; ++x) {
+                        baseLine[x] = Vector3<SInt16>(decoded[0],
+                            decoded[1], decoded[2])
+                            - Vector3<SInt16>(deltaDecoded[0],
+                            deltaDecoded[1], deltaDecoded[2]);
+                        decoded += 3;
+                        deltaDecoded += 3;
+                    }
+                    ntscInputLine += _ntscStride;
+                    ntscDeltaLine += _ntscStride;
+                    baseLine += box->_lCompareToRCompare;
+                }
+            }
+            SRGB srgb = _linearizer.srgb(rgb/box->_blockArea);
+            int bestPattern;
+            if (unchanged)
+                bestPattern = framePattern;
+            else {
+                // The previous block's pattern is often a good match for
+                // this one too, as are the patterns chosen in the previous
+                // frame for this block and its neighbours. The left
+                // neighbour's entry in _framePatterns already holds its
+                // pattern for this frame, so the previous one is kept in m.
+                int seeds[4];
+                int seedCount = 0;
+                seeds[seedCount++] = m->_previousPattern[boxIndex];
+                if (framePatterns != 0) {
+                    seeds[seedCount++] = framePattern;
+                    if (boxColumn > 0) {
+                        seeds[seedCount++] =
+                            m->_previousFramePattern[boxIndex];
+                    }
+                    if (boxColumn + 1 < _columns)
+                        seeds[seedCount++] = framePatterns[_boxCount];
+                }
+                bestPattern =
+                    findPattern(m, boxIndex, srgb, seeds, seedCount);
+            }
+            tryPattern(m, boxIndex, bestPattern);
+            m->_previousPattern[boxIndex] = bestPattern;
+            m->_previousFramePattern[boxIndex] = framePattern;
+            _framePatterns[(blockRow*_columns + boxColumn)*_boxCount +
+                boxIndex] = bestPattern;
+            if (oneBpp && hres) {
+                bestPattern = ((bestPattern & 1) << 1) +
+                    ((bestPattern & 2) << 2) +
+                    ((bestPattern & 4) << 3) +
+                    ((bestPattern & 8) << 4) +
+                    ((bestPattern & 0x10) << 5) +
+                    ((bestPattern & 0x20) << 6) +
+                    ((bestPattern & 0x40) << 7) +
+                    ((bestPattern & 0x80) << 8) +
+                    ((bestPattern & 0x100) << 9) +
+                    ((bestPattern & 0x200) << 10) +
+                    ((bestPattern & 0x400) << 11) +
+                    ((bestPattern & 0x800) << 12) +
+                    ((bestPattern & 0x1000) << 13) +
+                    ((bestPattern & 0x2000) << 14) +
+                    ((bestPattern & 0x4000) << 15) +
+                    ((bestPattern & 0x8000) << 16);
+            }
+            if (bitCount == 16) {
+                if (!_graphics ||
+                    ((box->_bitOffset & 16) == 0 && (!oneBpp || !hres))) {
+                    *m->_d0 = bestPattern;
+                    m->_d0[1] = bestPattern >> 8;
+                }
+                else {
+                    if (oneBpp && hres) {
+                        *m->_d0 = bestPattern;
+                        m->_d0[1] = bestPattern >> 8;
+                        m->_d0[2] = bestPattern >> 16;
+                        m->_d0[3] = bestPattern >> 24;
+                    }
+                    else {
+                        m->_d0[2] = bestPattern;
+                        m->_d0[3] = bestPattern >> 8;
+                    }
+                }
+            }
+            else {
+                int byte = box->_bitOffset >> 3;
+                int mask = (1 << bitCount) - 1;
+                int shift = box->_bitOffset & 7;
+                bestPattern >>= _combineShift - bitCount;
+                if (oneBpp && hres) {
+                    mask = (1 << (bitCount << 1)) - 1;
+                    if (bitCount == 8) {
+                        m->_d0[byte] = bestPattern;
+                        m->_d0[byte + 1] = bestPattern >> 8;
+                        if (_combineVertical) {
+                            d1[byte] = bestPattern >> 16;
+                            d1[byte + 1] = bestPattern >> 24;
+                        }
+                    }
+                    else {
+                        if (bitCount == 4) {
+                            m->_d0[byte] = bestPattern;
+                            if (_combineVertical)
+                                d1[byte] = bestPattern >> 8;
+                        }
+                        else {
+                            m->_d0[byte] = (m->_d0[byte] & ~(mask << shift)) +
+                                ((bestPattern & mask) << shift);
+                            if (_combineVertical) {
+                                bestPattern >>= _combineShift;
+                                d1[byte] = (d1[byte] & ~(mask << shift)) +
+                                    ((bestPattern & mask) << shift);
+                            }
+                        }
+                    }
+                }
+                else {
+                    m->_d0[byte] = (m->_d0[byte] & ~(mask << shift)) +
+                        ((bestPattern & mask) << shift);
+                    if (_combineVertical) {
+                        bestPattern >>= _combineShift;
+                        d1[byte] = (d1[byte] & ~(mask << shift)) +
+                            ((bestPattern & mask) << shift);
+                    }
+                }
+            }
+            ++boxIndex;
+            if (boxIndex == _boxCount) {
+                boxIndex = 0;
+                m->_inputBlock += _boxIncrement*3*sizeof(float);
+                m->_errorBlock += _boxIncrement;
+                m->_temporalBlock += _boxIncrement;
+                m->_rgbiBlock += _boxIncrement;
+                m->_ntscBlock += _boxIncrement;
+                m->_ntscInputBlock += _boxIncrement;
+                m->_d0 += _incrementBytes;
+                d1 += _incrementBytes;
+                column += _incrementBytes;
+                ++boxColumn;
+                if (!_rowsIndependent)
+                    columnsDone(blockRow, boxColumn);
+                if (column >= bytesPerRow)
+                    break;
+            }
+        }
+
+        if (_graphics) {
+            fixEndianness(&m->_rowData[1], bytesPerRow, oneBpp);
+            if (_combineVertical) {
+                fixEndianness(&m->_rowData[1 + rowDataStride], bytesPerRow,
+                    oneBpp);
+            }
+        }
+        if (_combineVertical) {
+            _data->change(0, row*bytesPerRow, bytesPerRow, &m->_rowData[1]);
+            _data->change(0, row*bytesPerRow + (1 << bankShift),
+                bytesPerRow, &m->_rowData[1 + rowDataStride]);
+        }
+        else {
+            _data->change(0, row*bytesPerRow + (bank << bankShift),
+                bytesPerRow, &m->_rowData[1]);
+        }
+        Lock lock(&_rowMutex);
+        ++_blockRowsDone;
+        _program->updateOutput();
+        _program->setProgress(static_cast<float>(_blockRowsDone)/_blockRows);
+    }
+
+    // Returns true if no component of the box's input pixels has changed by
+    // more than the sequence threshold since the previous frame.
+    bool inputUnchanged(Box* box, const Byte* inputLine)
+    {
+        const Byte* previousLine =
+            &_previousScaled[0] + (inputLine - _scaled.data());
+        for (int y = 0; y < _blockHeight; ++y) {
+            auto input = reinterpret_cast<const Colour*>(inputLine);
+            auto previous = reinterpret_cast<const Colour*>(previousLine);
+            for (int x = 0; x < box->_lChangeToRChange; ++x) {
+                Colour d = input[x] - previous[x];
+                if (fabs(d.x) > _sequenceThreshold ||
+                    fabs(d.y) > _sequenceThreshold ||
+                    fabs(d.z) > _sequenceThreshold)
+                    return false;
+            }
+            inputLine += _scaled.stride();
+            previousLine += _scaled.stride();
+        }
+        return true;
+    }
+
+    // Returns the best pattern for a box whose average target colour is
+    // srgb. The seeds are patterns likely to be good matches.
+    int findPattern(RowMatcher* m, int boxIndex, SRGB srgb, const int* seeds,
+        int seedCount)
+    {
+        Box* box = &_boxes[boxIndex];
+        auto s = Vector3Cast<int>(
+            Vector3Cast<float>(srgb)*_srgbScale - 0.5f);
+        // Gather the closest patterns.
+        Candidate* candidates = &m->_candidates[0];
+        int n = 0;
+        for (int z = 0; n == 0; ++z) {
+            // Always search at least a 2x2x2 region of the gamut in
+            // case we're on the boundary between two entries on any
+            // given access.
+            int rMin = max(s.x - z, 0);
+            int rMax = min(s.x + 1 + z, _srgbDiv.x - 1);
+            int gMin = max(s.y - z, 0);
+            int gMax = min(s.y + 1 + z, _srgbDiv.y - 1);
+            int bMin = max(s.z - z, 0);
+            int bMax = min(s.z + 1 + z, _srgbDiv.z - 1);
+            for (int r = rMin; r <= rMax; ++r) {
+                for (int g = gMin; g <= gMax; ++g) {
+                    for (int b = bMin; b <= bMax; ++b) {
+                        Word* patterns;
+                        int c = box->_table.get(r +
+                            _srgbDiv.x*(g + _srgbDiv.y*b), &patterns);
+                        for (int i = 0; i < c; ++i) {
+                            int pattern = *patterns;
+                            SRGB a = box->_patternSRGB[pattern];
+                            int dr = a.x - srgb.x;
+                            int dg = a.y - srgb.y;
+                            int db = a.z - srgb.z;
+                            candidates[n]._prescore =
+                                dr*dr + dg*dg + db*db;
+                            candidates[n]._index = n;
+                            candidates[n]._pattern = pattern;
+                            ++n;
+                            ++patterns;
+                        }
+                        if (r > rMin && r < rMax && g > gMin &&
+                            g < gMax && b == bMin)
+                            b = bMax - 1;
+                    }
+                }
+            }
+        }
+        // Try the patterns whose average colour is closest to the
+        // target first, so that a good bound is found early. Below full
+        // quality only the most promising fraction is tried at all.
+        std::sort(candidates, candidates + n);
+        static const int minimumTries = 16;
+        int tries = n;
+        if (_searchFraction < 1) {
+            tries = min(n, max(minimumTries,
+                static_cast<int>(n*_searchFraction)));
+        }
+        // The seeds give a bound to abandon worse candidates against before
+        // any of them have been tried. They might not be candidates though,
+        // so they can't win by themselves.
+        float bound = std::numeric_limits<float>::max();
+        for (int i = 0; i < seedCount; ++i) {
+            int seed = seeds[i];
+            if (seed == -1)
+                continue;
+            int j;
+            for (j = 0; j < i; ++j)
+                if (seeds[j] == seed)
+                    break;
+            if (j == i)
+                bound = min(bound, tryPattern(m, boxIndex, seed, bound));
+        }
+        int bestPattern = 0;
+        int bestIndex = -1;
+        float bestMetric = std::numeric_limits<float>::max();
+        do {
+            for (int i = 0; i < tries; ++i) {
+                Candidate* c = &candidates[i];
+                // Candidates are only abandoned once they are strictly
+                // worse than the best, and ties go to the earliest in
+                // gamut table order, so the order in which they are
+                // tried doesn't affect the result.
+                float metric = tryPattern(m, boxIndex, c->_pattern,
+                    min(bound, bestMetric));
+                if (metric < bestMetric ||
+                    (metric == bestMetric && c->_index < bestIndex)) {
+                    bestPattern = c->_pattern;
+                    bestIndex = c->_index;
+                    bestMetric = metric;
+                }
+            }
+            // If a seed beat every candidate, they were all abandoned, so
+            // search again without its bound.
+            if (bestIndex != -1 ||
+                bound == std::numeric_limits<float>::max())
+                break;
+            bound = std::numeric_limits<float>::max();
+        } while (true);
+        return bestPattern;
+    }
+
+    // Returns the error metric for pattern, or the largest float if it is
+    // abandoned for exceeding bound part way through.
+    float tryPattern(RowMatcher* m, int boxIndex, int pattern,
+        float bound = std::numeric_limits<float>::max())
+    {
+        Box* box = &_boxes[boxIndex];
+        float metric = 0;
+        int lBlockToLChange = box->_lBlockToLChange;
+        const Byte* inputLine =
+            m->_inputBlock + sizeof(Colour)*box->_lBlockToLCompare;
+        Colour* errorLine = m->_errorBlock + box->_lBlockToLCompare;
+        const Colour* temporalLine =
+            m->_temporalBlock + box->_lBlockToLCompare;
+        Byte* rgbiLine = m->_rgbiBlock + lBlockToLChange;
+        Byte* ntscLine = m->_ntscBlock;
+        Byte* ntscInputLine = m->_ntscInputBlock + box->_lBlockToLChange;
+        Vector3<SInt16>* baseLine = &m->_base[0];
+        for (int scanline = 0; scanline < _blockHeight; ++scanline) {
+            int s = scanline / _scanlinesRepeat2;
+            SRGB* srgb = &m->_srgb[0];
+            auto input = reinterpret_cast<const Colour*>(inputLine);
+            auto error = errorLine;
+            auto temporal = temporalLine;
+            if (_graphics) {
+                for (int x = 0; x < box->_lChangeToRChange; ++x) {
+                    int p = pattern;
+                    if (_combineVertical && (scanline & 1) != 0)
+                        p >>= _combineShift;
+                    int position = box->_positionForPixel[x + lBlockToLChange];
+                    if (position == -1)
+                        m->_rgbiPattern[x] = 16;
+                    else {
+                        m->_rgbiPattern[x] =
+                            _rgbiFromBits[(p >> position) & _pixelMask];
+                    }
+                }
+            }
+            else {
+                UInt64 rgbi = _sequencer->process(pattern + (m->_d0[-1] << 24),
+                    _modeThread, _palette2, s, false, 0);
+                for (int x = 0; x < box->_lChangeToRChange; ++x)
+                    m->_rgbiPattern[x] = (rgbi >> (x << 2)) & 0xf;
+            }
+            if (!_isComposite) {
+                for (int x = 0; x < box->_lChangeToRChange; ++x) {
+                    Byte* p = &_rgbiPalette[3*m->_rgbiPattern[x]];
+                    *srgb = SRGB(p[0], p[1], p[2]);
+                    ++srgb;
+                }
+            }
+            else {
+                Byte* rgbi = rgbiLine;
+                int x;
+                for (x = 0; x < box->_lChangeToRChange; ++x) {
+                    if (m->_rgbiPattern[x] != 16)
+                        rgbi[x] = m->_rgbiPattern[x];
+                }
+                Byte* ntsc = ntscLine + box->_lBlockToLChange;
+                for (x = -1; x < box->_lChangeToRChange; ++x) {
+                    int phase = (x + lBlockToLChange) & 3;
+                    if (rgbi[x] != 16) {
+                        if (rgbi[x + 1] != 16) {
+                            ntsc[x] = _composite.simulateCGA(rgbi[x],
+                                rgbi[x + 1], phase);
+                        }
+                        else {
+                            ntsc[x] = _composite.simulateHalfCGA(rgbi[x],
+                                ntscInputLine[x + 1], phase);
+                        }
+                    }
+                    else {
+                        if (rgbi[x + 1] != 16) {
+                            ntsc[x] = _composite.simulateRightHalfCGA(
+                                ntscInputLine[x], rgbi[x + 1], phase);
+                        }
+                        else
+                            ntsc[x] = ntscInputLine[x];
+                    }
+                }
+                m->_deltaDecoders[boxIndex].decodeNTSC(
+                    ntscLine + box->_lBlockToLDelta);
+                SInt16* decoded = m->_deltaDecoded;
+                for (int x = 0; x < box->_lCompareToRCompare; ++x) {
+                    Vector3<SInt16> b = baseLine[x];
+                    srgb[x] = SRGB(
+                        byteClamp((b.x + decoded[0] + _bias) >> _shift),
+                        byteClamp((b.y + decoded[1] + _bias) >> _shift),
+                        byteClamp((b.z + decoded[2] + _bias) >> _shift));
+                    decoded += 3;
+                }
+            }
+            srgb = &m->_srgb[0];
+            Byte* rgbi = rgbiLine;
+            for (int x = 0; x < box->_lCompareToRCompare; ++x) {
+                SRGB o = *srgb;
+                Colour output = _linearizer.linear(o);
+                Colour target = *input;
+                if (_diffusionVertical2 != 0 &&
+                    (!_diffuseInternally2 || scanline != 0))
+                    target -= _diffusionVertical2*error[-_errorStride];
+                if (*rgbi != 16 && (!_diffuseInternally2 || x != 0))
+                    target -= _diffusionHorizontal2*error[-1];
+                if (_diffusionTemporal2 != 0)
+                    target -= _diffusionTemporal2*(*temporal);
+                switch (_clipping2) {
+                    case 1:
+                        target.x = clamp(0.0f, target.x, 1.0f);
+                        target.y = clamp(0.0f, target.y, 1.0f);
+                        target.z = clamp(0.0f, target.z, 1.0f);
+                        break;
+                    case 2:
+                        if (target.x < 0.0f) {
+                            float scale = 0.5f/(0.5f - target.x);
+                            target.x = 0.0f;
+                            target.y = 0.5f + (target.y - 0.5f)*scale;
+                            target.z = 0.5f + (target.z - 0.5f)*scale;
+                        }
+                        if (target.x > 1.0f) {
+                            float scale = 0.5f/(target.x - 0.5f);
+                            target.x = 1.0f;
+                            target.y = 0.5f + (target.y - 0.5f)*scale;
+                            target.z = 0.5f + (target.z - 0.5f)*scale;
+                        }
+                        if (target.y < 0.0f) {
+                            float scale = 0.5f/(0.5f - target.y);
+                            target.x = 0.5f + (target.x - 0.5f)*scale;
+                            target.y = 0.0f;
+                            target.z = 0.5f + (target.z - 0.5f)*scale;
+                        }
+                        if (target.y > 1.0f) {
+                            float scale = 0.5f/(target.y - 0.5f);
+                            target.x = 0.5f + (target.x - 0.5f)*scale;
+                            target.y = 1.0f;
+                            target.z = 0.5f + (target.z - 0.5f)*scale;
+                        }
+                        if (target.z < 0.0f) {
+                            float scale = 0.5f/(0.5f - target.z);
+                            target.x = 0.5f + (target.x - 0.5f)*scale;
+                            target.y = 0.5f + (target.y - 0.5f)*scale;
+                            target.z = 0.0f;
+                        }
+                        if (target.z > 1.0f) {
+                            float scale = 0.5f/(target.z - 0.5f);
+                            target.x = 0.5f + (target.x - 0.5f)*scale;
+                            target.y = 0.5f + (target.y - 0.5f)*scale;
+                            target.z = 1.0f;
+                        }
+                        break;
+                    case 3:
+                        target.x = clamp(-1.0f, target.x, 2.0f);
+                        target.y = clamp(-1.0f, target.y, 2.0f);
+                        target.z = clamp(-1.0f, target.z, 2.0f);
+                        break;
+                }
+
+                Colour e = output - target;
+                *error = e;
+
+                float contribution = 0;
+                switch (_metric2) {
+                    case 1:
+                        contribution = e.modulus2();
+                        break;
+                    case 0:
+                    case 2:
+                        {
+                            SRGB t = _linearizer.srgb(target);
+                            float dr = static_cast<float>(o.x - t.x);
+                            float dg = static_cast<float>(o.y - t.y);
+                            float db = static_cast<float>(o.z - t.z);
+                            if (_metric == 0)
+                                contribution = dr*dr + dg*dg + db*db;
+                            else {
+                                // Fast colour distance metric from
+                                // http://www.compuphase.com/cmetric.htm .
+                                float mr = (o.x + t.x)/512.0f;
+                                contribution = 4.0f*dg*dg + (2.0f + mr)*dr*dr +
+                                    (3.0f - mr)*db*db;
+                            }
+                        }
+                        break;
+                    case 3:
+                        contribution = deltaE2Luv(output, target);
+                        break;
+                    case 4:
+                        contribution = deltaE2CIE76(output, target);
+                        break;
+                    case 5:
+                        contribution = deltaE2CIE94(output, target);
+                        break;
+                    case 6:
+                        contribution = deltaE2CIEDE2000(output, target);
+                        break;
+                }
+                metric += contribution;
+                // Contributions are never negative so this candidate can't
+                // get any better. The caller will try the winner again to
+                // fill in the rest of the error and output buffers.
+                if (metric > bound)
+                    return std::numeric_limits<float>::max();
+
+                ++input;
+                ++error;
+                ++temporal;
+                ++srgb;
+                ++rgbi;
+            }
+            inputLine += _scaled.stride();
+            errorLine += _errorStride;
+            temporalLine += _errorStride;
+            ntscLine += _ntscStride;
+            ntscInputLine += _ntscStride;
+            rgbiLine += _rgbiStride;
+            baseLine += box->_lCompareToRCompare;
+        }
+        return metric;
+    }
+    void initData()
+    {
+        static const int regs = -CGAData::registerLogCharactersPerBank;
+        Byte cgaRegistersData[regs] = { 0 };
+        Byte* cgaRegisters = &cgaRegistersData[regs];
+        cgaRegisters[CGAData::registerScanlinesRepeat] = _scanlinesRepeat;
+        cgaRegisters[CGAData::registerMode] = _mode;
+        cgaRegisters[CGAData::registerPalette] = _palette;
+        cgaRegisters[CGAData::registerInterlaceMode] = 2;
+        cgaRegisters[CGAData::registerMaximumScanline] = _scanlinesPerRow - 1;
+        if (!_active) {
+            _data->change(0, CGAData::registerScanlinesRepeat, 1,
+                &cgaRegisters[CGAData::registerScanlinesRepeat]);
+            _data->change(0, CGAData::registerMode, 2,
+                &cgaRegisters[CGAData::registerMode]);
+            _data->change(0, CGAData::registerInterlaceMode, 2,
+                &cgaRegisters[CGAData::registerInterlaceMode]);
+            return;
+        }
+        _hdotsPerChar = (_mode & 1) != 0 ? 8 : 16;
+        _horizontalDisplayed =
+            (_activeSize.x + _hdotsPerChar - 1)/_hdotsPerChar;
+        int scanlinesPerRow = _scanlinesPerRow*_scanlinesRepeat;
+        _verticalDisplayed =
+            (_activeSize.y + scanlinesPerRow - 1)/scanlinesPerRow;
+        _logCharactersPerBank = 0;
+        while ((1 << _logCharactersPerBank) <
+            _horizontalDisplayed*_verticalDisplayed)
+            ++_logCharactersPerBank;
+        int horizontalTotal = _horizontalDisplayed + 272/_hdotsPerChar;
+        int horizontalSyncPosition = _horizontalDisplayed + 80/_hdotsPerChar;
+        int totalScanlines = _activeSize.y + 62;
+        int verticalTotal = totalScanlines/scanlinesPerRow;
+        int verticalTotalAdjust =
+            totalScanlines - verticalTotal*scanlinesPerRow;
+        if (verticalTotal > 128 &&
+            verticalTotal < (32 - verticalTotalAdjust)/scanlinesPerRow + 128) {
+            verticalTotalAdjust += (verticalTotal - 128)*scanlinesPerRow;
+            verticalTotal = 128;
+        }
+        int verticalSyncPosition = _verticalDisplayed + 24/scanlinesPerRow;
+        int hdotsPerScanline = horizontalTotal*_hdotsPerChar;
+        cgaRegisters[CGAData::registerLogCharactersPerBank] =
+            _logCharactersPerBank;
+        cgaRegisters[CGAData::registerHorizontalTotalHigh] =
+            (horizontalTotal - 1) >> 8;
+        cgaRegisters[CGAData::registerHorizontalDisplayedHigh] =
+            _horizontalDisplayed >> 8;
+        cgaRegisters[CGAData::registerHorizontalSyncPositionHigh] =
+            horizontalSyncPosition >> 8;
+        cgaRegisters[CGAData::registerVerticalTotalHigh] =
+            (verticalTotal - 1) >> 8;
+        cgaRegisters[CGAData::registerVerticalDisplayedHigh] =
+            _verticalDisplayed >> 8;
+        cgaRegisters[CGAData::registerVerticalSyncPositionHigh] =
+            verticalSyncPosition >> 8;
+        cgaRegisters[CGAData::registerHorizontalTotal] =
+            (horizontalTotal - 1) & 0xff;
+        cgaRegisters[CGAData::registerHorizontalDisplayed] =
+            _horizontalDisplayed & 0xff;
+        cgaRegisters[CGAData::registerHorizontalSyncPosition] =
+            horizontalSyncPosition & 0xff;
+        cgaRegisters[CGAData::registerHorizontalSyncWidth] = 10;
+        cgaRegisters[CGAData::registerVerticalTotal] =
+            (verticalTotal - 1) & 0xff;
+        cgaRegisters[CGAData::registerVerticalTotalAdjust] =
+            verticalTotalAdjust;
+        cgaRegisters[CGAData::registerVerticalDisplayed] =
+            _verticalDisplayed & 0xff;
+        cgaRegisters[CGAData::registerVerticalSyncPosition] =
+            verticalSyncPosition & 0xff;
+        cgaRegisters[CGAData::registerCursorStart] = 6;
+        cgaRegisters[CGAData::registerCursorEnd] = 7;
+        _data->change(0, -regs, regs, &cgaRegistersData[0]);
+        int last = _horizontalDisplayed*_verticalDisplayed*2 - 1;
+        if ((_mode & 2) != 0)
+            last += 2 << _logCharactersPerBank;
+        _data->change(0, last, 0);
+        _data->setTotals(hdotsPerScanline*totalScanlines, hdotsPerScanline - 2,
+            static_cast<int>((hdotsPerScanline - 2)*(totalScanlines + 0.5)));
+    }
+
+    Program* _program;
+    CGAData* _data;
+    CGASequencer* _sequencer;
+    CGAComposite _composite;
+    Linearizer _linearizer;
+
+    int _phase;
+    int _mode;
+    int _palette;
+    int _scanlinesPerRow;
+    int _scanlinesRepeat;
+    int _connector;
+    float _diffusionHorizontal;
+    float _diffusionVertical;
+    float _diffusionTemporal;
+    int _interlace;
+    bool _interlaceSync;
+    bool _interlacePhase;
+    bool _flicker;
+    double _quality;
+    double _gamma;
+    int _clipping;
+    int _metric;
+    int _characterSet;
+    double _hue;
+    double _saturation;
+    double _contrast;
+    double _brightness;
+    double _chromaBandwidth;
+    double _lumaBandwidth;
+    double _rollOff;
+    double _lobes;
+    int _prescalerProfile;
+    int _lookAhead;
+    bool _combineScanlines;
+    int _advance;
+	bool _diffuseInternally;
+	bool _diffuseInternally2;
+    bool _needRescale;
+
+    bool _active;
+    Vector _size;
+    int _lTargetToLBlock;
+    int _lBlockToRTarget;
+    Vector _activeSize;
+    ScanlineRenderer _scaler;
+    AlignedBuffer _scaled;
+    int _horizontalDisplayed;
+    int _verticalDisplayed;
+    int _hdotsPerChar;
+    int _logCharactersPerBank;
+
+    Byte _rgbiPalette[3*0x11];
+    Array<bool> _skip;
+
+    Byte _rgbiPattern[28];
+    Array<Byte> _ntscPattern;
+    Array<Byte> _ntsc;
+    Array<SRGB> _srgb;
+    Bitmap<SRGB> _input;
+    Array<Colour> _error;
+    Array<Byte> _activeInputs;
+    int _bias;
+    int _shift;
+
+	int _phaseMode;
+    const Byte* _inputStart;
+    Colour* _errorStart;
+    Byte* _ntscStart;
+    int _lNtscToLBlock;
+    int _blockHeight;
+    int _decoderLength;
+    int _errorStride;
+    int _ntscStride;
+    int _rgbiStride;
+    int _rowDataStride;
+    int _bankShift;
+    int _bytesPerRow;
+    int _boxCount;
+    int _boxIncrement;
+    int _incrementBytes;
+    int _bitCount;
+    bool _oneBpp;
+    bool _hres;
+    int _phase2;
+    int _overscan;
+    Vector3<float> _srgbScale;
+    Vector3<int> _srgbDiv;
+    double _searchFraction;
+    Array<Colour> _temporalError;
+    Colour* _temporalStart;
+    bool _sequence;
+    bool _sequenceStarted;
+    bool _continueSequence;
+    float _sequenceThreshold;
+    Array<Byte> _previousScaled;
+    Array<int> _framePatterns;
+    bool _isComposite;
+    bool _graphics;
+    int _metric2;
+    int _clipping2;
+    int _scanlinesRepeat2;
+    int _palette2;
+    int _modeThread;
+    float _diffusionHorizontal2;
+    float _diffusionVertical2;
+    float _diffusionTemporal2;
+    bool _combineVertical;
+
+    Mutex _mutex;
+
+    Box _boxes[24];
+    Byte _rgbiFromBits[4];
+    int _pixelMask;
+    int _combineShift;
+    int _patternCount;
+
+    MatchingNTSCDecoder _gamutDecoder;
+
+    // Rows of character blocks are shared out between the RowMatchers.
+    ThreadPool _rowPool;
+    Array<RowMatcher> _rowMatchers;
+    Mutex _rowMutex;
+    int _columns;
+    int _blockRowsPerRow;
+    int _blockRows;
+    int _nextBlockRow;
+    int _blockRowsDone;
+    bool _rowsIndependent;
+    int _rowLag;
+    Array<int> _columnsDone;
+    Array<Event> _rowProgressed;
+};
+
+typedef CGAMatcherT<void> CGAMatcher;
+
+bool endsIn(String s, String suffix)
+{
+    int l = suffix.length();
+    int o = s.length() - l;
+    if (o < 0)
+        return false;
+    for (int i = 0; i < l; ++i)
+        if (tolower(s[i + o]) != tolower(suffix[i]))
+            return false;
+    return true;
+}
+
+class BitmapValue : public Structure
+{
+public:
+    void load(String filename)
+    {
+        _name = filename;
+        _file = File(filename, true);
+        // We parse the filename relative to the current directory here instead
+        // of relative to the config file path because the filename usually
+        // comes from the command line.
+        Vector size(0, 0);
+        _isPNG = endsIn(filename, ".png");
+        if (_isPNG) {
+            _bitmap = PNGFileFormat<SRGB>().load(_file);
+            size = _bitmap.size();
+        }
+        _size.set("x", size.x, Span());
+        _size.set("y", size.y, Span());
+    }
+    Bitmap<SRGB> bitmap() { return _bitmap; }
+    Value getValue(Identifier identifier) const
+    {
+        if (identifier == Identifier("size"))
+            return Value(VectorType(), &_size, Span());
+        return Structure::getValue(identifier);
+    }
+    String name() { return _name; }
+    bool operator==(const BitmapValue& other) const
+    {
+        return _name == other._name;
+    }
+    bool isPNG() { return _isPNG; }
+    File file() { return _file; }
+private:
+    bool _isPNG;
+    Structure _size;
+    String _name;
+    File _file;
+    Bitmap<SRGB> _bitmap;
+};
+
+class BitmapType : public StructuredType
+{
+public:
+    BitmapType(BitmapValue* bitmapValue)
+      : StructuredType(create<Body>(bitmapValue)) { }
+    static String name() { return "Bitmap"; }
+    class Body : public StructuredType::Body
+    {
+    public:
+        Body(BitmapValue* bitmapValue)
+          : StructuredType::Body("Bitmap", members()),
+            _bitmapValue(bitmapValue)
+        { }
+        List<StructuredType::Member> members()
+        {
+            List<StructuredType::Member> vectorMembers;
+            vectorMembers.add(StructuredType::member<Vector>("size"));
+            return vectorMembers;
+        }
+        bool canConvertFrom(const Type& from, String* reason) const
+        {
+            return from == StringType();
+        }
+        Value convert(const Value& value) const
+        {
+            _bitmapValue->load(value.value<String>());
+            return Value(type(), static_cast<Structure*>(_bitmapValue),
+                value.span());
+        }
+        Value defaultValue() const
+        {
+            return Value(type(), static_cast<Structure*>(_bitmapValue),
+                Span());
+        }
+    private:
+        BitmapValue* _bitmapValue;
+    };
+};
+
+class BitmapIsRGBIFunction : public Function
+{
+public:
+    BitmapIsRGBIFunction(BitmapType bitmapType)
+      : Function(create<Body>(bitmapType)) { }
+    class Body : public Function::Body
+    {
+    public:
+        Body(BitmapType bitmapType) : _bitmapType(bitmapType) { }
+        Value evaluate(List<Value> arguments, Span span) const
+        {
+            auto bitmap = static_cast<BitmapValue*>(
+                arguments.begin()->value<Structure*>())->bitmap();
+            Vector size = bitmap.size();
+
+            int maxDistance = 0;
+            const Byte* inputRow = bitmap.data();
+
+            for (int y = 0; y < size.y; ++y) {
+                const SRGB* inputPixel =
+                    reinterpret_cast<const SRGB*>(inputRow);
+                for (int x = 0; x < size.x; ++x) {
+                    SRGB s = *inputPixel;
+                    ++inputPixel;
+                    int bestDistance = 0x7fffffff;
+                    Byte bestRGBI = 0;
+                    for (int i = 0; i < 16; ++i) {
+                        int distance = (Vector3Cast<int>(rgbiPalette[i]) -
+                            Vector3Cast<int>(s)).modulus2();
+                        if (distance < bestDistance) {
+                            bestDistance = distance;
+                            if (distance < 42*42)
+                                break;
+                        }
+                    }
+                    maxDistance = max(bestDistance, maxDistance);
+                }
+                inputRow += bitmap.stride();
+            }
+
+            return Value(maxDistance < 15*15*3);
+        }
+        Identifier identifier() const { return "bitmapIsRGBI"; }
+        FunctionType type() const
+        {
+            return FunctionType(BooleanType(), _bitmapType);
+        }
+    private:
+        BitmapType _bitmapType;
+    };
+};
+
+
+// Registers the options understood by CGAArt config files. Shared by the
+// interactive program and the command-line batch converter so that a config
+// file saved by one can be used by the other.
+void addCGAArtOptions(ConfigFile* configFile, BitmapType bitmapType)
+{
+    configFile->addType(VectorType());
+    configFile->addOption("inputPicture", bitmapType);
+    configFile->addDefaultOption("mode", 0x1a);
+    configFile->addDefaultOption("palette", 0x0f);
+    configFile->addDefaultOption("interlaceMode", 0);
+    configFile->addDefaultOption("interlaceSync", false);
+    configFile->addDefaultOption("interlacePhase", false);
+    configFile->addDefaultOption("flicker", false);
+    configFile->addDefaultOption("scanlinesPerRow", 2);
+    configFile->addDefaultOption("scanlinesRepeat", 1);
+    configFile->addDefaultOption("contrast", 100.0);
+    configFile->addDefaultOption("brightness", 0.0);
+    configFile->addDefaultOption("saturation", 100.0);
+    configFile->addDefaultOption("hue", 0.0);
+    configFile->addDefaultOption("showClipping", false);
+    configFile->addDefaultOption("chromaBandwidth", 1.0);
+    configFile->addDefaultOption("lumaBandwidth", 1.0);
+    configFile->addDefaultOption("rollOff", 0.0);
+    configFile->addDefaultOption("lobes", 4.0);
+    configFile->addDefaultOption("horizontalDiffusion", 0.647565);
+    configFile->addDefaultOption("verticalDiffusion", 0.352435);
+    configFile->addDefaultOption("temporalDiffusion", 0.0);
+    configFile->addDefaultOption("quality", 0.5);
+    configFile->addDefaultOption("gamma", 0.0);
+    configFile->addDefaultOption("clipping", 1);
+    configFile->addDefaultOption("metric", 2);
+    configFile->addDefaultOption("connector", 1);
+    configFile->addDefaultOption("characterSet", 3);
+    configFile->addDefaultOption("cgaROM", String("5788005.u33"));
+    configFile->addDefaultOption("aspectRatio", 5.0/6.0);
+    configFile->addDefaultOption("scanlineWidth", 0.5);
+    configFile->addDefaultOption("scanlineProfile", 0);
+    configFile->addDefaultOption("horizontalProfile", 0);
+    configFile->addDefaultOption("prescalerProfile", 4);
+    configFile->addDefaultOption("lookAhead", 3);
+    configFile->addDefaultOption("advance", 2);
+    configFile->addDefaultOption("diffuseInternally", false);
+    configFile->addDefaultOption("combineScanlines", true);
+    configFile->addDefaultOption("scanlineBleeding", 2);
+    configFile->addDefaultOption("horizontalBleeding", 2);
+    configFile->addDefaultOption("zoom", 2.0);
+    configFile->addDefaultOption("horizontalRollOff", 0.0);
+    configFile->addDefaultOption("verticalRollOff", 0.0);
+    configFile->addDefaultOption("horizontalLobes", 4.0);
+    configFile->addDefaultOption("verticalLobes", 4.0);
+    configFile->addDefaultOption("subPixelSeparation", 1.0);
+    configFile->addDefaultOption("phosphor", 0);
+    configFile->addDefaultOption("mask", 0);
+    configFile->addDefaultOption("maskSize", 0.0);
+    configFile->addDefaultOption("overscan", 0.1);
+    configFile->addDefaultOption("phase", 1);
+    configFile->addDefaultOption("interactive", true);
+    configFile->addDefaultOption("combFilter", 0);
+    configFile->addDefaultOption("fftWisdom", String("wisdom"));
+    configFile->addDefaultOption("jobs", 0);
+    configFile->addDefaultOption("sequence", false);
+    configFile->addDefaultOption("sequenceThreshold", 0.002);
+    configFile->addDefaultOption("sequenceAppend", false);
+    configFile->addDefaultOption("activeSize", Vector(640, 200));
+
+    configFile->addFunco(BitmapIsRGBIFunction(bitmapType));
+}
+
+// Transfers the matcher and output settings from a loaded config file. The
+// caller is responsible for the settings that need the config file's path
+// (cgaROM) and for those it keeps for itself (activeSize).
+void applyCGAArtConfig(ConfigFile* config, CGAMatcher* matcher,
+    CGAOutput* output)
+{
+    matcher->setDiffusionHorizontal(
+        config->get<double>("horizontalDiffusion"));
+    matcher->setDiffusionVertical(
+        config->get<double>("verticalDiffusion"));
+    matcher->setDiffusionTemporal(
+        config->get<double>("temporalDiffusion"));
+    matcher->setQuality(config->get<double>("quality"));
+    matcher->setLookAhead(config->get<int>("lookAhead"));
+    matcher->setAdvance(config->get<int>("advance"));
+    matcher->setDiffuseInternally(
+        config->get<bool>("diffuseInternally"));
+    matcher->setCombineScanlines(config->get<bool>("combineScanlines"));
+    matcher->setGamma(config->get<double>("gamma"));
+    matcher->setClipping(config->get<int>("clipping"));
+    matcher->setMetric(config->get<int>("metric"));
+    matcher->setInterlace(config->get<int>("interlaceMode"));
+    matcher->setInterlaceSync(config->get<bool>("interlaceSync"));
+    matcher->setInterlacePhase(config->get<bool>("interlacePhase"));
+    matcher->setFlicker(config->get<bool>("flicker"));
+    bool phase = config->get<int>("phase") == 0;
+    matcher->setPhase(phase ? 0 : 1);
+    output->setPhase(phase ? 0 : 1);
+    matcher->setCharacterSet(config->get<int>("characterSet"));
+    matcher->setMode(config->get<int>("mode"));
+    matcher->setPalette(config->get<int>("palette"));
+    matcher->setScanlinesPerRow(config->get<int>("scanlinesPerRow"));
+    matcher->setScanlinesRepeat(config->get<int>("scanlinesRepeat"));
+
+    double brightness = config->get<double>("brightness");
+    output->setBrightness(brightness);
+    matcher->setBrightness(brightness);
+    double saturation = config->get<double>("saturation");
+    output->setSaturation(saturation);
+    matcher->setSaturation(saturation);
+    double hue = config->get<double>("hue");
+    output->setHue(hue);
+    matcher->setHue(hue);
+    double contrast = config->get<double>("contrast");
+    output->setContrast(contrast);
+    matcher->setContrast(contrast);
+    output->setShowClipping(config->get<bool>("showClipping"));
+    double chromaBandwidth = config->get<double>("chromaBandwidth");
+    matcher->setChromaBandwidth(chromaBandwidth);
+    output->setChromaBandwidth(chromaBandwidth);
+    double lumaBandwidth = config->get<double>("lumaBandwidth");
+    matcher->setLumaBandwidth(lumaBandwidth);
+    output->setLumaBandwidth(lumaBandwidth);
+    double rollOff = config->get<double>("rollOff");
+    matcher->setRollOff(rollOff);
+    output->setRollOff(rollOff);
+    double lobes = config->get<double>("lobes");
+    output->setLobes(lobes);
+    matcher->setLobes(lobes);
+    int connector = config->get<int>("connector");
+    output->setConnector(connector);
+    matcher->setConnector(connector);
+    output->setScanlineWidth(config->get<double>("scanlineWidth"));
+    output->setScanlineProfile(config->get<int>("scanlineProfile"));
+    output->setHorizontalProfile(config->get<int>("horizontalProfile"));
+    matcher->setPrescalerProfile(config->get<int>("prescalerProfile"));
+    output->setZoom(config->get<double>("zoom"));
+    output->setScanlineBleeding(config->get<int>("scanlineBleeding"));
+    output->setHorizontalBleeding(
+        config->get<int>("horizontalBleeding"));
+    output->setHorizontalRollOff(
+        config->get<double>("horizontalRollOff"));
+    output->setVerticalRollOff(config->get<double>("verticalRollOff"));
+    output->setHorizontalLobes(config->get<double>("horizontalLobes"));
+    output->setVerticalLobes(config->get<double>("verticalLobes"));
+    output->setSubPixelSeparation(
+        config->get<double>("subPixelSeparation"));
+    output->setPhosphor(config->get<int>("phosphor"));
+    output->setMask(config->get<int>("mask"));
+    output->setMaskSize(config->get<double>("maskSize"));
+    output->setAspectRatio(config->get<double>("aspectRatio"));
+    output->setOverscan(config->get<double>("overscan"));
+    output->setCombFilter(config->get<int>("combFilter"));
+}
+
+#endif // INCLUDED_CGAART_H
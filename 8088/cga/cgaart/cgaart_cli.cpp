@@ -0,0 +1,247 @@
+#include "alfe/main.h"
+#include "cgaart.h"
+
+// Command-line batch converter: runs the CGAArt matcher over a list of input
+// pictures without creating any windows, using the same config file format as
+// the interactive program. Several pictures are converted concurrently.
+
+class Collect
+{
+public:
+    Collect(AppendableArray<String>* inputs) : _inputs(inputs) { }
+    void operator()(const File& file)
+    {
+        String path = file.path();
+        if (!endsIn(path, ".png") && !endsIn(path, ".dat") &&
+            !endsIn(path, ".cgad"))
+            return;
+        // Don't reconvert the results of a previous run.
+        String stem = stemOf(path);
+        if (endsIn(stem, "_out") || endsIn(stem, "_sequence"))
+            return;
+        _inputs->append(path);
+    }
+    void operator()(const Directory& directory) { }
+    static String stemOf(String path)
+    {
+        int i;
+        for (i = path.length() - 1; i >= 0; --i)
+            if (path[i] == '.')
+                break;
+        if (i != -1)
+            path = path.subString(0, i);
+        return path;
+    }
+private:
+    AppendableArray<String>* _inputs;
+};
+
+class ConvertTask : public Task
+{
+public:
+    void setProgram(Program* program) { _program = program; }
+private:
+    void run();
+
+    Program* _program;
+};
+
+class Program : public ProgramBase
+{
+public:
+    void run()
+    {
+        if (_arguments.count() < 3) {
+            console.write("Syntax: " + _arguments[0] +
+                " <config file name> <input file or directory name>...\n"
+                "Inputs can be .png, .dat or .cgad files. Directories are "
+                "searched recursively\nfor these.\n");
+            return;
+        }
+        _configPath = _arguments[1];
+        for (int i = 2; i < _arguments.count(); ++i)
+            applyToWildcard(Collect(&_inputs), _arguments[i]);
+        if (_inputs.count() == 0)
+            throw Exception("No input files found.");
+        std::sort(&_inputs[0], &_inputs[0] + _inputs.count());
+        _nextInput = 0;
+        _converted = 0;
+
+        // Load the config once up front for the settings that apply to the
+        // whole batch rather than to an individual picture.
+        BitmapValue bitmapValue;
+        ConfigFile configFile;
+        addCLIOptions(&configFile, &bitmapValue, _inputs[0]);
+        File configFilePath(_configPath, true);
+        configFile.load(configFilePath);
+        FFTWWisdom<float> wisdom(File(configFile.get<String>("fftWisdom"),
+            configFilePath.parent()));
+
+        if (configFile.get<bool>("sequence")) {
+            convertSequence(&configFile);
+            return;
+        }
+
+        // Split the available CPUs between concurrent pictures and the row
+        // workers within each picture.
+        int cpus = ThreadPool::availableThreads();
+        int jobs = configFile.get<int>("jobs");
+        if (jobs <= 0)
+            jobs = cpus;
+        jobs = min(jobs, _inputs.count());
+        _matcherThreads = max(1, cpus/jobs);
+        ThreadPool pool(jobs);
+        Array<ConvertTask> tasks(jobs);
+        for (auto& t : tasks) {
+            t.setProgram(this);
+            t.setPool(&pool);
+            t.restart();
+        }
+        for (auto& t : tasks)
+            t.join();
+        console.write(decimal(_converted) + " of " +
+            decimal(_inputs.count()) + " files converted.\n");
+        if (_converted != _inputs.count())
+            throw Exception("Some files could not be converted.");
+    }
+    void addCLIOptions(ConfigFile* configFile, BitmapValue* bitmapValue,
+        String input)
+    {
+        BitmapType bitmapType(bitmapValue);
+        addCGAArtOptions(configFile, bitmapType);
+        List<Value> arguments;
+        arguments.add(_arguments[0] + " " + _configPath);
+        arguments.add(input);
+        configFile->addDefaultOption("arguments",
+            ArrayType(StringType(), IntegerType()), arguments);
+    }
+    bool nextInput(String* input)
+    {
+        Lock lock(&_mutex);
+        if (_nextInput == _inputs.count())
+            return false;
+        *input = _inputs[_nextInput];
+        ++_nextInput;
+        return true;
+    }
+    void convert(String input)
+    {
+        BitmapValue bitmapValue;
+        ConfigFile configFile;
+        addCLIOptions(&configFile, &bitmapValue, input);
+        File configFilePath(_configPath, true);
+        configFile.load(configFilePath);
+
+        CGAData data;
+        CGASequencer sequencer;
+        CGAOutput output(&data, &sequencer, 0);
+        CGAMatcher matcher(_matcherThreads);
+        matcher.setProgram(this);
+        matcher.setData(&data);
+        matcher.setSequencer(&sequencer);
+        applyCGAArtConfig(&configFile, &matcher, &output);
+        sequencer.setROM(File(configFile.get<String>("cgaROM"),
+            configFilePath.parent()));
+
+        // The config file usually names the input via arguments[1] but may
+        // override it, so take the name from the loaded config as the
+        // interactive program does.
+        String inputName = bitmapValue.name();
+        if (bitmapValue.isPNG()) {
+            matcher.setInput(bitmapValue.bitmap(),
+                configFile.get<Vector>("activeSize"));
+            matcher.restart();
+            matcher.join();
+        }
+        else {
+            File file(inputName, true);
+            if (endsIn(inputName, ".cgad"))
+                data.load(file);
+            else
+                data.loadVRAM(file);
+            matcher.initFromData();
+        }
+
+        String outputName = Collect::stemOf(inputName) + "_out";
+        data.save(File(outputName + ".cgad", true));
+        data.saveVRAM(File(outputName + ".dat", true));
+        {
+            // FFTW planning is not thread-safe, so only one picture at a
+            // time can be rendered.
+            Lock lock(&_outputMutex);
+            output.save(outputName);
+        }
+        output.saveRGBI(File(outputName + ".rgbi", true));
+
+        Lock lock(&_mutex);
+        ++_converted;
+        console.write(inputName + " -> " + outputName + "\n");
+    }
+    // Converts the inputs as frames of an animation. The frames depend on
+    // each other so they are matched one at a time, each using all the CPUs.
+    void convertSequence(ConfigFile* configFile)
+    {
+        File configFilePath(_configPath, true);
+        CGAData data;
+        CGASequencer sequencer;
+        CGAOutput output(&data, &sequencer, 0);
+        CGAMatcher matcher;
+        matcher.setProgram(this);
+        matcher.setData(&data);
+        matcher.setSequencer(&sequencer);
+        applyCGAArtConfig(configFile, &matcher, &output);
+        sequencer.setROM(File(configFile->get<String>("cgaROM"),
+            configFilePath.parent()));
+        matcher.setSequence(true,
+            configFile->get<double>("sequenceThreshold"));
+        Vector activeSize = configFile->get<Vector>("activeSize");
+
+        String outputName = Collect::stemOf(_inputs[0]) + "_sequence";
+        CGADataLog log(File(outputName + ".cgad", true),
+            configFile->get<bool>("sequenceAppend"));
+        for (int i = 0; i < _inputs.count(); ++i) {
+            if (!endsIn(_inputs[i], ".png"))
+                throw Exception(_inputs[i] + " is not a .png file.");
+            matcher.setInput(
+                PNGFileFormat<SRGB>().load(File(_inputs[i], true)),
+                activeSize);
+            matcher.restart();
+            matcher.join();
+            log.addFrame(&data);
+            console.write(_inputs[i] + "\n");
+        }
+        log.close();
+        console.write(decimal(log.frames()) + " frames written to " +
+            outputName + ".cgad.\n");
+    }
+    void reportError(String input, const Exception& e)
+    {
+        Lock lock(&_mutex);
+        console.write(input + ": " + e.message() + "\n");
+    }
+
+    // Called by the matcher. There is no window to update.
+    void updateOutput() { }
+    void setProgress(float progress) { }
+private:
+    String _configPath;
+    AppendableArray<String> _inputs;
+    int _nextInput;
+    int _converted;
+    int _matcherThreads;
+    Mutex _mutex;
+    Mutex _outputMutex;
+};
+
+void ConvertTask::run()
+{
+    String input;
+    while (!cancelling() && _program->nextInput(&input)) {
+        try {
+            _program->convert(input);
+        }
+        catch (const Exception& e) {
+            _program->reportError(input, e);
+        }
+    }
+}
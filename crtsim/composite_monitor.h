@@ -0,0 +1,547 @@
+#include "alfe/main.h"
+
+#ifndef INCLUDED_COMPOSITE_MONITOR_H
+#define INCLUDED_COMPOSITE_MONITOR_H
+
+#include <vector>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#include "alfe/pipes.h"
+
+typedef unsigned char Sample;  // Sync = 4, Blank = 60, Black = 70, White = 200
+
+// The signal processing part of a composite monitor: sync separation, color
+// burst detection, decoding and blooming. Each field is rendered into a
+// buffer of 0xffRRGGBB pixels (one pixel per sample, one row per scanline)
+// supplied by the frontend, which displays or saves it in fieldDone().
+//
+// Samples are processed in blocks of several scanlines, copied out of the
+// circular buffer so that the per-sample loops work on contiguous spans.
+class CompositeMonitor : public Sink<Sample>
+{
+public:
+    CompositeMonitor()
+      : Sink(1),
+        _phase(0),
+        _foundVerticalSync(false),
+        _fieldComplete(false),
+        _fields(0),
+        _samples(0),
+        _line(0),
+        _baseLoad(0.5),
+        _verticalSync(0),
+        _hysteresisCount(0),
+        _colorMode(false),
+        _dataData(0),
+        _dataPitch(0),
+
+        // TODO: make these user-settable
+        _brightness(0.06f),
+        _contrast(3.0f),
+        _saturation(0.7f),
+        _tint(18.0f),
+        _horizontalSize(0.95f),
+        _horizontalPosition(0),
+        _verticalSize(0.93f),
+        _verticalPosition(-0.01f),
+        _verticalHold(280),
+        _horizontalHold(25),
+        _bloomFactor(10.0f)
+    {
+        float samplesPerSecond = 157500000.0f/11.0f;
+        float us = samplesPerSecond/1000000.0f;  // samples per microsecond
+
+        // Horizontal times in samples.
+        float sync = 4.7f*us;
+        float breezeway = 0.6f*us;
+        _colorBurstStart = static_cast<int>(sync + breezeway);
+        float colorBurst = 2.5f*us;
+        float backPorch = 1.6f*us;
+        float frontPorch = 1.5f*us;
+        float blanking = sync + breezeway + colorBurst + backPorch + frontPorch;
+        float line = 910.0f;
+        _active = line - blanking;
+        _activeSamples = static_cast<int>(ceil(_active));
+        _preActive = blanking - frontPorch;
+        // The following parameter specifies how many samples early or late the
+        // horizontal sync pulse can be and still be recognized (assuming good
+        // signal fidelity). This sets the angle of the diagonal lines that
+        // vertical lines become when horizontal sync is lost.
+        _driftSamples = 8;
+        _minSamplesPerLine = static_cast<int>(line - _driftSamples);
+        _maxSamplesPerLine = static_cast<int>(line + _driftSamples);
+        // We won't be called to process until we have a block of scanlines.
+        _n = _maxSamplesPerLine*linesPerBlock;
+        _linePeriod = static_cast<int>(line);
+
+        // Vertical times in lines.
+        float preSyncLines = 3.0f;
+        float syncLines = 3.0f;
+        float postSyncLines = 14.0f;
+        float lines = 262.5f;
+        float blankingLines = preSyncLines + syncLines + postSyncLines;
+        float activeLines = lines - blankingLines;
+        _linesVisible = activeLines*_verticalSize;
+        _lineTop = postSyncLines + activeLines*(0.5f + _verticalPosition - _verticalSize/2.0f);
+        // The following parameter specifies how many lines early or late the
+        // vertical sync pulse can be and still be recognized (assuming good
+        // signal fidelity). This sets the "roll speed" of the picture when
+        // vertical sync is lost. Empirically determined from video of an IBM
+        // 5153 monitor.
+        _driftLines = 14;
+        _minLinesPerField = static_cast<int>(lines - _driftLines);
+        _maxLinesPerField = static_cast<int>(lines + _driftLines);
+
+        _lefts.resize(_maxLinesPerField);
+        _widths.resize(_maxLinesPerField);
+
+        for (int i = 0; i < 4; ++i)
+            _colorBurstPhase[i] = _lockedColorBurstPhase[i] = 0;
+
+        _crtLoad = _baseLoad;
+
+        // Room for the FIR filter history and for the last group of 8
+        // samples to overhang the end of the line.
+        int lineBuffer = 8 + _maxSamplesPerLine + 8;
+        _luma.resize(lineBuffer);
+        _chromaA.resize(lineBuffer);
+        _chromaB.resize(lineBuffer);
+        _levels.resize(3*lineBuffer);
+
+        int brightness = static_cast<int>(_brightness*100.0 - 7.5f*256.0f*_contrast)<<8;
+        int yContrast = static_cast<int>(_contrast*46816.0f);
+        for (int i = 0; i < 256; ++i) {
+            int gamma = static_cast<int>(pow(static_cast<float>(i)/255.0f, 1.9f)*255.0f);
+            _red[i] = 0xff000000 | (gamma<<16);
+            _green[i] = gamma<<8;
+            _blue[i] = gamma;
+        }
+        for (int i = 0; i < 256; ++i) {
+            int y = clamp(0, ((i - 60)*yContrast + brightness)>>16, 255);
+            _monochrome[i] = _red[y] | _green[y] | _blue[y];
+        }
+    }
+
+    // Returns the top row for a scanline, in an output image of the given
+    // height.
+    int topRow(int line, int height)
+    {
+        return static_cast<int>(
+            (static_cast<float>(line) - _verticalSyncPhase - _lineTop - 0.5f)*
+             static_cast<float>(height)/_linesVisible + 1.0f);
+    }
+
+    // Processes whole scanlines from the available samples, stopping early
+    // if a field is completed.
+    void consume(int n)
+    {
+        Accessor<Sample> reader = Sink::reader(n);
+        // The padding allows the decoding loops to overrun the last line.
+        if (static_cast<int>(_block.size()) < n + 16)
+            _block.resize(n + 16);
+        CopyTo<Sample> copy(&_block[0]);
+        reader.items(copy, 0, n);
+        const Sample* block = &_block[0];
+        int consumed = 0;
+        _fieldComplete = false;
+        while (n - consumed >= _maxSamplesPerLine && !_fieldComplete)
+            consumed += processLine(block + consumed);
+        read(consumed);
+        _samples += consumed;
+    }
+
+    // Pulls samples until a field has been rendered and passed to
+    // fieldDone(), or the input runs out.
+    void processField()
+    {
+        do {
+            consume(_n);
+        } while (!_fieldComplete && remaining() > 0);
+    }
+
+    int fields() const { return _fields; }
+    // Total number of samples processed.
+    UInt64 samples() const { return _samples; }
+
+protected:
+    // Called when a field is complete. The frontend can then change the
+    // field buffer.
+    virtual void fieldDone() = 0;
+
+    // Where the next field is rendered. Must be at least _maxSamplesPerLine
+    // pixels wide and _maxLinesPerField high.
+    void setFieldBuffer(Byte* data, int pitch)
+    {
+        _dataData = data;
+        _dataPitch = pitch;
+    }
+
+    int _minSamplesPerLine;
+    int _maxSamplesPerLine;
+    int _minLinesPerField;
+    int _maxLinesPerField;
+
+    float _linesVisible;
+    float _lineTop;
+    float _verticalSyncPhase;
+
+    std::vector<float> _lefts;    // First sample on each line
+    std::vector<float> _widths;   // How many samples visible on each line
+
+    int _topLine;
+    int _bottomLine;
+
+private:
+    static const int linesPerBlock = 32;
+
+    // Processes the scanline starting at "line", which has at least
+    // _maxSamplesPerLine samples. Returns the number of samples consumed.
+    int processLine(const Sample* line)
+    {
+        // Find the horizontal sync position.
+        int offset = 0;
+        for (int i = 0; i < _driftSamples*2; ++i, ++offset)
+            if (static_cast<int>(line[offset]) + static_cast<int>(line[offset + 1]) < _horizontalHold*2)
+                break;
+        // We use a phase-locked loop like real hardware does, in order to
+        // avoid losing horizontal sync if the pulse is missing for a line or
+        // two, and so that we get the correct "wobble" behavior.
+        int linePeriod = _maxSamplesPerLine - offset;
+        _linePeriod = (2*_linePeriod + linePeriod)/3;
+        _linePeriod = clamp(_minSamplesPerLine, _linePeriod, _maxSamplesPerLine);
+        offset = _maxSamplesPerLine - _linePeriod;
+
+        // Find the vertical sync position.
+        if (!_foundVerticalSync)
+            for (int j = 0; j < _maxSamplesPerLine; j += 57) {
+                _verticalSync = ((_verticalSync*232)>>8) + static_cast<int>(line[j]) - 60;
+                if (_verticalSync < -_verticalHold || _line == 2*_driftLines) {
+                    // To render interlaced signals correctly, we need to
+                    // figure out where the vertical sync pulse happens
+                    // relative to the horizontal pulse. This determines the
+                    // vertical position of the raster relative to the screen.
+                    _verticalSyncPhase = static_cast<float>(j)/static_cast<float>(_maxSamplesPerLine);
+                    // Now we can find out which scanlines are at the top and
+                    // bottom of the screen.
+                    _topLine = static_cast<int>(0.5f + _lineTop + _verticalSyncPhase);
+                    _bottomLine = static_cast<int>(1.5f + _linesVisible + _lineTop + _verticalSyncPhase);
+                    _line = 0;
+                    _foundVerticalSync = true;
+                    break;
+                }
+            }
+
+        // Determine the phase and strength of the color signal from the color
+        // burst, which starts shortly after the horizontal sync pulse ends.
+        // The color burst is 9 cycles long, and we look at the middle 5
+        // cycles.
+        accumulateColorBurst(line + (offset&~3) + _colorBurstStart + 8,
+            _colorBurstStart + 8 + _phase);
+        float total = 0.1f;
+        for (int i = 0; i < 4; ++i)
+            total += _colorBurstPhase[i]*_colorBurstPhase[i];
+        float colorBurstGain = 32.0f/sqrt(total);
+        int phaseCorrelation = (offset + _phase)&3;
+        float colorBurstI = colorBurstGain*(_colorBurstPhase[2] - _colorBurstPhase[0])/16.0f;
+        float colorBurstQ = colorBurstGain*(_colorBurstPhase[3] - _colorBurstPhase[1])/16.0f;
+        float hf = colorBurstGain*(_colorBurstPhase[0] - _colorBurstPhase[1] + _colorBurstPhase[2] - _colorBurstPhase[3]);
+        bool colorMode = (colorBurstI*colorBurstI + colorBurstQ*colorBurstQ) > 2.8 && hf < 16.0f;
+        if (colorMode)
+            for (int i = 0; i < 4; ++i)
+                _lockedColorBurstPhase[i] = _colorBurstPhase[i];
+        // Color killer hysteresis: We only switch between colour mode and
+        // monochrome mode if we stay in the new mode for 128 consecutive
+        // lines.
+        if (_colorMode != colorMode) {
+            _hysteresisCount++;
+            if (_hysteresisCount == 128) {
+                _colorMode = colorMode;
+                _hysteresisCount = 0;
+            }
+        }
+        else
+            _hysteresisCount = 0;
+
+        if (_foundVerticalSync && _line >= _topLine && _line < _bottomLine) {
+            int y = _line - _topLine;
+
+            // Lines with high amounts of brightness cause more load on the
+            // horizontal oscillator which decreases horizontal deflection,
+            // causing "blooming" (increase in width).
+            int totalSignal = sum(line + offset, _activeSamples) - 60*_activeSamples;
+            _crtLoad = 0.4f*_crtLoad + 0.6f*(_baseLoad + (totalSignal - 42000.0f)/140000.0f);
+            float bloom = clamp(-2.0f, _bloomFactor*_crtLoad, 10.0f);
+            float horizontalSize = (1.0f - 6.3f*bloom/_active)*_horizontalSize;
+            float samplesVisible = _active*horizontalSize;
+            float sampleLeft = _preActive + _active*(0.5f + _horizontalPosition - horizontalSize/2.0f);
+            _lefts[y] = sampleLeft;
+            _widths[y] = samplesVisible;
+
+            int start = max(static_cast<int>(sampleLeft) - 10, 0);
+            int end = min(static_cast<int>(sampleLeft + samplesVisible) + 10, _maxSamplesPerLine - offset);
+            DWord* destination = reinterpret_cast<DWord*>(_dataData + y*_dataPitch) + start;
+
+            if (_colorMode) {
+                float radians = static_cast<float>(tau)/360;
+                float tintI = -cos((103.0f + _tint)*radians);
+                float tintQ = sin((103.0f + _tint)*radians);
+                float colorBurstI = _lockedColorBurstPhase[(2 + phaseCorrelation)&3] - _lockedColorBurstPhase[(0 + phaseCorrelation)&3];
+                float colorBurstQ = _lockedColorBurstPhase[(3 + phaseCorrelation)&3] - _lockedColorBurstPhase[(1 + phaseCorrelation)&3];
+                int iMultiplier = static_cast<int>((colorBurstI*tintI - colorBurstQ*tintQ)*_saturation*_contrast*colorBurstGain*0.352f);
+                int qMultiplier = static_cast<int>((colorBurstQ*tintI + colorBurstI*tintQ)*_saturation*_contrast*colorBurstGain*0.352f);
+                decodeColor(line + offset + start, start, end - start,
+                    iMultiplier, qMultiplier, destination);
+            }
+            else {
+                const Sample* s = line + offset + start;
+                for (int x = 0; x < end - start; ++x)
+                    destination[x] = _monochrome[s[x]];
+            }
+        }
+        offset += _minSamplesPerLine;
+        _phase = (_phase + offset)&3;
+
+        ++_line;
+        if (_foundVerticalSync && _line == _minLinesPerField)
+            postField();
+        return offset;
+    }
+
+    // Accumulates the 20 color burst samples starting at "burst", the first
+    // of which has phase "phase". Each of the 4 phases is updated 5 times,
+    // so all 4 are updated at once.
+    void accumulateColorBurst(const Sample* burst, int phase)
+    {
+        static const float colorBurstFadeConstant = 1.0f/128.0f;
+        __m128 accumulator = _mm_setr_ps(
+            _colorBurstPhase[phase&3], _colorBurstPhase[(phase + 1)&3],
+            _colorBurstPhase[(phase + 2)&3], _colorBurstPhase[(phase + 3)&3]);
+        __m128 fade = _mm_set1_ps(1.0f - colorBurstFadeConstant);
+        __m128 scale = _mm_set1_ps(colorBurstFadeConstant);
+        __m128i blank = _mm_set1_epi32(60);
+        __m128i zero = _mm_setzero_si128();
+        for (int i = 0; i < 20; i += 4) {
+            __m128i s = _mm_cvtsi32_si128(
+                *reinterpret_cast<const int*>(burst + i));
+            s = _mm_unpacklo_epi16(_mm_unpacklo_epi8(s, zero), zero);
+            __m128 v = _mm_cvtepi32_ps(_mm_sub_epi32(s, blank));
+            accumulator = _mm_add_ps(_mm_mul_ps(accumulator, fade),
+                _mm_mul_ps(v, scale));
+        }
+        float a[4];
+        _mm_storeu_ps(a, accumulator);
+        for (int i = 0; i < 4; ++i)
+            _colorBurstPhase[(phase + i)&3] = a[i];
+    }
+
+    static int sum(const Sample* s, int n)
+    {
+        __m128i zero = _mm_setzero_si128();
+        __m128i total = zero;
+        int i;
+        for (i = 0; i + 16 <= n; i += 16) {
+            total = _mm_add_epi64(total, _mm_sad_epu8(_mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(s + i)), zero));
+        }
+        int t = _mm_cvtsi128_si32(total) +
+            _mm_cvtsi128_si32(_mm_srli_si128(total, 8));
+        for (; i < n; ++i)
+            t += s[i];
+        return t;
+    }
+
+    // 32-bit multiply (low half), which SSE2 doesn't have.
+    static __m128i multiply(__m128i a, __m128i b)
+    {
+        __m128i even = _mm_mul_epu32(a, b);
+        __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4),
+            _mm_srli_si128(b, 4));
+        return _mm_unpacklo_epi32(
+            _mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+    }
+
+    // The same 7-tap low-pass FIR filter is applied to the signal for luma
+    // and to the signal multiplied by the I and Q subcarriers for chroma. It
+    // removes high frequencies (including the color carrier frequency) -
+    // we could just keep a 4-sample running average but that leads to sharp
+    // edges in the resulting image. input[-6] to input[-1] are the history.
+    static __m128i lowPass(const Int16* input)
+    {
+        __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input - 6));
+        __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input - 5));
+        __m128i a2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input - 4));
+        __m128i a3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input - 3));
+        __m128i a4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input - 2));
+        __m128i a5 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input - 1));
+        __m128i a6 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input));
+        __m128i s24 = _mm_add_epi16(a2, a4);
+        return _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(a0, a6),
+            _mm_slli_epi16(_mm_add_epi16(a1, a5), 2)),
+            _mm_add_epi16(_mm_sub_epi16(_mm_slli_epi16(s24, 3), s24),
+            _mm_slli_epi16(a3, 3)));
+    }
+
+    // Decodes n samples starting at sample position x of the active line.
+    //
+    // The I and Q carrier multipliers for sample x are
+    // {iMultiplier, qMultiplier, -iMultiplier, -qMultiplier}[x&3] and
+    // {-qMultiplier, iMultiplier, qMultiplier, -iMultiplier}[x&3], so after
+    // filtering,
+    //   I = iMultiplier*A + qMultiplier*B
+    //   Q = iMultiplier*B - qMultiplier*A
+    // where A and B are the filtered signal multiplied by {1, 0, -1, 0} and
+    // {0, 1, 0, -1}. A and B fit in 16 bits, so the filtering is done 8
+    // samples at a time and then the YIQ to RGB matrix is folded into one
+    // multiplier per channel for each of Y, A and B.
+    void decodeColor(const Sample* input, int x, int n, int iMultiplier,
+        int qMultiplier, DWord* destination)
+    {
+        Int16* luma = &_luma[8];
+        Int16* chromaA = &_chromaA[8];
+        Int16* chromaB = &_chromaB[8];
+        for (int i = -6; i < 0; ++i)
+            luma[i] = chromaA[i] = chromaB[i] = 0;
+        static const Int16 carriers[12] =
+            {1, 0, -1, 0, 1, 0, -1, 0, 1, 0, -1, 0};
+        __m128i carrierA = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(carriers + (x&3)));
+        __m128i carrierB = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(carriers + ((x + 3)&3)));
+        __m128i blank = _mm_set1_epi16(60);
+        __m128i zero = _mm_setzero_si128();
+        for (int i = 0; i < n; i += 8) {
+            __m128i s = _mm_loadl_epi64(
+                reinterpret_cast<const __m128i*>(input + i));
+            s = _mm_sub_epi16(_mm_unpacklo_epi8(s, zero), blank);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(luma + i), s);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(chromaA + i),
+                _mm_mullo_epi16(s, carrierA));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(chromaB + i),
+                _mm_mullo_epi16(s, carrierB));
+        }
+
+        int yContrast = static_cast<int>(_contrast*1463.0f);
+        int brightness = static_cast<int>(_brightness*100.0 - 7.5f*256.0f*_contrast)<<8;
+        int im = iMultiplier;
+        int qm = qMultiplier;
+        __m128i yy = _mm_set1_epi32(yContrast);
+        __m128i bb = _mm_set1_epi32(brightness);
+        __m128i ra = _mm_set1_epi32(243*im - 160*qm);
+        __m128i rb = _mm_set1_epi32(243*qm + 160*im);
+        __m128i ga = _mm_set1_epi32(-71*im + 164*qm);
+        __m128i gb = _mm_set1_epi32(-71*qm - 164*im);
+        __m128i ba = _mm_set1_epi32(-283*im - 443*qm);
+        __m128i bbb = _mm_set1_epi32(-283*qm + 443*im);
+        Byte* levels = &_levels[0];
+        int stride = static_cast<int>(_levels.size())/3;
+        for (int i = 0; i < n; i += 8) {
+            __m128i y16 = lowPass(luma + i);
+            __m128i a16 = lowPass(chromaA + i);
+            __m128i b16 = lowPass(chromaB + i);
+            __m128i r[2], g[2], b[2];
+            for (int h = 0; h < 2; ++h) {
+                // Sign-extend 4 of the 16-bit values to 32 bits.
+                __m128i y = _mm_srai_epi32(h == 0 ?
+                    _mm_unpacklo_epi16(y16, y16) :
+                    _mm_unpackhi_epi16(y16, y16), 16);
+                __m128i a = _mm_srai_epi32(h == 0 ?
+                    _mm_unpacklo_epi16(a16, a16) :
+                    _mm_unpackhi_epi16(a16, a16), 16);
+                __m128i c = _mm_srai_epi32(h == 0 ?
+                    _mm_unpacklo_epi16(b16, b16) :
+                    _mm_unpackhi_epi16(b16, b16), 16);
+                y = _mm_add_epi32(multiply(y, yy), bb);
+                r[h] = _mm_srai_epi32(_mm_add_epi32(y, _mm_add_epi32(
+                    multiply(a, ra), multiply(c, rb))), 16);
+                g[h] = _mm_srai_epi32(_mm_add_epi32(y, _mm_add_epi32(
+                    multiply(a, ga), multiply(c, gb))), 16);
+                b[h] = _mm_srai_epi32(_mm_add_epi32(y, _mm_add_epi32(
+                    multiply(a, ba), multiply(c, bbb))), 16);
+            }
+            // Saturating packs clamp to 0..255.
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(levels + i),
+                _mm_packus_epi16(_mm_packs_epi32(r[0], r[1]), zero));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(levels + stride + i),
+                _mm_packus_epi16(_mm_packs_epi32(g[0], g[1]), zero));
+            _mm_storel_epi64(
+                reinterpret_cast<__m128i*>(levels + 2*stride + i),
+                _mm_packus_epi16(_mm_packs_epi32(b[0], b[1]), zero));
+        }
+        for (int i = 0; i < n; ++i) {
+            destination[i] = _red[levels[i]] | _green[levels[stride + i]] |
+                _blue[levels[2*stride + i]];
+        }
+    }
+
+    void postField()
+    {
+        fieldDone();
+        ++_fields;
+        _fieldComplete = true;
+
+        _line = 0;
+        _foundVerticalSync = false;
+        _crtLoad = _baseLoad;
+        _verticalSync = 0;
+    }
+
+    Byte* _dataData;
+    int _dataPitch;
+
+    float _brightness;
+    float _contrast;
+    float _saturation;
+    float _tint;
+    float _horizontalSize;
+    float _horizontalPosition;
+    float _verticalSize;
+    float _verticalPosition;
+    int _verticalHold;
+    int _horizontalHold;
+    float _bloomFactor;
+
+    int _driftLines;
+    int _driftSamples;
+    float _active;
+    int _activeSamples;
+    float _preActive;
+    int _colorBurstStart;
+
+    float _baseLoad;
+    float _crtLoad;
+
+    float _colorBurstPhase[4];
+    float _lockedColorBurstPhase[4];
+
+    int _phase;
+
+    int _line;
+    bool _foundVerticalSync;
+    bool _fieldComplete;
+    int _fields;
+    UInt64 _samples;
+    int _verticalSync;
+
+    std::vector<Sample> _block;
+    std::vector<Int16> _luma;
+    std::vector<Int16> _chromaA;
+    std::vector<Int16> _chromaB;
+    std::vector<Byte> _levels;
+
+    // Gamma-corrected channels, ready to be ORed together.
+    DWord _red[256];
+    DWord _green[256];
+    DWord _blue[256];
+    DWord _monochrome[256];
+
+    int _linePeriod;
+
+    int _hysteresisCount;
+    bool _colorMode;
+};
+
+#endif // INCLUDED_COMPOSITE_MONITOR_H
@@ -0,0 +1,181 @@
+#include "alfe/main.h"
+#include "alfe/evaluate.h"
+#include "alfe/bitmap_png.h"
+#include "alfe/thread.h"
+#include "alfe/timer.h"
+#include "composite_monitor.h"
+
+// Command-line renderer: runs a .ntsc file through the monitor simulation
+// once, from start to finish, without creating any windows, and reports the
+// throughput. Each field is scaled to a 640x480 frame (as the Direct3D
+// frontend would draw it in a window of that size, without the shadow mask
+// and scanline overlays) which is then saved while the next field is
+// processed.
+//
+// This program, and the simulation itself (composite_monitor.h, which is an
+// alfe pipe), are built on alfe/main.h and the alfe file, thread and pipe
+// classes. Those are still Win32-only, so for now it has to be built with the
+// Windows toolchain.
+
+static const int frameWidth = 640;
+static const int frameHeight = 480;
+
+// Writes a frame either to a numbered .png file or appended to a raw
+// 0xffRRGGBB stream.
+class WriteTask : public Task
+{
+public:
+    WriteTask() : _failed(false) { }
+    void setOutput(String outputName)
+    {
+        int l = outputName.length() - 4;
+        _png = l >= 0 && outputName.subString(l, 4) == ".png";
+        if (_png)
+            _stem = outputName.subString(0, l);
+        else
+            _stream = File(outputName, true).openWrite();
+    }
+    void write(Bitmap<DWORD> frame, int field)
+    {
+        finish();
+        _frame = frame;
+        _field = field;
+        restart();
+    }
+    void finish()
+    {
+        join();
+        if (_failed)
+            throw _exception;
+    }
+private:
+    void run()
+    {
+        try {
+            if (_png) {
+                PNGFileFormat<DWORD>().save(_frame,
+                    File(_stem + format("%06i", _field) + ".png", true));
+                return;
+            }
+            for (int y = 0; y < frameHeight; ++y)
+                _stream.write(_frame.row(y), frameWidth*sizeof(DWORD));
+        }
+        catch (const Exception& e) {
+            _exception = e;
+            _failed = true;
+        }
+    }
+
+    bool _png;
+    String _stem;
+    AutoStream _stream;
+    Bitmap<DWORD> _frame;
+    int _field;
+    bool _failed;
+    Exception _exception;
+};
+
+class HeadlessCompositeMonitor : public CompositeMonitor
+{
+public:
+    HeadlessCompositeMonitor() : _writer(0)
+    {
+        _field = Bitmap<DWORD>(Vector(_maxSamplesPerLine, _maxLinesPerField));
+        setFieldBuffer(_field.data(), _field.stride());
+        for (int i = 0; i < 2; ++i)
+            _frames[i] = Bitmap<DWORD>(Vector(frameWidth, frameHeight));
+    }
+    // With no writer the frames are still scaled but then discarded.
+    void setWriter(WriteTask* writer) { _writer = writer; }
+private:
+    void fieldDone()
+    {
+        // The writer may still have the other frame.
+        Bitmap<DWORD> frame = _frames[fields() & 1];
+        frame.fill(0);
+        for (int line = _topLine; line < _bottomLine; ++line) {
+            int top = max(topRow(line, frameHeight), 0);
+            int bottom = min(topRow(line + 1, frameHeight), frameHeight);
+            if (top >= bottom)
+                continue;
+            int y = line - _topLine;
+            scaleLine(_field.row(y), _lefts[y], _widths[y], frame.row(top));
+            for (int row = top + 1; row < bottom; ++row) {
+                memcpy(frame.row(row), frame.row(top),
+                    frameWidth*sizeof(DWORD));
+            }
+        }
+        if (_writer != 0)
+            _writer->write(frame, fields());
+    }
+    // Linearly interpolates the visible part of a scanline (width samples
+    // starting at left) to the width of the frame, like the texture sampler
+    // does.
+    static void scaleLine(const DWORD* input, float left, float width,
+        DWORD* output)
+    {
+        float step = width/frameWidth;
+        float p = left + 0.5f*step - 0.5f;
+        for (int x = 0; x < frameWidth; ++x, p += step) {
+            int i = static_cast<int>(p);
+            int f = static_cast<int>((p - i)*256.0f);
+            DWORD a = input[i];
+            DWORD b = input[i + 1];
+            DWORD rb = ((a & 0xff00ff)*(256 - f) + (b & 0xff00ff)*f) >> 8;
+            DWORD g = ((a & 0xff00)*(256 - f) + (b & 0xff00)*f) >> 8;
+            output[x] = 0xff000000 | (rb & 0xff00ff) | (g & 0xff00);
+        }
+    }
+
+    Bitmap<DWORD> _field;
+    Bitmap<DWORD> _frames[2];
+    WriteTask* _writer;
+};
+
+class Program : public ProgramBase
+{
+public:
+    void run()
+    {
+        if (_arguments.count() < 2) {
+            console.write("Syntax: " + _arguments[0] +
+                " <input file name> [<output file name> [<fields>]]\n"
+                "If the output file name ends in .png, each field is saved "
+                "as a separate .png\nfile with the field number appended to "
+                "the name. Otherwise the output is raw\n"
+                "32-bit 0xffRRGGBB, " + decimal(frameWidth) + "x" +
+                decimal(frameHeight) + " per field. With no output file "
+                "name the fields are\nrendered and discarded, to measure the "
+                "speed of the simulation.\n");
+            return;
+        }
+        File input(_arguments[1], true);
+        FileSource<Sample> source(input);
+        HeadlessCompositeMonitor monitor;
+        source.connect(&monitor);
+
+        ThreadPool ioPool(1);
+        WriteTask writer;
+        writer.setPool(&ioPool);
+        if (_arguments.count() >= 3) {
+            writer.setOutput(_arguments[2]);
+            monitor.setWriter(&writer);
+        }
+        int fields = 0x7fffffff;
+        if (_arguments.count() >= 4)
+            fields = evaluate<int>(_arguments[3]);
+
+        Timer timer;
+        while (monitor.fields() < fields && monitor.remaining() > 0)
+            monitor.processField();
+        writer.finish();
+        double seconds = timer.seconds();
+
+        double samples = static_cast<double>(monitor.samples());
+        console.write(decimal(monitor.fields()) + " fields rendered in " +
+            format("%.3f", seconds) + " seconds: " +
+            format("%.1f", monitor.fields()/seconds) + " fields/s, " +
+            format("%.2f", samples/(seconds*1000000.0)) +
+            " Msamples/s.\n");
+    }
+};
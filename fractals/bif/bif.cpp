@@ -2,6 +2,7 @@
 #include "alfe/fractal.h"
 #include "alfe/main.h"
 #include <vector>
+#include <emmintrin.h>
 
 class Pixel
 {
@@ -13,31 +14,169 @@ public:
         return 255 - static_cast<int>(255.0f*exp(hits/exposure));
     }
     int getHits() const { return hits; }
-    void increment() { ++hits; }
+    void add(int n) { hits += n; }
 private:
     int hits;
 };
 
+// Iterates the logistic map for a strip of columns. Each SSE vector holds
+// four adjacent columns. Hits are counted in the task's own column-major
+// histogram. In that layout a column's increments stay within a few
+// kilobytes, and no other thread writes there. The histogram is added to the
+// shared pixels every so often.
+class BifTask : public Task
+{
+public:
+    static const int lanes = 4;
+
+    BifTask()
+      : _region(Vector2<double>(0, 0), Vector2<double>(1, 1),
+            Vector2<int>(0, 0)),
+        _width(0),
+        _columns(0)
+    { }
+
+    void setStrip(Region region, int x0, int columns)
+    {
+        _region = region;
+        _x0 = x0;
+        // The last strip is padded to whole vectors, but only the columns
+        // that are on the image are counted.
+        _width = min(columns, region.getSize().x - x0);
+        _columns = (columns + lanes - 1) & -lanes;
+        _height = region.getSize().y;
+        _y.assign(_columns, 0.6f);
+        _hits.assign(_width*_height, 0);
+    }
+
+    // Starts a pass. If pixels isn't null the pass just adds the hits since
+    // the last merge to it.
+    void start(float offset, std::vector<Pixel>* pixels)
+    {
+        _offset = offset;
+        _pixels = pixels;
+        _newPixels = 0;
+        _newHits = 0;
+        restart();
+    }
+
+    // Pixels that got their first hit, and hits merged, in the last pass.
+    int newPixels() const { return _newPixels; }
+    Int64 newHits() const { return _newHits; }
+
+private:
+    void run()
+    {
+        if (_pixels != 0)
+            merge();
+        else
+            for (int x = 0; x < _columns; x += lanes)
+                iterate(x);
+    }
+
+    void iterate(int x)
+    {
+        float cx[lanes];
+        for (int i = 0; i < lanes; ++i) {
+            cx[i] = static_cast<float>(
+                _region.cxFromSx(_x0 + x + i + _offset));
+        }
+        __m128 c = _mm_loadu_ps(cx);
+        __m128 y = _mm_loadu_ps(&_y[x]);
+        __m128 one = _mm_set1_ps(1.0f);
+        for (int i = 0; i < 100; ++i)
+            y = _mm_mul_ps(_mm_mul_ps(c, y), _mm_sub_ps(one, y));
+
+        // The same mapping as Region::syFromCy().
+        Vector2<double> min = _region.getMin();
+        __m128 minY = _mm_set1_ps(static_cast<float>(min.y));
+        __m128 scale = _mm_set1_ps(static_cast<float>(
+            _height/(_region.getMax().y - min.y)));
+        int* hits = &_hits[x*_height];
+        int count = _width - x;
+        if (count > lanes)
+            count = lanes;
+        int ys[lanes];
+        for (int i = 0; i < 1000; ++i) {
+            y = _mm_mul_ps(_mm_mul_ps(c, y), _mm_sub_ps(one, y));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(ys),
+                _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(y, minY), scale)));
+            for (int j = 0; j < count; ++j)
+                if (static_cast<unsigned>(ys[j]) <
+                    static_cast<unsigned>(_height))
+                    ++hits[j*_height + ys[j]];
+        }
+
+        float yy[lanes];
+        _mm_storeu_ps(yy, y);
+        for (int i = 0; i < lanes; ++i) {
+            float v = yy[i];
+            if (v > 10 || v < -10 || (v > -1e-20 && v < 1e-20) || v != v)
+                v = 0.6f;
+            _y[x + i] = v;
+        }
+    }
+
+    void merge()
+    {
+        int width = _region.getSize().x;
+        for (int x = 0; x < _width; ++x) {
+            int* hits = &_hits[x*_height];
+            Pixel* p = &(*_pixels)[_x0 + x];
+            for (int y = 0; y < _height; ++y) {
+                int h = hits[y];
+                if (h != 0) {
+                    if (p->getHits() == 0)
+                        ++_newPixels;
+                    p->add(h);
+                    _newHits += h;
+                    hits[y] = 0;
+                }
+                p += width;
+            }
+        }
+    }
+
+    Region _region;
+    int _x0;
+    int _width;
+    int _columns;
+    int _height;
+    float _offset;
+    std::vector<float> _y;
+    std::vector<int> _hits;
+    std::vector<Pixel>* _pixels;
+    int _newPixels;
+    Int64 _newHits;
+};
+
 class BifCalcThread : public CalcThread
 {
 public:
-    BifCalcThread(Region region) : CalcThread(region) { initialize(); }
+    BifCalcThread(Region region)
+      : CalcThread(region), _tasks(_pool.threads())
+    {
+        for (auto& t : _tasks) {
+            t = new BifTask;
+            t->setPool(&_pool);
+        }
+        initialize();
+    }
+    ~BifCalcThread()
+    {
+        for (auto t : _tasks)
+            delete t;
+    }
 
     void draw(Byte* buffer, int byteWidth)
     {
         if (_region.pixels() == 0)
             return;
 
-        int n = 0;
-        float exposure = 0;
-        for (auto pp : pixels) {
-            int hits = pp.getHits();
-            if (hits > 0) {
-                ++n;
-                exposure -= hits;
-            }
-        }
-        exposure /= n;
+        // The mean number of hits of the pixels that have been hit, kept up
+        // to date as the tasks merge instead of rescanning the pixels.
+        int n = _litPixels;
+        float exposure = n == 0 ? -1.0f : static_cast<float>(-_hits/n);
 
         auto pp = pixels.begin();
         for (int ys = 0; ys < _region.getSize().y; ++ys) {
@@ -55,39 +194,67 @@ public:
     }
 
 private:
+    // Each pass iterates 1000 times per column, so this makes the picture
+    // lag the calculation by a few milliseconds at most.
+    static const int passesPerMerge = 8;
+
     void calculate()
     {
         offset += e;
         if (offset >= 1.0)
             offset -= 1.0;
-        float y = 0.6f;
-        for (int xs = _region.getSize().x - 1; xs >= 0; --xs) {
-            float x = static_cast<float>(_region.cxFromSx(xs + offset));
-            for (int i = 0; i < 100; ++i)
-                y = x*y*(1.0f - y);
-            for (int i = 0; i < 1000; ++i) {
-                y = x*y*(1.0f - y);
-                int ys = _region.syFromCy(y);
-                if (ys >= 0 && ys < _region.getSize().y)
-                    pixels[ys*_region.getSize().x + xs].increment();
+        runTasks(0);
+        if (++_passes % passesPerMerge == 0) {
+            runTasks(&pixels);
+            int n = 0;
+            Int64 hits = 0;
+            for (auto t : _tasks) {
+                n += t->newPixels();
+                hits += t->newHits();
             }
-            if (y > 10 || y < -10 || (y > -1e-20 && y < 1e-20))
-                y = 0.6f;
+            _litPixels += n;
+            _hits += hits;
         }
     }
 
+    void runTasks(std::vector<Pixel>* merge)
+    {
+        for (auto t : _tasks)
+            t->start(offset, merge);
+        for (auto t : _tasks)
+            t->join();
+    }
+
     void restart()
     {
         pixels.resize(_region.pixels());
-        for (auto pp : pixels)
+        for (auto& pp : pixels)
             pp.reset();
         offset = 0;
         e = exp(1.0f) - 2; // Any old irrational number will do here
+        _passes = 0;
+        _litPixels = 0;
+        _hits = 0;
+
+        // Strips are whole SSE vectors wide.
+        int width = _region.getSize().x;
+        int n = static_cast<int>(_tasks.size());
+        int groups = (width + BifTask::lanes - 1)/BifTask::lanes;
+        for (int i = 0; i < n; ++i) {
+            int x0 = groups*i/n*BifTask::lanes;
+            int x1 = groups*(i + 1)/n*BifTask::lanes;
+            _tasks[i]->setStrip(_region, x0, x1 - x0);
+        }
     }
 
     std::vector<Pixel> pixels;
     float offset;
     float e;
+    int _passes;
+    volatile int _litPixels;
+    volatile double _hits;
+    ThreadPool _pool;
+    std::vector<BifTask*> _tasks;
 };
 
 class Program : public ProgramBase
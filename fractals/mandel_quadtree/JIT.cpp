@@ -1,27 +1,62 @@
-#include "alfe/def.h"
+// Support for generating machine code at runtime. Included by
+// mandel_quadtree.cpp.
+
+#ifdef _MSC_VER
 #include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <vector>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
-class JIT
+// Memory for generated code. It's writable until finalize() and only
+// executable after that, never both at once (W^X).
+class JIT : Uncopyable
 {
 public:
-    JIT() : _memory(0) { }
-    ~JIT() { if (_memory != 0) VirtualFree(_memory, 0, MEM_RELEASE); }
+    JIT() : _memory(0), _size(0) { }
+    ~JIT()
+    {
+        if (_memory == 0)
+            return;
+#ifdef _WIN32
+        VirtualFree(_memory, 0, MEM_RELEASE);
+#else
+        munmap(_memory, _size);
+#endif
+    }
 
     void allocate(int size)
     {
         _size = size;
+#ifdef _WIN32
         _memory = reinterpret_cast<Byte*>(VirtualAlloc(NULL, _size,
             MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+        IF_NULL_THROW(_memory);
+#else
+        void* memory = mmap(NULL, _size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            throw Exception::systemError("Allocating JIT memory");
+        _memory = reinterpret_cast<Byte*>(memory);
+#endif
     }
 
     Byte* memory() { return _memory; }
 
     void finalize()
     {
-        IF_ZERO_THROW_LAST_ERROR(VirtualProtect(_memory, _size,
-            PAGE_EXECUTE_READ));
-        IF_ZERO_THROW_LAST_ERROR(FlushInstructionCache(GetCurrentProcess(),
-            _memory, _size));
+#ifdef _WIN32
+        DWORD oldProtect;
+        IF_ZERO_THROW(VirtualProtect(_memory, _size, PAGE_EXECUTE_READ,
+            &oldProtect));
+        IF_ZERO_THROW(FlushInstructionCache(GetCurrentProcess(), _memory,
+            _size));
+#else
+        IF_MINUS_ONE_THROW(mprotect(_memory, _size, PROT_READ | PROT_EXEC));
+#endif
     }
 
     void execute(void* context)
@@ -43,20 +78,20 @@ public:
     {
         int info[4];
 
-        __cpuid(info, 0);
+        cpuid(info, 0);
         int c = info[0] + 1;
         _info.resize(c * 4);
         for (int i = 0; i < c; ++i) {
-            __cpuid(info, i);
+            cpuid(info, i);
             for (int j = 0; j < 4; ++j)
                 _info[i*4 + j] = info[j];
         }
 
-        __cpuid(info, 0x80000000);
-        c = info[0];
+        cpuid(info, 0x80000000);
+        c = (info[0] & 0x7fffffff) + 1;
         _extendedInfo.resize(c * 4);
         for (int i = 0; i < c; ++i) {
-            __cpuid(info, 0x80000000 | i);
+            cpuid(info, 0x80000000 | i);
             for (int j = 0; j < 4; ++j)
                 _extendedInfo[i*4 + j] = info[j];
         }
@@ -69,10 +104,28 @@ public:
         _ssse3 = boolValue(_info[2], 9);
         _sse41 = boolValue(_info[2], 19);
         _sse42 = boolValue(_info[2], 20);
-        _avx = boolValue(info[2], 28);
+        _avx = boolValue(_info[2], 28);
+        bool leaf7 = _info.size() > 7*4;
+        _bmi2 = leaf7 && boolValue(_info[7*4 + 1], 8);
+        _adx = leaf7 && boolValue(_info[7*4 + 1], 19);
     }
 
+    bool sse2() const { return _sse2; }
+    bool avx() const { return _avx; }
+    bool bmi2() const { return _bmi2; }
+    bool adx() const { return _adx; }
+
 private:
+    static void cpuid(int info[4], unsigned int leaf)
+    {
+#ifdef _MSC_VER
+        __cpuidex(info, static_cast<int>(leaf), 0);
+#else
+        unsigned int* r = reinterpret_cast<unsigned int*>(info);
+        __cpuid_count(leaf, 0, r[0], r[1], r[2], r[3]);
+#endif
+    }
+
     int intValue(int value, int lowBit, int highBit)
     {
         return (value >> lowBit) & ((1 << (highBit + 1 - lowBit)) - 1);
@@ -87,4 +140,255 @@ private:
     std::vector<int> _extendedInfo;
 
     bool _x87, _mmx, _sse, _sse2, _sse3, _ssse3, _sse41, _sse42, _avx;
-};
\ No newline at end of file
+    bool _bmi2, _adx;
+};
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define X64_JIT
+
+// Just enough of an x64 assembler for the code we generate. Memory operands
+// are always [base + disp32]. Jumps and calls are to labels within the same
+// code, so the result can be copied anywhere.
+class X64Assembler
+{
+public:
+    enum Register { rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi,
+        r8, r9, r10, r11, r12, r13, r14, r15 };
+    enum Condition { below = 2, aboveOrEqual, equal, notEqual, belowOrEqual,
+        above, sign, notSign, less = 0xc, greaterOrEqual, lessOrEqual,
+        greater };
+    typedef int Label;
+
+    Label label()
+    {
+        _labels.push_back(-1);
+        return static_cast<int>(_labels.size()) - 1;
+    }
+    void bind(Label l) { _labels[l] = offset(); }
+
+    // reg <- [base + disp] and [base + disp] <- reg
+    void load32(Register r, Register base, int disp)
+    {
+        memory(false, 0x8b, r, base, disp);
+    }
+    void load64(Register r, Register base, int disp)
+    {
+        memory(true, 0x8b, r, base, disp);
+    }
+    void store32(Register base, int disp, Register r)
+    {
+        memory(false, 0x89, r, base, disp);
+    }
+    void store64(Register base, int disp, Register r)
+    {
+        memory(true, 0x89, r, base, disp);
+    }
+    void lea(Register r, Register base, int disp)
+    {
+        memory(true, 0x8d, r, base, disp);
+    }
+    // reg op= [base + disp]
+    void add32(Register r, Register base, int disp)
+    {
+        memory(false, 0x03, r, base, disp);
+    }
+    void adc32(Register r, Register base, int disp)
+    {
+        memory(false, 0x13, r, base, disp);
+    }
+    void sub32(Register r, Register base, int disp)
+    {
+        memory(false, 0x2b, r, base, disp);
+    }
+    void sbb32(Register r, Register base, int disp)
+    {
+        memory(false, 0x1b, r, base, disp);
+    }
+    void cmp32(Register r, Register base, int disp)
+    {
+        memory(false, 0x3b, r, base, disp);
+    }
+    // [base + disp] op= imm8
+    void addImmediate32(Register base, int disp, int i)
+    {
+        memory(false, 0x83, 0, base, disp);
+        byte(i);
+    }
+    void adcImmediate32(Register base, int disp, int i)
+    {
+        memory(false, 0x83, 2, base, disp);
+        byte(i);
+    }
+    void storeImmediate32(Register base, int disp, int i)
+    {
+        memory(false, 0xc7, 0, base, disp);
+        dword(i);
+    }
+    void not32(Register base, int disp) { memory(false, 0xf7, 2, base, disp); }
+    // CF = bit of [base + disp]
+    void bt32(Register base, int disp, int bit)
+    {
+        rex(false, 0, base);
+        byte(0x0f);
+        byte(0xba);
+        modRM(4, base, disp);
+        byte(bit);
+    }
+    // rdx:rax = rax*[base + disp]
+    void mul64(Register base, int disp) { memory(true, 0xf7, 4, base, disp); }
+    // high:low = rdx*[base + disp] (BMI2)
+    void mulx64(Register high, Register low, Register base, int disp)
+    {
+        byte(0xc4);
+        byte(((high & 8) != 0 ? 0 : 0x80) | 0x40 |
+            ((base & 8) != 0 ? 0 : 0x20) | 2);
+        byte(0x80 | ((~low & 0xf) << 3) | 3);
+        byte(0xf6);
+        modRM(high, base, disp);
+    }
+
+    // Register to register.
+    void mov32(Register d, Register s) { registers(false, 0x89, s, d); }
+    void mov64(Register d, Register s) { registers(true, 0x89, s, d); }
+    void add64(Register d, Register s) { registers(true, 0x01, s, d); }
+    void adc64(Register d, Register s) { registers(true, 0x11, s, d); }
+    void xor32(Register d, Register s) { registers(false, 0x31, s, d); }
+    void test32(Register d, Register s) { registers(false, 0x85, s, d); }
+    void imul64(Register d, Register s)
+    {
+        rex(true, d, s);
+        byte(0x0f);
+        byte(0xaf);
+        byte(0xc0 | ((d & 7) << 3) | (s & 7));
+    }
+    void shrd64(Register d, Register s, int count)
+    {
+        rex(true, s, d);
+        byte(0x0f);
+        byte(0xac);
+        byte(0xc0 | ((s & 7) << 3) | (d & 7));
+        byte(count);
+    }
+    void not32(Register d) { registers(false, 0xf7, 2, d); }
+    void neg32(Register d) { registers(false, 0xf7, 3, d); }
+    void addImmediate32(Register d, int i)
+    {
+        registers(false, 0x83, 0, d);
+        byte(i);
+    }
+    void adcImmediate64(Register d, int i)
+    {
+        registers(true, 0x83, 2, d);
+        byte(i);
+    }
+    void shr64(Register d, int count)
+    {
+        registers(true, 0xc1, 5, d);
+        byte(count);
+    }
+    void sar32(Register d, int count)
+    {
+        registers(false, 0xc1, 7, d);
+        byte(count);
+    }
+
+    void push(Register r)
+    {
+        if (r >= r8)
+            byte(0x41);
+        byte(0x50 + (r & 7));
+    }
+    void pop(Register r)
+    {
+        if (r >= r8)
+            byte(0x41);
+        byte(0x58 + (r & 7));
+    }
+    void jump(Condition c, Label l)
+    {
+        byte(0x0f);
+        byte(0x80 + c);
+        fixup(l);
+    }
+    void jump(Label l)
+    {
+        byte(0xe9);
+        fixup(l);
+    }
+    void call(Label l)
+    {
+        byte(0xe8);
+        fixup(l);
+    }
+    void ret() { byte(0xc3); }
+
+    int offset() const { return static_cast<int>(_code.size()); }
+
+    // Resolves the labels and copies the code into jit.
+    void assemble(JIT* jit)
+    {
+        for (size_t i = 0; i < _fixups.size(); ++i) {
+            int at = _fixups[i]._offset;
+            int target = _labels[_fixups[i]._label];
+            int relative = target - (at + 4);
+            for (int j = 0; j < 4; ++j)
+                _code[at + j] = static_cast<Byte>(relative >> (j*8));
+        }
+        jit->allocate(offset());
+        memcpy(jit->memory(), &_code[0], offset());
+        jit->finalize();
+    }
+
+private:
+    struct Fixup
+    {
+        int _offset;
+        Label _label;
+    };
+
+    void byte(int b) { _code.push_back(static_cast<Byte>(b)); }
+    void dword(int d)
+    {
+        for (int i = 0; i < 4; ++i)
+            byte(d >> (i*8));
+    }
+    void rex(bool w, int reg, int base)
+    {
+        int r = (w ? 8 : 0) | ((reg & 8) != 0 ? 4 : 0) |
+            ((base & 8) != 0 ? 1 : 0);
+        if (r != 0)
+            byte(0x40 | r);
+    }
+    void modRM(int reg, Register base, int disp)
+    {
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == rsp)
+            byte(0x24);
+        dword(disp);
+    }
+    void memory(bool w, int opcode, int reg, Register base, int disp)
+    {
+        rex(w, reg, base);
+        byte(opcode);
+        modRM(reg, base, disp);
+    }
+    void registers(bool w, int opcode, int reg, Register rm)
+    {
+        rex(w, reg, rm);
+        byte(opcode);
+        byte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+    }
+    void fixup(Label l)
+    {
+        Fixup f;
+        f._offset = offset();
+        f._label = l;
+        _fixups.push_back(f);
+        dword(0);
+    }
+
+    std::vector<Byte> _code;
+    std::vector<int> _labels;
+    std::vector<Fixup> _fixups;
+};
+#endif
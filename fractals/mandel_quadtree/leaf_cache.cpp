@@ -0,0 +1,180 @@
+// A persistent cache of the colours of completed points. Included by
+// mandel_quadtree.cpp.
+//
+// The colour of a point depends only on c (and on the precision it was
+// evaluated at, which determines the rounding), not on where the point is in
+// the matrix, so the key is a hash of those. That means a point is found
+// again wherever the matrix has moved to since it was evaluated, and in later
+// runs.
+//
+// The cache is a memory-mapped file holding a set-associative hash table:
+// each key can only be in one of the waysPerSet entries of the set that its
+// hash selects, and when the set is full the least recently used entry is
+// replaced. So the file never grows and a lookup touches a single cache line.
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+class LeafCache : Uncopyable
+{
+public:
+    // 4M entries: a 64Mb file.
+    static const int defaultSets = 0x100000;
+    // 64M entries: a 1Gb file. A header asking for more is treated as
+    // corrupt.
+    static const int maximumSets = 0x1000000;
+
+    LeafCache() : _header(0), _entries(0), _bytes(0) { }
+    ~LeafCache() { close(); }
+
+    // Opens the cache file, creating it if it doesn't exist or isn't a cache
+    // file. An existing cache keeps its size.
+    void open(const File& file, int sets = defaultSets)
+    {
+        close();
+        FileStream f = file.openReadWrite();
+        UInt64 size = f.size();
+        if (size >= sizeof(Header)) {
+            map(&f, sizeof(Header));
+            Header header = *_header;
+            close();
+            size_t bytes = bytesForSets(header._sets);
+            if (header._magic == magic && header._version == version &&
+                header._sets > 0 && header._sets <= maximumSets &&
+                size >= bytes) {
+                map(&f, bytes);
+                _sets = header._sets;
+                return;
+            }
+        }
+        map(&f, bytesForSets(sets));
+        memset(_header, 0, _bytes);
+        _header->_magic = magic;
+        _header->_version = version;
+        _header->_sets = sets;
+        _sets = sets;
+    }
+
+    void close()
+    {
+        if (_header == 0)
+            return;
+#ifdef _WIN32
+        UnmapViewOfFile(_header);
+#else
+        munmap(_header, _bytes);
+#endif
+        _header = 0;
+        _entries = 0;
+    }
+
+    bool valid() const { return _header != 0; }
+
+    // The key for the point c = x + iy. Never 0, which marks an empty entry.
+    static UInt64 key(const Digit* x, const Digit* y, int precision)
+    {
+        UInt64 h = 0xcbf29ce484222325ULL;  // FNV-1a
+        h = (h ^ precision)*0x100000001b3ULL;
+        for (int i = 0; i < precision; ++i)
+            h = (h ^ x[i])*0x100000001b3ULL;
+        for (int i = 0; i < precision; ++i)
+            h = (h ^ y[i])*0x100000001b3ULL;
+        return h == 0 ? 1 : h;
+    }
+
+    // Returns true and sets *colour if the point with this key is cached.
+    bool find(UInt64 key, unsigned int* colour)
+    {
+        Entry* set = setForKey(key);
+        for (int i = 0; i < waysPerSet; ++i)
+            if (set[i]._key == key) {
+                set[i]._lastUsed = ++_header->_clock;
+                *colour = set[i]._colour;
+                return true;
+            }
+        return false;
+    }
+
+    void add(UInt64 key, unsigned int colour)
+    {
+        Entry* set = setForKey(key);
+        // Ages are taken relative to the clock so that they're still right
+        // after it wraps around.
+        UInt32 clock = ++_header->_clock;
+        Entry* oldest = set;
+        for (int i = 0; i < waysPerSet; ++i) {
+            Entry* entry = &set[i];
+            if (entry->_key == key || entry->_key == 0) {
+                oldest = entry;
+                break;
+            }
+            if (clock - entry->_lastUsed > clock - oldest->_lastUsed)
+                oldest = entry;
+        }
+        oldest->_key = key;
+        oldest->_colour = colour;
+        oldest->_lastUsed = clock;
+    }
+
+private:
+    static const UInt32 magic = 0x434c514d;  // "MQLC"
+    static const UInt32 version = 1;
+    static const int waysPerSet = 4;
+
+    struct Header
+    {
+        UInt32 _magic;
+        UInt32 _version;
+        int _sets;
+        UInt32 _clock;
+        Byte _padding[48];
+    };
+
+    struct Entry
+    {
+        UInt64 _key;
+        unsigned int _colour;
+        UInt32 _lastUsed;
+    };
+
+    static size_t bytesForSets(int sets)
+    {
+        return sizeof(Header) +
+            static_cast<size_t>(sets)*waysPerSet*sizeof(Entry);
+    }
+
+    Entry* setForKey(UInt64 key)
+    {
+        return &_entries[static_cast<size_t>((key >> 32) % _sets)*
+            waysPerSet];
+    }
+
+    // The mapping keeps the file open, so f can be closed afterwards.
+    void map(FileStream* f, size_t bytes)
+    {
+        _bytes = bytes;
+        void* memory;
+#ifdef _WIN32
+        HANDLE mapping = CreateFileMapping(*f, NULL, PAGE_READWRITE, 0,
+            static_cast<DWORD>(bytes), NULL);
+        IF_NULL_THROW(mapping);
+        memory = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, bytes);
+        CloseHandle(mapping);
+        IF_NULL_THROW(memory);
+#else
+        if (f->size() < bytes)
+            IF_MINUS_ONE_THROW(ftruncate(*f, bytes));
+        memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, *f, 0);
+        if (memory == MAP_FAILED)
+            throw Exception::systemError("Mapping leaf cache");
+#endif
+        _header = static_cast<Header*>(memory);
+        _entries = reinterpret_cast<Entry*>(_header + 1);
+    }
+
+    Header* _header;
+    Entry* _entries;
+    size_t _bytes;
+    int _sets;
+};
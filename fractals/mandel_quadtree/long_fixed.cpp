@@ -316,17 +316,13 @@ void abs(Digit* r, const Digit* v, int n)
 //    lr += m << bitsPerHalfDigit;
 //}
 
+// The compiler turns this into a single MUL (and, unlike inline assembly, it
+// works on x64).
 void mul(Digit& lr, Digit& hr, Digit a, Digit b)
 {
-    Digit l, h;
-    __asm {
-        mov eax, a
-        mul b
-        mov h, edx
-        mov l, eax
-    }
-    hr = h;
-    lr = l;
+    UInt64 p = static_cast<UInt64>(a)*b;
+    lr = static_cast<Digit>(p);
+    hr = static_cast<Digit>(p >> bitsPerDigit);
 }
 
 // Helper function for multiply: r += a * b. Aliasing forbidden. an is the
@@ -360,9 +356,400 @@ void multiply(Digit* r, int rn, const Digit* a, int an, Digit b)
     //printf("\n");
 }
 
-// r = a * b. Aliasing ok. 
-// scratch must point to at least n*4 Digits. This buffer cannot be shared
-// across threads.
+// Multiplication of magnitudes. These give the full 2n digit product of two
+// unsigned n digit numbers (a*a if b is 0), and are picked by
+// productKernels() below.
+//
+// a*b + r[i] + carry can't overflow a double-width product, so each row is a
+// single chain of multiply-adds.
+
+// r[0..n) += a*b. Returns the carry out, which becomes digit n.
+inline Digit addRow(Digit* r, const Digit* a, int n, Digit b)
+{
+    UInt64 carry = 0;
+    for (int j = 0; j < n; ++j) {
+        carry += static_cast<UInt64>(a[j])*b + r[j];
+        r[j] = static_cast<Digit>(carry);
+        carry >>= bitsPerDigit;
+    }
+    return static_cast<Digit>(carry);
+}
+
+// r = a*b. Aliasing forbidden.
+inline void multiplyDigits(Digit* r, const Digit* a, const Digit* b, int n)
+{
+    zero(r, n);
+    for (int i = 0; i < n; ++i)
+        r[i + n] = addRow(r + i, a, n, b[i]);
+}
+
+// r = v*v. Aliasing forbidden. Each product of two different digits appears
+// twice, so we add those up once and double, and then add the squares: about
+// half the multiplications of multiplyDigits().
+inline void squareDigits(Digit* r, const Digit* v, int n)
+{
+    zero(r, 2*n);
+    for (int i = 0; i < n - 1; ++i)
+        r[i + n] = addRow(r + 2*i + 1, v + i + 1, n - i - 1, v[i]);
+    shiftLeft(r, r, 2*n, 1);
+    Digit carry = 0;
+    for (int i = 0; i < n; ++i) {
+        Digit low, high;
+        mul(low, high, v[i], v[i]);
+        adc(r[2*i], r[2*i], low, carry);
+        adc(r[2*i + 1], r[2*i + 1], high, carry);
+    }
+}
+
+// int96 and int128 (see precision.txt) are the common deep zoom cases, so
+// give the compiler a constant n to unroll.
+template<int n> void multiplyDigits(Digit* r, const Digit* a, const Digit* b)
+{
+    multiplyDigits(r, a, b, n);
+}
+
+template<int n> void squareDigits(Digit* r, const Digit* v)
+{
+    squareDigits(r, v, n);
+}
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define LONG_FIXED_WORDS
+
+// On x64 the magnitudes are multiplied 64 bits at a time, which needs a
+// quarter of the multiplications. Digits are packed into Words in pairs.
+typedef UInt64 Word;
+static const int bitsPerWord = 64;
+
+#ifdef _MSC_VER
+#define LONG_FIXED_ADX
+#else
+// GCC and Clang only allow the BMI2 and ADX intrinsics in functions
+// compiled for them.
+#define LONG_FIXED_ADX __attribute__((target("bmi2,adx")))
+#endif
+
+// Returns the low word of a*b + c + d and puts the high word in high. This
+// can't overflow.
+inline Word multiplyAdd(Word a, Word b, Word c, Word d, Word& high)
+{
+#ifdef _MSC_VER
+    Word h;
+    Word l = _umul128(a, b, &h);
+    _addcarry_u64(_addcarry_u64(0, l, c, &l), h, 0, &h);
+    _addcarry_u64(_addcarry_u64(0, l, d, &l), h, 0, &h);
+    high = h;
+    return l;
+#else
+    unsigned __int128 p = static_cast<unsigned __int128>(a)*b + c + d;
+    high = static_cast<Word>(p >> bitsPerWord);
+    return static_cast<Word>(p);
+#endif
+}
+
+// r[0..m) += a*b. Returns the carry out.
+inline Word addRow(Word* r, const Word* a, int m, Word b)
+{
+    Word carry = 0;
+    for (int j = 0; j < m; ++j)
+        r[j] = multiplyAdd(a[j], b, r[j], carry, carry);
+    return carry;
+}
+
+// As addRow(), but with MULX, which doesn't touch the flags, so that the
+// low halves and the high halves of the products can be added in two
+// independent carry chains (ADCX and ADOX).
+LONG_FIXED_ADX Word addRowADX(Word* r, const Word* a, int m, Word b)
+{
+    unsigned char lowCarry = 0;
+    unsigned char highCarry = 0;
+    unsigned long long high = 0;
+    for (int j = 0; j < m; ++j) {
+        unsigned long long h;
+        unsigned long long l = _mulx_u64(a[j], b, &h);
+        unsigned long long s;
+        lowCarry = _addcarryx_u64(lowCarry, r[j], l, &s);
+        highCarry = _addcarryx_u64(highCarry, s, high, &s);
+        r[j] = s;
+        high = h;
+    }
+    return high + lowCarry + highCarry;
+}
+
+typedef Word (*AddRow)(Word* r, const Word* a, int m, Word b);
+
+// From this many Words, Karatsuba multiplication is faster than the
+// schoolbook method (measured at 20-30 Words). The schoolbook square only
+// does half the work, so its crossover is much later.
+static const int karatsubaThreshold = 24;
+static const int karatsubaSquareThreshold = 2*karatsubaThreshold;
+
+// Words of scratch space that multiplyWords() and squareWords() need.
+int karatsubaScratch(int m)
+{
+    if (m < karatsubaThreshold)
+        return 0;
+    int h = (m + 1) >> 1;
+    return 4*(h + 1) + karatsubaScratch(h + 1);
+}
+
+// r = a + b where a has an Words and b has bn <= an Words. Returns the
+// carry out. Aliasing ok.
+inline Word addWords(Word* r, const Word* a, int an, const Word* b, int bn)
+{
+    unsigned char carry = 0;
+    for (int i = 0; i < an; ++i) {
+        unsigned long long s;
+        carry = _addcarry_u64(carry, a[i], i < bn ? b[i] : 0, &s);
+        r[i] = s;
+    }
+    return carry;
+}
+
+// r[0..rn) -= v[0..vn) with vn <= rn.
+inline void subtractWords(Word* r, int rn, const Word* v, int vn)
+{
+    unsigned char borrow = 0;
+    for (int i = 0; i < rn && (i < vn || borrow != 0); ++i) {
+        unsigned long long d;
+        borrow = _subborrow_u64(borrow, r[i], i < vn ? v[i] : 0, &d);
+        r[i] = d;
+    }
+}
+
+// The middle step of Karatsuba: given r = a0*b0 + a1*b1*B^2h and
+// middle = (a0 + a1)*(b0 + b1) (2h + 2 Words), adds
+// (middle - a0*b0 - a1*b1)*B^h to r.
+inline void karatsubaMiddle(Word* r, Word* middle, int h, int m)
+{
+    int l = m - h;
+    subtractWords(middle, 2*h + 2, r, 2*h);
+    subtractWords(middle, 2*h + 2, r + 2*h, 2*l);
+    Word* rr = r + h;
+    int rn = 2*m - h;
+    unsigned char carry = 0;
+    for (int i = 0; i < rn && (i < 2*h + 2 || carry != 0); ++i) {
+        unsigned long long s;
+        carry = _addcarry_u64(carry, rr[i], i < 2*h + 2 ? middle[i] : 0, &s);
+        rr[i] = s;
+    }
+}
+
+// r = a*b. Aliasing forbidden.
+template<AddRow addRow> void multiplyWords(Word* r, const Word* a,
+    const Word* b, int m, Word* scratch)
+{
+    if (m < karatsubaThreshold) {
+        for (int i = 0; i < m; ++i)
+            r[i] = 0;
+        for (int i = 0; i < m; ++i)
+            r[i + m] = addRow(r + i, a, m, b[i]);
+        return;
+    }
+    // Split into low halves of h Words and high halves of l <= h Words.
+    int h = (m + 1) >> 1;
+    int l = m - h;
+    Word* as = scratch;
+    Word* bs = as + h + 1;
+    Word* middle = bs + h + 1;
+    scratch = middle + 2*h + 2;
+    multiplyWords<addRow>(r, a, b, h, scratch);
+    multiplyWords<addRow>(r + 2*h, a + h, b + h, l, scratch);
+    as[h] = addWords(as, a, h, a + h, l);
+    bs[h] = addWords(bs, b, h, b + h, l);
+    multiplyWords<addRow>(middle, as, bs, h + 1, scratch);
+    karatsubaMiddle(r, middle, h, m);
+}
+
+// r = v*v. Aliasing forbidden.
+template<AddRow addRow> void squareWords(Word* r, const Word* v, int m,
+    Word* scratch)
+{
+    if (m < karatsubaSquareThreshold) {
+        for (int i = 0; i < 2*m; ++i)
+            r[i] = 0;
+        for (int i = 0; i < m - 1; ++i)
+            r[i + m] = addRow(r + 2*i + 1, v + i + 1, m - i - 1, v[i]);
+        Word low = 0;
+        for (int i = 0; i < 2*m; ++i) {
+            Word t = r[i] >> (bitsPerWord - 1);
+            r[i] = (r[i] << 1) | low;
+            low = t;
+        }
+        unsigned char carry = 0;
+        for (int i = 0; i < m; ++i) {
+            Word high;
+            Word low = multiplyAdd(v[i], v[i], 0, 0, high);
+            unsigned long long s;
+            carry = _addcarry_u64(carry, r[2*i], low, &s);
+            r[2*i] = s;
+            carry = _addcarry_u64(carry, r[2*i + 1], high, &s);
+            r[2*i + 1] = s;
+        }
+        return;
+    }
+    int h = (m + 1) >> 1;
+    int l = m - h;
+    Word* vs = scratch;
+    Word* middle = vs + 2*(h + 1);
+    scratch = middle + 2*h + 2;
+    squareWords<addRow>(r, v, h, scratch);
+    squareWords<addRow>(r + 2*h, v + h, l, scratch);
+    vs[h] = addWords(vs, v, h, v + h, l);
+    squareWords<addRow>(middle, vs, h + 1, scratch);
+    karatsubaMiddle(r, middle, h, m);
+}
+
+// Unrolled versions for 2 Words, which covers both int96 and int128.
+inline void multiplyWords2(Word* r, const Word* a, const Word* b)
+{
+    Word h0, h1, carry;
+    r[0] = multiplyAdd(a[0], b[0], 0, 0, h0);
+    Word t = multiplyAdd(a[1], b[0], h0, 0, h1);
+    r[1] = multiplyAdd(a[0], b[1], t, 0, carry);
+    r[2] = multiplyAdd(a[1], b[1], h1, carry, r[3]);
+}
+
+inline void squareWords2(Word* r, const Word* v)
+{
+    Word crossHigh, h0;
+    Word cross = multiplyAdd(v[0], v[1], 0, 0, crossHigh);
+    Word top = crossHigh >> (bitsPerWord - 1);
+    crossHigh = (crossHigh << 1) | (cross >> (bitsPerWord - 1));
+    cross <<= 1;
+    r[0] = multiplyAdd(v[0], v[0], 0, 0, h0);
+    r[1] = cross + h0;
+    r[2] = multiplyAdd(v[1], v[1], crossHigh, r[1] < h0 ? 1 : 0, r[3]);
+    r[3] += top;
+}
+
+// Picks the multiplication kernels for this CPU, once.
+class ProductKernels
+{
+public:
+    typedef void (*Multiply)(Word* r, const Word* a, const Word* b, int m,
+        Word* scratch);
+    typedef void (*Square)(Word* r, const Word* v, int m, Word* scratch);
+
+    ProductKernels()
+    {
+        int info[4];
+        __cpuid(info, 0);
+        bool adx = false;
+        if (info[0] >= 7) {
+            __cpuidex(info, 7, 0);
+            // BMI2 (MULX) and ADX (ADCX/ADOX).
+            adx = (info[1] & (1 << 8)) != 0 && (info[1] & (1 << 19)) != 0;
+        }
+        if (adx) {
+            _multiply = multiplyWords<addRowADX>;
+            _square = squareWords<addRowADX>;
+        }
+        else {
+            _multiply = multiplyWords<addRow>;
+            _square = squareWords<addRow>;
+        }
+    }
+    Multiply _multiply;
+    Square _square;
+};
+
+static const ProductKernels productKernels;
+
+// Packs n Digits into (n + 1)/2 Words.
+inline void wordsFromDigits(Word* r, const Digit* v, int n)
+{
+    for (int i = 0; i < n - 1; i += 2) {
+        *(r++) = static_cast<Word>(v[i]) |
+            (static_cast<Word>(v[i + 1]) << bitsPerDigit);
+    }
+    if ((n & 1) != 0)
+        *r = v[n - 1];
+}
+
+// Unpacks n Digits.
+inline void digitsFromWords(Digit* r, const Word* v, int n)
+{
+    for (int i = 0; i < n; ++i)
+        r[i] = static_cast<Digit>(v[i >> 1] >> ((i & 1)*bitsPerDigit));
+}
+#endif
+
+// Digits of scratch space that multiply() needs.
+int multiplyScratchDigits(int n)
+{
+#ifdef LONG_FIXED_WORDS
+    // The Words for a, b and the product, plus one Digit for alignment.
+    int m = (n + 1) >> 1;
+    return 4*n + 1 + 2*(4*m + karatsubaScratch(m));
+#else
+    return 4*n;
+#endif
+}
+
+// r = a*b (or a*a if b is 0) for unsigned a and b, giving 2n Digits.
+// Aliasing forbidden. scratch is the part of multiply()'s scratch space
+// after the operands.
+void multiplyMagnitudes(Digit* r, const Digit* a, const Digit* b, int n,
+    Digit* scratch)
+{
+#ifdef LONG_FIXED_WORDS
+    int m = (n + 1) >> 1;
+    Word* aw = reinterpret_cast<Word*>(
+        (reinterpret_cast<size_t>(scratch) + sizeof(Word) - 1) &
+        ~(sizeof(Word) - 1));
+    Word* bw = aw + m;
+    Word* rw = bw + m;
+    Word* kernelScratch = rw + 2*m;
+    // An odd number of Digits gets a zero pad Digit at the top.
+    wordsFromDigits(aw, a, n);
+    if (b == 0) {
+        if (m == 2)
+            squareWords2(rw, aw);
+        else
+            productKernels._square(rw, aw, m, kernelScratch);
+    }
+    else {
+        wordsFromDigits(bw, b, n);
+        if (m == 2)
+            multiplyWords2(rw, aw, bw);
+        else
+            productKernels._multiply(rw, aw, bw, m, kernelScratch);
+    }
+    digitsFromWords(r, rw, 2*n);
+#else
+    if (b == 0) {
+        switch (n) {
+            case 3:
+                squareDigits<3>(r, a);
+                break;
+            case 4:
+                squareDigits<4>(r, a);
+                break;
+            default:
+                squareDigits(r, a, n);
+                break;
+        }
+    }
+    else {
+        switch (n) {
+            case 3:
+                multiplyDigits<3>(r, a, b);
+                break;
+            case 4:
+                multiplyDigits<4>(r, a, b);
+                break;
+            default:
+                multiplyDigits(r, a, b, n);
+                break;
+        }
+    }
+#endif
+}
+
+// r = a * b. Aliasing ok. Squaring (a == b) is faster.
+// scratch must point to at least multiplyScratchDigits(n) Digits. This
+// buffer cannot be shared across threads.
 void multiply(Digit* r, const Digit* a, const Digit* b, Digit* scratch, int n,
     int integerBits = intBits)
 {
@@ -372,6 +759,7 @@ void multiply(Digit* r, const Digit* a, const Digit* b, Digit* scratch, int n,
 
     Digit* av = scratch + n2;
     Digit* bv = av + n;
+    bool squaring = (a == b);
     bool aNegative = false;
     bool bNegative = false;
     if (lessThanZero(a, n)) {
@@ -381,19 +769,21 @@ void multiply(Digit* r, const Digit* a, const Digit* b, Digit* scratch, int n,
     }
     else
         copy(av, a, n);
-    if (lessThanZero(b, n)) {
-        bNegative = true;
-        negate(bv, b, n);
-//        printf("-");
+    if (squaring)
+        bNegative = aNegative;
+    else {
+        if (lessThanZero(b, n)) {
+            bNegative = true;
+            negate(bv, b, n);
+//            printf("-");
+        }
+        else
+            copy(bv, b, n);
     }
-    else
-        copy(bv, b, n);
 //    print(av, n); printf("* "); print(bv, n); printf("= ");
 
     // 1) Implement full n*n->2n integer multiplication
-    zero(scratch, n2);
-    for (int i = 0; i < n; ++i)
-        multiply(scratch + i, n - i, av, n, bv[i]);
+    multiplyMagnitudes(scratch, av, squaring ? 0 : bv, n, bv + n);
 //    print(scratch, 2*n); printf("= ");
 
     // 2) Correct for signs
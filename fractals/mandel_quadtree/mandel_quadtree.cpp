@@ -6,6 +6,9 @@
 #include "alfe/fractal.h"
 #include "alfe/linked_list.h"
 #include "alfe/allocator.h"
+#include "alfe/timer.h"
+#include "alfe/bitmap_png.h"
+#include <intrin.h>
 #include <vector>
 #include <list>
 #include <algorithm>
@@ -14,6 +17,8 @@
 #include "resource.h"
 
 #include "long_fixed.cpp"
+#include "JIT.cpp"
+#include "leaf_cache.cpp"
 
 // Forward declarations
 class FractalProcessor;
@@ -21,6 +26,7 @@ template<class FractalProcessor> class Matrix;
 template<class FractalProcessor> class WorkQueueList;
 template<class FractalProcessor> class Screen;
 template<class FractalProcessor> class Evaluator;
+template<class FractalProcessor> class ReferenceOrbit;
 template<class FractalProcessor> class TowerGrid;
 template<class FractalProcessor> class GridRenderer;
 template<class FractalProcessor> class BlockCounter;
@@ -95,8 +101,14 @@ public:
         _angle(0),
         _logScreensPerUnit(0),
         _precision(0),
-        _logUnitsPerTexel(0)
+        _logUnitsPerTexel(0),
+        _reference(0)
     { }
+    ~Screen()
+    {
+        if (_reference != 0)
+            _reference->release();
+    }
 
     void setProcessor(FractalProcessor* processor)
     {
@@ -200,6 +212,7 @@ public:
         cFromTexel(Vector2Cast<float>(texelFromPoint(point)),
             evaluator->cx(), evaluator->cy(), evaluator->precision());
         evaluator->setLogDelta(_logUnitsPerTexel);
+        evaluator->setReference(_reference);
     }
 
     // The pixel corresponding to a particular texel
@@ -299,6 +312,17 @@ public:
 
         int logUnitsPerTexel() const { return _logUnitsPerTexel; }
 
+    // The colour of the leaf under a pixel, for rendering without the tower
+    // grid.
+    DWORD pixelColour(Vector2<float> pixel)
+    {
+        Vector point =
+            pointFromTexel(Vector2Cast<int>(texelFromPixel(pixel)));
+        if (!point.inside(Vector(1 << 30, 1 << 30)))
+            return 0;
+        return MColour(_matrix->colourAt(point)).asDWord();
+    }
+
 private:
     // Sometimes we'll try to plot a block that is smaller than a texel. This
     // should be a nop unless the block is in the top-left corner of the texel.
@@ -556,6 +580,51 @@ private:
             // else to do.
             _processor->splitNeeded();
         }
+        updateReference();
+    }
+
+    // Deep zooms are evaluated by perturbation from a reference orbit at the
+    // centre of the screen. The reference is kept while it covers the
+    // screen and the screen isn't so much smaller that the series
+    // approximation would be too conservative.
+    void updateReference()
+    {
+        // Shallower than this, all points are evaluated in double precision.
+        // Deeper than about 2^-900, the differences from the reference
+        // would underflow.
+        if (_precision < 2 || _logUnitsPerTexel < -900) {
+            setReference(0);
+            return;
+        }
+        int p = _precision + 2;
+        _referenceX.ensureLength(p);
+        _referenceY.ensureLength(p);
+        _referenceTemp.ensureLength(p);
+        cFromTexel(texelFromPixel(Vector2Cast<float>(_pixelsPerScreen)/2),
+            _referenceX, _referenceY, p);
+        double radius = ldexp(static_cast<double>(_texelsPerPixel)*
+            sqrt(static_cast<double>(_pixelsPerScreen.modulus2()))/2,
+            _logUnitsPerTexel);
+        if (_reference != 0 && _reference->precision() == p) {
+            sub(_referenceTemp, _referenceX, _reference->cx(), p);
+            double x = doubleFromFixed(_referenceTemp, 0, p);
+            sub(_referenceTemp, _referenceY, _reference->cy(), p);
+            double y = doubleFromFixed(_referenceTemp, 0, p);
+            double r = _reference->radius();
+            if (sqrt(x*x + y*y) + radius <= r && radius*16 >= r)
+                return;
+        }
+        setReference(new ReferenceOrbit<FractalProcessor>(_processor,
+            _referenceX, _referenceY, p, radius*2));
+    }
+
+    void setReference(ReferenceOrbit<FractalProcessor>* reference)
+    {
+        // Evaluators that are still using the old one have their own
+        // references to it.
+        if (_reference != 0)
+            _reference->release();
+        _reference = reference;
     }
 
     void ensureLengths()
@@ -629,6 +698,11 @@ private:
 
     int _precision;
     DigitBuffer _temp;
+
+    ReferenceOrbit<FractalProcessor>* _reference;
+    DigitBuffer _referenceX;
+    DigitBuffer _referenceY;
+    DigitBuffer _referenceTemp;
 };
 
 
@@ -1562,29 +1636,654 @@ private:
 };
 
 
+#ifdef X64_JIT
+// MandelbrotEvaluator::longFixedIterate() compiled for one precision, with
+// all the arithmetic unrolled and no calls out. The numbers are copied in
+// and out of a buffer of digits(precision) Digits laid out as in Number.
+//
+// Products are computed as multiply() does (so that the results are
+// identical), from 64-bit words when the precision is even and from
+// Digits otherwise. Squares only compute each cross product once.
+class LongFixedCode : X64Assembler
+{
+public:
+    enum Number { zx, zy, zSx, zSy, cx, cy, t0, t1, t2, delta, absA, absB,
+        product, numberCount = product + 2 };
+
+    struct Context
+    {
+        Digit* _digits;
+        int _maximumIterations;
+        SignedDigit _bailoutRadius2;
+        int _result;
+    };
+
+    static int digits(int precision) { return numberCount*precision; }
+
+    LongFixedCode(int precision, bool bmi2) : _p(precision), _bmi2(bmi2)
+    {
+        generate();
+        assemble(&_jit);
+    }
+
+    void run(Context* context) { _jit.execute(context); }
+
+private:
+    void generate()
+    {
+        Label square = label();
+        Label multiply2 = label();
+        Label loop = label();
+        Label finished = label();
+        Label done = label();
+        Label periodic = label();
+        Label escaped[2];
+
+        // rbx points to the Context, rbp to the Digits and r12 is i.
+        push(rbx);
+        push(rbp);
+        push(rsi);
+        push(rdi);
+        push(r12);
+#ifdef _WIN32
+        mov64(rbx, rcx);
+#else
+        mov64(rbx, rdi);
+#endif
+        load64(rbp, rbx, offsetof(Context, _digits));
+        xor32(r12, r12);
+        cmp32(r12, rbx, offsetof(Context, _maximumIterations));
+        jump(greaterOrEqual, finished);
+
+        bind(loop);
+        for (int k = 0; k < 2; ++k) {
+            escaped[k] = label();
+            callMultiply(square, t0, zx, zx);
+            callMultiply(square, t1, zy, zy);
+            add(t2, t0, t1);
+            load32(rax, rbp, at(t2, _p - 1));
+            cmp32(rax, rbx, offsetof(Context, _bailoutRadius2));
+            jump(greater, escaped[k]);
+            callMultiply(multiply2, t2, zx, zy);
+            add(zx, t0, cx);
+            sub(zx, zx, t1);
+            add(zy, t2, cy);
+        }
+        callMultiply(square, t0, zSx, zSx);
+        callMultiply(square, t1, zSy, zSy);
+        callMultiply(multiply2, t2, zSx, zSy);
+        add(zSx, t0, cx);
+        sub(zSx, zSx, t1);
+        add(zSy, t2, cy);
+
+        Label xClose = label();
+        Label next = label();
+        sub(t0, zSx, zx);
+        absolute(rbp, at(t0), rbp, at(t0));
+        lessThan(t0, delta, xClose, next);
+        bind(xClose);
+        sub(t0, zSy, zy);
+        absolute(rbp, at(t0), rbp, at(t0));
+        lessThan(t0, delta, periodic, next);
+        bind(next);
+        addImmediate32(r12, 2);
+        cmp32(r12, rbx, offsetof(Context, _maximumIterations));
+        jump(less, loop);
+
+        bind(finished);
+        storeImmediate32(rbx, offsetof(Context, _result), -1);
+        jump(done);
+        for (int k = 0; k < 2; ++k) {
+            bind(escaped[k]);
+            mov32(rax, r12);
+            addImmediate32(rax, k + 1);
+            store32(rbx, offsetof(Context, _result), rax);
+            jump(done);
+        }
+        bind(periodic);
+        mov32(rax, r12);
+        addImmediate32(rax, 2);
+        neg32(rax);
+        store32(rbx, offsetof(Context, _result), rax);
+
+        bind(done);
+        pop(r12);
+        pop(rdi);
+        pop(rsi);
+        pop(rbp);
+        pop(rbx);
+        ret();
+
+        bind(square);
+        multiplyRoutine(true, intBits);
+        bind(multiply2);
+        multiplyRoutine(false, intBits + 1);
+    }
+
+    // Byte offset of a Digit of a Number from rbp.
+    int at(int number, int digit = 0) const
+    {
+        return (number*_p + digit)*(bitsPerDigit/8);
+    }
+
+    void add(int r, int x, int y)
+    {
+        for (int i = 0; i < _p; ++i) {
+            load32(rax, rbp, at(x, i));
+            if (i == 0)
+                add32(rax, rbp, at(y, i));
+            else
+                adc32(rax, rbp, at(y, i));
+            store32(rbp, at(r, i), rax);
+        }
+    }
+
+    void sub(int r, int x, int y)
+    {
+        for (int i = 0; i < _p; ++i) {
+            load32(rax, rbp, at(x, i));
+            if (i == 0)
+                sub32(rax, rbp, at(y, i));
+            else
+                sbb32(rax, rbp, at(y, i));
+            store32(rbp, at(r, i), rax);
+        }
+    }
+
+    void callMultiply(Label routine, int r, int x, int y)
+    {
+        lea(rsi, rbp, at(x));
+        lea(rdi, rbp, at(y));
+        lea(r11, rbp, at(r));
+        call(routine);
+    }
+
+    // Copies the absolute value of the number at [source + sourceOffset]
+    // to [destination + destinationOffset]. They can be the same.
+    void absolute(Register source, int sourceOffset, Register destination,
+        int destinationOffset)
+    {
+        Label negative = label();
+        Label done = label();
+        int d = bitsPerDigit/8;
+        load32(rax, source, sourceOffset + (_p - 1)*d);
+        test32(rax, rax);
+        jump(sign, negative);
+        if (source != destination || sourceOffset != destinationOffset) {
+            for (int i = 0; i < _p; ++i) {
+                load32(rax, source, sourceOffset + i*d);
+                store32(destination, destinationOffset + i*d, rax);
+            }
+        }
+        jump(done);
+        bind(negative);
+        for (int i = 0; i < _p; ++i) {
+            load32(rax, source, sourceOffset + i*d);
+            not32(rax);
+            store32(destination, destinationOffset + i*d, rax);
+        }
+        addImmediate32(destination, destinationOffset, 1);
+        for (int i = 1; i < _p; ++i)
+            adcImmediate32(destination, destinationOffset + i*d, 0);
+        bind(done);
+    }
+
+    // Jumps to yes if x < y, and to no otherwise.
+    void lessThan(int x, int y, Label yes, Label no)
+    {
+        load32(rax, rbp, at(x, _p - 1));
+        cmp32(rax, rbp, at(y, _p - 1));
+        jump(less, yes);
+        jump(greater, no);
+        for (int i = _p - 2; i >= 0; --i) {
+            load32(rax, rbp, at(x, i));
+            cmp32(rax, rbp, at(y, i));
+            jump(below, yes);
+            jump(above, no);
+        }
+        jump(no);
+    }
+
+    // A subroutine that does multiply(r11, rsi, rdi) (or multiply(r11, rsi,
+    // rsi) if squaring).
+    void multiplyRoutine(bool squaring, int integerBits)
+    {
+        // r10 is -1 if the product is negative.
+        absolute(rsi, 0, rbp, at(absA));
+        if (!squaring) {
+            load32(r10, rsi, at(0, _p - 1));
+            sar32(r10, 31);
+            load32(rax, rdi, at(0, _p - 1));
+            sar32(rax, 31);
+            xor32(r10, rax);
+            absolute(rdi, 0, rbp, at(absB));
+        }
+        int b = squaring ? absA : absB;
+        if ((_p & 1) == 0)
+            wordProduct(squaring, b);
+        else
+            digitProduct(squaring, b);
+
+        // Shift and round as multiply() does.
+        int shift = _p*bitsPerDigit - integerBits;
+        int shiftDigits = shift >> logBitsPerDigit;
+        int shiftBits = shift & (bitsPerDigit - 1);
+        int d = bitsPerDigit/8;
+        for (int i = 0; i < _p; ++i) {
+            load64(rax, rbp, at(product, shiftDigits + i));
+            shr64(rax, shiftBits);
+            store32(r11, i*d, rax);
+        }
+        bt32(rbp, at(product, shiftDigits), shiftBits - 1);
+        for (int i = 0; i < _p; ++i)
+            adcImmediate32(r11, i*d, 0);
+
+        if (!squaring) {
+            Label positive = label();
+            test32(r10, r10);
+            jump(equal, positive);
+            for (int i = 0; i < _p; ++i)
+                not32(r11, i*d);
+            addImmediate32(r11, 0, 1);
+            for (int i = 1; i < _p; ++i)
+                adcImmediate32(r11, i*d, 0);
+            bind(positive);
+        }
+        ret();
+    }
+
+    // product = absA*b, a column at a time (product scanning) with a 192-bit
+    // accumulator in rdi:r9:r8.
+    void wordProduct(bool squaring, int b)
+    {
+        int m = _p/2;
+        int w = bitsPerWord/8;
+        Register high = _bmi2 ? rcx : rdx;
+        xor32(r8, r8);
+        xor32(r9, r9);
+        xor32(rdi, rdi);
+        for (int k = 0; k < 2*m - 1; ++k) {
+            for (int i = max(0, k - m + 1); i <= min(k, m - 1); ++i) {
+                int j = k - i;
+                if (squaring && i > j)
+                    continue;
+                if (_bmi2) {
+                    load64(rdx, rbp, at(absA) + i*w);
+                    mulx64(rcx, rax, rbp, at(b) + j*w);
+                }
+                else {
+                    load64(rax, rbp, at(absA) + i*w);
+                    mul64(rbp, at(b) + j*w);
+                }
+                int times = (squaring && i != j) ? 2 : 1;
+                for (int t = 0; t < times; ++t) {
+                    add64(r8, rax);
+                    adc64(r9, high);
+                    adcImmediate64(rdi, 0);
+                }
+            }
+            store64(rbp, at(product) + k*w, r8);
+            mov64(r8, r9);
+            mov64(r9, rdi);
+            xor32(rdi, rdi);
+        }
+        store64(rbp, at(product) + (2*m - 1)*w, r8);
+    }
+
+    // As wordProduct() but a Digit at a time, for odd precisions. Each
+    // product of Digits fits in 64 bits, so the accumulator is r9:r8.
+    void digitProduct(bool squaring, int b)
+    {
+        xor32(r8, r8);
+        xor32(r9, r9);
+        for (int k = 0; k < 2*_p - 1; ++k) {
+            for (int i = max(0, k - _p + 1); i <= min(k, _p - 1); ++i) {
+                int j = k - i;
+                if (squaring && i > j)
+                    continue;
+                load32(rax, rbp, at(absA, i));
+                load32(rcx, rbp, at(b, j));
+                imul64(rax, rcx);
+                int times = (squaring && i != j) ? 2 : 1;
+                for (int t = 0; t < times; ++t) {
+                    add64(r8, rax);
+                    adcImmediate64(r9, 0);
+                }
+            }
+            store32(rbp, at(product, k), r8);
+            shrd64(r8, r9, bitsPerDigit);
+            shr64(r9, bitsPerDigit);
+        }
+        store32(rbp, at(product, 2*_p - 1), r8);
+    }
+
+    int _p;
+    bool _bmi2;
+    JIT _jit;
+};
+
+// The generated code for each precision, created when first needed and
+// shared by all the threads.
+class LongFixedJIT : Uncopyable
+{
+public:
+    // Beyond this the unrolled code gets too big to be worth it.
+    static const int maximumPrecision = 32;
+
+    LongFixedJIT()
+    {
+        for (int i = 0; i <= maximumPrecision; ++i)
+            _code[i] = 0;
+        _bmi2 = CPUInfo().bmi2();
+    }
+    ~LongFixedJIT()
+    {
+        for (int i = 0; i <= maximumPrecision; ++i)
+            delete _code[i];
+    }
+    // Returns 0 if precision isn't supported.
+    LongFixedCode* code(int precision)
+    {
+        if (precision > maximumPrecision)
+            return 0;
+        LongFixedCode* code = _code[precision];
+        if (code != 0)
+            return code;
+        Lock lock(&_mutex);
+        if (_code[precision] == 0)
+            _code[precision] = new LongFixedCode(precision, _bmi2);
+        return _code[precision];
+    }
+private:
+    LongFixedCode* volatile _code[maximumPrecision + 1];
+    bool _bmi2;
+    Mutex _mutex;
+};
+
+static LongFixedJIT longFixedJIT;
+#endif
+
+
+// A high-precision orbit of one point near the middle of the screen, which
+// lets the orbits of the other points be computed from their (small)
+// differences from it in double precision, using perturbation theory:
+// if z = Z + d and c = C + dc then the next d is 2*Z*d + d*d + dc.
+//
+// The orbit is computed lazily in blocks of maximumIterations(), since that
+// is how far each evaluation takes a point. Each block stores Z as a double
+// for each iteration, and for even iterations n the difference between Z(n)
+// and Z(n/2) (the periodicity check's slow orbit), computed before rounding
+// so that the check still works when they're very close. The start of each
+// block also keeps the full precision Z and Z(n/2) so that an evaluation can
+// convert a point's z to and from a difference.
+//
+// The first block also gives the coefficients of a cubic in dc that
+// approximates d, accurate for all dc within the radius given to the
+// constructor for the first seriesSkip() iterations, so that new points can
+// skip those.
+//
+// The orbit is shared by all the threads, and is reference counted so that
+// it can be replaced while some of them are still using it.
+template<class FractalProcessor> class ReferenceOrbit : Uncopyable
+{
+public:
+    struct Entry
+    {
+        Complex<double> _z;
+        Complex<double> _d;  // Z(n) - Z(n/2), for even n.
+    };
+private:
+    class Block
+    {
+    public:
+        Block(int size, int precision) : _entries(size)
+        {
+            _checkpoint.ensureLength(4*precision);
+        }
+        Array<Entry> _entries;
+        DigitBuffer _checkpoint;  // Z.x, Z.y, Z(n/2).x, Z(n/2).y
+    };
+public:
+    // That's 2^26 iterations with the default maximumIterations().
+    static const int maximumBlocks = 4096;
+    // The blocks are also limited to this many bytes in total, since they
+    // live as long as the orbit does.
+    static const int maximumBytes = 0x10000000;
+
+    ReferenceOrbit(FractalProcessor* processor, const Digit* cx,
+        const Digit* cy, int precision, double radius)
+      : _processor(processor),
+        _precision(precision),
+        _blockSize(processor->maximumIterations()),
+        _bailoutRadius2(processor->getBailoutRadius2()),
+        _radius(radius),
+        _blockCount(0),
+        _escaped(false),
+        _seriesSkip(0),
+        _count(1)
+    {
+        int p = _precision;
+        _cx.ensureLength(p);
+        _cy.ensureLength(p);
+        copy(_cx, cx, p);
+        copy(_cy, cy, p);
+        _buffer.ensureLength(7*p + multiplyScratchDigits(p));
+        Digit* t = _buffer;
+        for (int i = 0; i < 8; ++i) {
+            _t[i] = t;
+            t += p;
+        }
+        for (int i = 0; i < 4; ++i)
+            zero(_t[i], p);
+        // We always need at least two blocks to convert back from the first.
+        _maximumBlocks = max(2, min(maximumBlocks,
+            maximumBytes/blockBytes()));
+    }
+    ~ReferenceOrbit()
+    {
+        for (int i = 0; i < _blockCount; ++i)
+            delete _blocks[i];
+        _processor->tracker()->adjustMemory(-_blockCount*blockBytes());
+    }
+
+    void acquire() { InterlockedIncrement(&_count); }
+    void release()
+    {
+        if (InterlockedDecrement(&_count) == 0)
+            delete this;
+    }
+
+    int precision() const { return _precision; }
+    const Digit* cx() const { return _cx; }
+    const Digit* cy() const { return _cy; }
+    double radius() const { return _radius; }
+    int blockSize() const { return _blockSize; }
+
+    // Makes sure that blocks 0 to block have been computed. Returns false if
+    // the reference escapes before the start of block.
+    bool ensure(int block)
+    {
+        if (block < _blockCount)
+            return true;
+        if (block >= _maximumBlocks)
+            return false;
+        Lock lock(&_mutex);
+        while (_blockCount <= block) {
+            if (_escaped)
+                return false;
+            // Points can fall back to longFixedIterate() rather than making
+            // us go over the memory limit.
+            if (_blockCount >= 2 && !_processor->tracker()->canAllocate())
+                return false;
+            computeBlock();
+        }
+        return true;
+    }
+
+    // Only valid for blocks that ensure() has returned true for.
+    const Entry* entries(int block) const
+    {
+        return &_blocks[block]->_entries[0];
+    }
+    const Digit* checkpoint(int block, int number) const
+    {
+        return _blocks[block]->_checkpoint + number*_precision;
+    }
+
+    // Only valid after ensure(0).
+    int seriesSkip() const { return _seriesSkip; }
+    // d(seriesSkip()) if slow is false, d(seriesSkip()/2) if it's true.
+    Complex<double> series(Complex<double> dc, bool slow) const
+    {
+        const Complex<double>* a = _series[slow ? 1 : 0];
+        return ((a[2]*dc + a[1])*dc + a[0])*dc;
+    }
+
+private:
+    int blockBytes() const
+    {
+        return static_cast<int>(_blockSize*sizeof(Entry) +
+            4*_precision*sizeof(Digit));
+    }
+
+    // Converts Z, or Z(n/2) if slow is true, to double precision.
+    Complex<double> z(bool slow)
+    {
+        int i = slow ? 2 : 0;
+        return Complex<double>(doubleFromFixed(_t[i], 0, _precision),
+            doubleFromFixed(_t[i + 1], 0, _precision));
+    }
+
+    // z = z*z + c, with z in _t[i] and _t[i + 1].
+    void iterate(int i)
+    {
+        int p = _precision;
+        Digit* x = _t[i];
+        Digit* y = _t[i + 1];
+        multiply(_t[4], x, x, _t[7], p);
+        multiply(_t[5], y, y, _t[7], p);
+        multiply(_t[6], x, y, _t[7], p, intBits + 1);
+        add(x, _t[4], _cx, p);
+        sub(x, x, _t[5], p);
+        add(y, _t[6], _cy, p);
+    }
+
+    void computeBlock()
+    {
+        int p = _precision;
+        int block = _blockCount;
+        Block* b = new Block(_blockSize, p);
+        _processor->tracker()->adjustMemory(blockBytes());
+        for (int i = 0; i < 4; ++i)
+            copy(b->_checkpoint + i*p, _t[i], p);
+        for (int i = 0; i < _blockSize; ++i) {
+            Entry* e = &b->_entries[i];
+            e->_z = z(false);
+            if ((i & 1) == 0) {
+                sub(_t[4], _t[0], _t[2], p);
+                sub(_t[5], _t[1], _t[3], p);
+                e->_d = Complex<double>(doubleFromFixed(_t[4], 0, p),
+                    doubleFromFixed(_t[5], 0, p));
+            }
+            if (e->_z.modulus2() > _bailoutRadius2) {
+                // Nothing can be perturbed from an orbit that has escaped.
+                _escaped = true;
+                break;
+            }
+            iterate(0);
+            if ((i & 1) != 0)
+                iterate(2);
+        }
+        _blocks[block] = b;
+        if (block == 0)
+            computeSeries(b);
+        // Publish the block only once it's complete.
+        _blockCount = block + 1;
+    }
+
+    // Finds how many iterations can be skipped by using the coefficients
+    // A, B and C of d = A*dc + B*dc^2 + C*dc^3. We stop when the cubic term
+    // is no longer negligible compared to the linear one, as then the
+    // missing higher order terms might not be negligible either.
+    void computeSeries(Block* b)
+    {
+        Complex<double> a[3] = { 0, 0, 0 };
+        Array<Complex<double> > history(3*_blockSize);
+        double r = _radius;
+        int n;
+        for (n = 0; n < _blockSize - 2; ++n) {
+            const Entry* e = &b->_entries[n];
+            if (e->_z.modulus2() > _bailoutRadius2)
+                break;
+            if (a[2].modulus()*r*r*r > ldexp(a[0].modulus()*r, -45))
+                break;
+            for (int i = 0; i < 3; ++i)
+                history[3*n + i] = a[i];
+            Complex<double> z2 = e->_z*2.0;
+            Complex<double> a0 = z2*a[0] + 1.0;
+            Complex<double> a1 = z2*a[1] + a[0]*a[0];
+            a[2] = z2*a[2] + a[0]*a[1]*2.0;
+            a[0] = a0;
+            a[1] = a1;
+        }
+        _seriesSkip = n > 0 ? (n - 1) & ~1 : 0;
+        for (int i = 0; i < 3; ++i) {
+            _series[0][i] = history[3*_seriesSkip + i];
+            _series[1][i] = history[3*(_seriesSkip/2) + i];
+        }
+    }
+
+    FractalProcessor* _processor;
+    int _precision;
+    int _blockSize;
+    int _maximumBlocks;
+    double _bailoutRadius2;
+    double _radius;
+    DigitBuffer _cx;
+    DigitBuffer _cy;
+
+    // Z, Z(n/2) and scratch space for computing the next block.
+    DigitBuffer _buffer;
+    Digit* _t[8];
+
+    Block* _blocks[maximumBlocks];
+    volatile int _blockCount;
+    bool _escaped;
+    Mutex _mutex;
+
+    int _seriesSkip;
+    Complex<double> _series[2][3];
+
+    volatile LONG _count;
+};
+
+
 template<class FractalProcessor> class Evaluator : Uncopyable
 {
+protected:
     typedef IncompleteLeaf<FractalProcessor> IncompleteLeaf;
 public:
     Evaluator(FractalProcessor* processor)
-      : _processor(processor)
+      : _processor(processor), _reference(0)
     {
         _bailoutRadius2 = processor->getBailoutRadius2();
         _maximumIterations = _processor->maximumIterations();
     }
+    ~Evaluator() { setReference(0); }
 
     // Updates the IncompleteLeaf after evaluation
     void updateLeaf(IncompleteLeaf* leaf) const
     {
-        copy(leaf->number(0), _zx, _precision);
-        copy(leaf->number(1), _zy, _precision);
-        copy(leaf->number(2), _zSx, _precision);
-        copy(leaf->number(3), _zSy, _precision);
+        copy(leaf->number(_processor, 0), _zx, _precision);
+        copy(leaf->number(_processor, 1), _zy, _precision);
+        copy(leaf->number(_processor, 2), _zSx, _precision);
+        copy(leaf->number(_processor, 3), _zSy, _precision);
         leaf->_iterations += _maximumIterations;
     }
 
     void initFromLeaf(IncompleteLeaf* leaf)
     {
+        _startIteration = leaf->_iterations;
         _precision = leaf->precision() + 1;
         _cx.ensureLength(_precision);
         _cy.ensureLength(_precision);
@@ -1592,18 +2291,50 @@ public:
         _zy.ensureLength(_precision);
         _zSx.ensureLength(_precision);
         _zSy.ensureLength(_precision);
-        copy(_zx, leaf->number(0), _precision);
-        copy(_zy, leaf->number(1), _precision);
-        copy(_zSx, leaf->number(2), _precision);
-        copy(_zSy, leaf->number(3), _precision);
+        copy(_zx, leaf->number(_processor, 0), _precision);
+        copy(_zy, leaf->number(_processor, 1), _precision);
+        copy(_zSx, leaf->number(_processor, 2), _precision);
+        copy(_zSy, leaf->number(_processor, 3), _precision);
+    }
+
+    // Starts a new point with z = 0, for evaluating points that aren't in
+    // the matrix.
+    void initAtOrigin(int precision)
+    {
+        _startIteration = 0;
+        _precision = precision;
+        _cx.ensureLength(_precision);
+        _cy.ensureLength(_precision);
+        _zx.ensureLength(_precision);
+        _zy.ensureLength(_precision);
+        _zSx.ensureLength(_precision);
+        _zSy.ensureLength(_precision);
+        zero(_zx, _precision);
+        zero(_zy, _precision);
+        zero(_zSx, _precision);
+        zero(_zSy, _precision);
     }
 
     void setLogDelta(int logDelta) { _logDelta = logDelta; }
 
+    // The screen's reference orbit, if there is one.
+    void setReference(ReferenceOrbit<FractalProcessor>* reference)
+    {
+        if (reference == _reference)
+            return;
+        if (reference != 0)
+            reference->acquire();
+        if (_reference != 0)
+            _reference->release();
+        _reference = reference;
+    }
+
     int result() const { return _result; }
 
     Digit* cx() { return _cx; }
     Digit* cy() { return _cy; }
+    const Digit* zx() const { return _zx; }
+    const Digit* zy() const { return _zy; }
     int precision() const { return _precision; }
 
 protected:
@@ -1620,22 +2351,41 @@ protected:
     int _maximumIterations;
     double _bailoutRadius2;
     int _result;
+    unsigned int _startIteration;
+    ReferenceOrbit<FractalProcessor>* _reference;
 };
 
+template<class FractalProcessor> class MandelbrotLanes;
+
 template<class FractalProcessor> class MandelbrotEvaluator
   : public Evaluator<FractalProcessor>
 {
 public:
+    typedef MandelbrotLanes<FractalProcessor> Lanes;
+
     MandelbrotEvaluator(FractalProcessor* processor)
-      : Evaluator(processor)
+      : Evaluator(processor), _iteration(-1)
     { }
 
+    void initFromLeaf(IncompleteLeaf* leaf)
+    {
+        Evaluator::initFromLeaf(leaf);
+        _iteration = -1;
+    }
+
+    void initAtOrigin(int precision)
+    {
+        Evaluator::initAtOrigin(precision);
+        _iteration = -1;
+    }
+
     void iterate()
     {
         if (_precision <= 2)
             doubleIterate();
         else
-            longFixedIterate();
+            if (!perturbationIterate() && !jitIterate())
+                longFixedIterate();
     }
 
     bool inSet()
@@ -1760,6 +2510,141 @@ public:
         _result = -1;
     }
 
+    // Iterates using the reference orbit. Returns false (having changed
+    // nothing) if that can't be done accurately, in which case the caller
+    // falls back to longFixedIterate().
+    bool perturbationIterate()
+    {
+        typedef typename ReferenceOrbit<FractalProcessor>::Entry Entry;
+        ReferenceOrbit<FractalProcessor>* reference = _reference;
+        if (reference == 0 || _precision > reference->precision())
+            return false;
+        int blockSize = reference->blockSize();
+        if (_startIteration % blockSize != 0)
+            return false;
+        int block = _startIteration / blockSize;
+        // We also need the start of the next block, to convert back.
+        if (!reference->ensure(block + 1))
+            return false;
+
+        // Find the differences from the reference orbit.
+        int p = reference->precision();
+        _wide.ensureLength(p);
+        Complex<double> dc(difference(_cx, reference->cx()),
+            difference(_cy, reference->cy()));
+        Complex<double> d(difference(_zx, reference->checkpoint(block, 0)),
+            difference(_zy, reference->checkpoint(block, 1)));
+        Complex<double> dS(difference(_zSx, reference->checkpoint(block, 2)),
+            difference(_zSy, reference->checkpoint(block, 3)));
+
+        int start = block*blockSize;
+        int end = start + blockSize;
+        int n = start;
+        if (n == 0 && dc.modulus() <= reference->radius()) {
+            n = reference->seriesSkip();
+            d = reference->series(dc, false);
+            dS = reference->series(dc, true);
+        }
+        const Entry* entries = reference->entries(block) - start;
+        const Entry* next = reference->entries(block + 1);
+        // The slow orbit may be in an earlier block.
+        int slow = n/2;
+        int slowBlock = slow/blockSize;
+        const Entry* slowEntries =
+            reference->entries(slowBlock) - slowBlock*blockSize;
+        int slowEnd = (slowBlock + 1)*blockSize;
+
+        double delta = ldexp(1.0, _logDelta);
+        double bailoutRadius2 = _bailoutRadius2;
+        // If z is much smaller than Z, d has lost too much precision to be
+        // trusted (this is when "glitches" appear).
+        static const double glitch = 1e-6;
+        for (; n < end; n += 2) {
+            Complex<double> zz = entries[n]._z;
+            Complex<double> z = zz + d;
+            double z2 = z.modulus2();
+            if (z2 > bailoutRadius2) {
+                _result = n - start + 1;
+                return true;
+            }
+            if (z2 < glitch*zz.modulus2())
+                return false;
+            d = d*(zz*2.0 + d) + dc;
+
+            zz = entries[n + 1]._z;
+            z = zz + d;
+            z2 = z.modulus2();
+            if (z2 > bailoutRadius2) {
+                _result = n - start + 2;
+                return true;
+            }
+            if (z2 < glitch*zz.modulus2())
+                return false;
+            d = d*(zz*2.0 + d) + dc;
+
+            if (slow == slowEnd) {
+                ++slowBlock;
+                slowEntries = reference->entries(slowBlock) - slow;
+                slowEnd += blockSize;
+            }
+            zz = slowEntries[slow]._z;
+            if ((zz + dS).modulus2() < glitch*zz.modulus2())
+                return false;
+            dS = dS*(zz*2.0 + dS) + dc;
+            ++slow;
+
+            // z - zS = (Z(n) - Z(n/2)) + (d - dS)
+            Complex<double> zd = n + 2 < end ? entries[n + 2]._d : next->_d;
+            zd += d - dS;
+            if (abs(zd.x) < delta && abs(zd.y) < delta) {
+                _result = -(n - start + 2);
+                return true;
+            }
+        }
+        undifference(_zx, d.x, reference->checkpoint(block + 1, 0));
+        undifference(_zy, d.y, reference->checkpoint(block + 1, 1));
+        undifference(_zSx, dS.x, reference->checkpoint(block + 1, 2));
+        undifference(_zSy, dS.y, reference->checkpoint(block + 1, 3));
+        _result = -1;
+        return true;
+    }
+
+    // As longFixedIterate() but using the generated code for our precision.
+    // Returns false (having changed nothing) if there isn't any.
+    bool jitIterate()
+    {
+#ifdef X64_JIT
+        typedef LongFixedCode Code;
+        int p = _precision;
+        Code* code = longFixedJIT.code(p);
+        if (code == 0)
+            return false;
+        _jitDigits.ensureLength(Code::digits(p));
+        Digit* d = _jitDigits;
+        copy(d + Code::zx*p, _zx, p);
+        copy(d + Code::zy*p, _zy, p);
+        copy(d + Code::zSx*p, _zSx, p);
+        copy(d + Code::zSy*p, _zSy, p);
+        copy(d + Code::cx*p, _cx, p);
+        copy(d + Code::cy*p, _cy, p);
+        fixedFromDouble(d + Code::delta*p, 1.0, _logDelta, p);
+        Code::Context context;
+        context._digits = d;
+        context._maximumIterations = _maximumIterations;
+        context._bailoutRadius2 = static_cast<SignedDigit>(
+            ldexp(_bailoutRadius2, bitsPerDigit - intBits));
+        code->run(&context);
+        copy(_zx, d + Code::zx*p, p);
+        copy(_zy, d + Code::zy*p, p);
+        copy(_zSx, d + Code::zSx*p, p);
+        copy(_zSy, d + Code::zSy*p, p);
+        _result = context._result;
+        return true;
+#else
+        return false;
+#endif
+    }
+
     bool longFixedInSet()
     {
         int p = _precision;
@@ -1788,36 +2673,372 @@ public:
 private:
     void ensureLengths()
     {
-        _buffer.ensureLength(8*_precision);
+        int p = _precision;
+        _buffer.ensureLength(4*p + multiplyScratchDigits(p));
         Digit* t = _buffer;
         for (int i = 0; i < 5; ++i) {
             _t[i] = t;
-            t += _precision;
+            t += p;
         }
     }
 
+    // Returns v - reference as a double, where v has our precision and
+    // reference has the reference orbit's.
+    double difference(const Digit* v, const Digit* reference)
+    {
+        int p = _reference->precision();
+        copy(_wide, p, v, _precision);
+        sub(_wide, _wide, reference, p);
+        return doubleFromFixed(_wide, 0, p);
+    }
+
+    // v = reference + d.
+    void undifference(Digit* v, double d, const Digit* reference)
+    {
+        int p = _reference->precision();
+        fixedFromDouble(_wide, d, 0, p);
+        add(_wide, _wide, reference, p);
+        copy(v, _precision, _wide, p);
+    }
+
+    // Converts the point to the double-precision state used by
+    // MandelbrotLanes.
+    void startDouble()
+    {
+        _z.x = doubleFromFixed(_zx, 0, _precision);
+        _z.y = doubleFromFixed(_zy, 0, _precision);
+        _zS.x = doubleFromFixed(_zSx, 0, _precision);
+        _zS.y = doubleFromFixed(_zSy, 0, _precision);
+        _c.x = doubleFromFixed(_cx, 0, _precision);
+        _c.y = doubleFromFixed(_cy, 0, _precision);
+        _delta = ldexp(1.0, _logDelta);
+        _iteration = 0;
+    }
+
+    // Called by MandelbrotLanes when the maximum number of iterations have
+    // been done without reaching a conclusion.
+    void finishDouble()
+    {
+        fixedFromDouble(_zx, _z.x, 0, _precision);
+        fixedFromDouble(_zy, _z.y, 0, _precision);
+        fixedFromDouble(_zSx, _zS.x, 0, _precision);
+        fixedFromDouble(_zSy, _zS.y, 0, _precision);
+        _result = -1;
+    }
+
     DigitBuffer _buffer;
     Digit* _t[5];
+    DigitBuffer _wide;
+    DigitBuffer _jitDigits;
+
+    // State of a point being iterated by MandelbrotLanes. _iteration is -1
+    // until startDouble() has been called.
+    Complex<double> _z;
+    Complex<double> _zS;
+    Complex<double> _c;
+    double _delta;
+    int _iteration;
+
+    friend class MandelbrotLanes<FractalProcessor>;
 };
 
 
-template<class FractalProcessor, class Evaluator> class FractalThread
-  : public Thread
+// Vector operations on 4 doubles at once with AVX. Comparisons return a bit
+// mask with one bit per lane.
+struct AVXDoubles
 {
-    typedef IncompleteLeaf<FractalProcessor> IncompleteLeaf;
-    typedef Manipulator<FractalProcessor> Manipulator;
-    typedef WorkQueueList<FractalProcessor> WorkQueueList;
-public:
-    FractalThread(FractalProcessor* processor)
+    typedef __m256d Doubles;
+    static const int lanes = 4;
+
+    static Doubles load(const double* p) { return _mm256_loadu_pd(p); }
+    static void store(double* p, Doubles v) { _mm256_storeu_pd(p, v); }
+    static Doubles set(double v) { return _mm256_set1_pd(v); }
+    static Doubles add(Doubles a, Doubles b) { return _mm256_add_pd(a, b); }
+    static Doubles sub(Doubles a, Doubles b) { return _mm256_sub_pd(a, b); }
+    static Doubles mul(Doubles a, Doubles b) { return _mm256_mul_pd(a, b); }
+    static Doubles abs(Doubles v)
+    {
+        return _mm256_andnot_pd(_mm256_set1_pd(-0.0), v);
+    }
+    static int greater(Doubles a, Doubles b)
+    {
+        return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_GT_OQ));
+    }
+    static int less(Doubles a, Doubles b)
+    {
+        return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ));
+    }
+    // Avoids the penalty for switching back to SSE code.
+    static void end() { _mm256_zeroupper(); }
+};
+
+// Visual C++ 2017 15.3 and later have the AVX-512 intrinsics.
+#if _MSC_VER >= 1911
+#define MANDELBROT_AVX512 1
+
+// The same with 8 doubles at once with AVX-512.
+struct AVX512Doubles
+{
+    typedef __m512d Doubles;
+    static const int lanes = 8;
+
+    static Doubles load(const double* p) { return _mm512_loadu_pd(p); }
+    static void store(double* p, Doubles v) { _mm512_storeu_pd(p, v); }
+    static Doubles set(double v) { return _mm512_set1_pd(v); }
+    static Doubles add(Doubles a, Doubles b) { return _mm512_add_pd(a, b); }
+    static Doubles sub(Doubles a, Doubles b) { return _mm512_sub_pd(a, b); }
+    static Doubles mul(Doubles a, Doubles b) { return _mm512_mul_pd(a, b); }
+    static Doubles abs(Doubles v) { return _mm512_abs_pd(v); }
+    static int greater(Doubles a, Doubles b)
+    {
+        return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ);
+    }
+    static int less(Doubles a, Doubles b)
+    {
+        return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ);
+    }
+    static void end() { _mm256_zeroupper(); }
+};
+#endif
+
+// Iterates several points at once, one in each lane of an AVX (4 lanes) or
+// AVX-512 (8 lanes) vector, doing the same calculation as
+// MandelbrotEvaluator::doubleIterate(). Each call runs until at least one of
+// the points has escaped, been found to be periodic or done the maximum
+// number of iterations, so that the caller can replace it with another
+// point and keep all the lanes busy. The other points carry on from where
+// they left off on the next call.
+template<class FractalProcessor> class MandelbrotLanes : Uncopyable
+{
+    typedef MandelbrotEvaluator<FractalProcessor> MandelbrotEvaluator;
+public:
+    static const int maximumLanes = 8;
+
+    MandelbrotLanes(FractalProcessor* processor)
+      : _lanes(1), _bailoutRadius2(processor->getBailoutRadius2())
+    {
+        int info[4];
+        __cpuid(info, 1);
+        // Check for AVX, and that the OS saves the YMM registers.
+        if ((info[2] & 0x18000000) != 0x18000000)
+            return;
+        UInt64 xcr0 = _xgetbv(0);
+        if ((xcr0 & 6) != 6)
+            return;
+        _lanes = 4;
+#ifdef MANDELBROT_AVX512
+        __cpuid(info, 0);
+        if (info[0] < 7)
+            return;
+        __cpuidex(info, 7, 0);
+        // AVX-512F, and the OS saves the opmask and ZMM registers.
+        if ((info[1] & 0x10000) != 0 && (xcr0 & 0xe6) == 0xe6)
+            _lanes = 8;
+#endif
+    }
+
+    // The number of points to iterate at once. This is 1 if the CPU has no
+    // AVX, in which case each point is iterated with
+    // MandelbrotEvaluator::iterate().
+    int lanes() const { return _lanes; }
+
+    // Bit i of active is set if evaluators[i] has a point to iterate.
+    // Returns the lanes that have finished, whose evaluators' result() is
+    // then valid. Points that need more precision than a double are
+    // iterated on their own.
+    int iterate(MandelbrotEvaluator** evaluators, int active)
+    {
+        int vector = 0;
+        int finished = 0;
+        for (int i = 0; i < _lanes; ++i) {
+            int bit = 1 << i;
+            if ((active & bit) == 0)
+                continue;
+            if (_lanes == 1 || evaluators[i]->precision() > 2) {
+                evaluators[i]->iterate();
+                finished |= bit;
+            }
+            else
+                vector |= bit;
+        }
+        // Give the caller a chance to refill the lanes we just finished.
+        if (finished != 0 || vector == 0)
+            return finished;
+#ifdef MANDELBROT_AVX512
+        if (_lanes == 8)
+            return iterate<AVX512Doubles>(evaluators, vector);
+#endif
+        return iterate<AVXDoubles>(evaluators, vector);
+    }
+
+private:
+    template<class T> int iterate(MandelbrotEvaluator** evaluators,
+        int active)
+    {
+        typedef typename T::Doubles Doubles;
+        static const int n = T::lanes;
+        double zx[n];
+        double zy[n];
+        double zSx[n];
+        double zSy[n];
+        double cx[n];
+        double cy[n];
+        double delta[n];
+        // The number of steps of 2 iterations before the first point runs
+        // out of iterations.
+        int steps = 0x7fffffff;
+        for (int i = 0; i < n; ++i) {
+            if ((active & (1 << i)) == 0) {
+                // An idle lane. With c = 0 it never escapes, and with
+                // delta = 0 it's never found to be periodic.
+                zx[i] = zy[i] = zSx[i] = zSy[i] = cx[i] = cy[i] = 0;
+                delta[i] = 0;
+                continue;
+            }
+            MandelbrotEvaluator* e = evaluators[i];
+            if (e->_iteration < 0)
+                e->startDouble();
+            zx[i] = e->_z.x;
+            zy[i] = e->_z.y;
+            zSx[i] = e->_zS.x;
+            zSy[i] = e->_zS.y;
+            cx[i] = e->_c.x;
+            cy[i] = e->_c.y;
+            delta[i] = e->_delta;
+            steps = min(steps,
+                (e->_maximumIterations - e->_iteration + 1) >> 1);
+        }
+
+        Doubles vzx = T::load(zx);
+        Doubles vzy = T::load(zy);
+        Doubles vzSx = T::load(zSx);
+        Doubles vzSy = T::load(zSy);
+        Doubles vcx = T::load(cx);
+        Doubles vcy = T::load(cy);
+        Doubles vdelta = T::load(delta);
+        Doubles bailoutRadius2 = T::set(_bailoutRadius2);
+        int escaped1 = 0;
+        int escaped2 = 0;
+        int periodic = 0;
+        int step;
+        for (step = 0; step < steps; ++step) {
+            Doubles zr2 = T::mul(vzx, vzx);
+            Doubles zi2 = T::mul(vzy, vzy);
+            Doubles zri = T::mul(vzx, vzy);
+            escaped1 = T::greater(T::add(zr2, zi2), bailoutRadius2);
+            vzx = T::add(T::sub(zr2, zi2), vcx);
+            vzy = T::add(T::add(zri, zri), vcy);
+
+            zr2 = T::mul(vzx, vzx);
+            zi2 = T::mul(vzy, vzy);
+            zri = T::mul(vzx, vzy);
+            escaped2 = T::greater(T::add(zr2, zi2), bailoutRadius2);
+            vzx = T::add(T::sub(zr2, zi2), vcx);
+            vzy = T::add(T::add(zri, zri), vcy);
+
+            zr2 = T::mul(vzSx, vzSx);
+            zi2 = T::mul(vzSy, vzSy);
+            zri = T::mul(vzSx, vzSy);
+            vzSx = T::add(T::sub(zr2, zi2), vcx);
+            vzSy = T::add(T::add(zri, zri), vcy);
+            periodic = T::less(T::abs(T::sub(vzx, vzSx)), vdelta) &
+                T::less(T::abs(T::sub(vzy, vzSy)), vdelta);
+
+            if (((escaped1 | escaped2 | periodic) & active) != 0)
+                break;
+        }
+        T::store(zx, vzx);
+        T::store(zy, vzy);
+        T::store(zSx, vzSx);
+        T::store(zSy, vzSy);
+        T::end();
+
+        // If we stopped early, every lane completed the last step.
+        int done = 2*step;
+        if (step < steps)
+            done += 2;
+        int finished = 0;
+        for (int i = 0; i < n; ++i) {
+            int bit = 1 << i;
+            if ((active & bit) == 0)
+                continue;
+            MandelbrotEvaluator* e = evaluators[i];
+            int iteration = e->_iteration + 2*step;
+            if ((escaped1 & bit) != 0)
+                e->_result = iteration + 1;
+            else
+                if ((escaped2 & bit) != 0)
+                    e->_result = iteration + 2;
+                else
+                    if ((periodic & bit) != 0)
+                        e->_result = -(iteration + 2);
+                    else {
+                        e->_iteration += done;
+                        e->_z = Complex<double>(zx[i], zy[i]);
+                        e->_zS = Complex<double>(zSx[i], zSy[i]);
+                        if (e->_iteration < e->_maximumIterations)
+                            continue;
+                        e->finishDouble();
+                    }
+            finished |= bit;
+        }
+        return finished;
+    }
+
+    int _lanes;
+    double _bailoutRadius2;
+};
+
+
+template<class FractalProcessor, class Evaluator> class FractalThread
+  : public Thread
+{
+    typedef IncompleteLeaf<FractalProcessor> IncompleteLeaf;
+    typedef Manipulator<FractalProcessor> Manipulator;
+    typedef WorkQueueList<FractalProcessor> WorkQueueList;
+    typedef typename Evaluator::Lanes Lanes;
+
+    // A point claimed by this thread. Points are claimed a batch at a time
+    // (batches points per SIMD lane) so that the processor lock is taken
+    // less often, and start iterating as lanes become free.
+    class Lane
+    {
+    public:
+        enum State { idle, ready, running, finished };
+
+        Lane() : _state(idle), _pointValid(false) { }
+
+        State _state;
+        volatile Vector _point;
+        volatile bool _pointValid;
+        unsigned int _iterations;
+        UInt64 _cacheKey;
+    };
+    static const int batches = 4;
+    static const int maximumSlots = batches*Lanes::maximumLanes;
+public:
+    FractalThread(FractalProcessor* processor)
       : _ending(false),
         _failed(false),
         _processor(processor),
-        _evaluator(processor),
-        _running(false)
+        _iterator(processor),
+        _running(false),
+        _readyTop(0),
+        _readyBottom(0)
     {
         _screen = processor->screen();
         _matrix = processor->matrix();
         _queue = processor->queue();
+        _laneCount = _iterator.lanes();
+        _slotCount = batches*_laneCount;
+        for (int i = 0; i < _slotCount; ++i)
+            _evaluators[i] = new Evaluator(processor);
+    }
+
+    ~FractalThread()
+    {
+        for (int i = 0; i < _slotCount; ++i)
+            delete _evaluators[i];
     }
 
     // Signals the thread to come to an end.
@@ -1835,32 +3056,57 @@ public:
 
     HANDLE finishedHandle() { return _finished; }
 
+    // Waits until the thread runs out of work after a go().
+    void waitUntilFinished() { _finished.wait(); }
+
     void growMatrix(Vector quadrant)
     {
-        Vector point(int(_point.x), int(_point.y));
-        if ((point& 1) != Vector(0, 0))
-            _pointValid = false;
-        point = (point>>1) | (quadrant<<29);
-        _point.x = point.x;
-        _point.y = point.y;
+        for (int i = 0; i < _slotCount; ++i) {
+            Lane* lane = &_lanes[i];
+            Vector point(int(lane->_point.x), int(lane->_point.y));
+            if ((point& 1) != Vector(0, 0))
+                lane->_pointValid = false;
+            point = (point>>1) | (quadrant<<29);
+            lane->_point.x = point.x;
+            lane->_point.y = point.y;
+        }
     }
 
     void shrinkMatrix(Vector semiQuadrant)
     {
-        Vector point(int(_point.x), int(_point.y));
-        point = (point<<1) + (semiQuadrant<<28);
-        if ((point & 0xc0000000) != Vector(0, 0))
-            _pointValid = false;
-        _point.x = point.x;
-        _point.y = point.y;
+        for (int i = 0; i < _slotCount; ++i) {
+            Lane* lane = &_lanes[i];
+            Vector point(int(lane->_point.x), int(lane->_point.y));
+            point = (point<<1) + (semiQuadrant<<28);
+            if ((point & 0xc0000000) != Vector(0, 0))
+                lane->_pointValid = false;
+            lane->_point.x = point.x;
+            lane->_point.y = point.y;
+        }
     }
 
     bool running() const { return _running; }
 
+    // Called with the processor locked by a thread that has run out of work,
+    // to take a point that this thread has claimed but not started.
+    bool giveAway(Vector* point, unsigned int* iterations)
+    {
+        int slot;
+        while (takeReady(&slot)) {
+            Lane* lane = &_lanes[slot];
+            if (lane->_pointValid) {
+                *point = Vector(int(lane->_point.x), int(lane->_point.y));
+                *iterations = lane->_iterations;
+                return true;
+            }
+        }
+        return false;
+    }
+
 private:
-    void postEvaluationProcessing()
+    void postEvaluationProcessing(Lane* lane, Evaluator* evaluator)
     {
-        int result = _evaluator.result();
+        int result = evaluator->result();
         _processor->addIterations(
             result == -1 ? _processor->maximumIterations() : abs(result));
 
@@ -1868,13 +3114,13 @@ private:
         // to another thread completing an adjacent block. So, re-find the
         // block by point coordinates again and make sure it's still
         // incomplete.
-        if (!_pointValid) {
+        if (!lane->_pointValid) {
             // Matrix was grown or shrunk and this point didn't make the
-            // cut (or we haven't done anything yet).
+            // cut.
             return;
         }
-        _pointValid = false;
-        Vector point(int(_point.x), int(_point.y));
+        lane->_pointValid = false;
+        Vector point(int(lane->_point.x), int(lane->_point.y));
         Manipulator* manipulator = _matrix->manipulator(point);
         if (manipulator->isComplete()) {
             // This point got moved to a new IncompletePoint* and the other
@@ -1886,29 +3132,42 @@ private:
             return;
         }
         IncompleteLeaf* leaf = manipulator->incompleteLeaf();
-        if (leaf->_iterations != _iterations) {
-            // Some other thread got to it before us.
+        if (leaf->_iterations != lane->_iterations) {
+            // Some other thread (or another of our lanes) got to it before
+            // us.
             return;
         }
+        LeafCache* cache = _processor->cache();
         if (result < -1) {
             // Point was found to be periodic.
+            if (cache != 0)
+                cache->add(lane->_cacheKey, 0);
             manipulator->complete(0);
             return;
         }
         if (result == -1) {
             // Leaf is still undecided after the maximum number of iterations
             // were completed.
-            _evaluator.updateLeaf(leaf);
+            evaluator->updateLeaf(leaf);
+            if (leaf->_iterations >= _processor->iterationLimit()) {
+                // Give up and treat it as being in the set.
+                manipulator->complete(0);
+                return;
+            }
             if (leaf->_iterations > leaf->_colour)
                 manipulator->plot(0);
             return;
         }
         // Point escaped.
-        manipulator->complete(result + _iterations);
+        if (cache != 0)
+            cache->add(lane->_cacheKey, result + lane->_iterations);
+        manipulator->complete(result + lane->_iterations);
     }
 
-    // Returns true if we ran out of work to do.
-    bool preEvaluationProcessing()
+    // Returns true if we ran out of work to do. Otherwise the lane is
+    // active if it has a point to iterate.
+    bool preEvaluationProcessing(Lane* lane, Evaluator* evaluator,
+        bool maySteal)
     {
         if (_processor->interrupted()) {
             _processor->clearInterrupted();
@@ -1918,48 +3177,169 @@ private:
             }
         }
 
+        Manipulator* manipulator;
         IncompleteLeaf* leaf = _processor->getNextLeaf();
-        if (leaf == 0)
-            return true;
-        Manipulator* manipulator = _matrix->manipulator(leaf);
-        if (manipulator->isDeleted())
-            return false;
+        if (leaf != 0) {
+            manipulator = _matrix->manipulator(leaf);
+            if (manipulator->isDeleted())
+                return false;
+        }
+        else {
+            // Help out a thread that has claimed more than it can start.
+            Vector point;
+            unsigned int iterations;
+            if (!maySteal ||
+                !_processor->dispatcher()->steal(this, &point, &iterations))
+                return true;
+            manipulator = _matrix->manipulator(point);
+            if (manipulator->isComplete() || manipulator->topLeft() != point)
+                return false;
+            leaf = manipulator->incompleteLeaf();
+            if (leaf->_iterations != iterations)
+                return false;
+        }
         _processor->splitNeeded();
         Vector point = manipulator->topLeft();
-        _point.x = point.x;
-        _point.y = point.y;
-        _evaluator.initFromLeaf(leaf);
-        _screen->initEvaluatorWithPoint(&_evaluator, point);
-        _iterations = leaf->_iterations;
-        if (_iterations == 0 && _evaluator.inSet()) {
+        lane->_point.x = point.x;
+        lane->_point.y = point.y;
+        evaluator->initFromLeaf(leaf);
+        _screen->initEvaluatorWithPoint(evaluator, point);
+        lane->_iterations = leaf->_iterations;
+        if (lane->_iterations == 0 && evaluator->inSet()) {
             manipulator->complete(0);
             return false;
         }
-        _pointValid = true;
+        LeafCache* cache = _processor->cache();
+        if (cache != 0) {
+            lane->_cacheKey = LeafCache::key(evaluator->cx(), evaluator->cy(),
+                evaluator->precision());
+            unsigned int colour;
+            if (lane->_iterations == 0 &&
+                cache->find(lane->_cacheKey, &colour)) {
+                // Evaluated before, here or in an earlier run.
+                manipulator->complete(colour);
+                return false;
+            }
+        }
+        lane->_pointValid = true;
+        lane->_state = Lane::ready;
         return false;
     }
 
+    // Claims points for the idle slots. Called with the processor locked.
+    void claim()
+    {
+        bool queued[maximumSlots];
+        for (int i = 0; i < _slotCount; ++i)
+            queued[i] = false;
+        for (LONG t = _readyTop; t != _readyBottom; ++t)
+            queued[_readySlots[t & (maximumSlots - 1)]] = true;
+        int emptyLanes = 0;
+        for (int i = 0; i < _laneCount; ++i)
+            if (_laneSlots[i] < 0)
+                ++emptyLanes;
+        bool outOfWork = false;
+        for (int i = 0; i < _slotCount && !outOfWork; ++i) {
+            Lane* lane = &_lanes[i];
+            if (lane->_state == Lane::ready && !queued[i]) {
+                // Another thread stole it.
+                lane->_state = Lane::idle;
+            }
+            while (lane->_state == Lane::idle && !outOfWork) {
+                // Only steal enough to fill our empty lanes. Taking a whole
+                // batch would leave the victim to steal it back.
+                bool maySteal = _readyBottom - _readyTop < emptyLanes;
+                outOfWork =
+                    preEvaluationProcessing(lane, _evaluators[i], maySteal);
+            }
+            if (lane->_state == Lane::ready && !queued[i]) {
+                _readySlots[_readyBottom & (maximumSlots - 1)] = i;
+                InterlockedIncrement(&_readyBottom);
+            }
+        }
+    }
+
+    // Takes the oldest claimed point that hasn't been started. This thread
+    // does this without the processor lock and thieves with it, so the only
+    // race is between this thread and one thief.
+    bool takeReady(int* slot)
+    {
+        do {
+            LONG top = _readyTop;
+            if (top == _readyBottom)
+                return false;
+            int s = _readySlots[top & (maximumSlots - 1)];
+            if (InterlockedCompareExchange(&_readyTop, top + 1, top) == top) {
+                *slot = s;
+                return true;
+            }
+        } while (true);
+    }
+
+    // Starts claimed points in the empty lanes, and returns the lanes that
+    // have points.
+    int fillLanes()
+    {
+        int active = 0;
+        for (int i = 0; i < _laneCount; ++i) {
+            int slot = _laneSlots[i];
+            if (slot < 0 && takeReady(&slot)) {
+                _laneSlots[i] = slot;
+                _lanes[slot]._state = Lane::running;
+                _laneEvaluators[i] = _evaluators[slot];
+            }
+            if (slot >= 0)
+                active |= 1 << i;
+        }
+        return active;
+    }
+
     void threadProc()
     {
         BEGIN_CHECKED {
             do {
-                _pointValid = false;
+                for (int i = 0; i < _slotCount; ++i) {
+                    _lanes[i]._state = Lane::idle;
+                    _lanes[i]._pointValid = false;
+                }
+                for (int i = 0; i < _laneCount; ++i)
+                    _laneSlots[i] = -1;
+                int allLanes = (1 << _laneCount) - 1;
                 _ready.wait();
                 do {
-                    {
+                    // Only take the lock when we've run out of claimed
+                    // points.
+                    int active = fillLanes();
+                    if (active != allLanes) {
                         Lock lock(_processor);
                         _running = true;
-                        postEvaluationProcessing();
+                        for (int i = 0; i < _slotCount; ++i) {
+                            Lane* lane = &_lanes[i];
+                            if (lane->_state == Lane::finished) {
+                                postEvaluationProcessing(lane,
+                                    _evaluators[i]);
+                                lane->_state = Lane::idle;
+                            }
+                        }
                         if (_ending) {
                             _running = false;
                             break;
                         }
-                        if (preEvaluationProcessing()) {
+                        // Once we run out of work, carry on with the points
+                        // we have.
+                        claim();
+                        active = fillLanes();
+                        if (active == 0) {
                             _running = false;
                             break;
                         }
                     }
-                    _evaluator.iterate();
+                    int finished = _iterator.iterate(_laneEvaluators, active);
+                    for (int i = 0; i < _laneCount; ++i)
+                        if ((finished & (1 << i)) != 0) {
+                            _lanes[_laneSlots[i]]._state = Lane::finished;
+                            _laneSlots[i] = -1;
+                        }
                 } while (true);
                 _finished.signal();
             } while (!_ending);
@@ -1976,16 +3356,25 @@ private:
     volatile bool _running;
     Event _ready;    // Set by UI thread to trigger this thread to start.
     Event _finished; // Set by this thread to tell the UI thread we're done.
-    Evaluator _evaluator;
+    Lanes _iterator;
+    int _laneCount;
+    int _slotCount;
+    Evaluator* _evaluators[maximumSlots];
+    Lane _lanes[maximumSlots];
+
+    // The slot each SIMD lane is iterating, or -1.
+    int _laneSlots[Lanes::maximumLanes];
+    Evaluator* _laneEvaluators[Lanes::maximumLanes];
+
+    // Claimed slots waiting for a lane, oldest (coarsest) first.
+    int _readySlots[maximumSlots];
+    volatile LONG _readyTop;
+    volatile LONG _readyBottom;
 
-    volatile Vector _point;
-    volatile bool _pointValid;
     FractalProcessor* _processor;
     Screen<FractalProcessor>* _screen;
     Matrix<FractalProcessor>* _matrix;
     WorkQueueList* _queue;
-
-    unsigned int _iterations;
 };
 
 
@@ -2134,6 +3523,18 @@ private:
 };
 
 
+// Gives thief, which has run out of work, a point that another of threads has
+// claimed but not started. Called with the processor locked.
+template<class Thread> bool stealPoint(const std::vector<Thread*>& threads,
+    Thread* thief, Vector* point, unsigned int* iterations)
+{
+    for (size_t i = 0; i < threads.size(); ++i)
+        if (threads[i] != 0 && threads[i] != thief &&
+            threads[i]->giveAway(point, iterations))
+            return true;
+    return false;
+}
+
 template<class FractalProcessor, class Thread> class Dispatcher
   : public IdleProcessor, Uncopyable
 {
@@ -2143,14 +3544,7 @@ public:
     void setProcessor(FractalProcessor* processor)
     {
         _processor = processor;
-
-        // Count available threads
-        DWORD_PTR pam, sam;
-        IF_ZERO_THROW(GetProcessAffinityMask(GetCurrentProcess(), &pam, &sam));
-        for (DWORD_PTR p = 1; p != 0; p <<= 1)
-            if ((pam&p) != 0)
-                ++_nThreads;
-
+        _nThreads = ThreadPool::availableThreads();
         _threads.resize(_nThreads, 0);
         _threadHandles.resize(_nThreads);
         for (int i = 0; i < _nThreads; ++i) {
@@ -2171,9 +3565,14 @@ public:
                 thread->end();
         }
         // Wait for them all to actually stop and delete them. Don't rethrow
-        // any exceptions here.
+        // any exceptions here. The others mustn't steal from a deleted
+        // thread.
         for (int i = 0; i < _nThreads; ++i) {
             Thread* thread = _threads[i];
+            {
+                Lock lock(_processor);
+                _threads[i] = 0;
+            }
             if (thread != 0)
                 delete thread;
         }
@@ -2208,6 +3607,12 @@ public:
         } while (!gotMessage);
     }
 
+    // Called with the processor locked by thief, which has run out of work.
+    bool steal(Thread* thief, Vector* point, unsigned int* iterations)
+    {
+        return stealPoint(_threads, thief, point, iterations);
+    }
+
     void growMatrix(Vector semiQuadrant)
     {
         for (int i = 0; i < _nThreads; ++i)
@@ -2249,33 +3654,46 @@ public:
         else
             _memoryLimit = static_cast<size_t>((ms.ullTotalPhys / 5) * 4);
         _memoryUsed = 0;
+        _memoryHighWaterMark = 0;
         for (int i = 0; i < 32; ++i)
             _leafCounts[i] = 0;
         _counterOffset = 0;
+        for (int i = 0; i < maximumPrecision; ++i)
+            _arenas[i] = 0;
+    }
+    ~MemoryTracker()
+    {
+        printLeafCounts();
+        for (int i = 0; i < maximumPrecision; ++i)
+            delete _arenas[i];
     }
-    ~MemoryTracker() { printLeafCounts(); }
 
     void setProcessor(FractalProcessor* processor)
     {
         _processor = processor;
         _allocator.setProcessor(processor);
+        // The size of a grid doesn't depend on its precision, since the
+        // numbers of incomplete leaves are in the LeafArenas.
         for (BlockType t = gridBlockType; t != lastBlockType;
             t = static_cast<BlockType>(static_cast<int>(t) + 1))
             for (int i = 0; i < 16; ++i)
-                for (int p = 0; p < 3; ++p)
-                    _heap[t][i][p] =
-                        _allocator.heapForSize(GridType(i, t, p, 0).bytes());
+                _heap[t][i] =
+                    _allocator.heapForSize(GridType(i, t, 0, 0).bytes());
     }
 
     bool canAllocate() const { return _memoryUsed < _memoryLimit; }
-    void adjustMemory(int bytes) { _memoryUsed += bytes; }
+    // Reference orbits are extended by the worker threads.
+    void adjustMemory(int bytes)
+    {
+        Lock lock(&_mutex);
+        _memoryUsed += bytes;
+        _memoryHighWaterMark = max(_memoryHighWaterMark, _memoryUsed);
+    }
+    size_t memoryHighWaterMark() const { return _memoryHighWaterMark; }
 
     typename Allocator::Heap* heapForType(GridType gridType)
     {
-        if (gridType._precision < 4)
-            return _heap[gridType._blockType][gridType._logBlocks]
-                [gridType._precision];
-        return _allocator.heapForSize(gridType.bytes());
+        return _heap[gridType._blockType][gridType._logBlocks];
     }
 
     Grid* allocateGrid(GridType gridType)
@@ -2301,6 +3719,30 @@ public:
         heapForType(grid->_gridType)->deallocate(grid);
     }
 
+    // Gives an incomplete leaf a slot for its numbers.
+    void allocateNumbers(IncompleteLeaf* leaf)
+    {
+        LeafArena* leafArena = arena(leaf->precision());
+        size_t bytes = leafArena->bytes();
+        leaf->_slot = leafArena->allocate();
+        adjustMemory(static_cast<int>(leafArena->bytes() - bytes));
+    }
+
+    void deallocateNumbers(IncompleteLeaf* leaf)
+    {
+        arena(leaf->precision())->deallocate(leaf->_slot);
+    }
+
+    LeafArena* arena(int precision)
+    {
+        LeafArena* leafArena = _arenas[precision];
+        if (leafArena == 0) {
+            leafArena = new LeafArena(precision + 1);
+            _arenas[precision] = leafArena;
+        }
+        return leafArena;
+    }
+
     void incrementLogPoints(Grid* grid)
     {
         if (grid->_gridType._blockType != gridBlockType) {
@@ -2352,9 +3794,15 @@ private:
 
     FractalProcessor* _processor;
     Allocator _allocator;
-    typename Allocator::Heap* _heap[lastBlockType][16][3];
+    // GridType::_precision is a 10-bit signed field.
+    static const int maximumPrecision = 0x200;
+
+    typename Allocator::Heap* _heap[lastBlockType][16];
+    LeafArena* _arenas[maximumPrecision];
     size_t _memoryLimit;
     size_t _memoryUsed;
+    size_t _memoryHighWaterMark;
+    Mutex _mutex;
 
     int _leafCounts[32];
     int _counterOffset;
@@ -2403,6 +3851,13 @@ public:
         ZoomingRotatingWindow::Params zwp(awp, -2.3);
         _window.create(zwp);
 
+        // Points evaluated in earlier runs. On Windows the file can't be
+        // shared, so if another instance is using it we run without it.
+        try {
+            _cache.open(File("mandel_quadtree.cache", true));
+        }
+        catch (Exception&) { }
+
         // Link up objects
         _queue.setProcessor(this);
         _dispatcher.setProcessor(this);
@@ -2464,6 +3919,8 @@ public:
 
     int maximumIterations() const { return 0x4000; }
     double getBailoutRadius2() const { return 16; }
+    // Undecided points are iterated for as long as they're on screen.
+    unsigned int iterationLimit() const { return 0xffffffff; }
 
     Matrix* matrix() { return &_matrix; }
     Screen* screen() { return &_screen; }
@@ -2473,6 +3930,7 @@ public:
     Dispatcher* dispatcher() { return &_dispatcher; }
     GridRenderer* renderer() { return _renderer; }
     ZoomingRotatingWindow* window() { return &_window; }
+    LeafCache* cache() { return _cache.valid() ? &_cache : 0; }
     float logScreensPerUnit() const { return _logScreensPerUnit; }
     void addIterations(int iterations) { _iterations += iterations; }
 
@@ -2495,12 +3953,15 @@ private:
     Direct3D _direct3D;
     float _logScreensPerUnit;
     WorkQueueList _queue;
+    // The screen's reference orbit is freed after everything else, and tells
+    // the tracker.
+    MemoryTracker _tracker;
     Screen _screen;
     TowerGrid _towerGrid;
     int _precision;
     int _derivatives;
-    MemoryTracker _tracker;
     Matrix _matrix;
+    LeafCache _cache;
     Device _device;
     Dispatcher _dispatcher;
     bool _leavesInQueue;
@@ -2515,11 +3976,577 @@ private:
     DWORD _lastTickCount;
 };
 
+class HeadlessProcessor;
+
+// HeadlessProcessor has nothing to paint, so its TowerGrid just keeps track
+// of the size of the grid for Screen. The picture is read from the matrix
+// once it's complete, by Screen::pixelColour().
+template<> class TowerGrid<HeadlessProcessor> : Uncopyable
+{
+public:
+    TowerGrid() : _size(1, 1) { }
+    void setProcessor(HeadlessProcessor* processor) { }
+
+    void split() { _size <<= 1; }
+    void combine(Vector offset) { _size = (_size + offset + 1) >> 1; }
+    void move(Vector topLeftTower, Vector bottomRightTower)
+    {
+        _size = bottomRightTower - topLeftTower;
+    }
+    void plot(Vector texel, int size, DWORD colour) { }
+    void tilePlot(Vector texel, int size, DWORD colour) { }
+    void update() { }
+
+    Vector size() const { return _size; }
+    // The same as the window's GridRenderer, so that the matrix is refined
+    // to the same depth.
+    int logTexelsPerTile() { return 8; }
+    int logTilesPerTower() { return 1; }
+private:
+    Vector _size;
+};
+
+// Runs the threads until there's nothing left for them to do, rather than
+// in the background of a message loop as Dispatcher does.
+template<class FractalProcessor, class Thread> class HeadlessDispatcher
+  : Uncopyable
+{
+public:
+    void setProcessor(FractalProcessor* processor, int threads)
+    {
+        _processor = processor;
+        _threads.resize(threads, 0);
+        _busy.resize(threads, false);
+        for (int i = 0; i < threads; ++i) {
+            Thread* thread = new Thread(_processor);
+            _threads[i] = thread;
+            thread->start();
+        }
+    }
+
+    ~HeadlessDispatcher()
+    {
+        for (size_t i = 0; i < _threads.size(); ++i)
+            if (_threads[i] != 0)
+                _threads[i]->end();
+        for (size_t i = 0; i < _threads.size(); ++i) {
+            Thread* thread = _threads[i];
+            {
+                Lock lock(_processor);
+                _threads[i] = 0;
+            }
+            delete thread;
+        }
+    }
+
+    // Called with the processor locked. A thread isn't restarted until
+    // run() has seen it finish, so that each go() has exactly one finish.
+    void resume()
+    {
+        for (size_t i = 0; i < _threads.size(); ++i)
+            if (!_busy[i]) {
+                _busy[i] = true;
+                _threads[i]->go();
+            }
+    }
+
+    void run()
+    {
+        do {
+            {
+                Lock lock(_processor);
+                _processor->resume();
+                if (std::find(_busy.begin(), _busy.end(), true) ==
+                    _busy.end())
+                    return;
+            }
+            for (size_t i = 0; i < _threads.size(); ++i) {
+                {
+                    Lock lock(_processor);
+                    if (!_busy[i])
+                        continue;
+                }
+                _threads[i]->waitUntilFinished();
+                _threads[i]->check();
+                Lock lock(_processor);
+                _busy[i] = false;
+            }
+        } while (true);
+    }
+
+    // Called with the processor locked by thief, which has run out of work.
+    bool steal(Thread* thief, Vector* point, unsigned int* iterations)
+    {
+        return stealPoint(_threads, thief, point, iterations);
+    }
+
+    void growMatrix(Vector semiQuadrant)
+    {
+        for (size_t i = 0; i < _threads.size(); ++i)
+            _threads[i]->growMatrix(semiQuadrant);
+    }
+
+    void shrinkMatrix(Vector semiQuadrant)
+    {
+        for (size_t i = 0; i < _threads.size(); ++i)
+            _threads[i]->shrinkMatrix(semiQuadrant);
+    }
+
+private:
+    FractalProcessor* _processor;
+    std::vector<Thread*> _threads;
+    std::vector<bool> _busy;
+};
+
+// Does the same progressive refinement as FractalProcessor, for one view
+// and without a window, until every point on the screen is decided. For
+// benchmarking evaluator changes reproducibly.
+class HeadlessProcessor : public Mutex
+{
+    typedef MandelbrotEvaluator<HeadlessProcessor> MandelbrotEvaluator;
+    typedef FractalThread<HeadlessProcessor, MandelbrotEvaluator>
+        FractalThread;
+    typedef IncompleteLeaf<HeadlessProcessor> IncompleteLeaf;
+    typedef Matrix<HeadlessProcessor> Matrix;
+    typedef Screen<HeadlessProcessor> Screen;
+    typedef WorkQueueList<HeadlessProcessor> WorkQueueList;
+    typedef HeadlessDispatcher<HeadlessProcessor, FractalThread> Dispatcher;
+    typedef MemoryTracker<HeadlessProcessor> MemoryTracker;
+    typedef TowerGrid<HeadlessProcessor> TowerGrid;
+public:
+    // Points that are still undecided after iterationLimit iterations are
+    // taken to be in the set.
+    HeadlessProcessor(Complex<double> centre, double logScreensPerUnit,
+        unsigned int iterationLimit, int threads)
+      : _logScreensPerUnit(logScreensPerUnit),
+        _iterationLimit(iterationLimit),
+        _maximumIterations(
+            static_cast<int>(min(0x4000u, (iterationLimit + 1) & ~1u))),
+        _splitNeeded(false),
+        _leavesInQueue(false),
+        _interrupted(false),
+        _evaluations(0),
+        _iterations(0)
+    {
+        _queue.setProcessor(this);
+        _dispatcher.setProcessor(this, threads);
+        _towerGrid.setProcessor(this);
+        _screen.setProcessor(this);
+        _tracker.setProcessor(this);
+        _matrix.setProcessor(this);
+        _screen.setInitial(centre, logScreensPerUnit);
+    }
+
+    // Refines the view at the given size in pixels and angle (as a fraction
+    // of a turn anticlockwise) until it's complete, and returns the picture.
+    Bitmap<DWORD> render(Vector size, double angle)
+    {
+        _screen.resize(size);
+        _screen.zoomRotate(Fix16p16(_logScreensPerUnit), Fix16p16(angle),
+            size/2, false, false);
+        leavesInQueue();
+        _dispatcher.run();
+
+        Bitmap<DWORD> bitmap(size);
+        for (int y = 0; y < size.y; ++y)
+            for (int x = 0; x < size.x; ++x) {
+                bitmap[Vector(x, y)] = _screen.pixelColour(
+                    Vector2<float>(x + 0.5f, y + 0.5f));
+            }
+        return bitmap;
+    }
+
+    // As FractalProcessor.
+    void resume()
+    {
+        if (_splitNeeded || _leavesInQueue || _interrupted) {
+            if (_leavesInQueue && _queue.atEnd()) {
+                _queue.reset();
+                _leavesInQueue = false;
+            }
+            _dispatcher.resume();
+        }
+    }
+
+    void splitNeeded() { _splitNeeded = true; }
+    void leavesInQueue() { _leavesInQueue = true; _splitNeeded = true; }
+    void setInterrupted() { _interrupted = true; }
+    void clearInterrupted() { _interrupted = false; }
+    bool interrupted() { return _interrupted; }
+
+    // As FractalProcessor.
+    IncompleteLeaf* getNextLeaf()
+    {
+        if (_queue.atEnd()) {
+            if (_leavesInQueue)
+                resume();
+            else
+                if (_splitNeeded) {
+                    _splitNeeded = false;
+                    _matrix.scheduleSplitLargeLeaves();
+                    if (!_matrix.resume()) {
+                        _interrupted = true;
+                        return 0;
+                    }
+                    if (_leavesInQueue)
+                        resume();
+                }
+        }
+        return _queue.get();
+    }
+
+    int maximumIterations() const { return _maximumIterations; }
+    double getBailoutRadius2() const { return 16; }
+    unsigned int iterationLimit() const { return _iterationLimit; }
+
+    Matrix* matrix() { return &_matrix; }
+    Screen* screen() { return &_screen; }
+    TowerGrid* towerGrid() { return &_towerGrid; }
+    WorkQueueList* queue() { return &_queue; }
+    MemoryTracker* tracker() { return &_tracker; }
+    Dispatcher* dispatcher() { return &_dispatcher; }
+    void addIterations(int iterations)
+    {
+        ++_evaluations;
+        _iterations += iterations;
+    }
+
+    UInt64 evaluations() const { return _evaluations; }
+    UInt64 iterations() const { return _iterations; }
+
+    // There's no cache unless this is called before render(), so that
+    // benchmarks are repeatable.
+    void openCache(const File& file) { _cache.open(file); }
+    LeafCache* cache() { return _cache.valid() ? &_cache : 0; }
+
+private:
+    double _logScreensPerUnit;
+    unsigned int _iterationLimit;
+    int _maximumIterations;
+    WorkQueueList _queue;
+    // The screen's reference orbit is freed after everything else, and tells
+    // the tracker.
+    MemoryTracker _tracker;
+    Screen _screen;
+    TowerGrid _towerGrid;
+    Matrix _matrix;
+    LeafCache _cache;
+    Dispatcher _dispatcher;
+    bool _splitNeeded;
+    bool _leavesInQueue;
+    bool _interrupted;
+
+    // Statistics
+    UInt64 _evaluations;
+    UInt64 _iterations;
+};
+
+// Renders one view without a window, for "-render".
+class HeadlessRenderer : Uncopyable
+{
+public:
+    HeadlessRenderer()
+      : _centre(-0.5, 0),
+        _zoom(0),
+        _angle(0),
+        _size(640, 480),
+        _iterationLimit(0x100000),
+        _threads(ThreadPool::availableThreads())
+    { }
+
+    // Returns false if the arguments aren't understood.
+    bool parse(const Array<String>& arguments)
+    {
+        if (arguments.count() < 3)
+            return false;
+        _outputName = arguments[2];
+        for (int i = 3; i < arguments.count(); ++i) {
+            String argument = arguments[i];
+            CharacterSource s(argument);
+            if (s.get() != '-')
+                return false;
+            int o = s.get();
+            String v = argument.subString(2, argument.length() - 2);
+            if (o == 'c') {
+                _cacheName = v;
+                continue;
+            }
+            double value = atof(NullTerminatedString(v));
+            switch (o) {
+                case 'x': _centre.x = value; continue;
+                case 'y': _centre.y = value; continue;
+                case 'z': _zoom = value; continue;
+                case 'r': _angle = value; continue;
+                case 'w': _size.x = static_cast<int>(value); continue;
+                case 'h': _size.y = static_cast<int>(value); continue;
+                case 'i':
+                    _iterationLimit = static_cast<unsigned int>(value);
+                    continue;
+                case 't': _threads = static_cast<int>(value); continue;
+            }
+            return false;
+        }
+        return _size.x > 0 && _size.y > 0 && _iterationLimit > 0 &&
+            _threads > 0;
+    }
+
+    void run()
+    {
+        Timer timer;
+        // The window starts at -2.3 (the whole set), and the zoom is
+        // relative to that.
+        HeadlessProcessor processor(_centre, -2.3 + _zoom, _iterationLimit,
+            _threads);
+        if (!_cacheName.empty())
+            processor.openCache(File(_cacheName, true));
+        Bitmap<DWORD> bitmap = processor.render(_size, _angle);
+        double seconds = timer.seconds();
+        PNGFileFormat<DWORD>().save(bitmap, File(_outputName, true));
+
+        double iterations = static_cast<double>(processor.iterations());
+        console.write(format("%.3f", seconds) + " seconds on " +
+            decimal(_threads) + " threads.\n" +
+            format("%.0f", static_cast<double>(processor.evaluations())) +
+            " point evaluations, " + format("%.0f", iterations) +
+            " iterations (" + format("%.0f", iterations/seconds) +
+            " per second).\n" + "Memory high-water mark " +
+            format("%.1f", processor.tracker()->memoryHighWaterMark()/
+                static_cast<double>(0x100000)) + "Mb.\n");
+    }
+
+    static String syntax()
+    {
+        return "-render <output.png> [<options>]\n"
+            "Options are:\n"
+            "  -x<real>, -y<imaginary>  centre (default -0.5, 0)\n"
+            "  -z<zoom>        log2 of magnification (default 0, the whole "
+            "set)\n"
+            "  -r<turns>       rotation anticlockwise (default 0)\n"
+            "  -w<width>, -h<height>  size in pixels (default 640x480)\n"
+            "  -i<iterations>  maximum iterations (default 1048576)\n"
+            "  -t<threads>     number of threads (default all)\n"
+            "  -c<file>        cache of evaluated points to use and update "
+            "(default none)\n";
+    }
+
+private:
+    String _outputName;
+    String _cacheName;
+    Complex<double> _centre;
+    double _zoom;
+    double _angle;
+    Vector _size;
+    unsigned int _iterationLimit;
+    int _threads;
+};
+
+// Stands in for FractalProcessor when evaluating points outside the matrix,
+// with the same limits.
+class BenchmarkProcessor
+{
+public:
+    int maximumIterations() const { return 0x4000; }
+    double getBailoutRadius2() const { return 16; }
+};
+
+// Measures how many points per second the double-precision evaluator gets
+// through on some well-known views, iterating one point at a time and with
+// MandelbrotLanes.
+class MandelbrotBenchmark : Uncopyable
+{
+    typedef MandelbrotEvaluator<BenchmarkProcessor> MandelbrotEvaluator;
+    typedef MandelbrotLanes<BenchmarkProcessor> MandelbrotLanes;
+
+    static const int gridSize = 256;
+    static const int points = gridSize*gridSize;
+
+    struct View
+    {
+        const char* _name;
+        double _x;
+        double _y;
+        double _size;
+    };
+public:
+    MandelbrotBenchmark() : _lanes(&_processor)
+    {
+        for (int i = 0; i < _lanes.lanes(); ++i)
+            _evaluators[i] = new MandelbrotEvaluator(&_processor);
+    }
+    ~MandelbrotBenchmark()
+    {
+        for (int i = 0; i < _lanes.lanes(); ++i)
+            delete _evaluators[i];
+    }
+    void run()
+    {
+        static const View views[] = {
+            { "Whole set",       -0.75,          0.0,          3.0 },
+            { "Seahorse valley", -0.745,         0.11,         0.02 },
+            { "Elephant valley",  0.3,           0.02,         0.05 },
+            { "Spiral",          -0.7436447860,  0.1318252536, 0.00003 }
+        };
+        console.write(decimal(_lanes.lanes()) + " lanes, " +
+            decimal(gridSize) + "x" + decimal(gridSize) + " points per "
+            "view.\n");
+        int viewCount = sizeof(views)/sizeof(views[0]);
+        for (int i = 0; i < viewCount; ++i) {
+            _view = &views[i];
+            _logDelta = static_cast<int>(
+                floor(log(_view->_size/gridSize)/log(2.0)));
+            double scalar = points/timeScalar();
+            double lanes = points/timeLanes();
+            console.write(String(_view->_name) + ": " +
+                format("%.0f", scalar) + " points/s one at a time, " +
+                format("%.0f", lanes) + " points/s in lanes (" +
+                format("%.2f", lanes/scalar) + "x)\n");
+        }
+    }
+private:
+    // Sets up evaluator to iterate point i, and returns true if it needs
+    // iterating.
+    bool setPoint(MandelbrotEvaluator* evaluator, int i)
+    {
+        double step = _view->_size/gridSize;
+        double x = _view->_x + ((i % gridSize) + 0.5 - gridSize/2)*step;
+        double y = _view->_y + ((i / gridSize) + 0.5 - gridSize/2)*step;
+        evaluator->initAtOrigin(2);
+        fixedFromDouble(evaluator->cx(), x, 0, 2);
+        fixedFromDouble(evaluator->cy(), y, 0, 2);
+        evaluator->setLogDelta(_logDelta);
+        return !evaluator->inSet();
+    }
+    double timeScalar()
+    {
+        MandelbrotEvaluator* evaluator = _evaluators[0];
+        Timer timer;
+        for (int i = 0; i < points; ++i)
+            if (setPoint(evaluator, i))
+                evaluator->iterate();
+        return timer.seconds();
+    }
+    double timeLanes()
+    {
+        Timer timer;
+        int next = 0;
+        int active = 0;
+        int finished = (1 << _lanes.lanes()) - 1;
+        do {
+            for (int i = 0; i < _lanes.lanes(); ++i) {
+                int bit = 1 << i;
+                if ((finished & bit) == 0)
+                    continue;
+                active &= ~bit;
+                while (next < points) {
+                    if (setPoint(_evaluators[i], next++)) {
+                        active |= bit;
+                        break;
+                    }
+                }
+            }
+            if (active == 0)
+                break;
+            finished = _lanes.iterate(_evaluators, active);
+        } while (true);
+        return timer.seconds();
+    }
+
+    BenchmarkProcessor _processor;
+    MandelbrotLanes _lanes;
+    MandelbrotEvaluator* _evaluators[MandelbrotLanes::maximumLanes];
+    const View* _view;
+    int _logDelta;
+};
+
+#ifdef X64_JIT
+// Checks that the generated code gets exactly the same results as
+// longFixedIterate() for each precision it handles, and compares speeds.
+// iterate() only uses it from 3 Digits, but 1 and 2 are checked too since
+// they take the single Word and single Digit paths through the generator.
+class JITTest : Uncopyable
+{
+    typedef MandelbrotEvaluator<BenchmarkProcessor> MandelbrotEvaluator;
+
+    static const int points = 1024;
+public:
+    JITTest() : _evaluator(&_processor) { }
+    void run()
+    {
+        int mismatches = 0;
+        for (int p = 1; p <= LongFixedJIT::maximumPrecision; ++p) {
+            double jit = 0;
+            double longFixed = 0;
+            Array<Digit> z(2*p);
+            for (int i = 0; i < points; ++i) {
+                setPoint(p, i);
+                Timer jitTimer;
+                _evaluator.jitIterate();
+                jit += jitTimer.seconds();
+                int result = _evaluator.result();
+                copy(&z[0], _evaluator.zx(), p);
+                copy(&z[p], _evaluator.zy(), p);
+
+                setPoint(p, i);
+                Timer longFixedTimer;
+                _evaluator.longFixedIterate();
+                longFixed += longFixedTimer.seconds();
+                if (_evaluator.result() != result ||
+                    memcmp(&z[0], _evaluator.zx(), p*sizeof(Digit)) != 0 ||
+                    memcmp(&z[p], _evaluator.zy(), p*sizeof(Digit)) != 0)
+                    ++mismatches;
+            }
+            console.write("Precision " + decimal(p) + ": " +
+                format("%.2f", longFixed/jit) + "x\n");
+        }
+        console.write(decimal(mismatches) + " mismatches.\n");
+    }
+private:
+    // Points along a line through seahorse valley, with some noise in the
+    // low Digits so that all of them are used.
+    void setPoint(int p, int i)
+    {
+        _evaluator.initAtOrigin(p);
+        double t = (i + 0.5)/points;
+        fixedFromDouble(_evaluator.cx(), -0.75 + 0.01*t, 0, p);
+        fixedFromDouble(_evaluator.cy(), 0.1 - 0.05*t, 0, p);
+        for (int j = 0; j < p - 2; ++j) {
+            _evaluator.cx()[j] = i*0x9e3779b9 + j;
+            _evaluator.cy()[j] = i*0x85ebca6b + j;
+        }
+        // With one Digit, delta is the lowest bit rather than 1.0.
+        _evaluator.setLogDelta(intBits - max(p - 1, 1)*bitsPerDigit);
+    }
+
+    BenchmarkProcessor _processor;
+    MandelbrotEvaluator _evaluator;
+};
+#endif
+
 class Program : public ProgramBase
 {
 public:
     void run()
     {
+        if (_arguments.count() >= 2 && _arguments[1] == "-benchmark") {
+            MandelbrotBenchmark().run();
+            return;
+        }
+        if (_arguments.count() >= 2 && _arguments[1] == "-render") {
+            HeadlessRenderer renderer;
+            if (!renderer.parse(_arguments)) {
+                console.write("Syntax: " + _arguments[0] + " " +
+                    HeadlessRenderer::syntax());
+                return;
+            }
+            renderer.run();
+            return;
+        }
+#ifdef X64_JIT
+        if (_arguments.count() >= 2 && _arguments[1] == "-testjit") {
+            JITTest().run();
+            return;
+        }
+#endif
         COMInitializer ci;
 
         GridRenderer<FractalProcessor> renderer(
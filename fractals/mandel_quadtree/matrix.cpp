@@ -80,51 +80,113 @@ public:
                     bytes()));
     }
 
-    void init(IncompleteLeaf* from)
+    // Initializes this leaf from one that is about to be deleted. At the
+    // same precision the leaves just exchange arena slots, so no digits need
+    // to be copied.
+    void init(FractalProcessor* processor, IncompleteLeaf* from)
     {
         _colour = from->_colour;
         _iterations = from->_iterations;
         int op = from->precision() + 1;
         int p = precision() + 1;
+        if (p == op) {
+            swap(_slot, from->_slot);
+            return;
+        }
         for (int i = 0; i < numbers(); ++i)
-            copy(number(i), p, from->number(i), op);
+            copy(number(processor, i), p, from->number(processor, i), op);
     }
 
-    Digit* number(int offset)
+    Digit* number(FractalProcessor* processor, int offset)
     {
-        return reinterpret_cast<Digit*>(
-            reinterpret_cast<Byte*>(this) + sizeof(IncompleteLeaf) +
-            offset*(precision() + 1)*sizeof(Digit));
+        return processor->tracker()->arena(precision())->
+            number(_slot, offset);
     }
 
-    IncompleteLeaf* next()
-    {
-        return reinterpret_cast<IncompleteLeaf*>(number(numbers()));
-    }
+    IncompleteLeaf* next() { return this + 1; }
 
-    void init(int colour)
+    void init(FractalProcessor* processor, int colour)
     {
         _colour = colour;
         _iterations = 0;
         for (int i = 0; i < numbers(); ++i)
-            zero(number(i), precision() + 1);
+            zero(number(processor, i), precision() + 1);
     }
 
-    int bytes() const
-    {
-        return sizeof(IncompleteLeaf) +
-            numbers()*sizeof(Digit)*(precision() + 1);
-    }
+    int bytes() const { return sizeof(IncompleteLeaf); }
 
     unsigned int _iterations;
 
     // Which grid is this leaf in?
     Grid* _parent;
 
+    // Where _z.x, _z.y, _zS.x and _zS.y are in the LeafArena for this leaf's
+    // precision.
+    UInt32 _slot;
+
     static int numbers() { return 4; }
+};
+
 
-    // Data for _z and _zS follows in "struck hack" fashion: _z.x, _z.y, _zS.x
-    // _zS.y.
+// The numbers of the incomplete leaves of one precision. Keeping these out of
+// the grids makes all incomplete leaves the same (small) size whatever their
+// precision, so moving a leaf (when a grid is defragmented, split or
+// consolidated) moves a 32-bit slot index instead of copying its digits.
+//
+// Slots are allocated in chunks which never move, and each chunk holds each
+// of the four numbers in its own array, so the same number of consecutive
+// slots is contiguous. Freed slots are reused before the arena grows.
+class LeafArena : Uncopyable
+{
+public:
+    LeafArena(int digits) : _digits(digits), _slots(0), _free(noSlot) { }
+    ~LeafArena()
+    {
+        for (size_t i = 0; i < _chunks.size(); ++i)
+            delete[] _chunks[i];
+    }
+
+    UInt32 allocate()
+    {
+        if (_free != noSlot) {
+            UInt32 slot = _free;
+            _free = *number(slot, 0);
+            return slot;
+        }
+        if ((_slots & slotMask) == 0)
+            _chunks.push_back(new Digit[chunkDigits()]);
+        return _slots++;
+    }
+
+    // The first digit of a free slot holds the next free slot.
+    void deallocate(UInt32 slot)
+    {
+        *number(slot, 0) = _free;
+        _free = slot;
+    }
+
+    Digit* number(UInt32 slot, int offset)
+    {
+        return _chunks[slot >> logSlotsPerChunk] +
+            ((offset << logSlotsPerChunk) + (slot & slotMask))*_digits;
+    }
+
+    size_t bytes() const { return _chunks.size()*chunkDigits()*sizeof(Digit); }
+
+private:
+    static const int logSlotsPerChunk = 10;
+    static const UInt32 slotMask = (1 << logSlotsPerChunk) - 1;
+    static const UInt32 noSlot = 0xffffffff;
+
+    size_t chunkDigits() const
+    {
+        return (4 << logSlotsPerChunk)*static_cast<size_t>(_digits);
+    }
+
+    int _digits;
+    UInt32 _slots;
+    UInt32 _free;
+    std::vector<Digit*> _chunks;
 };
 
 
@@ -157,8 +219,7 @@ public:
         if (_blockType == completeLeafType)
             return sizeof(CompleteLeaf);
         if (_blockType == incompleteLeafType)
-            return sizeof(IncompleteLeaf) +
-                IncompleteLeaf::numbers()*sizeof(Digit)*(_precision + 1);
+            return sizeof(IncompleteLeaf);
         return sizeof(GridBlock);
     }
 
@@ -260,8 +321,11 @@ public:
                         oldGrid->blockAtIndex(0));
                     int n = _gridType.count();
                     for (int i = 0; i < n; ++i) {
+                        // The numbers stay where they are in the arena.
                         incompleteLeaf->moveFrom(oldLeaf);
-                        incompleteLeaf->init(oldLeaf);
+                        incompleteLeaf->_colour = oldLeaf->_colour;
+                        incompleteLeaf->_iterations = oldLeaf->_iterations;
+                        incompleteLeaf->_slot = oldLeaf->_slot;
                         processor->tracker()->reseatLeaf(oldLeaf,
                             incompleteLeaf, logPointsPerLeaf);
                         incompleteLeaf->_parent = this;
@@ -447,7 +511,7 @@ protected:
     int blocksPerGroup() const { return 1 << _logBlocksPerGroup; }
 
     // Move the blocks from source to this group.
-    void moveBlocks(BlockGroup source)
+    void moveBlocks(FractalProcessor* processor, BlockGroup source)
     {
         int destinationStride = blocksPerGrid();
         int sourceStride = source.blocksPerGrid();
@@ -463,8 +527,8 @@ protected:
                 Byte* source = sourceLine;
                 Byte* destination = destinationLine;
                 for (int x = 0; x < width; ++x) {
-                    reinterpret_cast<IncompleteLeaf*>(destination)->
-                        init(reinterpret_cast<IncompleteLeaf*>(source));
+                    reinterpret_cast<IncompleteLeaf*>(destination)->init(
+                        processor, reinterpret_cast<IncompleteLeaf*>(source));
                     source += bytes;
                     destination += bytes;
                 }
@@ -802,6 +866,7 @@ public:
             while (!atEnd()) {
                 IncompleteLeaf* leaf = incompleteLeaf();
                 leaf->_parent = grid;
+                _processor->tracker()->allocateNumbers(leaf);
                 _processor->queue()->add(leaf, logPointsPerGroup());
                 moveNext();
             }
@@ -873,7 +938,7 @@ public:
         for (int i = 0; i < 4; ++i) {
             descend();
             setLogBlocksPerGroup(logBlocks);
-            other.moveBlocks(*this);
+            other.moveBlocks(_processor, *this);
             ascend();
             other.moveNext();
             deleteChildGrid();
@@ -932,6 +997,7 @@ public:
             while (!atEnd()) {
                 _processor->queue()->remove(incompleteLeaf(),
                     _grid->logPointsPerBlock(_processor->matrix())/* logPointsPerGroup()*/);
+                _processor->tracker()->deallocateNumbers(incompleteLeaf());
                 moveNext();
             }
         _processor->tracker()->deallocateGrid(_grid);
@@ -1054,10 +1120,10 @@ protected:
             Grid* quad = parent().createGrid(
                 1, incompleteLeafType, screenPrecision(1));
             dest = parent().child();
-            dest.moveBlocks(*this);
+            dest.moveBlocks(_processor, *this);
             dest.moveNext();
             for (int i = 1; i < 4; ++i) {
-                dest.incompleteLeaf()->init(colour);
+                dest.incompleteLeaf()->init(_processor, colour);
                 dest.moveNext();
             }
         }
@@ -1068,7 +1134,7 @@ protected:
                     1, incompleteLeafType, screenPrecision(1));
                 dest = parent().child();
                 for (int i = 0; i < 4; ++i) {
-                    dest.incompleteLeaf()->init(colour);
+                    dest.incompleteLeaf()->init(_processor, colour);
                     dest.moveNext();
                 }
             }
@@ -1133,7 +1199,7 @@ protected:
         }
         else {
             newGrid = parent().createGrid(0, type, screenPrecision(-1));
-            parent().child().moveBlocks(*this);
+            parent().child().moveBlocks(_processor, *this);
         }
         // This should not invalidate newGrid, because newGrid should be 1x1
         // and we're deleting a 2x2 grid.
@@ -1149,7 +1215,7 @@ protected:
     void createLeaf(int colour = 0)
     {
         createGrid(0, incompleteLeafType, screenPrecision(0));
-        child().incompleteLeaf()->init(colour);
+        child().incompleteLeaf()->init(_processor, colour);
         moveNext();
     }
 
@@ -1177,7 +1243,7 @@ protected:
             dest.createGrid(logBlocks, type, p);
             dest.descend();
             dest.setLogBlocksPerGroup(logBlocks);
-            dest.moveBlocks(*this);
+            dest.moveBlocks(_processor, *this);
             dest.ascend();
             dest.moveNext();
             moveNext();
@@ -1285,6 +1351,14 @@ public:
         Manipulator::plot(location);
     }
 
+    // The colour of the leaf containing a point.
+    unsigned int colourAt(Vector point)
+    {
+        reset();
+        moveTo(point);
+        return Manipulator::colour();
+    }
+
     // Splits leaves larger than a tile.
     void splitMultiTileLeaves()
     {
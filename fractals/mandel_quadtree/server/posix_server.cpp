@@ -0,0 +1,1016 @@
+// Portable fractal computation server.
+//
+// Clients send boxes of points to iterate and the server streams back the
+// result for each point as soon as it's known, so that a deep zoom can be
+// spread across the cores of several machines. This is the POSIX
+// counterpart of server.cpp. One thread does all the socket IO with epoll,
+// and a pool of workers (one per core by default) does the computation.
+// Each worker keeps its own queue of boxes, most important first, and takes
+// boxes from the other workers' queues when its own is empty, so that no
+// core sits idle while there's work queued behind another one.
+//
+// It doesn't use alfe (which is Windows-only) so builds on its own:
+//   g++ -O2 -std=c++11 -pthread posix_server.cpp -o posix_server
+//
+// Usage:
+//   posix_server [-p<port>] [-t<threads>]
+//     Serve until killed (default port 24448, one thread per core).
+//   posix_server -c<host> [-p<port>] [<driver options>]
+//     Send boxes to a server and report the end-to-end throughput.
+//   posix_server -l [-t<threads>] [<driver options>]
+//     The same, with a server started in this process, over loopback.
+//   Driver options (defaults in brackets) are:
+//     -x<real> -y<imaginary>  centre (-0.75, 0.1)
+//     -s<size>                width and height of the area (0.01)
+//     -d<digits>              precision in 32-bit digits (4)
+//     -b<boxes>               number of boxes (256)
+//     -n<points>              points per box, a square number (256)
+//     -i<iterations>          maximum iterations (65536)
+//
+// Protocol. All values are 32-bit words, in the byte order of the hosts
+// (which is assumed to be the same - little-endian in practice). A box is:
+//   _points, _precision, _id, _priority, _bailoutRadius2, _logDelta,
+//     _maximumIterations, _logUnitsPerTexel (see BoxHeader)
+//   _precision words of c.x at texel (0, 0)
+//   _precision words of c.y at texel (0, 0)
+//   _points entries of: texel x, texel y, then _precision words each of
+//     z.x, z.y, zS.x and zS.y
+// Boxes with a lower _priority (e.g. those nearer the middle of the screen)
+// are iterated first. For each point the server sends:
+//   _id of the box, index of the point in the box, result
+// where result is the number of iterations to escape, or minus the number of
+// iterations to detect periodicity, or -1 if the point is still undecided
+// after _maximumIterations. In that case the 4*_precision words of z.x, z.y,
+// zS.x and zS.y follow, so that the client can send the point again to carry
+// on.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <vector>
+#include <queue>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <stdexcept>
+
+// long_fixed.cpp expects these from alfe and <intrin.h>.
+typedef uint64_t UInt64;
+typedef uint8_t Byte;
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+inline void cpuid(int info[4], int leaf, int subleaf)
+{
+    unsigned int a, b, c, d;
+    __cpuid_count(leaf, subleaf, a, b, c, d);
+    info[0] = a;
+    info[1] = b;
+    info[2] = c;
+    info[3] = d;
+}
+#undef __cpuid
+#undef __cpuidex
+#define __cpuid(info, leaf) cpuid(info, leaf, 0)
+#define __cpuidex(info, leaf, subleaf) cpuid(info, leaf, subleaf)
+#endif
+
+#include "../long_fixed.cpp"
+
+static void throwSystemError(const std::string& message)
+{
+    throw std::runtime_error(message + ": " + strerror(errno));
+}
+
+struct BoxHeader
+{
+    static const int maximumPrecision = 1024;
+    static const int maximumPoints = 0x10000;
+
+    bool valid() const
+    {
+        return _points > 0 && _points <= maximumPoints && _precision > 0 &&
+            _precision <= maximumPrecision && _maximumIterations > 0;
+    }
+    int entryDigits() const { return 2 + 4*_precision; }
+    int digits() const { return 2*_precision + _points*entryDigits(); }
+
+    int _points;
+    int _precision;
+    int _id;                // Not used by server, just passed back
+    int _priority;          // Lower is more important
+    int _bailoutRadius2;    // Compared with the top digit of |z|^2
+    int _logDelta;          // Periodicity is detected to within 2^_logDelta
+    int _maximumIterations;
+    int _logUnitsPerTexel;
+};
+
+class Connection;
+
+class Box
+{
+public:
+    Box(const BoxHeader& header, const Byte* data,
+        const std::shared_ptr<Connection>& connection)
+      : _header(header), _data(header.digits()), _connection(connection)
+    {
+        memcpy(&_data[0], data, _data.size()*sizeof(Digit));
+    }
+
+    Digit* cx() { return &_data[0]; }
+    Digit* cy() { return cx() + _header._precision; }
+    // Texel x and y followed by z.x, z.y, zS.x and zS.y.
+    Digit* entry(int i)
+    {
+        return cy() + _header._precision + i*_header.entryDigits();
+    }
+
+    BoxHeader _header;
+    std::vector<Digit> _data;
+    std::shared_ptr<Connection> _connection;
+};
+
+// Orders the worker queues with the most important box on top.
+struct LessImportant
+{
+    bool operator()(const Box* a, const Box* b) const
+    {
+        return a->_header._priority > b->_header._priority;
+    }
+};
+
+class Connection
+{
+public:
+    Connection(int fd)
+      : _fd(fd), _received(0), _sent(0), _closed(false), _waking(false)
+    { }
+    // The descriptor isn't closed until the workers have finished with the
+    // boxes from this connection, so it can't be reused for another one
+    // while they still refer to it.
+    ~Connection() { ::close(_fd); }
+
+    int fd() const { return _fd; }
+
+    // IO thread: reads what's available and returns the complete boxes, or
+    // returns false if the connection has closed or sent a bad box.
+    bool receive(const std::shared_ptr<Connection>& self,
+        std::vector<Box*>* boxes)
+    {
+        bool open = true;
+        do {
+            if (_incoming.size() - _received < 0x10000)
+                _incoming.resize(_received + 0x10000);
+            ssize_t n = recv(_fd, &_incoming[_received],
+                _incoming.size() - _received, 0);
+            if (n > 0) {
+                _received += n;
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (n < 0 && errno == EINTR)
+                continue;
+            open = false;
+            break;
+        } while (true);
+
+        size_t offset = 0;
+        do {
+            if (_received - offset < sizeof(BoxHeader))
+                break;
+            BoxHeader header;
+            memcpy(&header, &_incoming[offset], sizeof(BoxHeader));
+            if (!header.valid())
+                return false;
+            size_t bytes =
+                sizeof(BoxHeader) + header.digits()*sizeof(Digit);
+            if (_received - offset < bytes)
+                break;
+            boxes->push_back(new Box(header,
+                &_incoming[offset + sizeof(BoxHeader)], self));
+            offset += bytes;
+        } while (true);
+        memmove(&_incoming[0], &_incoming[offset], _received - offset);
+        _received -= offset;
+        return open;
+    }
+
+    // Worker thread: queues the result for a point. Returns true if the IO
+    // thread needs to be woken to send it.
+    bool addResult(const void* data, size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_closed)
+            return false;
+        const Byte* b = static_cast<const Byte*>(data);
+        _outgoing.insert(_outgoing.end(), b, b + bytes);
+        if (_waking)
+            return false;
+        _waking = true;
+        return true;
+    }
+
+    // IO thread: sends as much as possible. Returns false if the connection
+    // failed. Sets *pending if there's more to send when the socket is
+    // writable again.
+    bool send(bool* pending)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        while (_sent < _outgoing.size()) {
+            ssize_t n = ::send(_fd, &_outgoing[_sent],
+                _outgoing.size() - _sent, MSG_NOSIGNAL);
+            if (n >= 0) {
+                _sent += n;
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                *pending = true;
+                return true;
+            }
+            return false;
+        }
+        _outgoing.clear();
+        _sent = 0;
+        _waking = false;
+        *pending = false;
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closed = true;
+        _outgoing.clear();
+        shutdown(_fd, SHUT_RDWR);
+    }
+
+    bool closed()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _closed;
+    }
+
+private:
+    int _fd;
+    std::vector<Byte> _incoming;
+    size_t _received;
+
+    std::mutex _mutex;
+    std::vector<Byte> _outgoing;
+    size_t _sent;
+    bool _closed;
+    // The IO thread has been asked to send and hasn't finished yet.
+    bool _waking;
+};
+
+// Iterates the points of a box. Each worker has one.
+class PointIterator
+{
+public:
+    void setBox(Box* box)
+    {
+        _box = box;
+        _precision = box->_header._precision;
+        _maximumIterations = box->_header._maximumIterations;
+        _logDelta = box->_header._logDelta;
+        _bailoutRadius2 = box->_header._bailoutRadius2;
+        int p = _precision;
+        _buffer.ensureLength(7*p);
+        Digit* t = _buffer;
+        for (int i = 0; i < 7; ++i) {
+            _t[i] = t;
+            t += p;
+        }
+        _scratch.ensureLength(multiplyScratchDigits(p));
+    }
+
+    // Returns the result for point i, leaving z and zS in the box.
+    int iterate(int i)
+    {
+        int p = _precision;
+        Digit* entry = _box->entry(i);
+        int logUnitsPerTexel = _box->_header._logUnitsPerTexel;
+        fixedFromDouble(_t[4], static_cast<SignedDigit>(entry[0]),
+            logUnitsPerTexel, p);
+        add(_t[4], _t[4], _box->cx(), p);
+        fixedFromDouble(_t[5], static_cast<SignedDigit>(entry[1]),
+            logUnitsPerTexel, p);
+        add(_t[5], _t[5], _box->cy(), p);
+        _zx = entry + 2;
+        _zy = _zx + p;
+        _zSx = _zy + p;
+        _zSy = _zSx + p;
+        if (p <= 2)
+            return doubleIterate();
+        return longFixedIterate();
+    }
+
+private:
+    int doubleIterate()
+    {
+        int p = _precision;
+        double zx = doubleFromFixed(_zx, 0, p);
+        double zy = doubleFromFixed(_zy, 0, p);
+        double zSx = doubleFromFixed(_zSx, 0, p);
+        double zSy = doubleFromFixed(_zSy, 0, p);
+        double cx = doubleFromFixed(_t[4], 0, p);
+        double cy = doubleFromFixed(_t[5], 0, p);
+        double delta = ldexp(1.0, _logDelta);
+        double bailoutRadius2 = ldexp(static_cast<double>(_bailoutRadius2),
+            intBits - bitsPerDigit);
+        for (int i = 0; i < _maximumIterations; i += 2) {
+            double zr2 = zx*zx;
+            double zi2 = zy*zy;
+            zy = 2*zx*zy + cy;
+            zx = zr2 - zi2 + cx;
+            if (zr2 + zi2 > bailoutRadius2)
+                return i + 1;
+
+            zr2 = zx*zx;
+            zi2 = zy*zy;
+            zy = 2*zx*zy + cy;
+            zx = zr2 - zi2 + cx;
+            if (zr2 + zi2 > bailoutRadius2)
+                return i + 2;
+
+            zr2 = zSx*zSx;
+            zi2 = zSy*zSy;
+            zSy = 2*zSx*zSy + cy;
+            zSx = zr2 - zi2 + cx;
+            if (fabs(zx - zSx) < delta && fabs(zy - zSy) < delta)
+                return -(i + 2);
+        }
+        fixedFromDouble(_zx, zx, 0, p);
+        fixedFromDouble(_zy, zy, 0, p);
+        fixedFromDouble(_zSx, zSx, 0, p);
+        fixedFromDouble(_zSy, zSy, 0, p);
+        return -1;
+    }
+
+    int longFixedIterate()
+    {
+        int p = _precision;
+        Digit* s = _scratch;
+        fixedFromDouble(_t[3], 1.0, _logDelta, p);
+        for (int i = 0; i < _maximumIterations; i += 2) {
+            multiply(_t[0], _zx, _zx, s, p);
+            multiply(_t[1], _zy, _zy, s, p);
+            add(_t[2], _t[0], _t[1], p);
+            if (static_cast<SignedDigit>(_t[2][p - 1]) > _bailoutRadius2)
+                return i + 1;
+            multiply(_t[2], _zx, _zy, s, p, intBits + 1);
+            add(_zx, _t[0], _t[4], p);
+            sub(_zx, _zx, _t[1], p);
+            add(_zy, _t[2], _t[5], p);
+
+            multiply(_t[0], _zx, _zx, s, p);
+            multiply(_t[1], _zy, _zy, s, p);
+            add(_t[2], _t[0], _t[1], p);
+            if (static_cast<SignedDigit>(_t[2][p - 1]) > _bailoutRadius2)
+                return i + 2;
+            multiply(_t[2], _zx, _zy, s, p, intBits + 1);
+            add(_zx, _t[0], _t[4], p);
+            sub(_zx, _zx, _t[1], p);
+            add(_zy, _t[2], _t[5], p);
+
+            multiply(_t[0], _zSx, _zSx, s, p);
+            multiply(_t[1], _zSy, _zSy, s, p);
+            multiply(_t[2], _zSx, _zSy, s, p, intBits + 1);
+            add(_zSx, _t[0], _t[4], p);
+            sub(_zSx, _zSx, _t[1], p);
+            add(_zSy, _t[2], _t[5], p);
+            sub(_t[0], _zSx, _zx, p);
+            abs(_t[0], _t[0], p);
+            if (lessThan(_t[0], _t[3], p)) {
+                sub(_t[0], _zSy, _zy, p);
+                abs(_t[0], _t[0], p);
+                if (lessThan(_t[0], _t[3], p))
+                    return -(i + 2);
+            }
+        }
+        return -1;
+    }
+
+    Box* _box;
+    int _precision;
+    int _maximumIterations;
+    int _logDelta;
+    SignedDigit _bailoutRadius2;
+    DigitBuffer _buffer;
+    DigitBuffer _scratch;
+    Digit* _t[7];
+    Digit* _zx;
+    Digit* _zy;
+    Digit* _zSx;
+    Digit* _zSy;
+};
+
+class Server
+{
+    struct WorkerQueue
+    {
+        std::mutex _mutex;
+        std::priority_queue<Box*, std::vector<Box*>, LessImportant> _boxes;
+    };
+
+public:
+    Server(const char* port, int threads)
+      : _epoll(-1), _wake(-1), _listen(-1), _ending(false), _queued(0),
+        _nextQueue(0), _queues(threads)
+    {
+        try {
+            _epoll = epoll_create1(EPOLL_CLOEXEC);
+            if (_epoll == -1)
+                throwSystemError("Creating epoll instance");
+            _wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (_wake == -1)
+                throwSystemError("Creating eventfd");
+            listen(port);
+            watch(_wake, EPOLLIN, 0);
+            watch(_listen, EPOLLIN, 0);
+        }
+        catch (...) {
+            closeDescriptors();
+            throw;
+        }
+        for (int i = 0; i < threads; ++i)
+            _workers.push_back(std::thread(&Server::work, this, i));
+    }
+
+    ~Server()
+    {
+        stop();
+        for (auto& worker : _workers)
+            worker.join();
+        for (auto& queue : _queues)
+            while (!queue._boxes.empty()) {
+                delete queue._boxes.top();
+                queue._boxes.pop();
+            }
+        for (auto& connection : _connections)
+            connection.second->close();
+        closeDescriptors();
+    }
+
+    int port() const { return _port; }
+
+    // Does the IO until stop() is called.
+    void run()
+    {
+        epoll_event events[64];
+        while (!_ending) {
+            int n = epoll_wait(_epoll, events, 64, -1);
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                throwSystemError("Waiting for socket events");
+            }
+            for (int i = 0; i < n; ++i) {
+                Connection* connection =
+                    static_cast<Connection*>(events[i].data.ptr);
+                if (connection == 0) {
+                    // The listening socket or the eventfd.
+                    accept();
+                    sendResults();
+                    continue;
+                }
+                // It may have been closed by an earlier event in this batch.
+                auto c = _connections.find(connection);
+                if (c == _connections.end())
+                    continue;
+                std::shared_ptr<Connection> s = c->second;
+                bool ok = true;
+                if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) !=
+                    0) {
+                    std::vector<Box*> boxes;
+                    ok = connection->receive(s, &boxes);
+                    for (auto box : boxes)
+                        submit(box);
+                }
+                if (ok && (events[i].events & EPOLLOUT) != 0)
+                    ok = send(s);
+                if (!ok)
+                    close(s);
+            }
+        }
+    }
+
+    // Can be called from any thread.
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_idleMutex);
+            _ending = true;
+        }
+        _work.notify_all();
+        wake();
+    }
+
+private:
+    void closeDescriptors()
+    {
+        if (_listen != -1)
+            ::close(_listen);
+        if (_wake != -1)
+            ::close(_wake);
+        if (_epoll != -1)
+            ::close(_epoll);
+    }
+
+    void listen(const char* port)
+    {
+        addrinfo hints;
+        memset(&hints, 0, sizeof(addrinfo));
+        hints.ai_family = AF_INET6;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo* address;
+        if (getaddrinfo(0, port, &hints, &address) != 0)
+            throw std::runtime_error("Resolving port " + std::string(port));
+        _listen = socket(address->ai_family,
+            address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            address->ai_protocol);
+        if (_listen == -1) {
+            freeaddrinfo(address);
+            throwSystemError("Creating socket");
+        }
+        // Accept IPv4 connections as well.
+        int off = 0;
+        setsockopt(_listen, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        int on = 1;
+        setsockopt(_listen, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        int r = bind(_listen, address->ai_addr, address->ai_addrlen);
+        freeaddrinfo(address);
+        if (r == -1)
+            throwSystemError("Binding to port " + std::string(port));
+        if (::listen(_listen, SOMAXCONN) == -1)
+            throwSystemError("Listening");
+        sockaddr_in6 bound;
+        socklen_t length = sizeof(bound);
+        if (getsockname(_listen, reinterpret_cast<sockaddr*>(&bound),
+            &length) == -1)
+            throwSystemError("Finding port");
+        _port = ntohs(bound.sin6_port);
+    }
+
+    void watch(int fd, uint32_t events, Connection* connection,
+        int operation = EPOLL_CTL_ADD)
+    {
+        epoll_event event;
+        event.events = events;
+        event.data.ptr = connection;
+        if (epoll_ctl(_epoll, operation, fd, &event) == -1)
+            throwSystemError("Watching socket");
+    }
+
+    void accept()
+    {
+        do {
+            int fd = accept4(_listen, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd == -1) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                // EAGAIN when there are no more, or out of descriptors, in
+                // which case we'll try again on the next event.
+                return;
+            }
+            // Results are small, and should go as soon as they're ready.
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            std::shared_ptr<Connection> connection(new Connection(fd));
+            _connections[connection.get()] = connection;
+            watch(fd, EPOLLIN, connection.get());
+        } while (true);
+    }
+
+    void close(const std::shared_ptr<Connection>& connection)
+    {
+        epoll_ctl(_epoll, EPOLL_CTL_DEL, connection->fd(), 0);
+        connection->close();
+        _connections.erase(connection.get());
+    }
+
+    // Returns false if the connection failed.
+    bool send(const std::shared_ptr<Connection>& connection)
+    {
+        bool pending;
+        if (!connection->send(&pending))
+            return false;
+        uint32_t events = EPOLLIN;
+        if (pending)
+            events |= EPOLLOUT;
+        watch(connection->fd(), events, connection.get(), EPOLL_CTL_MOD);
+        return true;
+    }
+
+    // Sends the results that the workers have queued since we last looked.
+    void sendResults()
+    {
+        uint64_t count;
+        if (read(_wake, &count, sizeof(count)) != sizeof(count))
+            return;
+        std::vector<std::shared_ptr<Connection>> ready;
+        {
+            std::lock_guard<std::mutex> lock(_readyMutex);
+            ready.swap(_ready);
+        }
+        for (auto& connection : ready)
+            if (!connection->closed() && !send(connection))
+                close(connection);
+    }
+
+    void wake()
+    {
+        uint64_t one = 1;
+        if (write(_wake, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            throwSystemError("Waking IO thread");
+    }
+
+    // Worker thread: the IO thread has a result to send on connection.
+    void resultReady(const std::shared_ptr<Connection>& connection)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_readyMutex);
+            _ready.push_back(connection);
+        }
+        wake();
+    }
+
+    // IO thread: the boxes are shared out between the workers in turn, and
+    // the workers rebalance them by stealing.
+    void submit(Box* box)
+    {
+        WorkerQueue* queue = &_queues[_nextQueue];
+        _nextQueue = (_nextQueue + 1) % _queues.size();
+        {
+            std::lock_guard<std::mutex> lock(queue->_mutex);
+            queue->_boxes.push(box);
+        }
+        {
+            std::lock_guard<std::mutex> lock(_idleMutex);
+            ++_queued;
+        }
+        _work.notify_one();
+    }
+
+    // Worker thread: returns the most important box from this worker's queue
+    // or, if that's empty, from the first other queue that isn't. Waits if
+    // there aren't any, and returns 0 when the server is stopping.
+    Box* take(int worker)
+    {
+        int n = static_cast<int>(_queues.size());
+        do {
+            for (int i = 0; i < n; ++i) {
+                WorkerQueue* queue = &_queues[(worker + i) % n];
+                std::lock_guard<std::mutex> lock(queue->_mutex);
+                if (!queue->_boxes.empty()) {
+                    Box* box = queue->_boxes.top();
+                    queue->_boxes.pop();
+                    std::lock_guard<std::mutex> idleLock(_idleMutex);
+                    --_queued;
+                    return box;
+                }
+            }
+            std::unique_lock<std::mutex> lock(_idleMutex);
+            while (_queued == 0 && !_ending)
+                _work.wait(lock);
+            if (_ending)
+                return 0;
+        } while (true);
+    }
+
+    void work(int worker)
+    {
+        PointIterator iterator;
+        std::vector<Digit> result;
+        try {
+            while (Box* box = take(worker)) {
+                std::unique_ptr<Box> owner(box);
+                std::shared_ptr<Connection> connection = box->_connection;
+                iterator.setBox(box);
+                int p = box->_header._precision;
+                for (int i = 0; i < box->_header._points; ++i) {
+                    if (connection->closed())
+                        break;
+                    int iterations = iterator.iterate(i);
+                    result.resize(3);
+                    result[0] = box->_header._id;
+                    result[1] = i;
+                    result[2] = iterations;
+                    if (iterations == -1) {
+                        Digit* z = box->entry(i) + 2;
+                        result.insert(result.end(), z, z + 4*p);
+                    }
+                    if (connection->addResult(&result[0],
+                        result.size()*sizeof(Digit)))
+                        resultReady(connection);
+                }
+            }
+        }
+        catch (std::exception& e) {
+            fprintf(stderr, "Worker failed: %s\n", e.what());
+            abort();
+        }
+    }
+
+    int _epoll;
+    int _wake;
+    int _listen;
+    int _port;
+    std::map<Connection*, std::shared_ptr<Connection>> _connections;
+
+    std::mutex _readyMutex;
+    std::vector<std::shared_ptr<Connection>> _ready;
+
+    std::mutex _idleMutex;
+    std::condition_variable _work;
+    std::atomic<bool> _ending;
+    int _queued;
+
+    int _nextQueue;
+    std::vector<WorkerQueue> _queues;
+    std::vector<std::thread> _workers;
+};
+
+// Sends a square of boxes to a server and measures how long it takes for
+// all the results to come back.
+class ThroughputClient
+{
+public:
+    ThroughputClient()
+      : _centreX(-0.75), _centreY(0.1), _size(0.01), _precision(4),
+        _boxes(256), _points(256), _maximumIterations(65536)
+    { }
+
+    // Returns false if the option isn't a driver option.
+    bool option(char o, const char* value)
+    {
+        switch (o) {
+            case 'x': _centreX = atof(value); return true;
+            case 'y': _centreY = atof(value); return true;
+            case 's': _size = atof(value); return true;
+            case 'd': _precision = atoi(value); return true;
+            case 'b': _boxes = atoi(value); return true;
+            case 'n': _points = atoi(value); return true;
+            case 'i': _maximumIterations = atoi(value); return true;
+        }
+        return false;
+    }
+
+    void run(const char* host, const char* port)
+    {
+        int fd = connect(host, port);
+        std::vector<Byte> request = requests();
+        size_t expected = static_cast<size_t>(_boxes)*_points;
+
+        auto start = std::chrono::steady_clock::now();
+        std::thread sender([&]() {
+            size_t sent = 0;
+            while (sent < request.size()) {
+                ssize_t n = ::send(fd, &request[sent], request.size() - sent,
+                    MSG_NOSIGNAL);
+                if (n <= 0) {
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    break;
+                }
+                sent += n;
+            }
+        });
+
+        double firstResult = 0;
+        size_t results = 0;
+        UInt64 iterations = 0;
+        size_t undecided = 0;
+        std::vector<Byte> buffer(0x10000);
+        size_t received = 0;
+        while (results < expected) {
+            if (buffer.size() - received < 0x8000)
+                buffer.resize(buffer.size()*2);
+            ssize_t n = recv(fd, &buffer[received], buffer.size() - received,
+                0);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR)
+                    continue;
+                break;
+            }
+            if (results == 0 && received == 0)
+                firstResult = secondsSince(start);
+            received += n;
+            size_t offset = 0;
+            do {
+                if (received - offset < 3*sizeof(Digit))
+                    break;
+                int result[3];
+                memcpy(result, &buffer[offset], sizeof(result));
+                size_t bytes = sizeof(result);
+                if (result[2] == -1)
+                    bytes += 4*_precision*sizeof(Digit);
+                if (received - offset < bytes)
+                    break;
+                offset += bytes;
+                ++results;
+                if (result[2] == -1) {
+                    ++undecided;
+                    iterations += _maximumIterations;
+                }
+                else
+                    iterations += ::abs(result[2]);
+            } while (true);
+            memmove(&buffer[0], &buffer[offset], received - offset);
+            received -= offset;
+        }
+        double seconds = secondsSince(start);
+        sender.join();
+        ::close(fd);
+        if (results < expected)
+            throw std::runtime_error("Server closed the connection");
+
+        printf("%zu points in %.3f seconds (first after %.3f): %.0f points "
+            "per second, %.4g iterations per second, %zu undecided.\n",
+            results, seconds, firstResult, results/seconds,
+            iterations/seconds, undecided);
+    }
+
+private:
+    static double secondsSince(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+    static int connect(const char* host, const char* port)
+    {
+        addrinfo hints;
+        memset(&hints, 0, sizeof(addrinfo));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addresses;
+        if (getaddrinfo(host, port, &hints, &addresses) != 0) {
+            throw std::runtime_error("Resolving " + std::string(host) + ":" +
+                port);
+        }
+        int fd = -1;
+        for (addrinfo* a = addresses; a != 0; a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd == -1)
+                continue;
+            if (::connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+                break;
+            ::close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(addresses);
+        if (fd == -1)
+            throwSystemError("Connecting to " + std::string(host));
+        return fd;
+    }
+
+    // The boxes are tiles of a square, each a square of points, and the
+    // tiles nearest the centre are the most important.
+    std::vector<Byte> requests()
+    {
+        int side = static_cast<int>(sqrt(static_cast<double>(_points)));
+        int tiles = static_cast<int>(sqrt(static_cast<double>(_boxes)));
+        if (side*side != _points || tiles*tiles != _boxes || _precision < 1 ||
+            _precision > BoxHeader::maximumPrecision)
+            throw std::runtime_error("Bad driver options");
+        int logUnitsPerTexel;
+        frexp(_size/(side*tiles), &logUnitsPerTexel);
+        double unitsPerTexel = ldexp(1.0, logUnitsPerTexel);
+        double left = _centreX - unitsPerTexel*side*tiles/2;
+        double top = _centreY - unitsPerTexel*side*tiles/2;
+
+        BoxHeader header;
+        header._points = _points;
+        header._precision = _precision;
+        header._bailoutRadius2 = 16 << (bitsPerDigit - intBits);
+        header._logDelta = logUnitsPerTexel;
+        header._maximumIterations = _maximumIterations;
+        header._logUnitsPerTexel = logUnitsPerTexel;
+        std::vector<Digit> digits(header.digits());
+        std::vector<Byte> request;
+        for (int y = 0; y < tiles; ++y)
+            for (int x = 0; x < tiles; ++x) {
+                header._id = y*tiles + x;
+                int dx = 2*x + 1 - tiles;
+                int dy = 2*y + 1 - tiles;
+                header._priority = dx*dx + dy*dy;
+                Digit* cx = &digits[0];
+                Digit* cy = cx + _precision;
+                fixedFromDouble(cx, left + x*side*unitsPerTexel, 0,
+                    _precision);
+                fixedFromDouble(cy, top + y*side*unitsPerTexel, 0,
+                    _precision);
+                Digit* entry = cy + _precision;
+                for (int i = 0; i < _points; ++i) {
+                    entry[0] = i % side;
+                    entry[1] = i / side;
+                    zero(entry + 2, 4*_precision);
+                    entry += header.entryDigits();
+                }
+                const Byte* h = reinterpret_cast<const Byte*>(&header);
+                request.insert(request.end(), h, h + sizeof(BoxHeader));
+                const Byte* d = reinterpret_cast<const Byte*>(&digits[0]);
+                request.insert(request.end(), d,
+                    d + digits.size()*sizeof(Digit));
+            }
+        return request;
+    }
+
+    double _centreX;
+    double _centreY;
+    double _size;
+    int _precision;
+    int _boxes;
+    int _points;
+    int _maximumIterations;
+};
+
+int main(int argc, char* argv[])
+{
+    std::string port = "24448";
+    int threads = std::thread::hardware_concurrency();
+    if (threads < 1)
+        threads = 1;
+    std::string host;
+    bool loopback = false;
+    ThroughputClient client;
+    for (int i = 1; i < argc; ++i) {
+        const char* argument = argv[i];
+        if (argument[0] == '-' && argument[1] != 0) {
+            const char* value = argument + 2;
+            switch (argument[1]) {
+                case 'p': port = value; continue;
+                case 't': threads = atoi(value); continue;
+                case 'c': host = value; continue;
+                case 'l': loopback = true; continue;
+            }
+            if (client.option(argument[1], value))
+                continue;
+        }
+        fprintf(stderr, "Syntax: %s [-p<port>] [-t<threads>] "
+            "[-c<host> | -l] [-x -y -s -d -b -n -i]\n", argv[0]);
+        return 1;
+    }
+    if (threads < 1)
+        threads = 1;
+
+    try {
+        if (loopback) {
+            Server server("0", threads);
+            std::thread io([&]() { server.run(); });
+            try {
+                client.run("localhost",
+                    std::to_string(server.port()).c_str());
+            }
+            catch (...) {
+                server.stop();
+                io.join();
+                throw;
+            }
+            server.stop();
+            io.join();
+            return 0;
+        }
+        if (!host.empty()) {
+            client.run(host.c_str(), port.c_str());
+            return 0;
+        }
+    }
+    catch (std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    do {
+        try {
+            Server server(port.c_str(), threads);
+            server.run();
+        }
+        catch (std::exception& e) {
+            fprintf(stderr, "%s\n", e.what());
+            // Wait a couple of seconds before restarting so that a
+            // persistent failure doesn't cause us to peg the CPU.
+            sleep(2);
+        }
+    } while (true);
+}
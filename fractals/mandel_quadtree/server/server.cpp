@@ -458,7 +458,8 @@ class Server : public Mutex
             _logDelta = _box->_logDelta;
             _bailoutRadius2 = _box->_bailoutRadius2;
             // Setup up temporary buffers
-            _buffer.ensureLength(10*_precision);
+            _buffer.ensureLength(6*_precision +
+                multiplyScratchDigits(_precision));
             Digit* t = _buffer;
             for (int i = 0; i < 7; ++i) {
                 _t[i] = t;
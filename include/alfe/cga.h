@@ -554,33 +554,118 @@ public:
         _root.save(&data, 0, 0, _total);
         file.openWrite().write(data);
     }
-    void load(File file)
+    void load(File file) { load(file, 0); }
+    // A CGAData log (a version 1 file, written by CGADataLog) holds a
+    // sequence of frames. Loading one reads just its index and the frames from
+    // the nearest keyframe up to the one containing time t (in hdots from the
+    // start of the log), and the state at that time replaces the contents of
+    // this CGAData. For other files t is ignored.
+    void load(File file, UInt64 t)
     {
         Lock lock(&_mutex);
-        _root.reset();
-        Array<Byte> data;
-        file.readIntoArray(&data);
-        if (deserialize(&data, 0) != *reinterpret_cast<const DWord*>("CGAD"))
+        FileStream stream = file.openRead();
+        UInt64 size = stream.size();
+        DWord header[5];
+        if (size < 20)
             throw Exception(file.path() + " is not a CGAData file.");
-        if (deserialize(&data, 4) != 0)
+        stream.read(reinterpret_cast<Byte*>(header), 20);
+        if (header[0] != *reinterpret_cast<const DWord*>("CGAD"))
+            throw Exception(file.path() + " is not a CGAData file.");
+        if (header[1] > 1)
             throw Exception(file.path() + " is too new for this program.");
-        _total = deserialize(&data, 8);
-        _pllWidth = deserialize(&data, 12);
-        _pllHeight = deserialize(&data, 16);
-        int offset = 20;
+        _root.reset();
+        _total = header[2];
+        _pllWidth = header[3];
+        _pllHeight = header[4];
+        if (header[1] == 1) {
+            loadLogFrame(&stream, t);
+            return;
+        }
+        if (size >= 0x80000000)
+            throw Exception("2Gb or more in file " + file.path());
+        Array<Byte> data(static_cast<int>(size) - 20);
+        if (data.count() > 0)
+            stream.read(&data[0], data.count());
+        int offset = 0;
         do {
             if (offset == data.count())
                 return;
-            int t = deserialize(&data, offset);
+            int time = deserialize(&data, offset);
             int address = deserialize(&data, offset + 4);
             int count = deserialize(&data, offset + 8);
             int length = 12 + count;
             if (offset + length > data.count())
                 throw Exception(file.path() + " is truncated.");
-            changeNoLock(t, address, count, &data[offset + 12]);
+            changeNoLock(time, address, count, &data[offset + 12]);
             offset += (length + 3) & ~3;
         } while (true);
     }
+    // After the header, a log consists of frames of change records in the
+    // same format as a version 0 file, except that the time of each record is
+    // relative to the start of its frame (and is currently always 0). A
+    // keyframe consists of a single record holding the complete state from
+    // registerLogCharactersPerBank onwards. The frames are followed by an
+    // array of these entries, starting at an 8-byte aligned offset, and a
+    // 16-byte footer: the UInt64 offset of the index, the DWord number of
+    // frames and "CGAX". All fields are little-endian and naturally aligned,
+    // so a log can also be used in place from a memory mapping.
+    //   A log that has been extended also contains the indexes written before
+    // each extension, and a log whose extension was interrupted ends with
+    // partial frames. Only the last complete index is used, and the first
+    // frame after each earlier index is a keyframe.
+    struct LogIndexEntry
+    {
+        UInt64 _t;          // Start of the frame in hdots
+        UInt64 _offset;     // File offset of the frame's first record
+        DWord _keyframe;
+        DWord _length;      // Bytes of records in the frame, 0 if unknown
+    };
+    // Reads the last complete index of a log, returning the file offset at
+    // which it starts.
+    static UInt64 readLogIndex(FileStream* stream, Array<LogIndexEntry>* index)
+    {
+        String path = stream->file().path();
+        UInt64 size = stream->size();
+        if (size < 36)
+            throw Exception(path + " is not a CGAData log.");
+        DWord header[2];
+        stream->seek(0);
+        stream->read(reinterpret_cast<Byte*>(header), 8);
+        if (header[0] != *reinterpret_cast<const DWord*>("CGAD") ||
+            header[1] != 1)
+            throw Exception(path + " is not a CGAData log.");
+        // Footers end at 8-byte aligned offsets. Search backwards from the
+        // end of the file for the last one that is consistent with its
+        // position.
+        Array<Byte> buffer(0x10000);
+        UInt64 end = size & ~static_cast<UInt64>(7);
+        while (end >= 36) {
+            int length = static_cast<int>(min<UInt64>(end - 20, 0x10000));
+            UInt64 start = end - length;
+            stream->seek(start);
+            stream->read(&buffer[0], length);
+            for (; end - 16 >= start; end -= 8) {
+                const Byte* footer =
+                    &buffer[static_cast<int>(end - 16 - start)];
+                UInt64 indexOffset = *reinterpret_cast<const UInt64*>(footer);
+                DWord frames = *reinterpret_cast<const DWord*>(footer + 8);
+                if (*reinterpret_cast<const DWord*>(footer + 12) !=
+                    *reinterpret_cast<const DWord*>("CGAX") ||
+                    indexOffset < 20 || indexOffset >= end ||
+                    (end - 16 - indexOffset) !=
+                    static_cast<UInt64>(frames)*sizeof(LogIndexEntry))
+                    continue;
+                index->allocate(frames);
+                if (frames > 0) {
+                    stream->seek(indexOffset);
+                    stream->read(reinterpret_cast<Byte*>(&(*index)[0]),
+                        frames*sizeof(LogIndexEntry));
+                }
+                return indexOffset;
+            }
+        }
+        throw Exception(path + " is not a complete CGAData log.");
+    }
     void saveVRAM(File file)
     {
         file.openWrite().write(getData(0, _endAddress, 0));
@@ -593,6 +678,18 @@ public:
         file.readIntoArray(&data);
         changeNoLock(0, 0, data.count(), &data[0]);
     }
+    // Returns the registers and VRAM at time t, starting at address
+    // registerLogCharactersPerBank.
+    Array<Byte> getState(int t = 0)
+    {
+        int endAddress;
+        {
+            Lock lock(&_mutex);
+            endAddress = _endAddress;
+        }
+        return getData(registerLogCharactersPerBank,
+            endAddress - registerLogCharactersPerBank, t);
+    }
     Byte getDataByte(int address, int t = 0)
     {
         return getData(address, 1, t)[0];
@@ -617,6 +714,71 @@ private:
             _root.ensureAddresses(registerLogCharactersPerBank, _endAddress);
         }
     }
+    void loadLogFrame(FileStream* stream, UInt64 t)
+    {
+        // The index is kept so that seeking around in a log only needs to
+        // read the frames. A change in size means the log has been extended.
+        String path = stream->file().path();
+        UInt64 size = stream->size();
+        if (path != _logPath || size != _logSize) {
+            _logIndexOffset = readLogIndex(stream, &_logIndex);
+            _logPath = path;
+            _logSize = size;
+        }
+        int frames = _logIndex.count();
+        if (frames == 0)
+            return;
+        int frame = 0;
+        int end = frames;
+        while (end - frame > 1) {
+            int middle = (frame + end)/2;
+            if (_logIndex[middle]._t <= t)
+                frame = middle;
+            else
+                end = middle;
+        }
+        int keyframe = frame;
+        while (keyframe > 0 && _logIndex[keyframe]._keyframe == 0)
+            --keyframe;
+        UInt64 start = _logIndex[keyframe]._offset;
+        UInt64 stop = _logIndex[frame]._offset + _logIndex[frame]._length;
+        if (_logIndex[frame]._length == 0) {
+            stop = frame + 1 < frames ? _logIndex[frame + 1]._offset :
+                _logIndexOffset;
+        }
+        if (stop - start >= 0x80000000)
+            throw Exception(path + " has a keyframe interval of 2Gb or more.");
+        Array<Byte> data(static_cast<int>(stop - start));
+        stream->seek(start);
+        stream->read(&data[0], data.count());
+
+        // Apply the records to a flat copy of the state, then put that in the
+        // tree as a single change.
+        Array<Byte> state;
+        int offset = 0;
+        while (offset + 12 <= data.count()) {
+            int address =
+                deserialize(&data, offset + 4) - registerLogCharactersPerBank;
+            int count = deserialize(&data, offset + 8);
+            int length = 12 + count;
+            if (address < 0 || count < 0 || offset + length > data.count())
+                throw Exception(path + " is corrupt.");
+            if (address + count > state.count()) {
+                Array<Byte> s(address + count);
+                memset(&s[0], 0, s.count());
+                if (state.count() > 0)
+                    memcpy(&s[0], &state[0], state.count());
+                state = s;
+            }
+            if (count > 0)
+                memcpy(&state[address], &data[offset + 12], count);
+            offset += (length + 3) & ~3;
+        }
+        if (state.count() > 0) {
+            changeNoLock(0, registerLogCharactersPerBank, state.count(),
+                &state[0]);
+        }
+    }
     int deserialize(Array<Byte>* data, int offset)
     {
         if (data->count() < offset + 4)
@@ -1182,9 +1344,161 @@ private:
     int _pllWidth;
     int _pllHeight;
     int _endAddress;
+    String _logPath;
+    UInt64 _logSize;
+    UInt64 _logIndexOffset;
+    Array<LogIndexEntry> _logIndex;
     Mutex _mutex;
 };
 
+// Records successive states of a CGAData as a CGAData log (see
+// CGAData::LogIndexEntry), so that a sequence of matched pictures can be
+// played back. Each frame is written as its differences from the previous
+// one, except that every keyframeInterval-th frame (and any frame whose
+// differences would be larger) holds the complete state. The index is written
+// by close(). With append set an existing log is extended: the new frames
+// start with a keyframe and are added after the end of the file, followed by
+// a new index. Nothing already in the file is rewritten, so if the program
+// stops before close() the old index is still used.
+class CGADataLog : Uncopyable
+{
+public:
+    CGADataLog(File file, bool append = false, int keyframeInterval = 64)
+      : _stream(append ? file.openReadWrite() : file.openWrite()),
+        _frames(0), _framesSinceKeyframe(0),
+        _keyframeInterval(keyframeInterval), _offset(0), _t(0),
+        _closed(false), _oldFrames(0)
+    {
+        if (!append)
+            return;
+        _offset = _stream.size();
+        if (_offset == 0)
+            return;
+        Array<CGAData::LogIndexEntry> index;
+        CGAData::readLogIndex(&_stream, &index);
+        DWord header[5];
+        _stream.seek(0);
+        _stream.read(reinterpret_cast<Byte*>(header), 20);
+        _total = header[2];
+        _frames = index.count();
+        if (_frames > 0) {
+            _index.append(index);
+            _t = index[_frames - 1]._t + _total;
+        }
+        _oldFrames = _frames;
+        _stream.seek(_offset);
+    }
+    ~CGADataLog()
+    {
+        try {
+            close();
+        }
+        catch (...) { }
+    }
+    void addFrame(CGAData* data)
+    {
+        Array<Byte> state = data->getState();
+        AppendableArray<Byte> records;
+        if (_offset == 0) {
+            _total = data->getTotal();
+            records.append(reinterpret_cast<const Byte*>("CGAD"), 4);
+            DWord header[4] = {1, static_cast<DWord>(_total),
+                static_cast<DWord>(data->getPLLWidth()),
+                static_cast<DWord>(data->getPLLHeight())};
+            records.append(reinterpret_cast<const Byte*>(header), 16);
+        }
+        CGAData::LogIndexEntry entry;
+        entry._t = _t;
+        entry._offset = _offset + records.count();
+        bool keyframe = _state.count() == 0 ||
+            _framesSinceKeyframe + 1 >= _keyframeInterval;
+        AppendableArray<Byte> changes;
+        int n = state.count();
+        int i = 0;
+        while (!keyframe && i < n) {
+            if (i < _state.count() && state[i] == _state[i]) {
+                ++i;
+                continue;
+            }
+            // Extend the change over runs of unchanged bytes that are
+            // shorter than a record header.
+            int end = i + 1;
+            for (int j = end; j < n && j < end + 12; ++j)
+                if (j >= _state.count() || state[j] != _state[j])
+                    end = j + 1;
+            addRecord(&changes, i, end - i, &state[i]);
+            i = end;
+            if (changes.count() > n/2)
+                keyframe = true;
+        }
+        if (keyframe)
+            addRecord(&records, 0, n, &state[0]);
+        else
+            records.append(changes);
+        entry._keyframe = keyframe ? 1 : 0;
+        entry._length =
+            static_cast<DWord>(_offset + records.count() - entry._offset);
+        _stream.write(records);
+        _index.append(entry);
+        _offset += records.count();
+        _t += _total;
+        _state = state;
+        _framesSinceKeyframe = keyframe ? 0 : _framesSinceKeyframe + 1;
+        ++_frames;
+    }
+    // Writes the index. No more frames can be added after this. Called by the
+    // destructor if necessary.
+    void close()
+    {
+        if (_closed)
+            return;
+        _closed = true;
+        if (_offset == 0 || _frames == _oldFrames)
+            return;
+        AppendableArray<Byte> tail;
+        DWord zero[2] = {0, 0};
+        int padding = static_cast<int>((~_offset + 1) & 7);
+        tail.append(reinterpret_cast<const Byte*>(zero), padding);
+        UInt64 indexOffset = _offset + padding;
+        if (_frames > 0) {
+            tail.append(reinterpret_cast<const Byte*>(&_index[0]),
+                _frames*sizeof(CGAData::LogIndexEntry));
+        }
+        tail.append(reinterpret_cast<const Byte*>(&indexOffset), 8);
+        DWord footer[2] = {static_cast<DWord>(_frames),
+            *reinterpret_cast<const DWord*>("CGAX")};
+        tail.append(reinterpret_cast<const Byte*>(footer), 8);
+        _stream.write(tail);
+    }
+    int frames() const { return _frames; }
+private:
+    // Address 0 here is registerLogCharactersPerBank.
+    static void addRecord(AppendableArray<Byte>* records, int address,
+        int count, const Byte* data)
+    {
+        address += CGAData::registerLogCharactersPerBank;
+        DWord header[3] = {0, static_cast<DWord>(address),
+            static_cast<DWord>(count)};
+        records->append(reinterpret_cast<const Byte*>(header), 12);
+        records->append(data, count);
+        DWord zero = 0;
+        records->append(reinterpret_cast<const Byte*>(&zero),
+            ((~count) + 1) & 3);
+    }
+
+    FileStream _stream;
+    Array<Byte> _state;
+    AppendableArray<CGAData::LogIndexEntry> _index;
+    int _frames;
+    int _framesSinceKeyframe;
+    int _keyframeInterval;
+    int _total;
+    UInt64 _offset;
+    UInt64 _t;
+    bool _closed;
+    int _oldFrames;
+};
+
 class CGAOutput : public ThreadTask
 {
 public:
@@ -1807,7 +2121,10 @@ public:
             outputRow += _bitmap.stride();
         }
         _lastBitmap = _bitmap;
-        _bitmap = _window->setNextBitmap(_bitmap);
+        if (_window != 0)
+            _bitmap = _window->setNextBitmap(_bitmap);
+        else
+            _bitmap = Bitmap<DWORD>();
     }
 
     void save(String outputFileName)
@@ -1883,7 +2200,7 @@ public:
             zoom = 1.0;
         {
             Lock lock(&_mutex);
-            if (_window->hWnd() != 0) {
+            if (_window != 0 && _window->hWnd() != 0) {
                 Vector mousePosition = _window->mousePosition();
                 Vector size = _outputSize;
                 Vector2<float> position = Vector2Cast<float>(size)/2.0f;
@@ -1978,7 +2295,7 @@ public:
             ratio = 1.0;
         {
             Lock lock(&_mutex);
-            if (_window->hWnd() != 0) {
+            if (_window != 0 && _window->hWnd() != 0) {
                 Vector mousePosition = _window->mousePosition();
                 Vector size = _outputSize;
                 Vector2<float> position = Vector2Cast<float>(size)/2.0f;
@@ -0,0 +1,275 @@
+// Pipes that degrade a composite video signal (8-bit samples with blanking
+// at 60) the way a poor RF channel or a worn tape would.
+//
+// Each pipe copies the samples it's asked for into a contiguous block,
+// processes the whole block with SSE2 and copies the result out, so the
+// per-sample work doesn't go through the Accessors. The random numbers come
+// from a CounterRandom indexed by sample (or chunk) number, so for a given
+// seed the output doesn't depend on how the stream is split into blocks.
+
+#include "alfe/main.h"
+
+#ifndef INCLUDED_CHANNEL_IMPAIRMENTS_H
+#define INCLUDED_CHANNEL_IMPAIRMENTS_H
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#include "alfe/pipes.h"
+#include "alfe/random.h"
+
+// Adds random noise to a signal. The noise added to each sample is the
+// product of two signed random bytes, the second of which was the first for
+// the previous sample.
+class NoisePipe : public Pipe<Byte, Byte, NoisePipe>
+{
+public:
+    NoisePipe(int level, UInt32 seed = 0, int n = defaultSampleCount)
+      : Pipe(this, (n + 15)&~15),  // Process 16 samples at once
+        _random(seed),
+        _position(0)
+    {
+        float l = static_cast<float>(level);
+        float m = static_cast<float>(65536 - level);
+        int s = static_cast<int>(sqrt(l*l + m*m));
+        _noiseLevel = 256*level/s;
+        _signalLevel = 32768*(65536 - level)/s;
+    }
+    void produce(int n)
+    {
+        n = (n + 15)&~15;
+        if (static_cast<int>(_block.count()) < n) {
+            _block = Array<Byte>(n);
+            _random32 = Array<UInt32>(n/4 + 2);
+        }
+        Byte* block = &_block[0];
+        CopyTo<Byte> copyTo(block);
+        _sink.reader(n).items(copyTo, n);
+
+        // Sample i uses random bytes i and i + 1, and each number gives
+        // four bytes.
+        UInt64 first = _position >> 2;
+        int count = static_cast<int>(((_position + n) >> 2) - first) + 1;
+        _random.fill(first, &_random32[0], count);
+        const SInt8* r = reinterpret_cast<const SInt8*>(&_random32[0]) +
+            (_position & 3);
+
+        // The signal scale doesn't always fit in 16 bits, so
+        // signal*_signalLevel is computed as
+        // signal*(_signalLevel - 16384) + (signal << 14).
+        __m128i levels = _mm_set1_epi32(
+            (_noiseLevel & 0xffff) |
+            (static_cast<UInt32>(_signalLevel - 16384) << 16));
+        __m128i blank = _mm_set1_epi16(60);
+        __m128i zero = _mm_setzero_si128();
+        __m128i low = _mm_set1_epi8(1);
+        __m128i high = _mm_set1_epi8(static_cast<char>(254));
+        for (int i = 0; i < n; i += 16) {
+            __m128i s = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(block + i));
+            __m128i a = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(r + i));
+            __m128i b = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(r + i + 1));
+            __m128i out[2];
+            for (int h = 0; h < 2; ++h) {
+                __m128i signal = _mm_sub_epi16(h == 0 ?
+                    _mm_unpacklo_epi8(s, zero) : _mm_unpackhi_epi8(s, zero),
+                    blank);
+                // Sign-extend the random bytes to 16 bits.
+                __m128i ra = _mm_srai_epi16(h == 0 ?
+                    _mm_unpacklo_epi8(a, a) : _mm_unpackhi_epi8(a, a), 8);
+                __m128i rb = _mm_srai_epi16(h == 0 ?
+                    _mm_unpacklo_epi8(b, b) : _mm_unpackhi_epi8(b, b), 8);
+                __m128i noise = _mm_mullo_epi16(ra, rb);
+                __m128i v[2];
+                for (int j = 0; j < 2; ++j) {
+                    __m128i ns = j == 0 ? _mm_unpacklo_epi16(noise, signal) :
+                        _mm_unpackhi_epi16(noise, signal);
+                    __m128i s32 = _mm_srai_epi32(j == 0 ?
+                        _mm_unpacklo_epi16(signal, signal) :
+                        _mm_unpackhi_epi16(signal, signal), 16);
+                    v[j] = _mm_srai_epi32(_mm_add_epi32(
+                        _mm_madd_epi16(ns, levels),
+                        _mm_slli_epi32(s32, 14)), 15);
+                }
+                out[h] = _mm_adds_epi16(_mm_packs_epi32(v[0], v[1]), blank);
+            }
+            __m128i o = _mm_packus_epi16(out[0], out[1]);
+            o = _mm_min_epu8(_mm_max_epu8(o, low), high);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(block + i), o);
+        }
+
+        CopyFrom<Byte> copyFrom(block);
+        _source.writer(n).items(copyFrom, n);
+        _position += n;
+        _sink.read(n);
+        _source.written(n);
+        if (_sink.finite())
+            _source.remaining(_sink.remaining());
+    }
+private:
+    int _noiseLevel;
+    int _signalLevel;
+    CounterRandom _random;
+    UInt64 _position;
+    Array<Byte> _block;
+    Array<UInt32> _random32;
+};
+
+
+// A filter which adds RF cable ghosting to a signal. Each group of 4 samples
+// has added to it a combination of the sums of the groups 3 and 4 groups
+// earlier.
+class GhostingPipe : public Pipe<Byte, Byte, GhostingPipe>
+{
+public:
+    // The inner loop processes 16 samples (4 groups) at once, so round up.
+    GhostingPipe(int n = defaultSampleCount)
+      : Pipe(this, (n + 15)&~15)
+    {
+        for (int i = 0; i < 4; ++i)
+            _history[i] = 0;
+    }
+    void produce(int n)
+    {
+        n = (n + 15)&~15;
+        if (static_cast<int>(_block.count()) < n) {
+            _block = Array<Byte>(n);
+            // The 4 previous group sums, then one per group of this block.
+            _sums = Array<Int16>(4 + n/4 + 4);
+        }
+        Byte* block = &_block[0];
+        CopyTo<Byte> copyTo(block);
+        _sink.reader(n).items(copyTo, n);
+        Int16* sums = &_sums[4];
+        for (int i = 0; i < 4; ++i)
+            sums[i - 4] = _history[i];
+
+        __m128i blank = _mm_set1_epi16(60);
+        __m128i zero = _mm_setzero_si128();
+        __m128i ones = _mm_set1_epi16(1);
+        __m128i taps = _mm_set1_epi32((-11 & 0xffff) | (5 << 16));
+        __m128i gain = _mm_set1_epi32(278 | (1 << 16));
+        __m128i low = _mm_set1_epi8(1);
+        __m128i high = _mm_set1_epi8(static_cast<char>(254));
+        for (int i = 0; i < n; i += 16) {
+            __m128i s = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(block + i));
+            __m128i s0 = _mm_sub_epi16(_mm_unpacklo_epi8(s, zero), blank);
+            __m128i s1 = _mm_sub_epi16(_mm_unpackhi_epi8(s, zero), blank);
+            // Sums of pairs, then of groups of 4.
+            __m128i pairs = _mm_packs_epi32(_mm_madd_epi16(s0, ones),
+                _mm_madd_epi16(s1, ones));
+            __m128i groups = _mm_madd_epi16(pairs, ones);
+            int g = i >> 2;
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(sums + g),
+                _mm_packs_epi32(groups, groups));
+
+            // The ghost for each of the 4 groups, 3 and 4 groups back.
+            __m128i ghost = _mm_madd_epi16(_mm_unpacklo_epi16(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i*>(sums + g - 3)),
+                _mm_loadl_epi64(reinterpret_cast<const __m128i*>(sums + g - 4))),
+                taps);
+            ghost = _mm_packs_epi32(ghost, ghost);
+            ghost = _mm_unpacklo_epi16(ghost, ghost);
+            __m128i g0 = _mm_unpacklo_epi32(ghost, ghost);
+            __m128i g1 = _mm_unpackhi_epi32(ghost, ghost);
+
+            __m128i out[2];
+            for (int h = 0; h < 2; ++h) {
+                __m128i sh = h == 0 ? s0 : s1;
+                __m128i gh = h == 0 ? g0 : g1;
+                __m128i v0 = _mm_srai_epi32(
+                    _mm_madd_epi16(_mm_unpacklo_epi16(sh, gh), gain), 8);
+                __m128i v1 = _mm_srai_epi32(
+                    _mm_madd_epi16(_mm_unpackhi_epi16(sh, gh), gain), 8);
+                out[h] = _mm_adds_epi16(_mm_packs_epi32(v0, v1), blank);
+            }
+            __m128i o = _mm_packus_epi16(out[0], out[1]);
+            o = _mm_min_epu8(_mm_max_epu8(o, low), high);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(block + i), o);
+        }
+        for (int i = 0; i < 4; ++i)
+            _history[i] = sums[n/4 - 4 + i];
+
+        CopyFrom<Byte> copyFrom(block);
+        _source.writer(n).items(copyFrom, n);
+        _sink.read(n);
+        _source.written(n);
+        if (_sink.finite())
+            _source.remaining(_sink.remaining());
+    }
+private:
+    Int16 _history[4];
+    Array<Byte> _block;
+    Array<Int16> _sums;
+};
+
+
+// A filter which occasionally drops the signal on the floor. Each chunk of 64
+// samples starts a dropout with probability outFrequency/2^32 and ends one
+// with probability inFrequency/2^32.
+template<class T> class DropOutPipe : public Pipe<T, T, DropOutPipe<T> >
+{
+public:
+    DropOutPipe(T dropOutValue, unsigned int outFrequency,
+        unsigned int inFrequency, UInt32 seed = 0,
+        int n = defaultSampleCount)
+      : Pipe<T, T, DropOutPipe<T> >(this, (n + 63)&~63),  // 64 at a time
+        _outFrequency(outFrequency),
+        _inFrequency(inFrequency),
+        _out(false),
+        _dropOutValue(dropOutValue),
+        _random(seed),
+        _chunk(0)
+    { }
+    void produce(int n)
+    {
+        n = (n + 63)&~63;
+        Accessor<T> reader = this->_sink.reader(n);
+        Accessor<T> writer = this->_source.writer(n);
+        // Copy runs of chunks that aren't dropped out in one go.
+        int run = 0;
+        for (int i = 0; i < (n>>6); ++i, ++_chunk) {
+            if (_random(_chunk*2) < _outFrequency)
+                _out = true;
+            if (_random(_chunk*2 + 1) < _inFrequency)
+                _out = false;
+            if (_out) {
+                copy(&reader, &writer, run);
+                run = 0;
+                for (int j = 0; j < 64; ++j)
+                    writer.item() = _dropOutValue;
+                reader.advance(64);
+            }
+            else
+                run += 64;
+        }
+        copy(&reader, &writer, run);
+        this->_sink.read(n);
+        this->_source.written(n);
+        if (this->_sink.finite())
+            this->_source.remaining(this->_sink.remaining());
+    }
+private:
+    static void copy(Accessor<T>* reader, Accessor<T>* writer, int n)
+    {
+        if (n == 0)
+            return;
+        CopyFrom<Accessor<T> > copyFrom(*reader);
+        writer->items(copyFrom, n);
+        reader->advance(n);
+    }
+
+    unsigned int _outFrequency;
+    unsigned int _inFrequency;
+    bool _out;
+    T _dropOutValue;
+    CounterRandom _random;
+    UInt64 _chunk;
+};
+
+#endif // INCLUDED_CHANNEL_IMPAIRMENTS_H
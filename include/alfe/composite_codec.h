@@ -0,0 +1,233 @@
+#include "alfe/main.h"
+
+#ifndef INCLUDED_COMPOSITE_CODEC_H
+#define INCLUDED_COMPOSITE_CODEC_H
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+// Lossless compression for frames of 8-bit composite video samples captured
+// at 8 times the colour carrier frequency (1820 samples per line). Each
+// sample is predicted from the sample one carrier cycle (8 samples) earlier
+// plus the change between the corresponding two samples on the previous
+// line. The previous line's chroma is inverted but cancels out of that
+// difference, so the prediction follows both the chroma and the vertical
+// changes in luma. The residuals (modulo 256) are then coded with a static
+// 4-way interleaved rANS coder whose frequency table is stored with the
+// frame.
+//
+// Format of a compressed frame:
+//   "CVC1" (never the start of a zlib stream)
+//   DWord number of samples
+//   Word[256] residual frequencies, summing to 4096
+//   rANS data: four DWord initial states then the renormalization bytes.
+//
+// Each thread needs its own CompositeCodec.
+class CompositeCodec
+{
+public:
+    static const int samplesPerCycle = 8;
+    static const int samplesPerLine = 1820;
+
+    static int maximumCompressedBytes(int count)
+    {
+        // Any symbol costs at most 12 bits.
+        return headerBytes + 32 + count*3/2;
+    }
+    static bool isCompressed(const Byte* data, int bytes)
+    {
+        return bytes >= headerBytes &&
+            *reinterpret_cast<const DWord*>(data) ==
+            *reinterpret_cast<const DWord*>("CVC1");
+    }
+    // Returns the number of bytes written to output, which must have room
+    // for maximumCompressedBytes(count).
+    int encode(const Byte* samples, int count, Byte* output)
+    {
+        _residuals.ensure(count);
+        Byte* r = &_residuals[0];
+        predict(samples, count, r);
+
+        int counts[256];
+        for (int i = 0; i < 256; ++i)
+            counts[i] = 0;
+        for (int i = 0; i < count; ++i)
+            ++counts[r[i]];
+        Word frequencies[256];
+        normalize(counts, count, frequencies);
+        DWord starts[257];
+        starts[0] = 0;
+        for (int i = 0; i < 256; ++i)
+            starts[i + 1] = starts[i] + frequencies[i];
+
+        *reinterpret_cast<DWord*>(output) =
+            *reinterpret_cast<const DWord*>("CVC1");
+        *reinterpret_cast<DWord*>(output + 4) = count;
+        memcpy(output + 8, frequencies, sizeof(frequencies));
+
+        // rANS works backwards, so encode from the end of the buffer and
+        // then move the result down.
+        Byte* end = output + maximumCompressedBytes(count);
+        Byte* p = end;
+        DWord states[4] = {lowBound, lowBound, lowBound, lowBound};
+        for (int i = count - 1; i >= 0; --i) {
+            DWord* x = &states[i & 3];
+            int s = r[i];
+            DWord f = frequencies[s];
+            DWord xMax = ((lowBound >> scaleBits) << 8)*f;
+            while (*x >= xMax) {
+                *--p = static_cast<Byte>(*x);
+                *x >>= 8;
+            }
+            *x = ((*x/f) << scaleBits) + (*x % f) + starts[s];
+        }
+        for (int i = 3; i >= 0; --i) {
+            p -= 4;
+            *reinterpret_cast<DWord*>(p) = states[i];
+        }
+        int bytes = static_cast<int>(end - p);
+        memmove(output + headerBytes, p, bytes);
+        return headerBytes + bytes;
+    }
+    void decode(const Byte* data, int bytes, Byte* samples, int count)
+    {
+        if (count < 0 || !isCompressed(data, bytes) ||
+            *reinterpret_cast<const DWord*>(data + 4) !=
+            static_cast<DWord>(count))
+            throw Exception("Frame is not in the expected format.");
+        const Word* frequencies = reinterpret_cast<const Word*>(data + 8);
+        DWord starts[256];
+        DWord start = 0;
+        for (int i = 0; i < 256; ++i) {
+            starts[i] = start;
+            for (DWord j = 0; j < frequencies[i]; ++j) {
+                if (start + j >= (1 << scaleBits))
+                    throw Exception("Frame is corrupt.");
+                _symbols[start + j] = i;
+            }
+            start += frequencies[i];
+        }
+        if (start != (1 << scaleBits))
+            throw Exception("Frame is corrupt.");
+
+        const Byte* p = data + headerBytes;
+        const Byte* end = data + bytes;
+        if (end - p < 16)
+            throw Exception("Frame is truncated.");
+        DWord states[4];
+        for (int i = 0; i < 4; ++i) {
+            states[i] = *reinterpret_cast<const DWord*>(p);
+            p += 4;
+        }
+        _residuals.ensure(count);
+        Byte* r = &_residuals[0];
+        static const DWord mask = (1 << scaleBits) - 1;
+        for (int i = 0; i < count; ++i) {
+            DWord* x = &states[i & 3];
+            int s = _symbols[*x & mask];
+            r[i] = s;
+            *x = frequencies[s]*(*x >> scaleBits) + (*x & mask) - starts[s];
+            while (*x < lowBound) {
+                if (p == end)
+                    throw Exception("Frame is truncated.");
+                *x = (*x << 8) | *p;
+                ++p;
+            }
+        }
+        reconstruct(r, count, samples);
+    }
+private:
+    static const int headerBytes = 8 + 256*sizeof(Word);
+    static const int scaleBits = 12;
+    static const DWord lowBound = 1 << 23;
+
+    static void predict(const Byte* x, int count, Byte* r)
+    {
+        static const int c = samplesPerCycle;
+        static const int l = samplesPerLine;
+        int i;
+        for (i = 0; i < min(count, c); ++i)
+            r[i] = x[i];
+        for (; i < min(count, l + c); ++i)
+            r[i] = x[i] - x[i - c];
+        for (; i + 16 <= count; i += 16) {
+            __m128i v = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(x + i));
+            v = _mm_sub_epi8(v, _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(x + i - c)));
+            v = _mm_sub_epi8(v, _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(x + i - l)));
+            v = _mm_add_epi8(v, _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(x + i - (l + c))));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(r + i), v);
+        }
+        for (; i < count; ++i)
+            r[i] = x[i] - x[i - c] - x[i - l] + x[i - (l + c)];
+    }
+    static void reconstruct(const Byte* r, int count, Byte* x)
+    {
+        static const int c = samplesPerCycle;
+        static const int l = samplesPerLine;
+        int i;
+        for (i = 0; i < min(count, c); ++i)
+            x[i] = r[i];
+        for (; i < min(count, l + c); ++i)
+            x[i] = r[i] + x[i - c];
+        // Each sample depends on the one a cycle earlier, so a cycle's worth
+        // of samples can be reconstructed at once.
+        for (; i + c <= count; i += c) {
+            __m128i v = _mm_loadl_epi64(
+                reinterpret_cast<const __m128i*>(r + i));
+            v = _mm_add_epi8(v, _mm_loadl_epi64(
+                reinterpret_cast<const __m128i*>(x + i - c)));
+            v = _mm_add_epi8(v, _mm_loadl_epi64(
+                reinterpret_cast<const __m128i*>(x + i - l)));
+            v = _mm_sub_epi8(v, _mm_loadl_epi64(
+                reinterpret_cast<const __m128i*>(x + i - (l + c))));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(x + i), v);
+        }
+        for (; i < count; ++i)
+            x[i] = r[i] + x[i - c] + x[i - l] - x[i - (l + c)];
+    }
+    // Scales the counts to frequencies summing to 1 << scaleBits, keeping
+    // every symbol that occurs codable.
+    static void normalize(const int* counts, int total, Word* frequencies)
+    {
+        static const int m = 1 << scaleBits;
+        int sum = 0;
+        int largest = 0;
+        for (int i = 0; i < 256; ++i) {
+            int f = static_cast<int>(
+                static_cast<UInt64>(counts[i])*m/max(total, 1));
+            if (f == 0 && counts[i] != 0)
+                f = 1;
+            frequencies[i] = f;
+            sum += f;
+            if (f > frequencies[largest])
+                largest = i;
+        }
+        if (sum == 0) {
+            // Empty frame - any valid table will do.
+            frequencies[0] = m;
+            return;
+        }
+        if (sum < m)
+            frequencies[largest] += m - sum;
+        while (sum > m) {
+            largest = 0;
+            for (int i = 1; i < 256; ++i)
+                if (frequencies[i] > frequencies[largest])
+                    largest = i;
+            --frequencies[largest];
+            --sum;
+        }
+    }
+
+    Array<Byte> _residuals;
+    Byte _symbols[1 << scaleBits];
+};
+
+#endif // INCLUDED_COMPOSITE_CODEC_H
@@ -15,6 +15,11 @@ template<> struct FFTW<float>
     typedef fftwf_plan Plan;
 
     static void execute(Plan p) { fftwf_execute(p); }
+    static Plan plan_dft_1d(int n, Complex* in, Complex* out, int sign,
+        unsigned flags)
+    {
+        return fftwf_plan_dft_1d(n, in, out, sign, flags);
+    }
     static Plan plan_dft_r2c_1d(int n, Real* in, Complex* out, unsigned flags)
     {
         return fftwf_plan_dft_r2c_1d(n, in, out, flags);
@@ -23,6 +28,10 @@ template<> struct FFTW<float>
     {
         return fftwf_plan_dft_c2r_1d(n, in, out, flags);
     }
+    static void execute_dft(Plan p, Complex* in, Complex* out)
+    {
+        fftwf_execute_dft(p, in, out);
+    }
     static void execute_dft_r2c(Plan p, Real* in, Complex* out)
     {
         fftwf_execute_dft_r2c(p, in, out);
@@ -128,6 +137,21 @@ private:
     };
 };
 
+template<class T> class FFTWPlanDFT1D : public FFTWPlan<T>
+{
+public:
+    FFTWPlanDFT1D() { }
+    FFTWPlanDFT1D(int n, FFTWComplexArray<T> in, FFTWComplexArray<T> out,
+        int sign, int rigor)
+      : FFTWPlan(FFTW<T>::plan_dft_1d(n, in.data(), out.data(), sign, rigor))
+    { }
+    void execute() { FFTWPlan<T>::execute(); }
+    void execute(FFTWComplexArray<T> in, FFTWComplexArray<T> out)
+    {
+        FFTW<T>::execute_dft(plan(), in.data(), out.data());
+    }
+};
+
 template<class T> class FFTWPlanDFTR2C1D : public FFTWPlan<T>
 {
 public:
@@ -695,6 +695,18 @@ public:
             FILE_ATTRIBUTE_NORMAL);
 #else
         return open(name(), O_WRONLY | O_APPEND);
+#endif
+    }
+    // Opens the file for reading and writing at arbitrary positions, creating
+    // it if it doesn't exist but keeping its contents if it does.
+    FileStreamT<T> openReadWrite() const
+    {
+#ifdef _WIN32
+        return open(GENERIC_READ | GENERIC_WRITE, 0, OPEN_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL);
+#else
+        return openWrite(O_RDWR | O_CREAT,
+            S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
 #endif
     }
     void remove()
@@ -7,6 +7,7 @@
 #include "alfe/fft.h"
 #include "alfe/image_filter.h"
 #include "alfe/colour_space.h"
+#include "alfe/thread.h"
 
 float sinc(float z)
 {
@@ -35,6 +36,91 @@ Complex<float> rotor(float phase)
     return Complex<float>(cos(angle), sin(angle));
 }
 
+// Lanczos resampling weights for an output pixel centred a fraction of a
+// sample after an input sample, tabulated for a set of fractions so that the
+// weights don't need to be recomputed for each pixel. The weights for each
+// phase are normalized to sum to 1 and padded with zeros to a multiple of 4
+// taps for SIMD.
+class LanczosTable
+{
+public:
+    static const int phases = 64;
+
+    LanczosTable() : _width(0) { }
+    void setWidth(float width)
+    {
+        if (width == _width)
+            return;
+        _width = width;
+        int taps = 0;
+        for (int p = 0; p < phases; ++p) {
+            float f = static_cast<float>(p)/phases;
+            _first[p] = static_cast<int>(-lobes*width + f);
+            int last = static_cast<int>(lobes*width + f);
+            taps = max(taps, last + 1 - _first[p]);
+        }
+        _taps = (taps + 3) & ~3;
+        _weights.ensure(phases*_taps);
+        for (int p = 0; p < phases; ++p) {
+            float f = static_cast<float>(p)/phases;
+            int last = static_cast<int>(lobes*width + f);
+            float* w = weights(p);
+            float t = 0;
+            int i;
+            for (i = 0; i <= last - _first[p]; ++i) {
+                w[i] = lanczos((i + _first[p])/width - f/width);
+                t += w[i];
+            }
+            for (; i < _taps; ++i)
+                w[i] = 0;
+            for (i = 0; i < _taps; ++i)
+                w[i] /= t;
+        }
+    }
+    float width() const { return _width; }
+    int taps() const { return _taps; }
+    int first(int phase) const { return _first[phase]; }
+    float* weights(int phase) { return &_weights[phase*_taps]; }
+
+    // Returns the weighted sum of the input samples starting at input.
+    float apply(int phase, const float* input)
+    {
+        const float* w = weights(phase);
+        __m128 total = _mm_setzero_ps();
+        for (int i = 0; i < _taps; i += 4) {
+            total = _mm_add_ps(total,
+                _mm_mul_ps(_mm_loadu_ps(w + i), _mm_loadu_ps(input + i)));
+        }
+        total = _mm_add_ps(total, _mm_movehl_ps(total, total));
+        total = _mm_add_ss(total, _mm_shuffle_ps(total, total, 1));
+        return _mm_cvtss_f32(total);
+    }
+private:
+    float _width;
+    int _taps;
+    int _first[phases];
+    Array<float> _weights;
+};
+
+template<class T> class NTSCCaptureDecoder;
+
+template<class T> class NTSCCaptureDecoderTaskT : public Task
+{
+public:
+    void setDecoder(NTSCCaptureDecoder<T>* decoder, int band, int bands)
+    {
+        _decoder = decoder;
+        _band = band;
+        _bands = bands;
+    }
+private:
+    void run() { _decoder->runBand(_band, _bands); }
+
+    NTSCCaptureDecoder<T>* _decoder;
+    int _band;
+    int _bands;
+};
+
 template<class T> class NTSCCaptureDecoder
 {
 public:
@@ -48,6 +134,7 @@ public:
         _yScale = 1;
         _doDecode = true;
         _chromaSamples = 8;
+        _pool = 0;
 
         for (int i = 8; i < 40; ++i)
             _burstWeights[i] = 1;
@@ -55,6 +142,13 @@ public:
             _burstWeights[i] = 1 - (cos(tau*i/16) + 1)/2;
             _burstWeights[i + 40] = (cos(tau*i/16) + 1)/2;
         }
+        for (int i = 0; i < 8; ++i) {
+            _carrier[i] = rotor(i/8.0f);
+            _rotorTable[i] = rotor(i/8.0).x;
+        }
+        _samples.ensure(inputSpaceBefore + inputSamples + inputSpaceAfter);
+        _samplesI.ensure(_samples.count());
+        _samplesQ.ensure(_samples.count());
     }
     void setOutputPixelsPerLine(int outputPixelsPerLine)
     {
@@ -67,6 +161,8 @@ public:
         // 1140                  800           960                5                        600               720
         _outputPixelsPerLine = outputPixelsPerLine;
     }
+    // The input buffer must have inputSpaceBefore bytes before input and
+    // inputSpaceAfter bytes after the inputSamples captured samples.
     void setInputBuffer(Byte* input) { _input = input; }
     void setOutputBuffer(Bitmap<T> output)  { _output = output; }
     void setContrast(float contrast) { _contrast = contrast; }
@@ -76,6 +172,24 @@ public:
     void setYScale(int yscale) { _yScale = yscale; }
     void setDoDecode(bool doDecode) { _doDecode = doDecode; }
     void setChromaSamples(float samples) { _chromaSamples = samples; }
+    // With a thread pool, the scanlines of each frame are decoded in
+    // parallel. Otherwise decode() does all the work on the calling thread.
+    void setThreadPool(ThreadPool* pool)
+    {
+        _pool = pool;
+        _tasks = Array<NTSCCaptureDecoderTaskT<T>>();
+        if (pool == 0)
+            return;
+        _tasks = Array<NTSCCaptureDecoderTaskT<T>>(pool->threads());
+        for (int i = 0; i < _tasks.count(); ++i) {
+            _tasks[i].setDecoder(this, i, _tasks.count());
+            _tasks[i].setPool(pool);
+        }
+    }
+
+    static const int inputSamples = 450*1024;
+    static const int inputSpaceBefore = 256;
+    static const int inputSpaceAfter = 256;
 
     void decode()
     {
@@ -85,24 +199,18 @@ public:
         }
         // Settings
 
-        static const int firstScanline = 0;  // 9
-        static const int lines = 240 + firstScanline;
         static const int nominalSamplesPerLine = 1820;
         static const int firstSyncSample = -40;  // Assumed position of previous hsync before our samples started (was -130)
-        static const float kernelSize = lobes;  // Lanczos parameter
         static const int nominalSamplesPerCycle = 8;
         static const int driftSamples = 40;
         static const int burstSamples = 48;  // Central 6 of 8-10 cycles
         static const int firstBurstSample = 32 + driftSamples;      // == 72
-        static const int burstCenter = firstBurstSample + burstSamples/2;
 
         Byte* b = _input;
 
 
         // Pass 1 - find sync and burst pulses, compute wobble amplitude and phase
 
-        float deltaSamplesPerCycle = 0;
-
         int syncPositions[lines + 1];
         int fracSyncPositions[lines + 1];
         int oldP = firstSyncSample - driftSamples;                  // == -80
@@ -120,9 +228,8 @@ public:
             for (int i = firstBurstSample; i < firstBurstSample + burstSamples; ++i) {
                 int j = oldP + i;                                   // == -8
                 int sample = b[j];
-                float phase = (j&7)/8.0f;
                 float w = 1; //_burstWeights[ i - firstBurstSample];
-                burst += rotor(phase)*sample*w;
+                burst += _carrier[j & 7]*sample*w;
                 t += w;
                 burstDC += sample;
             }
@@ -165,21 +272,14 @@ public:
             }
         }
 
-        float deltaSamplesPerLine = samplesPerLine - nominalSamplesPerLine;
 
-
-        // Pass 2 - render
-
-        Byte* outputRow = _output.data();
+        // Pass 2 - track the timing, colour and level of each line. Each line
+        // depends on the previous ones, but only through these few values.
 
         float q = syncPositions[1] - samplesPerLine;
         syncPositions[0] = q;
         Complex<float> burst = bursts[0];
-        float rotorTable[8];
-        for (int i = 0; i < 8; ++i)
-            rotorTable[i] = rotor(i/8.0).x;
         Complex<float> expectedBurst = burst;
-        int oldActualSamplesPerLine = nominalSamplesPerLine;
         float contrast1 = _contrast;
         float saturation1 = _saturation*100;
         for (int line = 0; line < lines; ++line) {
@@ -203,74 +303,13 @@ public:
             else
                 chromaAdjust = burst.conjugate()*contrast1*saturation1 / bm2;
             burstDCAverage = (2*burstDCAverage + burstDCs[line])/3;
-            float brightness1 = _brightness + 65 - burstDCAverage;
 
-            // Resample the image data
-
-            T* output = reinterpret_cast<T*>(outputRow);
-            int xStart = 65*_outputPixelsPerLine/760;
-            for (int x = xStart; x < xStart + _output.size().x; ++x) {
-                float y = 0;
-                Complex<float> c = 0;
-                float t = 0;
-
-                float kFrac0 = x*samplesPerLine/_outputPixelsPerLine;
-                float kFrac = q + kFrac0;
-                int k = static_cast<int>(kFrac);
-                kFrac -= k;
-                float samplesPerCycle = nominalSamplesPerCycle + deltaSamplesPerCycle;
-                float z0 = -kFrac/_chromaSamples;
-                int firstInput = -kernelSize*_chromaSamples + kFrac;
-                int lastInput = kernelSize*_chromaSamples + kFrac;
-
-                for (int j = firstInput; j <= lastInput; ++j) {
-                    // The input sample corresponding to the output pixel is k+kFrac
-                    // The sample we're looking at in this iteration is j+k
-                    // The difference is j-kFrac
-                    // So the value we pass to lanczos() is (j-kFrac)/_chromaSamples
-                    // So z0 = -kFrac/_chromaSamples;
-
-                    float s = lanczos(j/_chromaSamples + z0);
-                    int i = j + k;
-                    float z = s*b[i];
-                    c.x += rotorTable[i & 7]*z;
-                    c.y += rotorTable[(i + 6) & 7]*z;
-                    t += s;
-                }
-                c /= t;
-
-                //float lumaSamples = samplesPerLine/_outputPixelsPerLine;
-                float lumaSamples = samplesPerCycle/2;  // i.e. 7.16MHz
-                firstInput = -kernelSize*lumaSamples + kFrac;
-                lastInput = kernelSize*lumaSamples + kFrac;
-
-                Complex<float> cc = c*2;
-
-                t = 0;
-                z0 = -kFrac/lumaSamples;
-                for (int j = firstInput; j <= lastInput; ++j) {
-                    // The input sample corresponding to the output pixel is k+kFrac
-                    // The sample we're looking at in this iteration is j+k
-                    // The difference is j-kFrac
-                    // So the value we pass to lanczos() is (j-kFrac)/lumaSamples
-                    // So z0 = -kFrac/lumaSamples;
-
-                    float s = lanczos(j/lumaSamples + z0);
-                    int i = j + k;
-                    float z = s*(b[i] - (cc.x*rotorTable[i & 7] + cc.y*rotorTable[(i + 6)&7]));
-                    y += z;
-                    t += s;
-                }
-
-                y = y*contrast1/t + brightness1;
-                c = c*chromaAdjust*rotor((x - burstCenter*_outputPixelsPerLine/samplesPerLine)*adjust);
-
-                setOutput(output, SRGB(
-                    checkClamp(y + 0.9563*c.x + 0.6210*c.y),
-                    checkClamp(y - 0.2721*c.x - 0.6474*c.y),
-                    checkClamp(y - 1.1069*c.x + 1.7046*c.y)));
-                ++output;
-            }
+            Line* l = &_lines[line];
+            l->_q = q;
+            l->_samplesPerLine = samplesPerLine;
+            l->_chromaAdjust = chromaAdjust;
+            l->_adjust = adjust;
+            l->_brightness = _brightness + 65 - burstDCAverage;
 
             int p = syncPositions[line + 1];
             int actualSamplesPerLine = p - syncPositions[line];
@@ -279,24 +318,143 @@ public:
             q = (10*q + p)/11;
 
             expectedBurst = actualBurst;
+        }
 
-            if (line >= firstScanline) {
-                Byte* outputRow2 = outputRow + _output.stride();
-                for (int yy = 1; yy < _yScale; ++yy) {
-                    T* output = reinterpret_cast<T*>(outputRow2);
-                    T* input = reinterpret_cast<T*>(outputRow);
-                    for (int x = 0; x < _output.size().x; ++x) {
-                        *output = *input;
-                        ++output;
-                        ++input;
+
+        // Pass 3 - demodulate and resample each line
+
+        _chromaKernel.setWidth(_chromaSamples);
+        float lumaSamples = nominalSamplesPerCycle/2;  // i.e. 7.16MHz
+        if (lumaSamples != _lumaKernel.width()) {
+            _lumaKernel.setWidth(lumaSamples);
+            // The luma filter is applied to the input minus the modulated
+            // chroma, and the carrier part of that only depends on the phase
+            // and the position in the carrier cycle.
+            int taps = _lumaKernel.taps();
+            for (int p = 0; p < LanczosTable::phases; ++p) {
+                const float* w = _lumaKernel.weights(p);
+                for (int a = 0; a < 8; ++a) {
+                    Complex<float> c = 0;
+                    for (int i = 0; i < taps; ++i) {
+                        c.x += w[i]*_rotorTable[(a + i) & 7];
+                        c.y += w[i]*_rotorTable[(a + i + 6) & 7];
                     }
-                    outputRow2 += _output.stride();
+                    _lumaCarrier[p*8 + a] = c;
                 }
-                outputRow = outputRow2;
             }
         }
+        _pass = 0;
+        runBands();
+        _pass = 1;
+        runBands();
+    }
+
+    void runBand(int band, int bands)
+    {
+        if (_pass == 0) {
+            // Convert the input to floats, and demodulate it for chroma.
+            int n = _samples.count();
+            int end = (band + 1)*n/bands;
+            Byte* b = _input - inputSpaceBefore;
+            for (int i = band*n/bands; i < end; ++i) {
+                float s = b[i];
+                _samples[i] = s;
+                _samplesI[i] = s*_rotorTable[i & 7];
+                _samplesQ[i] = s*_rotorTable[(i + 6) & 7];
+            }
+            return;
+        }
+        for (int line = firstScanline + band; line < lines; line += bands)
+            decodeLine(line);
     }
 private:
+    static const int firstScanline = 0;  // 9
+    static const int lines = 240 + firstScanline;
+    static const int burstCenter = 32 + 40 + 48/2;
+
+    struct Line
+    {
+        float _q;
+        float _samplesPerLine;
+        Complex<float> _chromaAdjust;
+        float _adjust;
+        float _brightness;
+    };
+
+    void runBands()
+    {
+        if (_pool == 0) {
+            runBand(0, 1);
+            return;
+        }
+        for (auto& t : _tasks)
+            t.restart();
+        for (auto& t : _tasks)
+            t.join();
+    }
+    void decodeLine(int line)
+    {
+        const Line* l = &_lines[line];
+        float samplesPerLine = l->_samplesPerLine;
+        float contrast1 = _contrast;
+        Byte* outputRow =
+            _output.data() + (line - firstScanline)*_yScale*_output.stride();
+
+        // Resample the image data
+
+        T* output = reinterpret_cast<T*>(outputRow);
+        int xStart = 65*_outputPixelsPerLine/760;
+        const float* samples = &_samples[inputSpaceBefore];
+        const float* samplesI = &_samplesI[inputSpaceBefore];
+        const float* samplesQ = &_samplesQ[inputSpaceBefore];
+        // The chroma phase correction rotates steadily across the line.
+        Complex<float> phaseRotor = rotor((xStart -
+            burstCenter*_outputPixelsPerLine/samplesPerLine)*l->_adjust);
+        Complex<float> phaseStep = rotor(l->_adjust);
+        for (int x = xStart; x < xStart + _output.size().x; ++x) {
+            float kFrac0 = x*samplesPerLine/_outputPixelsPerLine;
+            float kFrac = l->_q + kFrac0;
+            int k = static_cast<int>(kFrac);
+            int phase = static_cast<int>(
+                (kFrac - k)*LanczosTable::phases + 0.5f);
+            if (phase == LanczosTable::phases) {
+                phase = 0;
+                ++k;
+            }
+
+            int i = k + _chromaKernel.first(phase);
+            Complex<float> c(_chromaKernel.apply(phase, samplesI + i),
+                _chromaKernel.apply(phase, samplesQ + i));
+
+            Complex<float> cc = c*2;
+            i = k + _lumaKernel.first(phase);
+            Complex<float> carrier = _lumaCarrier[phase*8 + (i & 7)];
+            float y = _lumaKernel.apply(phase, samples + i) -
+                (cc.x*carrier.x + cc.y*carrier.y);
+
+            y = y*contrast1 + l->_brightness;
+            c = c*l->_chromaAdjust*phaseRotor;
+            phaseRotor *= phaseStep;
+
+            setOutput(output, SRGB(
+                checkClamp(y + 0.9563*c.x + 0.6210*c.y),
+                checkClamp(y - 0.2721*c.x - 0.6474*c.y),
+                checkClamp(y - 1.1069*c.x + 1.7046*c.y)));
+            ++output;
+        }
+
+        Byte* outputRow2 = outputRow + _output.stride();
+        for (int yy = 1; yy < _yScale; ++yy) {
+            T* output = reinterpret_cast<T*>(outputRow2);
+            T* input = reinterpret_cast<T*>(outputRow);
+            for (int x = 0; x < _output.size().x; ++x) {
+                *output = *input;
+                ++output;
+                ++input;
+            }
+            outputRow2 += _output.stride();
+        }
+    }
     void outputRaw()
     {
         Byte* outputRow = _output.data();
@@ -340,6 +498,18 @@ private:
     bool _doDecode;
     float _chromaSamples;
     float _burstWeights[48];
+    Complex<float> _carrier[8];
+    float _rotorTable[8];
+    Line _lines[lines];
+    Array<float> _samples;
+    Array<float> _samplesI;
+    Array<float> _samplesQ;
+    LanczosTable _chromaKernel;
+    LanczosTable _lumaKernel;
+    Complex<float> _lumaCarrier[LanczosTable::phases*8];
+    int _pass;
+    ThreadPool* _pool;
+    Array<NTSCCaptureDecoderTaskT<T>> _tasks;
 };
 
 // A non-resampling decoder optimized to decode a large chunk of samples at
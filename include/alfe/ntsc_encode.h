@@ -0,0 +1,292 @@
+#ifndef INCLUDED_NTSC_ENCODE_H
+#define INCLUDED_NTSC_ENCODE_H
+
+#include "alfe/main.h"
+#include "alfe/bitmap.h"
+#include "alfe/complex.h"
+#include "alfe/fft.h"
+#include "alfe/colour_space.h"
+#include "alfe/minimum_maximum.h"
+
+// Encodes pictures 240 rows high to non-interlaced composite fields of 262
+// lines of 910 samples (4 per colour carrier cycle), one byte per sample with
+// blank at 60, black at 71 and white at 200. Each row is resampled and its
+// chroma modulated using FFTs, as ntsc/encode does. Since 910*262/4 is a
+// whole number of carrier cycles, consecutive fields can be concatenated
+// into a stream.
+class NTSCEncoder
+{
+public:
+    static const int samplesPerLine = 910;
+    static const int linesPerField = 262;
+    static const int samplesPerField = samplesPerLine*linesPerField;
+    // The active picture.
+    static const int activeLeft = 58;
+    static const int activeTop = 14;
+    static const int activeWidth = 768;
+    static const int activeHeight = 240;
+    // The part of each line where the burst is a steady sine wave.
+    static const int burstLeft = 16;
+    static const int burstRight = 44;
+
+    // Composite levels in units of 1/4 IRE (with blank at 0x0f0 = 0 IRE).
+    enum {
+        peakChroma   = 0x3cc,
+        white        = 0x320,
+        peakBurst    = 0x160,
+        black        = 0x118,
+        blank        = 0x0f0,
+        troughBurst  = 0x080,
+        troughChroma = 0x068,
+        sync         = 0x010
+    };
+
+    // The levels of the sync and burst waveforms, in the same units.
+    static int syncBurstLevel(int i)
+    {
+        static const int levels[] = {
+            // Sync
+            0x0f0,                      // 768-782
+            0x0e9, 0x0a4, 0x044, 0x011, // 783-786
+            0x010,                      // 787-849
+            0x017, 0x05c, 0x0bc, 0x0ef, // 850-853
+            0x0f0, 0x0f0, 0x0f0, 0x0f0, // 854-857
+            // Burst fields 1, 3
+            0x0f4, 0x0dc, 0x0d6, 0x12c, 0x123, 0x096, // 858-863
+            0x0b3, 0x14e, 0x12d, 0x092, // 864-867
+            0x0b3, 0x14e, 0x12d, 0x092, // 868-871
+            0x0b3, 0x14e, 0x12d, 0x092, // 872-875
+            0x0b3, 0x14e, 0x12d, 0x092, // 876-879
+            0x0b3, 0x14e, 0x12d, 0x092, // 880-883
+            0x0b3, 0x14e, 0x12d, 0x092, // 884-887
+            0x0b3, 0x14e, 0x12d, 0x092, // 888-891
+            0x0b3, 0x14e, 0x129, 0x0a6, // 892-895
+            0x0cd, 0x112, 0x0fa, 0x0ec, // 896-899
+            0x0f0,                      // 900-909
+            // Burst field 2, 4
+            0x0ec, 0x104, 0x10a, 0x0b4, 0x0bd, 0x14a, // 868-863
+            0x12d, 0x092, 0x0b3, 0x14e, // 864-867
+            0x12d, 0x092, 0x0b3, 0x14e, // 868-871
+            0x12d, 0x092, 0x0b3, 0x14e, // 872-875
+            0x12d, 0x092, 0x0b3, 0x14e, // 876-879
+            0x12d, 0x092, 0x0b3, 0x14e, // 880-883
+            0x12d, 0x092, 0x0b3, 0x14e, // 884-887
+            0x12d, 0x092, 0x0b3, 0x14e, // 888-891
+            0x12d, 0x092, 0x0b7, 0x13a, // 892-895
+            0x113, 0x0ce, 0x0e6, 0x0f4, // 896-899
+            0x0f0,                      // 900-909
+            //                             equalizing        serration
+            // VBI fields                  1, 3     2, 4     1, 3     2, 4
+            0x0f0,                      // 768-782  313-327  782      327
+            0x0e9, 0x0a4, 0x044, 0x011, // 783-786  328-331  783-786  328-331
+            0x010,                      // 787-815  332-360  787-260  332-715
+            0x017, 0x05c, 0x0bc, 0x0ef, // 816-819  361-364  261-264  716-719
+            0x0f0,                      // 820-327  365-782  265-327  720-782
+            0x0e9, 0x0a4, 0x044, 0x011, // 328-331  783-786  328-331  783-786
+            0x010,                      // 332-360  787-815  332-715  787-260
+            0x017, 0x05c, 0x0bc, 0x0ef, // 361-364  816-819  716-719  261-264
+            0x0f0                       // 365-782  820-327  720-782  265-327
+        };
+        return levels[i];
+    }
+
+    static void rise(Bitmap<int> b, int x, int y)
+    {
+        for (int xx = 0; xx < 4; ++xx)
+            b[Vector(x + xx, y)] = syncBurstLevel(xx + 6);
+    }
+
+    static void fall(Bitmap<int> b, int x, int y)
+    {
+        for (int xx = 0; xx < 4; ++xx)
+            b[Vector(x + xx, y)] = syncBurstLevel(xx + 1);
+    }
+
+    static Bitmap<int> createSyncBurstBitmap()
+    {
+        Bitmap<int> b(Vector(910, 262));
+        b.fill(blank);
+        for (int y = 0; y < 262; ++y) {
+            // Horizontal sync
+            fall(b, 783, y);
+            for (int x = 787; x < 850; ++x)
+                b[Vector(x, y)] = sync;
+            rise(b, 850, y);
+
+            // Burst
+            for (int x = 858; x < 900; ++x)
+                if ((y & 1) == 0)
+                    b[Vector(x, y)] = syncBurstLevel(14 + x-858);
+                else
+                    b[Vector(x, y)] = syncBurstLevel(57 + x-858);
+        }
+        // Vertical sync
+        for (int y = 241; y < 244; ++y) {
+            // Equalization
+            rise(b, 816, y);
+            for (int x = 820; x < 910; ++x)
+                b[Vector(x, y)] = blank;
+            fall(b, 328, y + 1);
+            for (int x = 332; x < 361; ++x)
+                b[Vector(x, y + 1)] = sync;
+            rise(b, 361, y + 1);
+
+            // Serration
+            for (int x = 850; x < 910; ++x)
+                b[Vector(x, y + 3)] = sync;
+            for (int x = 0; x < 261; ++x)
+                b[Vector(x, y + 4)] = sync;
+            rise(b, 261, y + 4);
+            fall(b, 328, y + 4);
+            for (int x = 332; x < 716; ++x)
+                b[Vector(x, y + 4)] = sync;
+            rise(b, 716, y + 4);
+
+            // Equalization
+            rise(b, 816, y + 6);
+            for (int x = 820; x < 910; ++x)
+                b[Vector(x, y + 6)] = blank;
+            fall(b, 328, y + 7);
+            for (int x = 332; x < 361; ++x)
+                b[Vector(x, y + 7)] = sync;
+            rise(b, 361, y + 7);
+        }
+        return b;
+    }
+
+    NTSCEncoder() : _inputWidth(0)
+    {
+        Bitmap<int> syncBurst = createSyncBurstBitmap();
+        _syncBurst = Array<Byte>(samplesPerField);
+        for (int y = 0; y < linesPerField; ++y)
+            for (int x = 0; x < samplesPerLine; ++x) {
+                _syncBurst[((y + 14)*samplesPerLine + x + 60) %
+                    samplesPerField] = (syncBurst[Vector(x, y)] + 2) >> 2;
+            }
+    }
+    // This creates FFTW plans, so (unlike encode()) it must not be called
+    // concurrently with anything else that uses FFTW.
+    void setInputWidth(int width)
+    {
+        if (width == _inputWidth)
+            return;
+        _inputWidth = width;
+        _inputSize = width*samplesPerLine/activeWidth;
+        int inputLeft = static_cast<int>(0.5f +
+            activeLeft*width/static_cast<float>(activeWidth));
+
+        // The picture is reflected at its edges to fill the line.
+        _sourceX = Array<int>(_inputSize);
+        _carrier = Array<Complex<float>>(_inputSize);
+        for (int x = 0; x < _inputSize; ++x) {
+            int xx;
+            if (x < inputLeft)
+                xx = inputLeft - 1 - x;
+            else
+                if (x < inputLeft + width)
+                    xx = x - inputLeft;
+                else
+                    xx = inputLeft + 2*width - 1 - x;
+            _sourceX[x] = clamp(0, xx, width - 1);
+            _carrier[x] = unit(-x*227.5f/_inputSize);
+        }
+
+        _yTime = FFTWComplexArray<float>(_inputSize);
+        _cTime = FFTWComplexArray<float>(_inputSize);
+        _yFrequency = FFTWComplexArray<float>(_inputSize);
+        _cFrequency = FFTWComplexArray<float>(_inputSize);
+        _oFrequency = FFTWComplexArray<float>(samplesPerLine);
+        _oTime = FFTWComplexArray<float>(samplesPerLine);
+        _yForward = FFTWPlanDFT1D<float>(_inputSize, _yTime, _yFrequency,
+            FFTW_FORWARD, FFTW_MEASURE);
+        _cForward = FFTWPlanDFT1D<float>(_inputSize, _cTime, _cFrequency,
+            FFTW_FORWARD, FFTW_MEASURE);
+        _backward = FFTWPlanDFT1D<float>(samplesPerLine, _oFrequency, _oTime,
+            FFTW_BACKWARD, FFTW_MEASURE);
+        // If the input is narrower than a line, the frequencies in the middle
+        // are never written.
+        for (int x = 0; x < samplesPerLine; ++x)
+            _oFrequency[x] = 0;
+    }
+    int inputWidth() const { return _inputWidth; }
+
+    // Writes samplesPerField samples to output.
+    void encode(Bitmap<SRGB> input, Byte* output)
+    {
+        memcpy(output, &_syncBurst[0], samplesPerField);
+        int xCount = min(samplesPerLine, _inputSize);
+        int xMid = (xCount + 1)/2;
+        float gain = (200.0f - 71.0f)/_inputSize;
+        for (int y = 0; y < activeHeight; ++y) {
+            const SRGB* row = input.row(y);
+            // The chroma phase alternates from line to line.
+            float phase = (y & 1) != 0 ? 1.0f : -1.0f;
+            for (int x = 0; x < _inputSize; ++x) {
+                SRGB srgb = row[_sourceX[x]];
+                float r = srgb.x/255.0f;
+                float g = srgb.y/255.0f;
+                float b = srgb.z/255.0f;
+                float i = 0.595716f*r - 0.274453f*g - 0.321263f*b;
+                float q = 0.211456f*r - 0.522591f*g + 0.311135f*b;
+                _yTime[x] = 0.299f*r + 0.587f*g + 0.114f*b;
+                _cTime[x] = Complex<float>(i, q)*_carrier[x]*phase;
+            }
+            _yForward.execute();
+            _cForward.execute();
+
+            for (int x = 0; x < xCount; ++x) {
+                int ix = x;
+                int ox = x;
+                if (x > xMid) {
+                    ix += _inputSize - xCount;
+                    ox += samplesPerLine - xCount;
+                }
+                if ((ox >= samplesPerLine - 284 &&
+                    ox <= samplesPerLine - 171) || (ox >= 171 && ox <= 284))
+                    _oFrequency[ox] = _cFrequency[ix];
+                else
+                    _oFrequency[ox] = _yFrequency[ix];
+            }
+            _backward.execute();
+
+            Byte* line = output + (y + activeTop)*samplesPerLine + activeLeft;
+            for (int x = 0; x < activeWidth; ++x)
+                line[x] = byteClamp(_oTime[x + activeLeft].x*gain + 71.5f);
+        }
+    }
+
+    // Finds the burst samples that have the same carrier phase as each of
+    // the first 4 samples of the active part of the given line, averaged
+    // over the burst.
+    void burst(int line, Byte* burst) const
+    {
+        const Byte* p = &_syncBurst[line*samplesPerLine];
+        for (int k = 0; k < 4; ++k) {
+            int total = 0;
+            int count = 0;
+            for (int x = burstLeft; x < burstRight; ++x)
+                if (((x - activeLeft) & 3) == k) {
+                    total += p[x];
+                    ++count;
+                }
+            burst[k] = (total + count/2)/count;
+        }
+    }
+private:
+    int _inputWidth;
+    int _inputSize;
+    Array<Byte> _syncBurst;
+    Array<int> _sourceX;
+    Array<Complex<float>> _carrier;
+    FFTWComplexArray<float> _yTime;
+    FFTWComplexArray<float> _cTime;
+    FFTWComplexArray<float> _yFrequency;
+    FFTWComplexArray<float> _cFrequency;
+    FFTWComplexArray<float> _oFrequency;
+    FFTWComplexArray<float> _oTime;
+    FFTWPlanDFT1D<float> _yForward;
+    FFTWPlanDFT1D<float> _cForward;
+    FFTWPlanDFT1D<float> _backward;
+};
+
+#endif // INCLUDED_NTSC_ENCODE_H
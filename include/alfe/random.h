@@ -3,6 +3,12 @@
 #ifndef INCLUDED_RANDOM_H
 #define INCLUDED_RANDOM_H
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
 UInt32 random32()
 {
     static UInt32 r = 0;
@@ -17,4 +23,79 @@ UInt64 random64(UInt64 n)
     return ((static_cast<UInt64>(random32()) << 32) + random32()) % n;
 }
 
+// A counter-based generator: number n of the stream for a given seed is a
+// hash of the seed and n, so any part of the stream can be generated
+// independently of the rest (out of order, or on several threads) and gives
+// the same results.
+class CounterRandom
+{
+public:
+    CounterRandom(UInt32 seed = 0) : _seed(seed) { }
+    UInt32 operator()(UInt64 n) const
+    {
+        return hash(static_cast<UInt32>(n)*golden + key(n));
+    }
+    // Writes numbers n to n + count - 1 to output.
+    void fill(UInt64 n, UInt32* output, int count) const
+    {
+        while (count > 0) {
+            // The key changes every 2^32 numbers.
+            int c = static_cast<int>(min(static_cast<UInt64>(count),
+                0x100000000ULL - static_cast<UInt32>(n)));
+            UInt32 k = key(n);
+            UInt32 x = static_cast<UInt32>(n)*golden + k;
+            int i;
+            __m128i v = _mm_add_epi32(_mm_set1_epi32(x),
+                _mm_setr_epi32(0, golden, 2*golden, 3*golden));
+            __m128i step = _mm_set1_epi32(4*golden);
+            for (i = 0; i + 4 <= c; i += 4) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i),
+                    hash(v));
+                v = _mm_add_epi32(v, step);
+            }
+            for (; i < c; ++i)
+                output[i] = hash(x + i*golden);
+            n += c;
+            output += c;
+            count -= c;
+        }
+    }
+private:
+    static const UInt32 golden = 0x9e3779b9;
+
+    UInt32 key(UInt64 n) const
+    {
+        return hash(_seed + hash(static_cast<UInt32>(n >> 32)));
+    }
+    static UInt32 hash(UInt32 x)
+    {
+        x ^= x >> 16;
+        x *= 0x7feb352d;
+        x ^= x >> 15;
+        x *= 0x846ca68b;
+        x ^= x >> 16;
+        return x;
+    }
+    static __m128i hash(__m128i x)
+    {
+        x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+        x = multiply(x, 0x7feb352d);
+        x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+        x = multiply(x, 0x846ca68b);
+        return _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+    }
+    // 32-bit multiply (low half), which SSE2 doesn't have.
+    static __m128i multiply(__m128i a, UInt32 b)
+    {
+        __m128i m = _mm_set1_epi32(b);
+        __m128i even = _mm_mul_epu32(a, m);
+        __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), m);
+        return _mm_unpacklo_epi32(
+            _mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+    }
+
+    UInt32 _seed;
+};
+
 #endif // INCLUDED_RANDOM_H
@@ -3,9 +3,13 @@
 #ifndef INCLUDED_LOCK_H
 #define INCLUDED_LOCK_H
 
+#ifdef _WIN32
 #include "alfe/windows_handle.h"
+#endif
 #include "alfe/linked_list.h"
 
+#ifdef _WIN32
+
 class Event : public WindowsHandle
 {
 public:
@@ -99,6 +103,162 @@ private:
     CRITICAL_SECTION _cs;
 };
 
+#else
+
+#include <pthread.h>
+#include <time.h>
+
+// pthreads functions return an error code rather than setting errno.
+#define IF_PTHREAD_ERROR_THROW(expr) CODE_MACRO( \
+    int r = (expr); \
+    if (r != 0) { \
+        errno = r; \
+        throw Exception::systemError(); \
+    } \
+)
+
+// An auto-reset event, like the Win32 one: a wait returns once the event has
+// been signalled, and resets it.
+class Event : Uncopyable
+{
+public:
+    Event() : _signalled(false)
+    {
+        IF_PTHREAD_ERROR_THROW(pthread_mutex_init(&_mutex, NULL));
+        IF_PTHREAD_ERROR_THROW(pthread_cond_init(&_condition, NULL));
+    }
+    ~Event()
+    {
+        pthread_cond_destroy(&_condition);
+        pthread_mutex_destroy(&_mutex);
+    }
+    void signal()
+    {
+        pthread_mutex_lock(&_mutex);
+        _signalled = true;
+        pthread_cond_signal(&_condition);
+        pthread_mutex_unlock(&_mutex);
+    }
+    // Waits for up to time milliseconds (-1 for no limit). Returns false if
+    // the time ran out.
+    bool wait(int time = -1)
+    {
+        timespec deadline;
+        if (time != -1) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += time/1000;
+            deadline.tv_nsec += (time%1000)*1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_nsec -= 1000000000;
+                ++deadline.tv_sec;
+            }
+        }
+        pthread_mutex_lock(&_mutex);
+        while (!_signalled) {
+            if (time == -1)
+                pthread_cond_wait(&_condition, &_mutex);
+            else {
+                if (pthread_cond_timedwait(&_condition, &_mutex, &deadline)
+                    == ETIMEDOUT)
+                    break;
+            }
+        }
+        bool signalled = _signalled;
+        _signalled = false;
+        pthread_mutex_unlock(&_mutex);
+        return signalled;
+    }
+    void reset()
+    {
+        pthread_mutex_lock(&_mutex);
+        _signalled = false;
+        pthread_mutex_unlock(&_mutex);
+    }
+private:
+    pthread_mutex_t _mutex;
+    pthread_cond_t _condition;
+    bool _signalled;
+};
+
+class Thread : Uncopyable
+{
+public:
+    Thread() : _started(false), _error(false) { }
+    ~Thread() { noFailJoin(); }
+    // Thread priorities need privileges on Linux, so this is a hint only.
+    void setPriority(int nPriority) { }
+    void noFailJoin()
+    {
+        if (!_started)
+            return;
+        _started = false;
+        pthread_join(_thread, NULL);
+    }
+    void join()
+    {
+        if (!_started)
+            return;
+        _started = false;
+        IF_PTHREAD_ERROR_THROW(pthread_join(_thread, NULL));
+        if (_error)
+            throw _exception;
+    }
+    void start()
+    {
+        IF_PTHREAD_ERROR_THROW(
+            pthread_create(&_thread, NULL, threadStaticProc, this));
+        _started = true;
+    }
+
+private:
+    static void* threadStaticProc(void* parameter)
+    {
+        reinterpret_cast<Thread*>(parameter)->process();
+        return 0;
+    }
+    void process()
+    {
+        try {
+            threadProc();
+        }
+        catch (Exception& e) {
+            _exception = e;
+            _error = true;
+        }
+    }
+
+    virtual void threadProc() = 0;
+
+    bool _started;
+    bool _error;
+    Exception _exception;
+    pthread_t _thread;
+};
+
+// Recursive, like the Win32 critical section, since some callers take a Lock
+// while already holding one on the same Mutex.
+class Mutex : Uncopyable
+{
+public:
+    Mutex()
+    {
+        pthread_mutexattr_t attributes;
+        IF_PTHREAD_ERROR_THROW(pthread_mutexattr_init(&attributes));
+        pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+        int error = pthread_mutex_init(&_mutex, &attributes);
+        pthread_mutexattr_destroy(&attributes);
+        IF_PTHREAD_ERROR_THROW(error);
+    }
+    ~Mutex() { pthread_mutex_destroy(&_mutex); }
+    void lock() { pthread_mutex_lock(&_mutex); }
+    void unlock() { pthread_mutex_unlock(&_mutex); }
+    bool tryLock() { return pthread_mutex_trylock(&_mutex) == 0; }
+private:
+    pthread_mutex_t _mutex;
+};
+
+#endif
+
 class Lock : Uncopyable
 {
 public:
@@ -210,17 +370,10 @@ private:
 class ThreadPool : Uncopyable
 {
 public:
-    ThreadPool(int threads = 0)
-    {
-        if (threads == 0) {
-            // Count available threads
-            DWORD_PTR pam, sam;
-            IF_ZERO_THROW(
-                GetProcessAffinityMask(GetCurrentProcess(), &pam, &sam));
-            for (DWORD_PTR p = 1; p != 0; p <<= 1)
-                if ((pam&p) != 0)
-                    ++threads;
-        }
+    ThreadPool(int threads = 0) : _idle(0)
+    {
+        if (threads == 0)
+            threads = availableThreads();
         _threads.allocate(threads);
         for (int i = 0; i < threads; ++i) {
             _threads[i]._threadPool = this;
@@ -352,6 +505,28 @@ public:
     }
 
     void addCompleted(Task* task) { _completed.add(task); }
+
+    int threads() const { return _threads.count(); }
+
+    // Number of CPUs this process can run on.
+    static int availableThreads()
+    {
+#ifdef _WIN32
+        DWORD_PTR pam, sam;
+        IF_ZERO_THROW(
+            GetProcessAffinityMask(GetCurrentProcess(), &pam, &sam));
+        int threads = 0;
+        for (DWORD_PTR p = 1; p != 0; p <<= 1)
+            if ((pam&p) != 0)
+                ++threads;
+        return threads;
+#else
+        cpu_set_t set;
+        IF_PTHREAD_ERROR_THROW(
+            pthread_getaffinity_np(pthread_self(), sizeof(set), &set));
+        return CPU_COUNT(&set);
+#endif
+    }
 private:
     void addNoLock(Task* task)
     {
@@ -3,29 +3,53 @@
 #ifndef INCLUDED_TIMER_H
 #define INCLUDED_TIMER_H
 
+#ifdef _WIN32
 #include <MMSystem.h>
+#else
+#include <time.h>
+#endif
 
 class Timer
 {
 public:
     Timer()
     {
+#ifdef _WIN32
         QueryPerformanceCounter(&_startTime);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &_startTime);
+#endif
     }
     void output(String caption)
     {
+        console.write(caption + ": " + decimal(static_cast<int>(
+            seconds()*1000000.0)) + " microseconds\n");
+        //printf("%lf us\n",time.QuadPart*1000000.0/frequency.QuadPart);
+    }
+    // Time since construction.
+    double seconds()
+    {
+#ifdef _WIN32
         LARGE_INTEGER time;
         QueryPerformanceCounter(&time);
         time.QuadPart -= _startTime.QuadPart;
         LARGE_INTEGER frequency;
         QueryPerformanceFrequency(&frequency);
-        console.write(caption + ": " + decimal(static_cast<int>(
-            (time.QuadPart*1000000)/frequency.QuadPart)) +
-            " microseconds\n");
-        //printf("%lf us\n",time.QuadPart*1000000.0/frequency.QuadPart);
+        return static_cast<double>(time.QuadPart)/
+            static_cast<double>(frequency.QuadPart);
+#else
+        timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return static_cast<double>(time.tv_sec - _startTime.tv_sec) +
+            static_cast<double>(time.tv_nsec - _startTime.tv_nsec)/1.0e9;
+#endif
     }
 private:
+#ifdef _WIN32
     LARGE_INTEGER _startTime;
+#else
+    timespec _startTime;
+#endif
 };
 
 //class Timer
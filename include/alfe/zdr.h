@@ -0,0 +1,244 @@
+#include "alfe/main.h"
+#include "alfe/thread.h"
+#include "alfe/composite_codec.h"
+#ifdef WIN32
+#define ZLIB_WINAPI
+#endif
+#include "zlib.h"
+
+#ifndef INCLUDED_ZDR_H
+#define INCLUDED_ZDR_H
+
+// A .zdr file holds captured composite video as frames of 8-bit samples, each
+// compressed as an independent zlib stream. Version 1 files (as originally
+// written by capture_stream) are just the concatenated streams, so a frame
+// can only be found by inflating everything before it. Version 2 files follow
+// the streams with an index: the UInt64 file offset of each frame, then a
+// 24-byte trailer:
+//   UInt64 end of the frame data (the offset of the index)
+//   DWord number of frames
+//   DWord samples per frame
+//   DWord version (2)
+//   "ZDRX"
+// For a version 1 file, ZDRReader builds the same index once and saves it in
+// a sidecar file (the .zdr file's name with "i" appended) for next time.
+// In a version 2 file, a frame may instead be compressed with CompositeCodec,
+// which is recognized by its first four bytes.
+
+static const int zdrSamplesPerFrame = 450*1024;
+
+class ZDRWriter : Uncopyable
+{
+public:
+    ZDRWriter(File file, int samplesPerFrame = zdrSamplesPerFrame)
+      : _stream(file.openWrite()), _samplesPerFrame(samplesPerFrame),
+        _offset(0), _closed(false) { }
+    ~ZDRWriter()
+    {
+        try {
+            close();
+        }
+        catch (...) { }
+    }
+    // Frames must be written in order.
+    void write(const Byte* data, int bytes)
+    {
+        _offsets.append(_offset);
+        _stream.write(data, bytes);
+        _offset += bytes;
+    }
+    // Writes the index. No more frames can be written after this.
+    void close()
+    {
+        if (_closed)
+            return;
+        _closed = true;
+        writeIndex(&_stream, _offsets, _offset, _samplesPerFrame);
+    }
+    int frames() const { return _offsets.count(); }
+
+    static void writeIndex(Stream* stream,
+        const AppendableArray<UInt64>& offsets, UInt64 end,
+        int samplesPerFrame)
+    {
+        AppendableArray<Byte> index;
+        if (offsets.count() > 0) {
+            index.append(reinterpret_cast<const Byte*>(&offsets[0]),
+                offsets.count()*sizeof(UInt64));
+        }
+        index.append(reinterpret_cast<const Byte*>(&end), 8);
+        DWord trailer[4] = {static_cast<DWord>(offsets.count()),
+            static_cast<DWord>(samplesPerFrame), 2,
+            *reinterpret_cast<const DWord*>("ZDRX")};
+        index.append(reinterpret_cast<const Byte*>(trailer), 16);
+        stream->write(index);
+    }
+private:
+    FileStream _stream;
+    AppendableArray<UInt64> _offsets;
+    int _samplesPerFrame;
+    UInt64 _offset;
+    bool _closed;
+};
+
+// Decompresses frames in either format. Each thread decompressing frames
+// needs its own ZDRInflater.
+class ZDRInflater : Uncopyable
+{
+public:
+    ZDRInflater()
+    {
+        memset(&_zs, 0, sizeof(z_stream));
+        if (inflateInit(&_zs) != Z_OK)
+            throw Exception("inflateInit failed");
+    }
+    ~ZDRInflater() { inflateEnd(&_zs); }
+    void decompress(const Byte* data, int bytes, Byte* samples, int count)
+    {
+        if (CompositeCodec::isCompressed(data, bytes)) {
+            _codec.decode(data, bytes, samples, count);
+            return;
+        }
+        if (inflateReset(&_zs) != Z_OK)
+            throw Exception("inflateReset failed");
+        _zs.avail_in = bytes;
+        _zs.next_in = const_cast<Byte*>(data);
+        _zs.avail_out = count;
+        _zs.next_out = samples;
+        int r = inflate(&_zs, Z_FINISH);
+        if (r != Z_STREAM_END || _zs.avail_out != 0)
+            throw Exception("inflate failed");
+    }
+private:
+    z_stream _zs;
+    CompositeCodec _codec;
+};
+
+class ZDRReader : Uncopyable
+{
+public:
+    ZDRReader(File file, int samplesPerFrame = zdrSamplesPerFrame)
+      : _stream(file.openRead()), _samplesPerFrame(samplesPerFrame)
+    {
+        UInt64 size = _stream.size();
+        if (readIndex(&_stream, size, false))
+            return;
+        File sidecar(file.path() + "i", true);
+        {
+            FileStream s = sidecar.tryOpenRead();
+            if (s.valid() && readIndex(&s, size, true))
+                return;
+        }
+        scan(size);
+        FileStream s = sidecar.openWrite();
+        ZDRWriter::writeIndex(&s, _offsets, _end, _samplesPerFrame);
+    }
+    int frames() const { return _offsets.count(); }
+    int samplesPerFrame() const { return _samplesPerFrame; }
+    // Reads and decompresses frame n into samples. Can be called from
+    // several threads at once, each with its own inflater.
+    void readFrame(int n, ZDRInflater* inflater, Byte* samples)
+    {
+        UInt64 end = n + 1 < _offsets.count() ? _offsets[n + 1] : _end;
+        int bytes = static_cast<int>(end - _offsets[n]);
+        Array<Byte> data(bytes);
+        {
+            Lock lock(&_mutex);
+            _stream.seek(_offsets[n]);
+            _stream.read(&data[0], bytes);
+        }
+        inflater->decompress(&data[0], bytes, samples, _samplesPerFrame);
+    }
+private:
+    // Reads the index from the end of stream, which is either the .zdr file
+    // (of length zdrSize) itself or its sidecar. Returns false if there isn't
+    // a valid index there.
+    bool readIndex(FileStream* stream, UInt64 zdrSize, bool sidecar)
+    {
+        UInt64 size = stream->size();
+        if (size < 24)
+            return false;
+        Byte trailer[24];
+        stream->seek(size - 24);
+        stream->read(trailer, 24);
+        UInt64 end = *reinterpret_cast<UInt64*>(&trailer[0]);
+        DWord* d = reinterpret_cast<DWord*>(&trailer[8]);
+        UInt64 indexBytes = d[0]*static_cast<UInt64>(sizeof(UInt64));
+        if (d[3] != *reinterpret_cast<const DWord*>("ZDRX") || d[2] != 2 ||
+            end > zdrSize || size - 24 != indexBytes + (sidecar ? 0 : end))
+            return false;
+        Array<UInt64> offsets(d[0]);
+        if (offsets.count() > 0) {
+            stream->seek(size - 24 - indexBytes);
+            stream->read(reinterpret_cast<Byte*>(&offsets[0]),
+                static_cast<int>(indexBytes));
+        }
+        _samplesPerFrame = d[1];
+        _end = end;
+        _offsets = AppendableArray<UInt64>();
+        _offsets.append(offsets);
+        return true;
+    }
+    // Finds the frames of a version 1 file by inflating all of it. A frame
+    // cut short by the end of the capture is ignored.
+    void scan(UInt64 size)
+    {
+        static const int bufferSize = 0x10000;
+        AppendableArray<UInt64> offsets;
+        Array<Byte> input(bufferSize);
+        Array<Byte> samples(_samplesPerFrame);
+        z_stream zs;
+        memset(&zs, 0, sizeof(z_stream));
+        if (inflateInit(&zs) != Z_OK)
+            throw Exception("inflateInit failed");
+        UInt64 position = 0;
+        UInt64 frameStart = 0;
+        UInt64 end = 0;
+        bool inFrame = false;
+        _stream.seek(0);
+        do {
+            if (zs.avail_in == 0) {
+                if (position == size)
+                    break;
+                int bytes = static_cast<int>(min(static_cast<UInt64>(
+                    bufferSize), size - position));
+                _stream.read(&input[0], bytes);
+                position += bytes;
+                zs.avail_in = bytes;
+                zs.next_in = &input[0];
+            }
+            if (!inFrame) {
+                frameStart = position - zs.avail_in;
+                inFrame = true;
+            }
+            zs.avail_out = _samplesPerFrame;
+            zs.next_out = &samples[0];
+            int r = inflate(&zs, Z_NO_FLUSH);
+            if (r == Z_STREAM_END) {
+                offsets.append(frameStart);
+                end = position - zs.avail_in;
+                inFrame = false;
+                if (inflateReset(&zs) != Z_OK)
+                    throw Exception("inflateReset failed");
+            }
+            else {
+                if (r != Z_OK && r != Z_BUF_ERROR) {
+                    inflateEnd(&zs);
+                    throw Exception(_stream.file().path() +
+                        " is not a .zdr file.");
+                }
+            }
+        } while (true);
+        inflateEnd(&zs);
+        _end = end;
+        _offsets = offsets;
+    }
+
+    FileStream _stream;
+    AppendableArray<UInt64> _offsets;
+    UInt64 _end;
+    int _samplesPerFrame;
+    Mutex _mutex;
+};
+
+#endif // INCLUDED_ZDR_H
@@ -1,5 +1,8 @@
 #include "alfe/string.h"
 #include "alfe/file.h"
+#include "alfe/thread.h"
+#include "alfe/random.h"
+#include "alfe/evaluate.h"
 #include <vector>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,6 +11,23 @@
 
 //#define DUMP
 
+// An opcode decoded when the program is loaded, so that the bars running it
+// don't have to pick it apart again on every instruction cycle.
+class Instruction
+{
+public:
+    enum Operation { unrecognized, nop, option, sleep, clrwdt, streamBits,
+        tris, streamStart, movwf, clr, subwf, decf, iorwf, andwf, xorwf,
+        addwf, movf, comf, incf, decfsz, rrf, rlf, swapf, incfsz, bcf, bsf,
+        btfsc, btfss, retlw, call, jump, movlw, iorlw, andlw, xorlw };
+
+    int _operation;
+    int _f;         // Register written, 0x20 for TRIS or -1 for none
+    int _literal;   // 8-bit literal, or 9-bit address for GOTO
+    UInt8 _mask;    // Bit for the bit-oriented operations
+    bool _d;        // Result goes to f rather than W
+};
+
 class SimulatedProgram
 {
 public:
@@ -56,6 +76,113 @@ public:
             else
                 _markers.push_back(_annotations.subString(marker, end - marker));
         }
+        for (int i = 0; i < 0x200; ++i)
+            decode(op(i));
+    }
+    void decode(int op)
+    {
+        static const int byteOperations[0x10] = {
+            Instruction::unrecognized, Instruction::clr, Instruction::subwf,
+            Instruction::decf, Instruction::iorwf, Instruction::andwf,
+            Instruction::xorwf, Instruction::addwf, Instruction::movf,
+            Instruction::comf, Instruction::incf, Instruction::decfsz,
+            Instruction::rrf, Instruction::rlf, Instruction::swapf,
+            Instruction::incfsz};
+        static const char* byteNames[0x10] = {
+            "", "", "SUBWF", "DECF", "IORWF", "ANDWF", "XORWF", "ADDWF",
+            "MOVF", "COMF", "INCF", "DECFSZ", "RRF", "RLF", "SWAPF", "INCFSF"};
+        static const char* bitNames[4] = {"BCF", "BSF", "BTFSC", "BTFSS"};
+        static const int literalOperations[8] = {
+            Instruction::retlw, Instruction::call, Instruction::jump,
+            Instruction::jump, Instruction::movlw, Instruction::iorlw,
+            Instruction::andlw, Instruction::xorlw};
+        static const char* literalNames[8] = {
+            "RETLW", "CALL ", "GOTO ", "GOTO ", "MOVLW", "IORLW", "ANDLW",
+            "XORLW"};
+
+        Instruction i;
+        i._operation = Instruction::unrecognized;
+        i._f = -1;
+        i._literal = op & 0xff;
+        i._mask = 1 << ((op >> 5) & 7);
+        i._d = ((op & 0x20) != 0);
+        int f = op & 0x1f;
+        String text;
+        if (op >= 0x1000) {
+            // Not a 12-bit opcode
+        }
+        else if ((op & 0xc00) == 0) {
+            i._f = f;
+            int o = op >> 6;
+            if (o > 1) {
+                i._operation = byteOperations[o];
+                text = String(byteNames[o]) + " " + hex(f, 2) + ", " +
+                    codePoint(i._d ? 'f' : 'W');
+            }
+            else if (o == 1) {
+                i._operation = Instruction::clr;
+                text = i._d ? "CLRF " + hex(f, 2) : String("CLRW");
+            }
+            else if (i._d) {
+                i._operation = Instruction::movwf;
+                text = "MOVWF " + hex(f, 2);
+            }
+            else {
+                i._f = -1;
+                switch (f) {
+                    case 0:
+                        i._operation = Instruction::nop;
+                        text = "NOP";
+                        break;
+                    case 2:
+                        i._operation = Instruction::option;
+                        text = "OPTION";
+                        break;
+                    case 3:
+                        i._operation = Instruction::sleep;
+                        text = "SLEEP";
+                        break;
+                    case 4:
+                        i._operation = Instruction::clrwdt;
+                        text = "CLRWDT";
+                        break;
+                    case 5:  // Not a real PIC12F508 opcode - used for simulator escape (data)
+                        i._operation = Instruction::streamBits;
+                        break;
+                    case 6:
+                        i._operation = Instruction::tris;
+                        i._f = 0x20;
+                        text = "TRIS GPIO";
+                        break;
+                    case 7:  // Not a real PIC12F08 opcode - used for simulator escape (space)
+                        i._operation = Instruction::streamStart;
+                        text = "---";
+                        break;
+                }
+            }
+        }
+        else if ((op & 0x800) == 0) {
+            i._f = f;
+            i._operation = Instruction::bcf + ((op >> 8) & 3);
+            text = String(bitNames[(op >> 8) & 3]) + " " + hex(f, 2) + ", " +
+                ((op >> 5) & 7);
+        }
+        else {
+            int o = (op >> 8) & 7;
+            i._operation = literalOperations[o];
+            if (i._operation == Instruction::jump) {
+                i._literal = op & 0x1ff;
+                text = String(literalNames[o]) + " " + hex(op & 0x1ff, 3);
+            }
+            else
+                text = String(literalNames[o]) + " " + hex(i._literal, 2);
+        }
+        // The stream escape is preceded by the bits it outputs.
+        int width = (i._operation == Instruction::streamBits ? 8 : 16);
+        while (text.length() < width)
+            text += " ";
+        _instructions.push_back(i);
+        _disassembly.push_back(text);
     }
     void parseLine()
     {
@@ -121,7 +248,12 @@ public:
         address <<= 1;
         return _data[address] | (_data[address + 1] << 8);
     }
+    const Instruction& instruction(int address) const
+    {
+        return _instructions[address];
+    }
     String annotation(int line) const { return _annotation[line]; }
+    String disassembly(int line) const { return _disassembly[line]; }
     String marker(int line) const { return _markers[line]; }
 private:
     UInt8 _data[0x400];
@@ -132,6 +264,8 @@ private:
     std::vector<String> _annotation;
     std::vector<String> _markers;
     String _annotationsFileName;
+    std::vector<Instruction> _instructions;
+    std::vector<String> _disassembly;
 };
 
 class Simulation;
@@ -200,258 +334,185 @@ public:
         if (_debug)
             printf("%*s% 7.2lf ", _indent*8, "", _tNextStop/(400.0*256.0));
         int pc = _pch | _memory[2];
-        int op = _program->op(pc);
+        const Instruction& instruction = _program->instruction(pc);
 #ifdef DUMP
         String markerCode = _program->marker(pc);
 #endif
         incrementPC();
         UInt16 r;
+        _f = instruction._f;
+        bool d = instruction._d;
+        int mask = instruction._mask;
+        int k = instruction._literal;
+        if (_debug && instruction._operation != Instruction::streamBits)
+            debugInstruction(pc);
 
-        if ((op & 0x800) == 0) {
-            _f = op & 0x1f;
-            if ((op & 0x400) == 0) {
-                bool d = ((op & 0x20) != 0);  // true if destination is f, false if destination is W
-                char dc = d ? 'f' : 'W';
-                switch (op >> 6) {
-                    case 0x0:
-                        if (!d)
-                            switch (_f) {
-                                case 0:
-                                    if (_debug) { printf("NOP             "); debug->write(_program->annotation(pc)); printf("\n"); }
-                                    _f = -1;
-                                    break;
-                                case 2:
-                                    if (_debug) { printf("OPTION          "); debug->write(_program->annotation(pc)); printf("\n"); }
-                                    _f = -1;
-                                    _option = _w;
-                                    break;
-                                case 3:
-                                    if (_debug) { printf("SLEEP           "); debug->write(_program->annotation(pc)); printf("\n"); }
-                                    _f = -1;
-                                    throw Exception(String("SLEEP not supported"));
-                                    break;
-                                case 4:
-                                    if (_debug) { printf("CLRWDT          "); debug->write(_program->annotation(pc)); printf("\n"); }
-                                    _f = -1;
-                                    throw Exception(String("CLRWDT not supported"));
-                                    break;
-                                case 5:  // Not a real PIC12F508 opcode - used for simulator escape (data)
-                                    _f = -1;
-                                    //if (_debug) { printf("%i               ", _w & 1); debug->write(_program->annotation(pc)); printf("\n"); }
-                                    //_simulation->streamBit((_w & 1) != 0);
-                                    //_skipping = true;
-                                    {
-                                        for (int i = 0; i < 8; ++i) {
-                                            _simulation->streamBit((_memory[7+i] & 1) != 0);
-                                            if (_debug)
-                                                printf("%i", _memory[7+i] & 1);
-                                        }
-                                    }
-                                    if (_debug) { printf("        "); debug->write(_program->annotation(pc)); printf("\n"); }
-                                    break;
-                                case 6:
-                                    if (_debug) { printf("TRIS GPIO       "); debug->write(_program->annotation(pc)); printf("\n"); }
-                                    _f = 0x20;
-                                    _data = _w;
-                                    break;
-                                case 7:  // Not a real PIC12F08 opcode - used for simulator escape (space)
-                                    _f = -1;
-                                    if (_debug) { printf("---             "); debug->write(_program->annotation(pc)); printf("\n"); }
-                                    _simulation->streamStart();
-                                    break;
-                                default:
-                                    unrecognizedOpcode(op);
-                                    break;
-                            }
-                        else {
-                            if (_debug) { printf("MOVWF 0x%02x      ", _f); debug->write(_program->annotation(pc)); printf("\n"); }
-                            _data = _w;
-                        }
-                        break;
-                    case 0x1:
-                        if (_debug) {
-                            if (!d)
-                                printf("CLRW            ");
-                            else
-                                printf("CLRF 0x%02x       ", _f);
-                             debug->write(_program->annotation(pc));
-                             printf("\n");
-                        }
-                        storeZ(0, d);
-                        break;
-                    case 0x2:
-                        if (_debug) { printf("SUBWF 0x%02x, %c   ", _f, dc); debug->write(_program->annotation(pc)); printf("\n"); }
-                        {
-                            UInt8 m = readMemory(_f);
-                            r = m - _w;
-                            if (r & 0x100)
-                                _memory[3] |= 1;
-                            else
-                                _memory[3] &= 0xfe;
-                            if ((m & 0xf) - (_w & 0xf) != (r & 0xf))
-                                _memory[3] |= 2;
-                            else
-                                _memory[3] &= 0xfd;
-                            storeZ(r, d);
-                        }
-                        break;
-                    case 0x3:
-                        if (_debug) { printf("DECF 0x%02x, %c    ", _f, dc); debug->write(_program->annotation(pc)); printf("\n"); }
-                        storeZ(readMemory(_f) - 1, d);
-                        break;
-                    case 0x4:
-                        if (_debug) { printf("IORWF 0x%02x, %c   ", _f, dc); debug->write(_program->annotation(pc)); printf("\n"); }
-                        storeZ(readMemory(_f) | _w, d);
-                        break;
-                    case 0x5:
-                        if (_debug) { printf("ANDWF 0x%02x, %c   ", _f, dc); debug->write(_program->annotation(pc)); printf("\n"); }
-                        storeZ(readMemory(_f) & _w, d);
-                        break;
-                    case 0x6:
-                        if (_debug) { printf("XORWF 0x%02x, %c   ", _f, dc); debug->write(_program->annotation(pc)); printf("\n"); }
-                        storeZ(readMemory(_f) ^ _w, d);
-                        break;
-                    case 0x7:
-                        if (_debug) { printf("ADDWF 0x%02x, %c   ", _f, dc); debug->write(_program->annotation(pc)); printf("\n"); }
-                        {
-                            UInt8 m = readMemory(_f);
-                            r = m + _w;
-                            if (r & 0x100)
-                                _memory[3] |= 1;
-                            else
-                                _memory[3] &= 0xfe;
-                            if ((_w & 0xf) + (m & 0xf) != (r & 0xf))
-                                _memory[3] |= 2;
-                            else
-                                _memory[3] &= 0xfd;
-                            storeZ(r, d);
-                        }
-                        break;
-                    case 0x8:
-                        if (_debug) { printf("MOVF 0x%02x, %c    ", _f, dc); debug->write(_program->annotation(pc)); printf("\n"); }
-                        storeZ(readMemory(_f), d);
-                        break;
-                    case 0x9:
-                        if (_debug) { printf("COMF 0x%02x, %c    ", _f, dc); debug->write(_program->annotation(pc)); printf("\n"); }
-                        storeZ(~readMemory(_f), d);
-                        break;
-                    case 0xa:
-                        if (_debug) { printf("INCF 0x%02x, %c    ", _f, dc); debug->write(_program->annotation(pc)); printf("\n"); }
-                        storeZ(readMemory(_f) + 1, d);
-                        break;
-                    case 0xb:
-                        if (_debug) { printf("DECFSZ 0x%02x, %c  ", _f, dc); debug->write(_program->annotation(pc)); printf("\n"); }
-                        r = readMemory(_f) - 1;
-                        store(r, d);
-                        if (r == 0) {
-                            incrementPC();
-                            _skipping = true;
-                        }
-                        break;
-                    case 0xc:
-                        if (_debug) { printf("RRF 0x%02x, %c     ", _f, dc); debug->write(_program->annotation(pc)); printf("\n"); }
-                        r = readMemory(_f) | ((_memory[3] & 1) << 8);
-                        setCarry((r & 1) != 0);
-                        store(r >> 1, d);
-                        break;
-                    case 0xd:
-                        if (_debug) { printf("RLF 0x%02x, %c     ", _f, dc); debug->write(_program->annotation(pc)); printf("\n"); }
-                        r = (readMemory(_f) << 1) | (_memory[3] & 1);
-                        setCarry((r & 0x100) != 0);
-                        store(r, d);
-                        break;
-                    case 0xe:
-                        if (_debug) { printf("SWAPF 0x%02x, %c   ", _f, dc); debug->write(_program->annotation(pc)); printf("\n"); }
-                        r = readMemory(_f);
-                        store((r >> 4) | (r << 4), d);
-                        break;
-                    case 0xf:
-                        if (_debug) { printf("INCFSF 0x%02x, %c  ", _f, dc); debug->write(_program->annotation(pc)); printf("\n"); }
-                        r = readMemory(_f) + 1;
-                        store(r, d);
-                        if (r == 0) {
-                            incrementPC();
-                            _skipping = true;
-                        }
-                        break;
+        switch (instruction._operation) {
+            case Instruction::unrecognized:
+                unrecognizedOpcode(_program->op(pc));
+                break;
+            case Instruction::nop:
+                break;
+            case Instruction::option:
+                _option = _w;
+                break;
+            case Instruction::sleep:
+                throw Exception(String("SLEEP not supported"));
+            case Instruction::clrwdt:
+                throw Exception(String("CLRWDT not supported"));
+            case Instruction::streamBits:
+                for (int i = 0; i < 8; ++i) {
+                    _simulation->streamBit((_memory[7+i] & 1) != 0);
+                    if (_debug)
+                        printf("%i", _memory[7+i] & 1);
                 }
-            }
-            else {
-                int b = (op >> 5) & 7;
-                int m = 1 << b;
-                switch (op >> 8) {
-                    case 4:
-                        if (_debug) { printf("BCF 0x%02x, %i     ", _f, b); debug->write(_program->annotation(pc)); printf("\n"); }
-                        _data = readMemory(_f) & ~m;
-                        break;
-                    case 5:
-                        if (_debug) { printf("BSF 0x%02x, %i     ", _f, b); debug->write(_program->annotation(pc)); printf("\n"); }
-                        _data = readMemory(_f) | m;
-                        break;
-                    case 6:
-                        if (_debug) { printf("BTFSC 0x%02x, %i   ", _f, b); debug->write(_program->annotation(pc)); printf("\n"); }
-                        if ((readMemory(_f, m) & m) == 0) {
-                            incrementPC();
-                            _skipping = true;
-                        }
-                        _f = -1;
-                        break;
-                    case 7:
-                        if (_debug) { printf("BTFSS 0x%02x, %i   ", _f, b); debug->write(_program->annotation(pc)); printf("\n"); }
-                        if ((readMemory(_f, m) & m) != 0) {
-                            incrementPC();
-                            _skipping = true;
-                        }
-                        _f = -1;
-                        break;
+                if (_debug)
+                    debugInstruction(pc);
+                break;
+            case Instruction::tris:
+                _data = _w;
+                break;
+            case Instruction::streamStart:
+                _simulation->streamStart();
+                break;
+            case Instruction::movwf:
+                _data = _w;
+                break;
+            case Instruction::clr:
+                storeZ(0, d);
+                break;
+            case Instruction::subwf:
+                {
+                    UInt8 m = readMemory(_f);
+                    r = m - _w;
+                    if (r & 0x100)
+                        _memory[3] |= 1;
+                    else
+                        _memory[3] &= 0xfe;
+                    if ((m & 0xf) - (_w & 0xf) != (r & 0xf))
+                        _memory[3] |= 2;
+                    else
+                        _memory[3] &= 0xfd;
+                    storeZ(r, d);
                 }
-            }
-
-        }
-        else {
-            _f = -1;
-            int d = op & 0xff;
-            switch (op >> 8) {
-                case 0x8:
-                    if (_debug) { printf("RETLW 0x%02x      ", d); debug->write(_program->annotation(pc)); printf("\n"); }
+                break;
+            case Instruction::decf:
+                storeZ(readMemory(_f) - 1, d);
+                break;
+            case Instruction::iorwf:
+                storeZ(readMemory(_f) | _w, d);
+                break;
+            case Instruction::andwf:
+                storeZ(readMemory(_f) & _w, d);
+                break;
+            case Instruction::xorwf:
+                storeZ(readMemory(_f) ^ _w, d);
+                break;
+            case Instruction::addwf:
+                {
+                    UInt8 m = readMemory(_f);
+                    r = m + _w;
+                    if (r & 0x100)
+                        _memory[3] |= 1;
+                    else
+                        _memory[3] &= 0xfe;
+                    if ((_w & 0xf) + (m & 0xf) != (r & 0xf))
+                        _memory[3] |= 2;
+                    else
+                        _memory[3] &= 0xfd;
+                    storeZ(r, d);
+                }
+                break;
+            case Instruction::movf:
+                storeZ(readMemory(_f), d);
+                break;
+            case Instruction::comf:
+                storeZ(~readMemory(_f), d);
+                break;
+            case Instruction::incf:
+                storeZ(readMemory(_f) + 1, d);
+                break;
+            case Instruction::decfsz:
+                r = readMemory(_f) - 1;
+                store(r, d);
+                if (r == 0) {
+                    incrementPC();
                     _skipping = true;
-                    _memory[2] = _stack[0];
-                    _pch = _stack[0] & 0x100;
-                    _stack[0] = _stack[1];
-                    _w = d;
-                    break;
-                case 0x9:
-                    if (_debug) { printf("CALL  0x%02x      ", d); debug->write(_program->annotation(pc)); printf("\n"); }
+                }
+                break;
+            case Instruction::rrf:
+                r = readMemory(_f) | ((_memory[3] & 1) << 8);
+                setCarry((r & 1) != 0);
+                store(r >> 1, d);
+                break;
+            case Instruction::rlf:
+                r = (readMemory(_f) << 1) | (_memory[3] & 1);
+                setCarry((r & 0x100) != 0);
+                store(r, d);
+                break;
+            case Instruction::swapf:
+                r = readMemory(_f);
+                store((r >> 4) | (r << 4), d);
+                break;
+            case Instruction::incfsz:
+                r = readMemory(_f) + 1;
+                store(r, d);
+                if (r == 0) {
+                    incrementPC();
                     _skipping = true;
-                    _stack[1] = _stack[0];
-                    _stack[0] = _memory[2] | _pch;
-                    _pch = 0;
-                    _memory[2] = d;
-                    break;
-                case 0xa:
-                case 0xb:
-                    if (_debug) { printf("GOTO  0x%03x     ", op & 0x1ff); debug->write(_program->annotation(pc)); printf("\n"); }
+                }
+                break;
+            case Instruction::bcf:
+                _data = readMemory(_f) & ~mask;
+                break;
+            case Instruction::bsf:
+                _data = readMemory(_f) | mask;
+                break;
+            case Instruction::btfsc:
+                if ((readMemory(_f, mask) & mask) == 0) {
+                    incrementPC();
                     _skipping = true;
-                    _pch = op & 0x100;
-                    _memory[2] = d;
-                    break;
-                case 0xc:
-                    if (_debug) { printf("MOVLW 0x%02x      ", d); debug->write(_program->annotation(pc)); printf("\n"); }
-                    _w = d;
-                    break;
-                case 0xd:
-                    if (_debug) { printf("IORLW 0x%02x      ", d); debug->write(_program->annotation(pc)); printf("\n"); }
-                    storeZ(_w | d, false);
-                    break;
-                case 0xe:
-                    if (_debug) { printf("ANDLW 0x%02x      ", d); debug->write(_program->annotation(pc)); printf("\n"); }
-                    storeZ(_w & d, false);
-                    break;
-                case 0xf:
-                    if (_debug) { printf("XORLW 0x%02x      ", d); debug->write(_program->annotation(pc)); printf("\n"); }
-                    storeZ(_w ^ d, false);
-                    break;
-            }
+                }
+                _f = -1;
+                break;
+            case Instruction::btfss:
+                if ((readMemory(_f, mask) & mask) != 0) {
+                    incrementPC();
+                    _skipping = true;
+                }
+                _f = -1;
+                break;
+            case Instruction::retlw:
+                _skipping = true;
+                _memory[2] = _stack[0];
+                _pch = _stack[0] & 0x100;
+                _stack[0] = _stack[1];
+                _w = k;
+                break;
+            case Instruction::call:
+                _skipping = true;
+                _stack[1] = _stack[0];
+                _stack[0] = _memory[2] | _pch;
+                _pch = 0;
+                _memory[2] = k;
+                break;
+            case Instruction::jump:
+                _skipping = true;
+                _pch = k & 0x100;
+                _memory[2] = k;
+                break;
+            case Instruction::movlw:
+                _w = k;
+                break;
+            case Instruction::iorlw:
+                storeZ(_w | k, false);
+                break;
+            case Instruction::andlw:
+                storeZ(_w & k, false);
+                break;
+            case Instruction::xorlw:
+                storeZ(_w ^ k, false);
+                break;
         }
 #ifdef DUMP
 //        if (_debug) {
@@ -714,6 +775,7 @@ public:
     int connectedBar(int direction) const { return _connectedBar[direction]; }
     int connectedDirection(int direction) const { return _connectedDirection[direction]; }
     int time() const { return _t; }
+    int nextStop() const { return _tNextStop; }
     bool live() const { return _live; }
     void clearLive() { _oldLive = _live; _live = false; }
     void resetNewlyConnected() { if (_live && !_oldLive) reset(); }
@@ -739,6 +801,12 @@ public:
         printf("\n");
     }
 private:
+    void debugInstruction(int pc)
+    {
+        debug->write(_program->disassembly(pc));
+        debug->write(_program->annotation(pc));
+        printf("\n");
+    }
     UInt8 readMemory(int address, UInt8 care = 0xff)
     {
         if (address == 0)
@@ -831,7 +899,7 @@ private:
         if (_number == 0)
             _tPerQuarterCycle = 100*256;
         else
-            _tPerQuarterCycle = (rand() % 512) + 99*256;  // 99*256 to 101*256 units of cycle/(100*256)
+            _tPerQuarterCycle = _simulation->random(512) + 99*256;  // 99*256 to 101*256 units of cycle/(100*256)
         _state = 0;
         _tNextStop = _tPerQuarterCycle;
     }
@@ -870,15 +938,113 @@ private:
     bool _oldLive;
     int _state;
     int _cyclesSinceLastSync;
+
 };
 
 typedef BarTemplate<Simulation> Bar;
 
+// Statistics from one or more simulations.
+class CampaignReport
+{
+public:
+    // Bin i counts configurations that settled in 2^i to 2^(i+1) cycles.
+    static const int bins = 32;
+
+    CampaignReport()
+      : _runs(0), _stoppedRuns(0), _changes(0), _streams(0), _badStreams(0),
+        _maxBadStreams(0), _settled(0), _totalSettlingCycles(0),
+        _totalSettlingCycles2(0), _maxSettlingCycles(0), _goodCycles(0),
+        _goodWords(0)
+    {
+        for (int i = 0; i < bins; ++i)
+            _histogram[i] = 0;
+    }
+
+    void addSettling(double cycles)
+    {
+        ++_settled;
+        _totalSettlingCycles += cycles;
+        _totalSettlingCycles2 += cycles*cycles;
+        int bin = 0;
+        while (bin < bins - 1 && cycles >= ldexp(1.0, bin + 1))
+            ++bin;
+        ++_histogram[bin];
+    }
+
+    void add(const CampaignReport& other)
+    {
+        _runs += other._runs;
+        _stoppedRuns += other._stoppedRuns;
+        _changes += other._changes;
+        _streams += other._streams;
+        _badStreams += other._badStreams;
+        _maxBadStreams = max(_maxBadStreams, other._maxBadStreams);
+        _settled += other._settled;
+        _totalSettlingCycles += other._totalSettlingCycles;
+        _totalSettlingCycles2 += other._totalSettlingCycles2;
+        _maxSettlingCycles = max(_maxSettlingCycles, other._maxSettlingCycles);
+        _goodCycles += other._goodCycles;
+        _goodWords += other._goodWords;
+        for (int i = 0; i < bins; ++i)
+            _histogram[i] += other._histogram[i];
+    }
+
+    void print() const
+    {
+        printf("Runs: %i (%i stopped early)\n", _runs, _stoppedRuns);
+        printf("Configurations: %.0lf\n", _changes);
+        printf("Streams: %.0lf\n", _streams);
+        printf("Bad streams: %.0lf\n", _badStreams);
+        printf("Max bad streams: %i\n", _maxBadStreams);
+        printf("Maximum settling cycles: %lf\n", _maxSettlingCycles);
+        if (_settled > 0) {
+            // 95% confidence interval for the mean, from the normal
+            // approximation.
+            double mean = _totalSettlingCycles/_settled;
+            double variance = max(0.0,
+                (_totalSettlingCycles2 - _settled*mean*mean)/
+                max(1.0, _settled - 1));
+            printf("Mean settling cycles: %lf +/- %lf\n", mean,
+                1.96*sqrt(variance/_settled));
+        }
+        if (_goodWords > 0)
+            printf("Cycles per word: %lf\n", _goodCycles/_goodWords);
+        printf("Settling cycles histogram:\n");
+        for (int i = 0; i < bins; ++i)
+            if (_histogram[i] != 0) {
+                printf("  %10.0lf - %10.0lf: %.0lf\n",
+                    i == 0 ? 0.0 : ldexp(1.0, i), ldexp(1.0, i + 1),
+                    _histogram[i]);
+            }
+    }
+
+    int _runs;
+    int _stoppedRuns;
+    double _changes;
+    double _streams;
+    double _badStreams;
+    int _maxBadStreams;
+    double _settled;
+    double _totalSettlingCycles;
+    double _totalSettlingCycles2;
+    double _maxSettlingCycles;
+    double _goodCycles;
+    double _goodWords;
+    double _histogram[bins];
+};
+
 class Simulation
 {
 public:
-    Simulation()
-      : _totalBars(100),
+    // Without the console, the simulation doesn't show its progress or
+    // respond to keys, so that several can run at once.
+    Simulation(int totalBars = 100, UInt32 seed = 0, bool console = true)
+      : _totalBars(totalBars),
+        _random(seed),
+        _randomCount(0),
+        _console(console),
+        _stopped(false),
+        _totalBadStreams(0),
         _stream(_totalBars*8),
         _expectedStream(_totalBars*8),
         _good(false),
@@ -896,16 +1062,18 @@ public:
         _goodsSinceLastChange(0),
         _settled(false),
         _oldGood(false),
-        _matrix(101*256),
-        _numbers(101, -1),
+        _matrix((totalBars + 1)*256),
+        _numbers(totalBars + 1, -1),
         _dumpMatrix(false),
         _badStreams(0),
         _maxBadStreams(0),
         _dumping(false)
     {
-        CONSOLE_SCREEN_BUFFER_INFO consoleScreenBufferInfo;
-        GetConsoleScreenBufferInfo(*debug, &consoleScreenBufferInfo);
-        _cursorPosition = consoleScreenBufferInfo.dwCursorPosition;
+        if (_console) {
+            CONSOLE_SCREEN_BUFFER_INFO consoleScreenBufferInfo;
+            GetConsoleScreenBufferInfo(*debug, &consoleScreenBufferInfo);
+            _cursorPosition = consoleScreenBufferInfo.dwCursorPosition;
+        }
     }
     void simulate()
     {
@@ -915,10 +1083,17 @@ public:
         SimulatedProgram rootProgram(String("../root.HEX"), String("../root.annotation"));
         rootProgram.load();
 
+        simulate(&rootProgram, &intervalProgram);
+    }
+    // Runs until there have been maximumChanges reconnections (forever if
+    // -1) or the network fails.
+    void simulate(const SimulatedProgram* rootProgram,
+        const SimulatedProgram* intervalProgram, int maximumChanges = -1)
+    {
         Bar* root;
         for (int i = 0; i <= _totalBars; ++i) {
             Handle bar;
-            bar = new Bar(this, (i == 0 ? &rootProgram : &intervalProgram), i, false);
+            bar = new Bar(this, (i == 0 ? rootProgram : intervalProgram), i, false);
             if (i == 0)
                 root = bar;
             _bars.push_back(bar);
@@ -931,11 +1106,11 @@ public:
         _streamEndPointer = _streamPointer + _totalBars*8;
         _connectedPairs = 0;
         do {
-            double cyclesBeforeChange = -log((static_cast<double>(rand()) + 1)/(static_cast<double>(RAND_MAX) + 1))*10000.0;
+            double cyclesBeforeChange = -log((static_cast<double>(random32()) + 1)/4294967296.0)*10000.0;
             bool final = false;
             do {
 #ifdef DUMP1
-                for (int i = 0; i < 101*256; ++i)
+                for (int i = 0; i < (_totalBars + 1)*256; ++i)
                     _matrix[i] = 0;
 #endif
                 int t;
@@ -954,8 +1129,8 @@ public:
 #ifdef DUMP1
                 if (_dumpMatrix)
                     for (int i = 0; i < t/(400*256); ++i) {
-                        for (int j = 0; j < 101; ++j) {
-                            int n = _matrix[j + i*101];
+                        for (int j = 0; j <= _totalBars; ++j) {
+                            int n = _matrix[j + i*(_totalBars + 1)];
                             if (n == 0)
                                 printf("    ");
                             else
@@ -971,9 +1146,11 @@ public:
                     _settlingCycles += t/(400.0*256.0);
                 _cyclesThisStream += t/(400.0*256.0);
                 _t += t/(1000000.0*400.0*256.0);
-            } while (!final);
+            } while (!final && !_stopped);
+            if (_stopped)
+                break;
 
-            if (!_dumping && (GetKeyState('D')&0x80000000) != 0) {
+            if (_console && !_dumping && (GetKeyState('D')&0x80000000) != 0) {
                 for (int i = 0; i <= _totalBars; ++i)
                     _bars[i]->dump();
                 _dumping = true;
@@ -991,13 +1168,15 @@ public:
             //    exit(0);
 
             if (_settled) {
+                if (_changes == maximumChanges)
+                    break;
                 _good = false;
                 _oldGood = false;
                 _settlingCycles = 0;
                 _streamsSinceLastChange = 0;
                 _goodsSinceLastChange = 0;
                 _settled = false;
-                int n = rand() % (4*_totalBars + 1);
+                int n = random(4*_totalBars + 1);
                 int barNumber = (n - 1)/4 + 1;
                 int connectorNumber = (n - 1)%4;
                 if (n == 0) {
@@ -1013,7 +1192,7 @@ public:
                     Bar* otherBar;
                     if (connectorNumber == 0 || connectorNumber == 3) {
                         // This is a male connector.
-                        n = rand() % (1 + 2*_totalBars - _connectedPairs);
+                        n = random(1 + 2*_totalBars - _connectedPairs);
                         for (connectedBarNumber = 0; connectedBarNumber <= _totalBars; ++connectedBarNumber) {
                             otherBar = _bars[connectedBarNumber];
                             if (connectedBarNumber > 0 && otherBar->connectedBar(1) == -1) {
@@ -1034,7 +1213,7 @@ public:
                     }
                     else {
                         // This is a female connector.
-                        n = rand() % (2*_totalBars - _connectedPairs);
+                        n = random(2*_totalBars - _connectedPairs);
                         for (connectedBarNumber = 1; connectedBarNumber <= _totalBars; ++connectedBarNumber) {
                             otherBar = _bars[connectedBarNumber];
                             if (otherBar->connectedBar(0) == -1) {
@@ -1060,8 +1239,10 @@ public:
                     otherBar->connect(connectedDirection, barNumber, connectorNumber);
                     ++_connectedPairs;
                 }
-                else {
-                    // This connector is connected - disconnect it.
+                else if (connectedBarNumber != -1) {
+                    // This connector is connected - disconnect it. (If it
+                    // isn't, every other connector is in use, so leave the
+                    // configuration as it is.)
 #ifdef DUMP
                     printf("Configuration %i, time %lf: Disconnecting bar %i direction %i from bar %i direction %i. ", _changes, _t, barNumber, connectorNumber, connectedBarNumber, connectedDirection);
 #endif
@@ -1099,6 +1280,8 @@ public:
     }
     void streamStart()
     {
+        if (_stopped)
+            return;
         int* streamPointer = &_stream[0];
         int* expectedStreamPointer = &_expectedStream[0];
         int liveBars = _bars[0]->prime(0);
@@ -1140,10 +1323,12 @@ public:
             printf("\n");
 #endif
             if (_oldGood) {
-                printf("Bad after good\n");
-                exit(0);
+                if (_console)
+                    printf("Bad after good\n");
+                _stopped = true;
             }
             ++_badStreams;
+            ++_totalBadStreams;
             if (_badStreams >= _maxBadStreams)
                 _maxBadStreams = _badStreams;
         }
@@ -1167,6 +1352,7 @@ public:
                     printf("Time %lf, Configuration %i settled in %lf\n", _t, _changes, _settlingCycles);
 #endif
                 _totalSettlingCycles += _settlingCycles;
+                _report.addSettling(_settlingCycles);
             }
         }
         _oldGood = _good;
@@ -1185,7 +1371,7 @@ public:
         }
 #ifndef DUMP
         clock_t wall = clock();
-        if ((wall - _wall) > CLOCKS_PER_SEC / 10) {
+        if (_console && (wall - _wall) > CLOCKS_PER_SEC / 10) {
             _wall = wall;
             SetConsoleCursorPosition(*debug, _cursorPosition);
             printf("Configuration: %i\n", _changes);
@@ -1200,7 +1386,7 @@ public:
         }
 #endif
         if (_badStreams > 100)
-            exit(0);
+            _stopped = true;
         _cyclesThisStream = 0;
         _streamPointer = &_stream[0];
     }
@@ -1223,11 +1409,37 @@ public:
 
     int getNumberForIndent(int indent) { return _numbers[indent]; }
     void setNumberForIndent(int indent, int number) { _numbers[indent] = number; }
-    void setMatrix(int t, int indent, int value) { _matrix[indent + t*101] = value; }
+    void setMatrix(int t, int indent, int value) { _matrix[indent + t*(_totalBars + 1)] = value; }
+
+    // Each simulation has its own random numbers, so that simulations with
+    // different seeds are independent and can run at the same time.
+    UInt32 random32() { return _random(_randomCount++); }
+    int random(int n) { return static_cast<int>(random32() % n); }
+
+    CampaignReport report()
+    {
+        CampaignReport report = _report;
+        report._runs = 1;
+        report._stoppedRuns = _stopped ? 1 : 0;
+        report._changes = _changes;
+        report._streams = _streams;
+        report._badStreams = _totalBadStreams;
+        report._maxBadStreams = _maxBadStreams;
+        report._maxSettlingCycles = _maxSettlingCycles;
+        report._goodCycles = _goodCycles;
+        report._goodWords = _goodWords;
+        return report;
+    }
 
 private:
     std::vector<Handle> _bars;
     int _totalBars;
+    CounterRandom _random;
+    UInt64 _randomCount;
+    bool _console;
+    bool _stopped;
+    double _totalBadStreams;
+    CampaignReport _report;
     std::vector<int> _stream;
     std::vector<int> _expectedStream;
     int* _streamPointer;
@@ -1257,13 +1469,115 @@ private:
     bool _dumping;
 };
 
+// One simulation of a campaign.
+class CampaignTask : public Task
+{
+public:
+    CampaignTask(const SimulatedProgram* rootProgram,
+        const SimulatedProgram* intervalProgram, int totalBars, UInt32 seed,
+        int changes)
+      : _rootProgram(rootProgram), _intervalProgram(intervalProgram),
+        _totalBars(totalBars), _seed(seed), _changes(changes),
+        _failed(false)
+    { }
+    const CampaignReport& report() const
+    {
+        if (_failed)
+            throw _exception;
+        return _report;
+    }
+private:
+    void run()
+    {
+        // Exceptions can't propagate out of a pool thread, so keep them
+        // for report() to rethrow.
+        try {
+            Simulation simulation(_totalBars, _seed, false);
+            simulation.simulate(_rootProgram, _intervalProgram, _changes);
+            _report = simulation.report();
+        }
+        catch (const Exception& e) {
+            _exception = e;
+            _failed = true;
+        }
+    }
+
+    const SimulatedProgram* _rootProgram;
+    const SimulatedProgram* _intervalProgram;
+    int _totalBars;
+    UInt32 _seed;
+    int _changes;
+    CampaignReport _report;
+    bool _failed;
+    Exception _exception;
+};
+
 class Program : public ProgramBase
 {
 public:
     void run()
     {
         setbuf(stdout, NULL);
+        if (_arguments.count() >= 2 && _arguments[1] == "-campaign") {
+            campaign();
+            return;
+        }
         Simulation simulation;
         simulation.simulate();
     }
+private:
+    // Runs many simulations with different seeds (and bar counts, if more
+    // than one is given) on all the CPUs, and reports their combined
+    // statistics.
+    void campaign()
+    {
+        if (_arguments.count() < 4) {
+            console.write("Syntax: " + _arguments[0] +
+                " -campaign <runs> <changes per run> [<bars>...]\n");
+            return;
+        }
+        int runs = evaluate<int>(_arguments[2]);
+        int changes = evaluate<int>(_arguments[3]);
+        std::vector<int> bars;
+        for (int i = 4; i < _arguments.count(); ++i)
+            bars.push_back(evaluate<int>(_arguments[i]));
+        if (bars.empty())
+            bars.push_back(100);
+
+        SimulatedProgram intervalProgram(String("../intervals.HEX"), String("../intervals.annotation"));
+        intervalProgram.load();
+        SimulatedProgram rootProgram(String("../root.HEX"), String("../root.annotation"));
+        rootProgram.load();
+
+#ifdef DUMP
+        // The dump output and the marker strings aren't thread-safe.
+        ThreadPool pool(1);
+#else
+        ThreadPool pool;
+#endif
+        std::vector<CampaignTask*> tasks;
+        for (int i = 0; i < runs; ++i) {
+            CampaignTask* task = new CampaignTask(&rootProgram,
+                &intervalProgram, bars[i % bars.size()], i + 1, changes);
+            task->setPool(&pool);
+            task->restart();
+            tasks.push_back(task);
+        }
+        // Every task has to finish before any can be deleted.
+        for (auto t : tasks)
+            t->join();
+        CampaignReport report;
+        try {
+            for (auto t : tasks)
+                report.add(t->report());
+        }
+        catch (...) {
+            for (auto t : tasks)
+                delete t;
+            throw;
+        }
+        for (auto t : tasks)
+            delete t;
+        report.print();
+    }
 };
@@ -0,0 +1,475 @@
+#include "alfe/main.h"
+#include "alfe/evaluate.h"
+#include "alfe/bitmap_png.h"
+#include "alfe/thread.h"
+#include "alfe/timer.h"
+#include "alfe/ntsc_encode.h"
+#include "alfe/ntsc_decode.h"
+#include "alfe/channel_impairments.h"
+#include <algorithm>
+
+// Streaming transcoder: encodes a sequence of pictures to composite the way
+// ntsc/encode does, optionally passes the signal through the channel
+// impairment pipes, and decodes it again to show how the pictures will look
+// on a composite display. Several frames are encoded and decoded
+// concurrently in a fixed ring of slots (so memory use doesn't depend on the
+// length of the sequence), and the composite fields only ever exist in
+// memory.
+
+static const int fieldSamples = NTSCEncoder::samplesPerField;
+static const int outputWidth = NTSCEncoder::activeWidth;
+static const int outputHeight = NTSCEncoder::activeHeight;
+
+// The decoder settings that undo the encoder's levels (black at 71, white at
+// 200) and recover its I and Q.
+template<class D> void setDecoderDefaults(D* decoder)
+{
+    double contrast = 255.0/(200 - 71);
+    decoder->setContrast(contrast);
+    decoder->setBrightness(-71*contrast/256);
+    decoder->setSaturation(2);
+    decoder->setHue(-90);
+    decoder->setChromaBandwidth(1);
+    decoder->setLumaBandwidth(1);
+    decoder->setRollOff(0);
+    decoder->setLobes(1.5);
+}
+
+void setLength(MatchingNTSCDecoder* decoder)
+{
+    decoder->setLength(outputWidth);
+    decoder->setInputScaling(1);
+}
+
+// The FFT decoder's filters assume a block of 512 samples, so each line is
+// decoded as two overlapping blocks of 448 pixels.
+static const int fftPadding = 32;
+static const int fftSecondBlock = outputWidth - 448;
+
+void setLength(NTSCDecoder* decoder)
+{
+    decoder->setLength(512, 448);
+    decoder->setPadding(fftPadding);
+}
+
+// active points at the first sample of the active part of the line.
+void decodeLine(MatchingNTSCDecoder* decoder, Byte* active, SRGB* output)
+{
+    decoder->decodeNTSC(active + decoder->inputLeft());
+    decoder->outputToSRGB(output);
+}
+
+void decodeLine(NTSCDecoder* decoder, Byte* active, SRGB* output)
+{
+    decoder->decodeNTSC(active - fftPadding, output);
+    decoder->decodeNTSC(active + fftSecondBlock - fftPadding,
+        output + fftSecondBlock);
+}
+
+// Supplies the channel with the samples of consecutive fields. The
+// impairment pipes work in blocks, so they read up to a block into the field
+// after the one being received - that is supplied too, or blanking after the
+// last field. Pull only.
+class FieldSource : public Source<Byte>
+{
+public:
+    FieldSource() : _field(0), _next(0), _position(0) { }
+    void setFields(Byte* field, Byte* next)
+    {
+        _field = field;
+        _next = next;
+    }
+    void produce(int n)
+    {
+        Accessor<Byte> w = writer(n);
+        for (int i = 0; i < n;) {
+            int c = min(n - i, fieldSamples - _position);
+            if (_field != 0) {
+                CopyFrom<Byte> copyFrom(_field + _position);
+                w.items(copyFrom, c);
+            }
+            else
+                for (int j = 0; j < c; ++j)
+                    w.item() = 60;
+            i += c;
+            _position += c;
+            if (_position == fieldSamples) {
+                _field = _next;
+                _next = 0;
+                _position = 0;
+            }
+        }
+        written(n);
+    }
+private:
+    Byte* _field;
+    Byte* _next;
+    int _position;
+};
+
+// Pulls a field's worth of samples out of the channel. Pull only.
+class FieldSink : public Sink<Byte>
+{
+public:
+    void consume(int n) { }
+    void receive(Byte* field)
+    {
+        CopyTo<Byte> copyTo(field);
+        reader(fieldSamples).items(copyTo, fieldSamples);
+        read(fieldSamples);
+    }
+};
+
+// Does the work for one frame: loads (if the input is a .png sequence) and
+// encodes it, then (after the channel) decodes it. Each slot has its own
+// encoder and decoders, so slots can run concurrently.
+template<class D> class FrameTask : public Task
+{
+public:
+    FrameTask() : _failed(false)
+    {
+        _field = Array<Byte>(fieldSamples);
+        _output = Bitmap<SRGB>(Vector(outputWidth, outputHeight));
+    }
+    // This creates FFTW plans, so it's called from the main thread.
+    void initialize(int inputWidth)
+    {
+        _encoder.setInputWidth(inputWidth);
+        // The burst phase alternates from line to line so each parity needs
+        // its own decoder.
+        for (int i = 0; i < 2; ++i) {
+            D* d = &_decoders[i];
+            setDecoderDefaults(d);
+            setLength(d);
+            Byte burst[4];
+            _encoder.burst(NTSCEncoder::activeTop + i, burst);
+            d->calculateBurst(burst);
+        }
+    }
+    void encode(String path)
+    {
+        _path = path;
+        _decode = false;
+        restart();
+    }
+    void encode(Bitmap<SRGB> input)
+    {
+        _path = String();
+        _input = input;
+        _decode = false;
+        restart();
+    }
+    void decode()
+    {
+        _decode = true;
+        restart();
+    }
+    void finish()
+    {
+        join();
+        if (_failed)
+            throw _exception;
+    }
+    Byte* field() { return &_field[0]; }
+    Bitmap<SRGB> output() { return _output; }
+    Bitmap<SRGB> input() { return _input; }
+private:
+    void run()
+    {
+        try {
+            if (_decode) {
+                Byte* line = &_field[NTSCEncoder::activeTop*
+                    NTSCEncoder::samplesPerLine + NTSCEncoder::activeLeft];
+                for (int y = 0; y < outputHeight; ++y) {
+                    decodeLine(&_decoders[y & 1], line, _output.row(y));
+                    line += NTSCEncoder::samplesPerLine;
+                }
+                return;
+            }
+            if (!_path.empty())
+                _input = PNGFileFormat<SRGB>().load(File(_path, true));
+            Vector size = _input.size();
+            if (size.x != _encoder.inputWidth() || size.y != outputHeight) {
+                throw Exception("Input frames must all be " +
+                    decimal(_encoder.inputWidth()) + "x" +
+                    decimal(outputHeight) + " pixels.");
+            }
+            _encoder.encode(_input, &_field[0]);
+        }
+        catch (const Exception& e) {
+            _exception = e;
+            _failed = true;
+        }
+    }
+
+    NTSCEncoder _encoder;
+    D _decoders[2];
+    String _path;
+    Bitmap<SRGB> _input;
+    Array<Byte> _field;
+    Bitmap<SRGB> _output;
+    bool _decode;
+    bool _failed;
+    Exception _exception;
+};
+
+// Writes a decoded frame either to a numbered .png file or appended to a raw
+// RGB stream.
+class WriteTask : public Task
+{
+public:
+    WriteTask() : _failed(false) { }
+    void setOutput(String outputName)
+    {
+        int l = outputName.length() - 4;
+        _png = l >= 0 && outputName.subString(l, 4) == ".png";
+        if (_png)
+            _stem = outputName.subString(0, l);
+        else
+            _stream = File(outputName, true).openWrite();
+    }
+    void write(Bitmap<SRGB> frame, int number)
+    {
+        finish();
+        _frame = frame;
+        _number = number;
+        restart();
+    }
+    void finish()
+    {
+        join();
+        if (_failed)
+            throw _exception;
+    }
+private:
+    void run()
+    {
+        try {
+            if (_png) {
+                PNGFileFormat<SRGB>().save(_frame,
+                    File(_stem + format("%06i", _number) + ".png", true));
+                return;
+            }
+            for (int y = 0; y < outputHeight; ++y)
+                _stream.write(_frame.row(y), outputWidth*sizeof(SRGB));
+        }
+        catch (const Exception& e) {
+            _exception = e;
+            _failed = true;
+        }
+    }
+
+    bool _png;
+    String _stem;
+    AutoStream _stream;
+    Bitmap<SRGB> _frame;
+    int _number;
+    bool _failed;
+    Exception _exception;
+};
+
+class Collect
+{
+public:
+    Collect(AppendableArray<String>* paths) : _paths(paths) { }
+    void operator()(const File& file) { _paths->append(file.path()); }
+    void operator()(const Directory& directory) { }
+private:
+    AppendableArray<String>* _paths;
+};
+
+class Program : public ProgramBase
+{
+public:
+    void run()
+    {
+        _fft = false;
+        _noise = 0;
+        _ghosting = false;
+        _dropOuts = false;
+        _rawWidth = 0;
+        _frames = 0x7fffffff;
+        AppendableArray<String> names;
+        bool unknownArgument = false;
+        for (int i = 1; i < _arguments.count(); ++i) {
+            String argument = _arguments[i];
+            CharacterSource s(argument);
+            if (s.get() != '-') {
+                names.append(argument);
+                continue;
+            }
+            int o = s.get();
+            String value = argument.subString(2, argument.length() - 2);
+            switch (o) {
+                case 'f': _fft = true; continue;
+                case 'g': _ghosting = true; continue;
+                case 'd': _dropOuts = true; continue;
+                case 'n': _noise = evaluate<int>(value); continue;
+                case 'w': _rawWidth = evaluate<int>(value); continue;
+                case 'c': _frames = evaluate<int>(value); continue;
+            }
+            unknownArgument = true;
+        }
+        if (unknownArgument || names.count() != 2) {
+            console.write("Syntax: " + _arguments[0] +
+                " <input> <output> [<options>]\n"
+                "If the input name ends in .png it is a wildcard matching "
+                "the frames, which are\nprocessed in name order. Otherwise it "
+                "is a raw 24-bit RGB stream (use -w to give\nthe width). "
+                "Frames must be 240 rows high.\n"
+                "If the output name ends in .png, each frame is saved as a "
+                "separate .png file\nwith the frame number appended to the "
+                "name. Otherwise the output is raw 24-bit\nRGB, " +
+                decimal(outputWidth) + "x" + decimal(outputHeight) +
+                " per frame.\n"
+                "Options are:\n"
+                "  -w<width>  width of raw input frames\n"
+                "  -c<count>  maximum number of frames to transcode\n"
+                "  -n<level>  add noise (10000 is a fairly poor signal)\n"
+                "  -g         add RF cable ghosting\n"
+                "  -d         add dropouts\n"
+                "  -f         decode with the FFT decoder instead of the FIR "
+                "one\n");
+            return;
+        }
+        _inputName = names[0];
+        _outputName = names[1];
+        if (_fft)
+            transcode<NTSCDecoder>();
+        else
+            transcode<MatchingNTSCDecoder>();
+    }
+private:
+    template<class D> void transcode()
+    {
+        // Find the frames and their size.
+        int inputWidth;
+        int frames;
+        AppendableArray<String> paths;
+        FileStream inputStream;
+        int l = _inputName.length() - 4;
+        bool png = l >= 0 && _inputName.subString(l, 4) == ".png";
+        if (png) {
+            applyToWildcard(Collect(&paths), _inputName);
+            if (paths.count() == 0)
+                throw Exception("No input files found.");
+            std::sort(&paths[0], &paths[0] + paths.count());
+            frames = paths.count();
+            inputWidth = PNGFileFormat<SRGB>().load(File(paths[0], true)).
+                size().x;
+        }
+        else {
+            if (_rawWidth <= 0)
+                throw Exception("Raw input needs a width (-w).");
+            inputWidth = _rawWidth;
+            inputStream = File(_inputName, true).openRead();
+            frames = static_cast<int>(inputStream.size()/
+                (inputWidth*outputHeight*3));
+        }
+        frames = min(frames, _frames);
+        if (frames == 0)
+            throw Exception("No frames to transcode.");
+
+        ThreadPool pool;
+        ThreadPool ioPool(1);
+        // Enough slots that every thread has a frame to encode or decode
+        // while the main thread runs the channel and waits for the oldest.
+        int slots = 2*pool.threads() + 2;
+        int lag = slots/2;
+        Array<FrameTask<D>> tasks(slots);
+        for (int i = 0; i < slots; ++i) {
+            tasks[i].setPool(&pool);
+            tasks[i].initialize(inputWidth);
+        }
+        WriteTask writer;
+        writer.setPool(&ioPool);
+        writer.setOutput(_outputName);
+
+        // The channel, if any. The seeds are fixed so that a run can be
+        // repeated exactly.
+        FieldSource source;
+        FieldSink sink;
+        NoisePipe noise(_noise, 1);
+        GhostingPipe ghosting;
+        DropOutPipe<Byte> dropOut(60, 6000, 2000000, 2);
+        Source<Byte>* s = &source;
+        if (_noise != 0) {
+            s->connect(noise.sink());
+            s = noise.source();
+        }
+        if (_ghosting) {
+            s->connect(ghosting.sink());
+            s = ghosting.source();
+        }
+        if (_dropOuts) {
+            s->connect(dropOut.sink());
+            s = dropOut.source();
+        }
+        bool channel = s != &source;
+        s->connect(&sink);
+
+        Timer timer;
+        int encoded = 0;
+        auto startEncode = [&]()
+        {
+            FrameTask<D>* task = &tasks[encoded % slots];
+            if (png)
+                task->encode(paths[encoded]);
+            else {
+                // The slot's previous input has been encoded already.
+                Bitmap<SRGB> input = task->input();
+                if (!input.valid())
+                    input = Bitmap<SRGB>(Vector(inputWidth, outputHeight));
+                for (int y = 0; y < outputHeight; ++y)
+                    inputStream.read(input.row(y), inputWidth*sizeof(SRGB));
+                task->encode(input);
+            }
+            ++encoded;
+        };
+        while (encoded < min(frames, slots))
+            startEncode();
+        for (int frame = 0; frame < frames + lag; ++frame) {
+            if (frame < frames) {
+                FrameTask<D>* task = &tasks[frame % slots];
+                task->finish();
+                if (channel) {
+                    // The pipes may need the start of the next field.
+                    Byte* next = 0;
+                    if (frame + 1 < frames) {
+                        FrameTask<D>* nextTask = &tasks[(frame + 1) % slots];
+                        nextTask->finish();
+                        next = nextTask->field();
+                    }
+                    source.setFields(task->field(), next);
+                    sink.receive(task->field());
+                }
+                task->decode();
+            }
+            // Retire the oldest frame in flight and reuse its slot.
+            int done = frame - lag;
+            if (done < 0)
+                continue;
+            FrameTask<D>* task = &tasks[done % slots];
+            task->finish();
+            writer.write(task->output(), done);
+            if (encoded < frames)
+                startEncode();
+            if ((done & 63) == 63)
+                console.write(".");
+        }
+        writer.finish();
+        double seconds = timer.seconds();
+        console.write("\n" + decimal(frames) + " frames transcoded in " +
+            format("%.3f", seconds) + " seconds: " +
+            format("%.1f", frames/seconds) + " frames/s.\n");
+    }
+
+    String _inputName;
+    String _outputName;
+    bool _fft;
+    int _noise;
+    bool _ghosting;
+    bool _dropOuts;
+    int _rawWidth;
+    int _frames;
+};
@@ -1,7 +1,5 @@
 #include "alfe/main.h"
-#include "alfe/complex.h"
-#include "alfe/colour_space.h"
-#include "fftw3.h"
+#include "vcr_decode.h"
 
 float preamp[] = {
   50.0, //  131.717972,
@@ -211,293 +209,6 @@ float preamp[] = {
   50.727127,
   47.210518};
 
-class VCRDecoder
-{
-public:
-    VCRDecoder()
-    {
-        FileStream inputStream = File("U:\\c2.raw", true).openRead();
-        //FileStream inputStream = File("U:\\captured.bin", true).openRead();
-        int nn = inputStream.size();
-
-        FileStream h = File("U:\\vcr_decoded.bin", true).openWrite();
-
-        int samplesPerFrame = 1824*253;
-        Array<Byte> input(samplesPerFrame);
-        _fftData.allocate(2048);
-        _chromaData.allocate(2048);
-        _burstData.allocate(91);
-        _forward = fftwf_plan_dft_1d(2048, reinterpret_cast<fftwf_complex*>(&_fftData[0]), reinterpret_cast<fftwf_complex*>(&_fftData[0]), -1, FFTW_MEASURE);
-        _backward = fftwf_plan_dft_1d(2048, reinterpret_cast<fftwf_complex*>(&_fftData[0]), reinterpret_cast<fftwf_complex*>(&_fftData[0]), 1, FFTW_MEASURE);
-        _chromaForward = fftwf_plan_dft_1d(2048, reinterpret_cast<fftwf_complex*>(&_chromaData[0]), reinterpret_cast<fftwf_complex*>(&_chromaData[0]), -1, FFTW_MEASURE);
-        _chromaBackward = fftwf_plan_dft_1d(2048, reinterpret_cast<fftwf_complex*>(&_chromaData[0]), reinterpret_cast<fftwf_complex*>(&_chromaData[0]), 1, FFTW_MEASURE);
-        Complex<float> localOscillatorFrequency = unit(4.4f*11/315);
-        Complex<float> chromaOscillatorFrequency = unit(2.0f/91);  // 0.629 == 315/11 / 2 / 4 * 16 / 91      0.629f*11/315 == 16/8/91
-
-        //static const float cutoff = 3.0f*2048*11/315;  // 3.3f
-        //static const int cutoff = 208;
-        static const int cutoff = static_cast<int>(2.2f*2048*11/315);
-        static const int chromaCutoff = static_cast<int>(2048.0*2.0/91)*0.75;  // *0.5;
-
-        _outputb0.allocate(2048);
-        _outputb1.allocate(2048);
-
-        Array<Complex<float>> amplitudes(253);
-        for (int y = 0; y < 253; ++y)
-            amplitudes[y] = 0;
-
-        Array<Vector3<float>> frameCache(3*2048*253);
-        for (int i = 0; i < 3*2048*253; ++i)
-            frameCache[i] = Vector3<float>(0, 0, 0);
-
-        int frame = 0;
-        Complex<float> burstAcc = 0;
-        Complex<float> framePhase = unit((90 - 33)/360.0f);
-    }
-
-    void decodeField()
-    {
-        while (nn > 0) {
-            inputStream.read(&input[0], min(nn, samplesPerFrame));
-            nn -= samplesPerFrame;
-
-            Complex<float> linePhase;
-            if ((frame & 1) == 0)
-                linePhase = framePhase * Complex<float>(0, 1);
-            else
-                linePhase = framePhase;
-
-            int p = 1824*2 + 1820;
-            int x;
-            int lows = 0;
-            for (x = 0; x < 1820; ++x) {
-                if (input[p] < 22)
-                    ++lows;
-                if (lows > 20)
-                    break;
-                ++p;
-                if (p >= samplesPerFrame - 1)
-                    break;
-            }
-            p += 133 - 20;
-            p -= 1820 - 10;
-            if (x < 1000)
-                p += 1820;
-
-            for (int y = 3; y < 253; ++y) {
-                float pFrac;
-                p += 1820 - 10;
-                for (x = 0; x < 20; ++x) {
-                    if (input[p] >= 22)
-                        break;
-                    ++p;
-                    if (p >= samplesPerFrame - 1)
-                        break;
-                }
-                int d = input[p] - input[p - 1];
-                if (d == 0)
-                    pFrac = 0;
-                else
-                    pFrac = static_cast<float>(input[p] - 22)/d;
-                // 22 position is input[p - pFrac]
-
-                for (x = 0; x < 1820; ++x) {
-                    if (p + x - 64 >= samplesPerFrame)
-                        break;
-                    _fftData[x] = input[p + x - 64];
-                }
-                for (; x < 2048; ++x)
-                    _fftData[x] = 0;
-
-                // TODO: shift by pFrac
-
-                Complex<float> burst = 0;
-                int nBurst = (y & 1 ? 46 : 45);
-                for (int x = 0; x < nBurst; ++x)
-                    burst += _fftData[x + 76]*unit(x*2.0f/91);
-                burst /= nBurst;
-                burstAcc = burstAcc*0.9f + burst*0.1f;
-
-                Complex<float> localOscillator = 1;
-                Complex<float> chromaOscillator = 1;
-
-                float total = 0;
-                for (int i = 0; i < 1666; ++i) {
-                    float v = _fftData[i + 82].x;
-                    _chromaData[i + 82] = v * chromaOscillator;
-                    total += v;
-                }
-                float mean = total/1666;
-                for (int i = 0; i < 160; ++i)
-                    _chromaData[i] = mean;
-                for (int i = 1666+82; i < 2048; ++i)
-                    _chromaData[i] = mean;
-
-
-                for (int i = 0; i < 2048; ++i) {
-                    _chromaData[i] *= chromaOscillator;
-                    _fftData[i] *= localOscillator;
-                    localOscillator *= localOscillatorFrequency;
-                    chromaOscillator *= chromaOscillatorFrequency;
-                }
-
-                fftwf_execute(_forward);
-                fftwf_execute(_chromaForward);
-                for (int x = cutoff; x < 2048 - cutoff; ++x)
-                    _fftData[x] = 0;
-                for (int x = chromaCutoff; x < 2048 - chromaCutoff; ++x)
-                    _chromaData[x] = 0;
-                fftwf_execute(_chromaBackward);
-
-                fftwf_execute(_backward);
-                for (int x = 0; x < 2047; ++x) {
-                    float deltaPhase = (_fftData[x + 1]/fftData[x]).argument();
-                    // 0  MHz                     <=> 0 deltaPhase
-                    // 3.4MHz <=> -40   IRE                             1 MHz
-                    //              7.5 IRE <=>   0
-                    // 4.4MHz <=> 100   IRE <=> 255                     0 MHz
-                    // 315/11MHz                  <=> tau deltaPhase
-                    float mhz = deltaPhase*315/(tau*11);
-                    float ire = (1.0f - mhz)*140 - 40;
-                    fftData[x] = (ire - 7.5f)*255.0f/(100 - 7.5);
-                }
-
-                //fftwf_execute(_forward);
-                //for (int x = 0; x < 206; ++x) {
-                //    fftData[x + 2] *= 50.0f/(preamp[x]*2048.0f);
-                //    fftData[2048 - (x + 2)] *= 50.0f/(preamp[x]*2048.0f);
-                //}
-                //fftwf_execute(_backward);
-
-                Complex<float> chromaPhase = burstAcc.conjugate()*linePhase/burstAcc.modulus();
-
-                for (int x = 0; x < 2048; ++x) {
-                    //outputb[x] = byteClamp(fftData[x].x / 2048.0f);
-                    float yy = _fftData[x].x;
-                    Complex<float> c = _chromaData[x]*chromaPhase / 20.48f; //  / 100.0f;
-                    float ii = c.x;
-                    float qq = c.y;
-                    frameCache[(((frame + 2)%3)*253 + y)*2048 + x] =
-                        Vector3<float>(
-                            yy + 0.9563*c.x + 0.6210*c.y,
-                            yy - 0.2721*c.x - 0.6474*c.y,
-                            yy - 1.1069*c.x + 1.7046*c.y);
-                }
-                if ((frame & 1) != 0)
-                    linePhase *= Complex<float>(0, -1);
-                else
-                    linePhase *= Complex<float>(0, 1);
-
-                //if (frame >= 1041 && frame <= 1638) {
-                //    fftwf_execute(forward);
-                //    //for (int x = 0; x < 2048; ++x)
-                //    //    amplitudes[y*2048 + x] = fftData[x].modulus() / 2048.0f;
-                //    amplitudes[y] += fftData[y + 2];
-                //}
-
-                //h.write(outputb);
-            }
-            printf(".");
-
-            for (int y = 3; y < 253; ++y) {
-                int p = (((frame + 1)%3)*253 + y)*2048;
-                int pu = (((frame + 1)%3)*253 + y - 1)*2048;
-                if (y == 0)
-                    pu = p;
-                int pd = (((frame + 1)%3)*253 + y + 1)*2048;
-                if (y == 252)
-                    pd = p;
-                int pp = ((frame%3)*253 + y)*2048;
-                int pn = (((frame + 2)%3)*253 + y)*2048;
-
-                for (int x = 0; x < 2048; ++x) {
-                    Vector3<float> c = frameCache[p + x];
-                    _outputb0[x] = SRGB(byteClamp(c.x), byteClamp(c.y), byteClamp(c.z));
-                    c = (frameCache[pu + x] + frameCache[pd + x] + frameCache[pp + x] + frameCache[pn + x])/4.0f;
-                    _outputb1[x] = SRGB(byteClamp(c.x), byteClamp(c.y), byteClamp(c.z));
-                }
-
-                if (frame%2 != 0) {
-                    h.write(_outputb0);
-                    h.write(_outputb1);
-                }
-                else {
-                    h.write(_outputb1);
-                    h.write(_outputb0);
-                }
-            }
-
-            //if (frame >= 1041 && frame <= 1638) {
-            //    int bestOffset;
-            //    float bestAmplitude = 0;
-            //    for (int offset = -10; offset < 10; ++offset) {
-            //        float amplitude = 0;
-            //        for (int y = 0; y < 253; ++y)
-            //            if (y+offset >= 0)
-            //                amplitude += amplitudes[y*2048 + y + offset];
-            //        if (amplitude > bestAmplitude) {
-            //            bestAmplitude = amplitude;
-            //            bestOffset = offset;
-            //        }
-            //    }
-            //    printf("frame %i strongest offset %i amplitude %f\n", frame, bestOffset);
-            //}
-
-            ++frame;
-
-            if ((frame & 1) == 0)
-                framePhase *= Complex<float>(0, 1);
-
-        }
-        //for (int y = 0; y < 253; ++y)
-        //    printf("  %f, %f,\n", amplitudes[y].x / (1639 - 1041), amplitudes[y].y / (1639 - 1041));
-    }
-
-    void decodeFrame()
-    {
-    }
-
-    void setBrightness(double brightness)
-    {
-        _brightness = brightness;
-    }
-    void setSaturation(double saturation)
-    {
-        _saturation = saturation;
-    }
-    void setContrast(double contrast) { _contrast = contrast; }
-    void setHue(double hue) { _hue = hue; }
-    void setLumaCutoff(double lumaCutoff) { _lumaCutoff = lumaCutoff; }
-    void setLumaHeterodyneFrequency(double lumaHeterodyneFrequency)
-    {
-        _lumaHeterodyneFrequency = lumaHeterodyneFrequency;
-    }
-    void setChromaCutoff(double chromaCutoff) { _chromaCutoff = chromaCutoff; }
-    void setDeinterlacing(double deinterlacing) { _deinterlacing = deinterlacing; }
-    void setFieldNumber(double fieldNumber) { _fieldNumber = fieldNumber; }
-
-private:
-    fftwf_plan _forward;
-    fftwf_plan _backward;
-    fftwf_plan _chromaForward;
-    fftwf_plan _chromaBackward;
-    Array<Complex<float>> _fftData;
-    Array<Complex<float>> _chromaData;
-    Array<Complex<float>> _burstData;
-    Array<SRGB> _outputb0;
-    Array<SRGB> _outputb1;
-
-    double _brightness;
-    double _saturation;
-    double _contrast;
-    double _hue;
-    double _lumaCutoff;
-    double _lumaHeterodyneFrequency;
-    double _chromaCutoff;
-    double _deinterlacing;
-    double _fieldNumber;
-};
-
 class VCRDecodeWindow;
 
 template<class T> class DecodedBitmapWindowT : public BitmapWindow
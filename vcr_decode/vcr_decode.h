@@ -0,0 +1,343 @@
+#include "alfe/main.h"
+
+#ifndef INCLUDED_VCR_DECODE_H
+#define INCLUDED_VCR_DECODE_H
+
+#include "alfe/complex.h"
+#include "alfe/colour_space.h"
+#include "alfe/bitmap.h"
+#include "alfe/fft.h"
+#include "alfe/thread.h"
+
+template<class T> class VCRDecoderTaskT : public Task
+{
+public:
+    void setDecoder(T* decoder, int band, int bands)
+    {
+        _decoder = decoder;
+        _band = band;
+        _bands = bands;
+    }
+private:
+    void run() { _decoder->runBand(_band, _bands); }
+
+    T* _decoder;
+    int _band;
+    int _bands;
+};
+
+class VCRDecoder;
+typedef VCRDecoderTaskT<VCRDecoder> VCRDecoderTask;
+
+// Decodes fields of VHS RF captured at 8 times the colour carrier frequency.
+// Luma is FM demodulated and chroma (colour-under) is heterodyned back up to
+// baseband. Each decoded line is kept for two more fields, so that the
+// output frame for the previous field can fill in its missing lines from the
+// fields either side.
+//
+// The sync positions and burst phases of a field have to be found serially,
+// but after that the lines are independent so with a thread pool they are
+// filtered in parallel.
+class VCRDecoder : Uncopyable
+{
+public:
+    static const int samplesPerLine = 1824;
+    static const int lines = 253;
+    static const int samplesPerField = samplesPerLine*lines;
+    static const int firstLine = 3;
+    static const int outputWidth = 2048;
+    static const int outputHeight = 2*(lines - firstLine);
+
+    VCRDecoder() : _field(0), _burstAcc(0), _pool(0)
+    {
+        _framePhase = unit((90 - 33)/360.0f);
+        FFTWComplexArray<float> data(outputWidth);
+        _forward = fftwf_plan_dft_1d(outputWidth, data.data(), data.data(),
+            FFTW_FORWARD, FFTW_MEASURE);
+        _backward = fftwf_plan_dft_1d(outputWidth, data.data(), data.data(),
+            FFTW_BACKWARD, FFTW_MEASURE);
+
+        // 4.4MHz is the luma carrier, 0.629MHz the chroma carrier.
+        _localOscillator.allocate(outputWidth);
+        _chromaOscillator.allocate(outputWidth);
+        for (int i = 0; i < outputWidth; ++i) {
+            _localOscillator[i] = unit(i*4.4f*11/315);
+            _chromaOscillator[i] = unit(i*2.0f/91);
+        }
+        for (int i = 0; i < 46; ++i)
+            _burstCarrier[i] = unit(i*2.0f/91);
+
+        _frameCache.allocate(3*lines*outputWidth);
+        for (int i = 0; i < 3*lines*outputWidth; ++i)
+            _frameCache[i] = Vector3<float>(0, 0, 0);
+        setThreadPool(0);
+    }
+    ~VCRDecoder()
+    {
+        fftwf_destroy_plan(_forward);
+        fftwf_destroy_plan(_backward);
+    }
+    // With a thread pool, the lines of each field are decoded in parallel.
+    // Otherwise decodeField() does all the work on the calling thread.
+    void setThreadPool(ThreadPool* pool)
+    {
+        _pool = pool;
+        int bands = pool == 0 ? 1 : pool->threads();
+        _tasks = Array<VCRDecoderTask>(pool == 0 ? 0 : bands);
+        for (int i = 0; i < _tasks.count(); ++i) {
+            _tasks[i].setDecoder(this, i, bands);
+            _tasks[i].setPool(pool);
+        }
+        _buffers = Array<Buffers>(bands);
+        for (auto& b : _buffers) {
+            b._luma = FFTWComplexArray<float>(outputWidth);
+            b._chroma = FFTWComplexArray<float>(outputWidth);
+        }
+    }
+    // Must be outputWidth by outputHeight.
+    void setOutputBuffer(Bitmap<SRGB> output) { _output = output; }
+    // The field number determines the phase of the colour carrier, so set
+    // this when starting partway through a capture.
+    void setField(int field)
+    {
+        _field = field;
+        _framePhase = unit((90 - 33)/360.0f);
+        for (int i = 0; i < (field >> 1) % 4; ++i)
+            _framePhase *= Complex<float>(0, 1);
+    }
+    int field() const { return _field; }
+
+    // Decodes samplesPerField samples. The output is the frame centred on
+    // the field before this one.
+    void decodeField(const Byte* input)
+    {
+        _input = input;
+        findLines();
+        if (_pool == 0)
+            runBand(0, 1);
+        else {
+            for (auto& t : _tasks)
+                t.restart();
+            for (auto& t : _tasks)
+                t.join();
+        }
+        ++_field;
+        if ((_field & 1) == 0)
+            _framePhase *= Complex<float>(0, 1);
+    }
+
+    void runBand(int band, int bands)
+    {
+        Buffers* buffers = &_buffers[band];
+        for (int y = firstLine + band; y < lines; y += bands) {
+            decodeLine(y, buffers);
+            outputLine(y);
+        }
+    }
+
+    void setBrightness(double brightness)
+    {
+        _brightness = brightness;
+    }
+    void setSaturation(double saturation)
+    {
+        _saturation = saturation;
+    }
+    void setContrast(double contrast) { _contrast = contrast; }
+    void setHue(double hue) { _hue = hue; }
+    void setLumaCutoff(double lumaCutoff) { _lumaCutoff = lumaCutoff; }
+    void setLumaHeterodyneFrequency(double lumaHeterodyneFrequency)
+    {
+        _lumaHeterodyneFrequency = lumaHeterodyneFrequency;
+    }
+    void setChromaCutoff(double chromaCutoff) { _chromaCutoff = chromaCutoff; }
+    void setDeinterlacing(double deinterlacing) { _deinterlacing = deinterlacing; }
+    void setFieldNumber(double fieldNumber) { _fieldNumber = fieldNumber; }
+
+private:
+    static const int cutoff = static_cast<int>(2.2f*2048*11/315);
+    static const int chromaCutoff =
+        static_cast<int>(static_cast<int>(2048.0*2.0/91)*0.75);
+
+    struct Buffers
+    {
+        FFTWComplexArray<float> _luma;
+        FFTWComplexArray<float> _chroma;
+    };
+
+    int sample(int p) const { return p < samplesPerField ? _input[p] : 0; }
+
+    // Finds the start of each line from its sync pulse, and the chroma phase
+    // from its burst. Both depend on the line before.
+    void findLines()
+    {
+        Complex<float> linePhase = _framePhase;
+        if ((_field & 1) == 0)
+            linePhase *= Complex<float>(0, 1);
+        Complex<float> lineRotor =
+            (_field & 1) != 0 ? Complex<float>(0, -1) : Complex<float>(0, 1);
+
+        int p = samplesPerLine*2 + 1820;
+        int x;
+        int lows = 0;
+        for (x = 0; x < 1820; ++x) {
+            if (_input[p] < 22)
+                ++lows;
+            if (lows > 20)
+                break;
+            ++p;
+            if (p >= samplesPerField - 1)
+                break;
+        }
+        p += 133 - 20;
+        p -= 1820 - 10;
+        if (x < 1000)
+            p += 1820;
+
+        for (int y = firstLine; y < lines; ++y) {
+            p += 1820 - 10;
+            for (x = 0; x < 20; ++x) {
+                if (_input[p] >= 22)
+                    break;
+                ++p;
+                if (p >= samplesPerField - 1)
+                    break;
+            }
+            int start = p - 64;
+            _lineStarts[y] = start;
+
+            Complex<float> burst = 0;
+            int nBurst = (y & 1 ? 46 : 45);
+            for (int i = 0; i < nBurst; ++i)
+                burst += _burstCarrier[i]*static_cast<float>(
+                    sample(start + 76 + i));
+            burst /= static_cast<float>(nBurst);
+            _burstAcc = _burstAcc*0.9f + burst*0.1f;
+            _chromaPhases[y] = _burstAcc.conjugate()*linePhase/
+                (_burstAcc.modulus()*20.48f);
+            linePhase *= lineRotor;
+        }
+    }
+    // Demodulates line y of the current field into the frame cache.
+    void decodeLine(int y, Buffers* buffers)
+    {
+        Complex<float>* luma = &buffers->_luma[0];
+        Complex<float>* chroma = &buffers->_chroma[0];
+        const Byte* input = _input + _lineStarts[y];
+        int n = min(1820, samplesPerField - _lineStarts[y]);
+        int x;
+        for (x = 0; x < n; ++x)
+            luma[x] = input[x];
+        for (; x < outputWidth; ++x)
+            luma[x] = 0;
+
+        float total = 0;
+        for (int i = 0; i < 1666; ++i) {
+            float v = luma[i + 82].x;
+            chroma[i + 82] = v;
+            total += v;
+        }
+        float mean = total/1666;
+        for (int i = 0; i < 160; ++i)
+            chroma[i] = mean;
+        for (int i = 1666 + 82; i < outputWidth; ++i)
+            chroma[i] = mean;
+
+        for (int i = 0; i < outputWidth; ++i) {
+            chroma[i] *= _chromaOscillator[i];
+            luma[i] *= _localOscillator[i];
+        }
+
+        fftwf_execute_dft(_forward, buffers->_luma.data(),
+            buffers->_luma.data());
+        fftwf_execute_dft(_forward, buffers->_chroma.data(),
+            buffers->_chroma.data());
+        for (x = cutoff; x < outputWidth - cutoff; ++x)
+            luma[x] = 0;
+        for (x = chromaCutoff; x < outputWidth - chromaCutoff; ++x)
+            chroma[x] = 0;
+        fftwf_execute_dft(_backward, buffers->_chroma.data(),
+            buffers->_chroma.data());
+        fftwf_execute_dft(_backward, buffers->_luma.data(),
+            buffers->_luma.data());
+
+        // 0  MHz                     <=> 0 deltaPhase
+        // 3.4MHz <=> -40   IRE                             1 MHz
+        //              7.5 IRE <=>   0
+        // 4.4MHz <=> 100   IRE <=> 255                     0 MHz
+        // 315/11MHz                  <=> tau deltaPhase
+        for (x = 0; x < outputWidth - 1; ++x) {
+            float deltaPhase =
+                (luma[x + 1]*luma[x].conjugate()).argument();
+            float mhz = deltaPhase*315/(tau*11);
+            float ire = (1.0f - mhz)*140 - 40;
+            luma[x] = (ire - 7.5f)*255.0f/(100 - 7.5f);
+        }
+
+        Complex<float> chromaPhase = _chromaPhases[y];
+        Vector3<float>* row =
+            &_frameCache[(((_field + 2)%3)*lines + y)*outputWidth];
+        for (x = 0; x < outputWidth; ++x) {
+            float yy = luma[x].x;
+            Complex<float> c = chroma[x]*chromaPhase;
+            row[x] = Vector3<float>(
+                yy + 0.9563f*c.x + 0.6210f*c.y,
+                yy - 0.2721f*c.x - 0.6474f*c.y,
+                yy - 1.1069f*c.x + 1.7046f*c.y);
+        }
+    }
+    // Outputs line y of the previous field, and the line below it
+    // interpolated from the lines above and below and from the fields either
+    // side. Only line y of the current field is needed, so this can follow
+    // decodeLine() in the same band.
+    void outputLine(int y)
+    {
+        const Vector3<float>* cache = &_frameCache[0];
+        int p = (((_field + 1)%3)*lines + y)*outputWidth;
+        int pu = p - outputWidth;
+        int pd = y == lines - 1 ? p : p + outputWidth;
+        int pp = ((_field%3)*lines + y)*outputWidth;
+        int pn = (((_field + 2)%3)*lines + y)*outputWidth;
+
+        int o = 2*(y - firstLine);
+        SRGB* output0 = _output.row(o + ((_field & 1) != 0 ? 0 : 1));
+        SRGB* output1 = _output.row(o + ((_field & 1) != 0 ? 1 : 0));
+        for (int x = 0; x < outputWidth; ++x) {
+            Vector3<float> c = cache[p + x];
+            output0[x] = SRGB(byteClamp(c.x), byteClamp(c.y), byteClamp(c.z));
+            c = (cache[pu + x] + cache[pd + x] + cache[pp + x] +
+                cache[pn + x])/4.0f;
+            output1[x] = SRGB(byteClamp(c.x), byteClamp(c.y), byteClamp(c.z));
+        }
+    }
+
+    fftwf_plan _forward;
+    fftwf_plan _backward;
+    Array<Complex<float>> _localOscillator;
+    Array<Complex<float>> _chromaOscillator;
+    Complex<float> _burstCarrier[46];
+    Array<Vector3<float>> _frameCache;
+    Bitmap<SRGB> _output;
+    const Byte* _input;
+    int _lineStarts[lines];
+    Complex<float> _chromaPhases[lines];
+    int _field;
+    Complex<float> _burstAcc;
+    Complex<float> _framePhase;
+
+    ThreadPool* _pool;
+    Array<VCRDecoderTask> _tasks;
+    Array<Buffers> _buffers;
+
+    double _brightness;
+    double _saturation;
+    double _contrast;
+    double _hue;
+    double _lumaCutoff;
+    double _lumaHeterodyneFrequency;
+    double _chromaCutoff;
+    double _deinterlacing;
+    double _fieldNumber;
+};
+
+#endif // INCLUDED_VCR_DECODE_H
@@ -0,0 +1,196 @@
+#include "alfe/main.h"
+#include "alfe/evaluate.h"
+#include "alfe/bitmap_png.h"
+#include "vcr_decode.h"
+
+// Command-line batch decoder: decodes a raw VHS capture (fields of
+// VCRDecoder::samplesPerField samples) without creating any windows. The
+// lines of each field are decoded in parallel while the next field is read
+// and the previous frame is written.
+
+// Reads fields into alternate buffers.
+class ReadTask : public Task
+{
+public:
+    ReadTask() : _failed(false)
+    {
+        for (int i = 0; i < 2; ++i)
+            _buffers[i] = Array<Byte>(VCRDecoder::samplesPerField);
+    }
+    void setStream(FileStream* stream, UInt64 remaining)
+    {
+        _stream = stream;
+        _remaining = remaining;
+        _buffer = 0;
+    }
+    void read()
+    {
+        _buffer ^= 1;
+        restart();
+    }
+    const Byte* data()
+    {
+        join();
+        if (_failed)
+            throw _exception;
+        return &_buffers[_buffer][0];
+    }
+private:
+    void run()
+    {
+        try {
+            int bytes = static_cast<int>(min(_remaining,
+                static_cast<UInt64>(VCRDecoder::samplesPerField)));
+            Byte* b = &_buffers[_buffer][0];
+            _stream->read(b, bytes);
+            // A field cut short by the end of the capture is padded out.
+            memset(b + bytes, 0, VCRDecoder::samplesPerField - bytes);
+            _remaining -= bytes;
+        }
+        catch (const Exception& e) {
+            _exception = e;
+            _failed = true;
+        }
+    }
+
+    FileStream* _stream;
+    UInt64 _remaining;
+    Array<Byte> _buffers[2];
+    int _buffer;
+    bool _failed;
+    Exception _exception;
+};
+
+// Writes a decoded frame either to a numbered .png file or appended to a raw
+// RGB stream.
+class WriteTask : public Task
+{
+public:
+    WriteTask() : _failed(false) { }
+    void setOutput(String outputName)
+    {
+        int l = outputName.length() - 4;
+        _png = l >= 0 && outputName.subString(l, 4) == ".png";
+        if (_png)
+            _stem = outputName.subString(0, l);
+        else
+            _stream = File(outputName, true).openWrite();
+    }
+    void write(Bitmap<SRGB> frame, int field)
+    {
+        finish();
+        _frame = frame;
+        _field = field;
+        restart();
+    }
+    void finish()
+    {
+        join();
+        if (_failed)
+            throw _exception;
+    }
+private:
+    void run()
+    {
+        try {
+            if (_png) {
+                PNGFileFormat<SRGB>().save(_frame,
+                    File(_stem + format("%06i", _field) + ".png", true));
+                return;
+            }
+            for (int y = 0; y < VCRDecoder::outputHeight; ++y) {
+                _stream.write(_frame.row(y),
+                    VCRDecoder::outputWidth*sizeof(SRGB));
+            }
+        }
+        catch (const Exception& e) {
+            _exception = e;
+            _failed = true;
+        }
+    }
+
+    bool _png;
+    String _stem;
+    AutoStream _stream;
+    Bitmap<SRGB> _frame;
+    int _field;
+    bool _failed;
+    Exception _exception;
+};
+
+class Program : public ProgramBase
+{
+public:
+    void run()
+    {
+        if (_arguments.count() < 3) {
+            console.write("Syntax: " + _arguments[0] +
+                " <input file name> <output file name> [<first field> "
+                "[<fields>]]\n"
+                "If the output file name ends in .png, each frame is saved "
+                "as a separate .png\nfile with the field number appended to "
+                "the name. Otherwise the output is raw\n"
+                "24-bit RGB, " + decimal(VCRDecoder::outputWidth) + "x" +
+                decimal(VCRDecoder::outputHeight) + " per frame. Each frame "
+                "is centred on the field before the\none decoded.\n");
+            return;
+        }
+        FileStream inputStream = File(_arguments[1], true).openRead();
+        static const int n = VCRDecoder::samplesPerField;
+        UInt64 size = inputStream.size();
+        int fields = static_cast<int>((size + n - 1)/n);
+        int first = 0;
+        if (_arguments.count() >= 4) {
+            first = evaluate<int>(_arguments[3]);
+            if (first < 0)
+                throw Exception("The first field can't be negative.");
+            first = min(first, fields);
+        }
+        int end = fields;
+        if (_arguments.count() >= 5) {
+            int count = evaluate<int>(_arguments[4]);
+            if (count <= 0)
+                throw Exception("The number of fields must be positive.");
+            end = first + min(count, fields - first);
+        }
+        if (first == end)
+            throw Exception("No fields to decode.");
+
+        ThreadPool pool;
+        // The reads and writes each get their own thread so that they don't
+        // wait for the decoding tasks.
+        ThreadPool ioPool(2);
+        VCRDecoder decoder;
+        decoder.setThreadPool(&pool);
+        decoder.setField(first);
+
+        ReadTask reader;
+        reader.setPool(&ioPool);
+        UInt64 start = static_cast<UInt64>(first)*n;
+        inputStream.seek(start);
+        reader.setStream(&inputStream, size - start);
+        reader.read();
+        WriteTask writer;
+        writer.setPool(&ioPool);
+        writer.setOutput(_arguments[2]);
+
+        Bitmap<SRGB> frames[2];
+        for (int i = 0; i < 2; ++i) {
+            frames[i] = Bitmap<SRGB>(Vector(VCRDecoder::outputWidth,
+                VCRDecoder::outputHeight));
+        }
+        for (int field = first; field < end; ++field) {
+            const Byte* input = reader.data();
+            if (field + 1 < end)
+                reader.read();
+            // The writer may still have the other frame.
+            Bitmap<SRGB> frame = frames[field & 1];
+            decoder.setOutputBuffer(frame);
+            decoder.decodeField(input);
+            writer.write(frame, field);
+            console.write(".");
+        }
+        writer.finish();
+        console.write("\n" + decimal(end - first) + " fields decoded.\n");
+    }
+};